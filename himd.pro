@@ -4,3 +4,15 @@ SUBDIRS  = libhimd himddump
 !without_gui: {
   SUBDIRS += qhimdtransfer
 }
+with_fuse: {
+  SUBDIRS += himdfuse
+}
+with_serve: {
+  SUBDIRS += himdserve
+  with_bench: {
+    SUBDIRS += himdserve/loadtest
+  }
+}
+with_bench: {
+  SUBDIRS += wavbench himdbench microbench
+}
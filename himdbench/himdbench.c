@@ -0,0 +1,774 @@
+/*
+ *   himdbench.c - time libhimd on synthetic HiMD images
+ *
+ *   The images come from himd_generate_image, so the numbers can be
+ *   compared between machines and versions without a HiMD medium. The
+ *   results are written as JSON.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "himd.h"
+#include "imagegen.h"
+#include "trackfile.h"
+
+#define DEFAULT_REPEATS 5
+#define RANDOM_READS 64		/* per track */
+#define RANDOM_READ_SIZE 4096
+#define RANDOM_CACHE_BLOCKS 16
+
+/* result of one benchmark run */
+enum { RUN_OK = 0, RUN_FAILED = -1, RUN_SKIPPED = 1 };
+
+struct bench {
+    const char * path;
+    int writable;
+    struct himd himd;
+    unsigned int seconds;
+};
+
+struct result {
+    const char * name;
+    GArray * ms;
+    unsigned long long bytes;	/* per run, for throughput */
+    unsigned long long ops;	/* per run, for random reads */
+    gchar * skipped;
+};
+
+typedef int (*bench_fn)(struct bench * b, struct result * r, struct himderrinfo * status);
+
+static const char * progname;
+
+/* Reason for a skipped benchmark */
+static int skip(struct himderrinfo * status, const char * reason)
+{
+    status->status = HIMD_OK;
+    g_strlcpy(status->statusmsg, reason, sizeof status->statusmsg);
+    return RUN_SKIPPED;
+}
+
+static void usage(void)
+{
+    printf("Usage: %s generate <DIR> [<options>]\n\
+       %s run [<options>] [-r <REPEATS>] [-o <FILE>] [-w] [<DIR>]\n\n\
+generate writes a synthetic HiMD to DIR. run times libhimd on the HiMD in\n\
+DIR, or on a new synthetic one in a temporary directory. The import\n\
+benchmark changes the HiMD (and restores it afterwards), so on a given\n\
+DIR it only runs with -w.\n\n\
+Options for synthetic images:\n\
+  -t <TRACKS>               number of tracks (default 12)\n\
+  -c <CODEC>[,<CODEC>...]   mp3, lpcm or atrac3, used in turn\n\
+  -s <SECONDS>              length of each track (default 30)\n\
+  -l contiguous|interleaved[:<BLOCKS>]\n\
+                            fragment layout, interleaved puts BLOCKS\n\
+                            blocks of each track in turn (default 16)\n\
+  -e latin1|utf16|sjis|mixed  string encoding\n\
+  -S <SEED>                 seed for keys and audio data\n", progname, progname);
+}
+
+static int parse_codecs(const char * arg, struct himd_image_spec * spec)
+{
+    gchar ** names = g_strsplit(arg, ",", 0);
+    unsigned int i;
+    int ret = 0;
+
+    spec->ncodecs = 0;
+    for(i = 0; names[i] && ret == 0; i++)
+    {
+        if(spec->ncodecs == 3)
+            ret = -1;
+        else if(strcmp(names[i], "mp3") == 0)
+            spec->codecs[spec->ncodecs++] = HIMD_IMAGE_MP3;
+        else if(strcmp(names[i], "lpcm") == 0)
+            spec->codecs[spec->ncodecs++] = HIMD_IMAGE_LPCM;
+        else if(strcmp(names[i], "atrac3") == 0)
+            spec->codecs[spec->ncodecs++] = HIMD_IMAGE_ATRAC3;
+        else
+            ret = -1;
+    }
+    g_strfreev(names);
+    return spec->ncodecs ? ret : -1;
+}
+
+static int parse_layout(const char * arg, struct himd_image_spec * spec)
+{
+    if(strcmp(arg, "contiguous") == 0)
+        spec->layout = HIMD_IMAGE_CONTIGUOUS;
+    else if(strncmp(arg, "interleaved", 11) == 0)
+    {
+        spec->layout = HIMD_IMAGE_INTERLEAVED;
+        if(arg[11] == ':')
+            spec->chunkblocks = MAX(1, atoi(arg + 12));
+        else if(arg[11] != '\0')
+            return -1;
+    }
+    else
+        return -1;
+    return 0;
+}
+
+static int parse_encoding(const char * arg, struct himd_image_spec * spec)
+{
+    if(strcmp(arg, "latin1") == 0)
+        spec->encoding = HIMD_IMAGE_LATIN1;
+    else if(strcmp(arg, "utf16") == 0)
+        spec->encoding = HIMD_IMAGE_UTF16;
+    else if(strcmp(arg, "sjis") == 0)
+        spec->encoding = HIMD_IMAGE_SHIFT_JIS;
+    else if(strcmp(arg, "mixed") == 0)
+        spec->encoding = HIMD_IMAGE_MIXED;
+    else
+        return -1;
+    return 0;
+}
+
+/* Handles the options shared by generate and run, returns 0 for options
+   that are not image options */
+static int image_option(int opt, const char * arg, struct himd_image_spec * spec)
+{
+    switch(opt)
+    {
+        case 't': spec->tracks = MAX(1, atoi(arg)); return 1;
+        case 's': spec->seconds = MAX(1, atoi(arg)); return 1;
+        case 'S': spec->seed = strtoul(arg, NULL, 10); return 1;
+        case 'c': return parse_codecs(arg, spec) < 0 ? -1 : 1;
+        case 'l': return parse_layout(arg, spec) < 0 ? -1 : 1;
+        case 'e': return parse_encoding(arg, spec) < 0 ? -1 : 1;
+    }
+    return 0;
+}
+
+static int is_mp3(const struct trackinfo * t)
+{
+    return t->codec_id == CODEC_ATRAC3PLUS_OR_MPEG && (t->codecinfo[0] & 3) == 3;
+}
+
+static int run_open(struct bench * b, struct result * r, struct himderrinfo * status)
+{
+    struct himd himd;
+    (void)r;
+
+    if(himd_open(&himd, b->path, status) < 0)
+        return RUN_FAILED;
+    himd_close(&himd);
+    return RUN_OK;
+}
+
+static int run_list(struct bench * b, struct result * r, struct himderrinfo * status)
+{
+    unsigned int i, slot, count = himd_track_count(&b->himd);
+    struct trackinfo t;
+    struct himd_tags tags;
+
+    for(i = 0; i < count; i++)
+    {
+        if((slot = himd_get_trackslot(&b->himd, i, status)) == 0 ||
+           himd_get_track_info(&b->himd, slot, &t, status) < 0 ||
+           himd_get_tags(&b->himd, &t, &tags, status) < 0)
+            return RUN_FAILED;
+        himd_free_tags(&tags);
+        if(himd_track_blocks(&b->himd, &t, status) < 0)
+            return RUN_FAILED;
+    }
+    r->ops = count;
+    return RUN_OK;
+}
+
+/* Reads all tracks with the given codec through the block streams */
+static int read_tracks(struct bench * b, struct result * r, int codec, struct himderrinfo * status)
+{
+    unsigned int i, slot, len, frames, count = himd_track_count(&b->himd), found = 0;
+    const unsigned char * data;
+    struct trackinfo t;
+    struct himd_mp3stream mp3;
+    struct himd_nonmp3stream nonmp3;
+
+    r->bytes = 0;
+    for(i = 0; i < count; i++)
+    {
+        if((slot = himd_get_trackslot(&b->himd, i, status)) == 0 ||
+           himd_get_track_info(&b->himd, slot, &t, status) < 0)
+            return RUN_FAILED;
+        if(codec == CODEC_ATRAC3PLUS_OR_MPEG ? !is_mp3(&t) : t.codec_id != codec)
+            continue;
+        found++;
+
+        if(codec == CODEC_ATRAC3PLUS_OR_MPEG)
+        {
+            if(himd_mp3stream_open(&b->himd, slot, &mp3, status) < 0)
+                return RUN_FAILED;
+            while(himd_mp3stream_read_block(&mp3, &data, &len, &frames, status) == 0)
+                r->bytes += len;
+            himd_mp3stream_close(&mp3);
+        }
+        else
+        {
+            if(himd_nonmp3stream_open(&b->himd, slot, &nonmp3, status) < 0)
+                return status->status == HIMD_ERROR_DISABLED_FEATURE ? RUN_SKIPPED : RUN_FAILED;
+            while(himd_nonmp3stream_read_block(&nonmp3, &data, &len, &frames, status) == 0)
+                r->bytes += len;
+            himd_nonmp3stream_close(&nonmp3);
+        }
+        if(status->status != HIMD_STATUS_AUDIO_EOF)
+            return RUN_FAILED;
+    }
+    if(!found)
+        return skip(status, "no such tracks");
+    return RUN_OK;
+}
+
+static int run_read_mp3(struct bench * b, struct result * r, struct himderrinfo * status)
+{
+    return read_tracks(b, r, CODEC_ATRAC3PLUS_OR_MPEG, status);
+}
+
+static int run_read_lpcm(struct bench * b, struct result * r, struct himderrinfo * status)
+{
+    return read_tracks(b, r, CODEC_LPCM, status);
+}
+
+static int run_read_atrac3(struct bench * b, struct result * r, struct himderrinfo * status)
+{
+    return read_tracks(b, r, CODEC_ATRAC3, status);
+}
+
+/* Seeks like a player or a file system client would. Every run starts
+   with a cold cache. */
+static int run_random_read(struct bench * b, struct result * r, struct himderrinfo * status)
+{
+    unsigned char buf[RANDOM_READ_SIZE];
+    unsigned int i, j, slot, count = himd_track_count(&b->himd);
+    struct himd_blockcache * cache = himd_blockcache_new(RANDOM_CACHE_BLOCKS);
+    struct himd_trackfile tf;
+    GRand * rand = g_rand_new_with_seed(count);
+    unsigned long long offset;
+    long len;
+    int ret = RUN_OK;
+
+    r->bytes = r->ops = 0;
+    for(i = 0; i < count && ret == RUN_OK; i++)
+    {
+        if((slot = himd_get_trackslot(&b->himd, i, status)) == 0)
+        {
+            ret = RUN_FAILED;
+            break;
+        }
+        if(himd_trackfile_open(&b->himd, slot, cache, &tf, status) < 0)
+        {
+            /* tracks that need mcrypt */
+            if(status->status == HIMD_ERROR_DISABLED_FEATURE)
+                continue;
+            ret = RUN_FAILED;
+            break;
+        }
+        for(j = 0; j < RANDOM_READS; j++)
+        {
+            offset = (unsigned long long)(g_rand_double(rand) * tf.size);
+            if((len = himd_trackfile_pread(&tf, buf, sizeof buf, offset, status)) < 0)
+            {
+                ret = RUN_FAILED;
+                break;
+            }
+            r->bytes += len;
+            r->ops++;
+        }
+        himd_trackfile_close(&tf);
+    }
+    if(ret == RUN_OK && r->ops == 0)
+    {
+        ret = skip(status, "no readable tracks");
+    }
+    g_rand_free(rand);
+    himd_blockcache_free(cache);
+    return ret;
+}
+
+static int run_find_holes(struct bench * b, struct result * r, struct himderrinfo * status)
+{
+    static struct himd_holelist holes;
+    (void)r;
+
+    return himd_find_holes(&b->himd, &holes, status) < 0 ? RUN_FAILED : RUN_OK;
+}
+
+/* A file of HMDHIFI as it was before the import benchmark */
+struct savedfile {
+    gchar * name;
+    gchar * contents;
+    gsize len;
+};
+
+/* Remembers the track indexes and the size of ATDATA */
+static int save_state(const char * dir, GArray * saved, gchar ** atdata, goffset * atdatalen)
+{
+    GDir * d = g_dir_open(dir, 0, NULL);
+    struct savedfile f;
+    const gchar * name;
+    GStatBuf st;
+    gchar * lower;
+
+    if(!d)
+        return -1;
+    *atdata = NULL;
+    while((name = g_dir_read_name(d)) != NULL)
+    {
+        lower = g_ascii_strdown(name, -1);
+        f.name = g_build_filename(dir, name, NULL);
+        if(g_str_has_prefix(lower, "trkidx") || g_str_has_prefix(lower, "_rkidx"))
+        {
+            if(g_file_get_contents(f.name, &f.contents, &f.len, NULL))
+            {
+                g_array_append_val(saved, f);
+                f.name = NULL;
+            }
+        }
+        else if(g_str_has_prefix(lower, "atdata") && !*atdata && g_stat(f.name, &st) == 0)
+        {
+            *atdata = f.name;
+            *atdatalen = st.st_size;
+            f.name = NULL;
+        }
+        g_free(f.name);
+        g_free(lower);
+    }
+    g_dir_close(d);
+    return *atdata ? 0 : -1;
+}
+
+static int restore_state(GArray * saved, const gchar * atdata, goffset atdatalen)
+{
+    struct savedfile * f;
+    unsigned int i;
+    int ret = 0;
+
+    for(i = 0; i < saved->len; i++)
+    {
+        f = &g_array_index(saved, struct savedfile, i);
+        if(!g_file_set_contents(f->name, f->contents, f->len, NULL))
+            ret = -1;
+    }
+    if(truncate(atdata, atdatalen) < 0)
+        ret = -1;
+    return ret;
+}
+
+static void free_state(GArray * saved, gchar * atdata)
+{
+    unsigned int i;
+
+    for(i = 0; i < saved->len; i++)
+    {
+        g_free(g_array_index(saved, struct savedfile, i).name);
+        g_free(g_array_index(saved, struct savedfile, i).contents);
+    }
+    g_array_free(saved, TRUE);
+    g_free(atdata);
+}
+
+/* What himddump writemp3 does, with silent 128 kbit/s frames as input */
+static int import_mp3(struct bench * b, struct result * r, struct himderrinfo * status)
+{
+    static const unsigned char header[4] = { 0xFF, 0xFB, 0x90, 0x44 };
+    const unsigned int framesize = 417, fpb = HIMD_AUDIO_SIZE / 417;
+    unsigned int frames = b->seconds * 44100 / 1152 + 1;
+    unsigned int blocks = (frames + fpb - 1) / fpb, firstblock, lastblock, i, j, n;
+    struct himd himd;
+    struct himd_writestream ws;
+    struct blockinfo block;
+    struct fraginfo frag;
+    struct trackinfo t;
+    mp3key key;
+    int slot;
+
+    if(himd_open(&himd, b->path, status) < 0)
+        return RUN_FAILED;
+    if((slot = himd_get_free_trackindex(&himd)) <= 0)
+    {
+        status->status = HIMD_ERROR_OUT_OF_TRACKS;
+        g_strlcpy(status->statusmsg, "No free track slot left", sizeof status->statusmsg);
+        goto fail;
+    }
+    if(himd_obtain_mp3key(&himd, slot, &key, status) < 0 ||
+       himd_writestream_open(&himd, &ws, &firstblock, &lastblock, status) < 0)
+        goto fail;
+    if(lastblock - firstblock + 1 < blocks)
+    {
+        himd_writestream_close(&ws);
+        himd_close(&himd);
+        return skip(status, "no hole big enough");
+    }
+
+    memset(&block, 0, sizeof block);
+    memcpy(&block.type, "SPMA", 4);
+    block.backup_type = block.type;
+    for(i = 0; i < blocks; i++)
+    {
+        n = MIN(fpb, frames - i * fpb);
+        memset(block.audio_data, 0, sizeof block.audio_data);
+        for(j = 0; j < n; j++)
+            memcpy(block.audio_data + j * framesize, header, sizeof header);
+        for(j = 0; j < ((n * framesize) & ~7U); j++)
+            block.audio_data[j] ^= key[j & 3];
+        block.nframes = n;
+        block.lendata = n * framesize;
+        block.serial_number = block.backup_serial_number = i;
+        if(himd_writestream_write(&ws, &block, status) < 0)
+        {
+            himd_writestream_close(&ws);
+            goto fail;
+        }
+        r->bytes += HIMD_BLOCKINFO_SIZE;
+    }
+    himd_writestream_close(&ws);
+
+    memset(&frag, 0, sizeof frag);
+    frag.firstblock = firstblock;
+    frag.lastblock = firstblock + blocks - 1;
+    frag.lastframe = frames - (blocks - 1) * fpb;
+    frag.fragtype = 1;
+
+    memset(&t, 0, sizeof t);
+    if((t.firstfrag = himd_add_fragment_info(&himd, &frag, status)) <= 0)
+        goto fail;
+    if((t.title = himd_add_string(&himd, "Imported Track", STRING_TYPE_TITLE, status)) < 0 ||
+       (t.artist = himd_add_string(&himd, "himdbench", STRING_TYPE_ARTIST, status)) < 0 ||
+       (t.album = himd_add_string(&himd, "Imports", STRING_TYPE_ALBUM, status)) < 0)
+        goto fail;
+    t.trackinalbum = 1;
+    t.codec_id = CODEC_ATRAC3PLUS_OR_MPEG;
+    t.codecinfo[0] = 3;
+    t.codecinfo[2] = 0xB0;
+    t.codecinfo[3] = 0xD9;
+    t.codecinfo[4] = 0x10;
+    t.seconds = b->seconds;
+    t.Lt = 0x10;
+    t.Dest = 1;
+    t.Xcc = 1;
+    t.Cc = 0x40;
+    if(himd_add_track_info(&himd, &t, status) < 0 ||
+       himd_write_tifdata(&himd, status) < 0)
+        goto fail;
+    himd_close(&himd);
+    return RUN_OK;
+
+fail:
+    himd_close(&himd);
+    return RUN_FAILED;
+}
+
+static int run_import_mp3(struct bench * b, struct result * r, struct himderrinfo * status)
+{
+    gchar * dir, * atdata = NULL;
+    GArray * saved;
+    goffset atdatalen = 0;
+    int ret;
+
+    if(!b->writable)
+    {
+        return skip(status, "read-only, use -w");
+    }
+    dir = g_build_filename(b->path, b->himd.need_lowercase ? "hmdhifi" : "HMDHIFI", NULL);
+    saved = g_array_new(FALSE, FALSE, sizeof(struct savedfile));
+    if(save_state(dir, saved, &atdata, &atdatalen) < 0)
+    {
+        status->status = HIMD_ERROR_CANT_ACCESS_HMDHIFI;
+        g_snprintf(status->statusmsg, sizeof status->statusmsg, "Can't back up %s", dir);
+        free_state(saved, atdata);
+        g_free(dir);
+        return RUN_FAILED;
+    }
+    r->bytes = 0;
+    ret = import_mp3(b, r, status);
+    if(restore_state(saved, atdata, atdatalen) < 0)
+    {
+        fprintf(stderr, "Could not restore %s after the import\n", dir);
+        exit(1);
+    }
+    free_state(saved, atdata);
+    g_free(dir);
+    return ret;
+}
+
+static void run_bench(struct bench * b, struct result * r, bench_fn fn, unsigned int repeats)
+{
+    struct himderrinfo status;
+    gint64 start;
+    double ms;
+    unsigned int i;
+    int ret;
+
+    r->ms = g_array_new(FALSE, FALSE, sizeof(double));
+    for(i = 0; i < repeats; i++)
+    {
+        memset(&status, 0, sizeof status);
+        start = g_get_monotonic_time();
+        ret = fn(b, r, &status);
+        ms = (g_get_monotonic_time() - start) / 1000.0;
+        if(ret == RUN_SKIPPED)
+        {
+            r->skipped = g_strdup(status.statusmsg);
+            break;
+        }
+        if(ret == RUN_FAILED)
+        {
+            fprintf(stderr, "%s: %s\n", r->name, status.statusmsg);
+            exit(1);
+        }
+        g_array_append_val(r->ms, ms);
+    }
+    fprintf(stderr, "%-12s %s\n", r->name, r->skipped ? "skipped" : "done");
+}
+
+static gint cmp_double(gconstpointer a, gconstpointer b)
+{
+    double da = *(const double*)a, db = *(const double*)b;
+    return da < db ? -1 : da > db;
+}
+
+static const char * fmt(char * buf, const char * format, double value)
+{
+    return g_ascii_formatd(buf, G_ASCII_DTOSTR_BUF_SIZE, format, value);
+}
+
+static void write_json_string(FILE * out, const char * value)
+{
+    fputc('"', out);
+    for(; *value; value++)
+    {
+        if(*value == '"' || *value == '\\')
+            fprintf(out, "\\%c", *value);
+        else if((unsigned char)*value < 0x20)
+            fprintf(out, "\\u%04x", *value);
+        else
+            fputc(*value, out);
+    }
+    fputc('"', out);
+}
+
+static void write_result(FILE * out, struct result * r, int last)
+{
+    char b1[G_ASCII_DTOSTR_BUF_SIZE], b2[G_ASCII_DTOSTR_BUF_SIZE], b3[G_ASCII_DTOSTR_BUF_SIZE];
+    double median;
+
+    fprintf(out, "    \"%s\": {", r->name);
+    if(r->skipped)
+    {
+        fprintf(out, "\"skipped\": ");
+        write_json_string(out, r->skipped);
+    }
+    else
+    {
+        g_array_sort(r->ms, cmp_double);
+        median = g_array_index(r->ms, double, r->ms->len / 2);
+        fprintf(out, "\"runs\": %u, \"min_ms\": %s, \"median_ms\": %s, \"max_ms\": %s",
+                r->ms->len, fmt(b1, "%.3f", g_array_index(r->ms, double, 0)),
+                fmt(b2, "%.3f", median), fmt(b3, "%.3f", g_array_index(r->ms, double, r->ms->len - 1)));
+        if(r->bytes && median > 0)
+            fprintf(out, ", \"bytes\": %llu, \"mb_per_s\": %s", r->bytes,
+                    fmt(b1, "%.2f", r->bytes / (median * 1000.0)));
+        if(r->ops && median > 0)
+            fprintf(out, ", \"ops\": %llu, \"ops_per_s\": %s", r->ops,
+                    fmt(b1, "%.1f", r->ops / (median / 1000.0)));
+    }
+    fprintf(out, "}%s\n", last ? "" : ",");
+}
+
+static const char * codec_name(enum himd_image_codec codec)
+{
+    switch(codec)
+    {
+        case HIMD_IMAGE_MP3: return "mp3";
+        case HIMD_IMAGE_LPCM: return "lpcm";
+        default: return "atrac3";
+    }
+}
+
+static void write_json(FILE * out, const char * path, const struct himd_image_spec * spec,
+                       unsigned int tracks, unsigned int repeats, struct result * results, unsigned int n)
+{
+    static const char * const layouts[] = { "contiguous", "interleaved" };
+    static const char * const encodings[] = { "latin1", "utf16", "sjis", "mixed" };
+    unsigned int i;
+
+    fprintf(out, "{\n  \"image\": {\"path\": ");
+    write_json_string(out, path);
+    fprintf(out, ", \"tracks\": %u", tracks);
+    if(spec)
+    {
+        fprintf(out, ", \"synthetic\": true, \"codecs\": [");
+        for(i = 0; i < spec->ncodecs; i++)
+            fprintf(out, "%s\"%s\"", i ? ", " : "", codec_name(spec->codecs[i]));
+        fprintf(out, "], \"seconds\": %u, \"layout\": \"%s\", \"chunk_blocks\": %u, \"encoding\": \"%s\", \"seed\": %u",
+                spec->seconds, layouts[spec->layout], spec->chunkblocks, encodings[spec->encoding], spec->seed);
+    }
+    fprintf(out, "},\n  \"repeats\": %u,\n  \"results\": {\n", repeats);
+    for(i = 0; i < n; i++)
+        write_result(out, &results[i], i == n - 1);
+    fprintf(out, "  }\n}\n");
+}
+
+static void remove_tree(const char * path)
+{
+    GDir * d = g_dir_open(path, 0, NULL);
+    const gchar * name;
+    gchar * child;
+
+    if(d)
+    {
+        while((name = g_dir_read_name(d)) != NULL)
+        {
+            child = g_build_filename(path, name, NULL);
+            remove_tree(child);
+            g_free(child);
+        }
+        g_dir_close(d);
+    }
+    g_remove(path);
+}
+
+static int cmd_generate(int argc, char ** argv)
+{
+    struct himd_image_spec spec;
+    struct himderrinfo status;
+    int opt;
+
+    himd_image_spec_init(&spec);
+    while((opt = getopt(argc, argv, "t:c:s:l:e:S:")) != -1)
+        if(image_option(opt, optarg, &spec) <= 0)
+        {
+            usage();
+            return 1;
+        }
+    if(optind != argc - 1)
+    {
+        usage();
+        return 1;
+    }
+    if(himd_generate_image(argv[optind], &spec, &status) < 0)
+    {
+        fprintf(stderr, "Can't generate image: %s\n", status.statusmsg);
+        return 1;
+    }
+    return 0;
+}
+
+static int cmd_run(int argc, char ** argv)
+{
+    static const struct { const char * name; bench_fn fn; } benches[] = {
+        { "open", run_open },
+        { "list", run_list },
+        { "read_mp3", run_read_mp3 },
+        { "read_lpcm", run_read_lpcm },
+        { "read_atrac3", run_read_atrac3 },
+        { "random_read", run_random_read },
+        { "find_holes", run_find_holes },
+        { "import_mp3", run_import_mp3 },
+    };
+    const unsigned int nbenches = sizeof benches / sizeof benches[0];
+    struct result results[sizeof benches / sizeof benches[0]];
+    struct himd_image_spec spec;
+    struct himderrinfo status;
+    struct bench b;
+    unsigned int repeats = DEFAULT_REPEATS, i;
+    const char * outname = NULL;
+    gchar * tmpdir = NULL;
+    FILE * out = stdout;
+    int opt, ret;
+
+    himd_image_spec_init(&spec);
+#ifndef CONFIG_WITH_MCRYPT
+    /* only MP3 tracks can be written and read without mcrypt */
+    spec.ncodecs = 1;
+#endif
+    memset(&b, 0, sizeof b);
+    while((opt = getopt(argc, argv, "t:c:s:l:e:S:r:o:w")) != -1)
+    {
+        if((ret = image_option(opt, optarg, &spec)) > 0)
+            continue;
+        switch(ret < 0 ? '?' : opt)
+        {
+            case 'r': repeats = MAX(1, atoi(optarg)); break;
+            case 'o': outname = optarg; break;
+            case 'w': b.writable = 1; break;
+            default: usage(); return 1;
+        }
+    }
+    if(optind < argc - 1)
+    {
+        usage();
+        return 1;
+    }
+
+    if(optind == argc - 1)
+        b.path = argv[optind];
+    else
+    {
+        if(!(tmpdir = g_dir_make_tmp("himdbench-XXXXXX", NULL)))
+        {
+            fprintf(stderr, "Can't create temporary directory: %s\n", g_strerror(errno));
+            return 1;
+        }
+        fprintf(stderr, "generating image in %s\n", tmpdir);
+        if(himd_generate_image(tmpdir, &spec, &status) < 0)
+        {
+            fprintf(stderr, "Can't generate image: %s\n", status.statusmsg);
+            remove_tree(tmpdir);
+            g_free(tmpdir);
+            return 1;
+        }
+        b.path = tmpdir;
+        b.writable = 1;
+    }
+    b.seconds = spec.seconds;
+
+    if(himd_open(&b.himd, b.path, &status) < 0)
+    {
+        fprintf(stderr, "Can't open HiMD: %s\n", status.statusmsg);
+        return 1;
+    }
+    memset(results, 0, sizeof results);
+    for(i = 0; i < nbenches; i++)
+    {
+        results[i].name = benches[i].name;
+        run_bench(&b, &results[i], benches[i].fn, repeats);
+    }
+
+    if(outname && !(out = fopen(outname, "w")))
+    {
+        fprintf(stderr, "Can't write %s: %s\n", outname, g_strerror(errno));
+        return 1;
+    }
+    write_json(out, b.path, tmpdir ? &spec : NULL, himd_track_count(&b.himd), repeats, results, nbenches);
+    if(out != stdout)
+        fclose(out);
+
+    himd_close(&b.himd);
+    for(i = 0; i < nbenches; i++)
+    {
+        g_array_free(results[i].ms, TRUE);
+        g_free(results[i].skipped);
+    }
+    if(tmpdir)
+    {
+        remove_tree(tmpdir);
+        g_free(tmpdir);
+    }
+    return 0;
+}
+
+int main(int argc, char ** argv)
+{
+    progname = argv[0];
+    if(argc >= 2 && strcmp(argv[1], "generate") == 0)
+        return cmd_generate(argc - 1, argv + 1);
+    if(argc >= 2 && strcmp(argv[1], "run") == 0)
+        return cmd_run(argc - 1, argv + 1);
+    usage();
+    return 1;
+}
@@ -0,0 +1,11 @@
+TEMPLATE=app
+CONFIG  -= qt
+CONFIG  += console link_pkgconfig link_prl
+PKGCONFIG += glib-2.0
+INCLUDEPATH += ../libhimd
+SOURCES += himdbench.c
+
+# synthetic LPCM and ATRAC3 tracks need mcrypt, like in libhimd
+!without_mcrypt: DEFINES += CONFIG_WITH_MCRYPT
+
+include(../libhimd/use_libhimd.pri)
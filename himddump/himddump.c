@@ -7,26 +7,64 @@
 #include <glib.h>
 #include <locale.h>
 #include <string.h>
+#include <math.h>
 #include <mad.h>
 #include <id3tag.h>
 #include <glib/gstdio.h>
 
 #include "himd.h"
 #include "sony_oma.h"
+#include "wavsink.h"
+#include "flacsink.h"
+#include "mp3sink.h"
+#include "analysis.h"
+#include "splitsink.h"
+#include "fsck.h"
+#include "recover.h"
+#include "himdimg.h"
 
 void usage(char * cmdname)
 {
-  printf("Usage: %s <HiMD path> <command>, where <command> is either of:\n\n\
+  printf("Usage: %s [--stats] <HiMD path> <command>, where <command> is either of:\n\n\
           strings          - dumps all strings found in the tracklist file\n\
           tracks           - lists all tracks on disc\n\
           tracks verbose   - lists details of all tracks on disc\n\
           discid           - reads the disc id of the inserted medium\n\
           holes            - lists all holes on disc\n\
+          fsck [<THREADS>] - checks all audio blocks against the track index\n\
+          recover [write]  - rebuilds the track index from the audio blocks\n\
+                             (only shows the result unless write is given)\n\
+          pack <FILE> [zstd]\n\
+                           - archives the disc as image without unused blocks\n\
+          unpack <DIR>     - writes the disc or image as HMDHIFI below <DIR>\n\
           mp3key <TRK>     - show the MP3 encryption key for track <TRK>\n\
           dumptrack <TRK>  - dump track <TRK>\n\
           dumpmp3 <TRK>    - dump MP3 track <TRK>\n\
           dumpnonmp3 <TRK> - dump non-MP3 track <TRK>\n\
-          writemp3 <FILE>  - write mp3 to disc\n", cmdname);
+          dumpflac <TRK>   - dump LPCM track <TRK> as FLAC\n\
+                             (LPCM dumps also write their loudness to stream.json)\n\
+          dumpsplit <TRK> [wav|flac] [<DB> [<SECS>]]\n\
+                           - split LPCM track <TRK> at silences below <DB> dBFS\n\
+                             (default -50) lasting <SECS> seconds (default 2)\n\
+          writemp3 <FILE>  - write mp3 to disc\n\
+          split <TRK> <SECS>\n\
+                           - split track <TRK> <SECS> seconds into it\n\
+          trim <TRK> <HEADSECS> <TAILSECS>\n\
+                           - cut seconds from the start and end of track <TRK>\n\
+          join <TRK> <TRK2>\n\
+                           - append track <TRK2> to track <TRK>, MP3 tracks\n\
+                             can't be split, trimmed or joined\n\
+          delete <TRK>...  - delete the tracks <TRK>\n\
+          reorder <TRK>... - play the tracks in the order given, all tracks\n\
+                             have to be listed\n\
+          sync <DIR> [previous]\n\
+                           - export new and changed tracks to <DIR>, remove\n\
+                             deleted ones; with previous, tracks unchanged since\n\
+                             the previous TIF generation are not decoded\n\n\
+<HiMD path> is the root of the disc, an image written by pack or a raw\n\
+image of the disc (as written by dd), images are read-only.\n\
+With --stats, the I/O and decryption counters of the command are printed\n\
+to stderr at the end.\n", cmdname);
 }
 
 static const char * hexdump(unsigned char * input, int len)
@@ -215,37 +253,58 @@ clean:
     himd_blockstream_close(&str);
 }
 
-void himd_dumpmp3(struct himd * himd, int trknum)
+int himd_dumpmp3(struct himd * himd, int trknum, const char * filename)
 {
     struct himd_mp3stream str;
+    struct himd_mp3sink sink;
     struct himderrinfo status;
-    FILE * strdumpf;
+    struct trackinfo trkinfo;
+    struct himd_tags tags;
     unsigned int len;
     const unsigned char * data;
-    strdumpf = fopen("stream.mp3","wb");
-    if(!strdumpf)
+    int ret = 0;
+
+    if(himd_get_track_info(himd, trknum, &trkinfo, &status) < 0)
     {
-        perror("Opening stream.mp3");
-        return;
+        fprintf(stderr, "Error obtaining track info: %s\n", status.statusmsg);
+        return -1;
+    }
+    if(himd_get_tags(himd, &trkinfo, &tags, &status) < 0)
+    {
+        fprintf(stderr, "Error reading track strings: %s\n", status.statusmsg);
+        return -1;
     }
     if(himd_mp3stream_open(himd, trknum, &str, &status) < 0)
     {
         fprintf(stderr, "Error opening track %d: %s\n", trknum, status.statusmsg);
-        return;
+        himd_free_tags(&tags);
+        return -1;
+    }
+    if(himd_mp3sink_open(&sink, filename, &tags, &status) < 0)
+    {
+        fprintf(stderr, "%s\n", status.statusmsg);
+        himd_mp3stream_close(&str);
+        himd_free_tags(&tags);
+        return -1;
     }
     while(himd_mp3stream_read_block(&str, &data, &len, NULL, &status) >= 0)
     {
-        if(fwrite(data,len,1,strdumpf) != 1)
-        {
-            perror("writing dumped stream");
-            goto clean;
-        }
+        if(himd_mp3sink_write(&sink, data, len, &status) < 0)
+            break;
     }
     if(status.status != HIMD_STATUS_AUDIO_EOF)
-        fprintf(stderr,"Error reading MP3 data: %s\n", status.statusmsg);
-clean:
-    fclose(strdumpf);
+    {
+        fprintf(stderr,"Error dumping MP3 data: %s\n", status.statusmsg);
+        ret = -1;
+    }
+    if(himd_mp3sink_close(&sink, &status) < 0)
+    {
+        fprintf(stderr,"%s\n", status.statusmsg);
+        ret = -1;
+    }
     himd_mp3stream_close(&str);
+    himd_free_tags(&tags);
+    return ret;
 }
 
 
@@ -262,46 +321,214 @@ int write_oma_header(FILE * f, const struct trackinfo * trkinfo)
     return 0;
 }
 
-/* For LPCM: creates headerless PCM
-             play with: play -t s2 -r 44100 -B -c2 stream.pcm
+/* Writes the loudness of an analyzed track to stream.json */
+static void write_report(const struct himd_analysis * an, const struct himd_tags * tags)
+{
+    struct himderrinfo status;
+
+    if(himd_analysis_write_report(&an->result, tags, "stream.json", &status) < 0)
+        fprintf(stderr, "%s\n", status.statusmsg);
+}
+
+/* The loudness report goes to stream.json if analyze is set */
+int himd_dumppcm(struct himd * himd, int trknum, const char * filename, int analyze)
+{
+    struct himd_nonmp3stream str;
+    struct himd_wavsink sink;
+    struct himd_analysis an;
+    struct himderrinfo status;
+    unsigned int len;
+    const unsigned char * data;
+    int ret = 0;
+
+    if(himd_nonmp3stream_open(himd, trknum, &str, &status) < 0)
+    {
+        fprintf(stderr, "Error opening track %d: %s\n", trknum, status.statusmsg);
+        return -1;
+    }
+    if(analyze && himd_nonmp3stream_set_analysis(&str, &an, &status) < 0)
+    {
+        fprintf(stderr, "%s\n", status.statusmsg);
+        himd_nonmp3stream_close(&str);
+        return -1;
+    }
+    if(himd_wavsink_open(&sink, filename, &status) < 0)
+    {
+        fprintf(stderr, "%s\n", status.statusmsg);
+        himd_nonmp3stream_close(&str);
+        return -1;
+    }
+    while(himd_nonmp3stream_read_block(&str, &data, &len, NULL, &status) >= 0)
+    {
+        if(himd_wavsink_write(&sink, data, len, &status) < 0)
+            break;
+    }
+    if(status.status != HIMD_STATUS_AUDIO_EOF)
+    {
+        fprintf(stderr,"Error dumping PCM data: %s\n", status.statusmsg);
+        ret = -1;
+    }
+    if(himd_wavsink_close(&sink, &status) < 0)
+    {
+        fprintf(stderr,"%s\n", status.statusmsg);
+        ret = -1;
+    }
+    himd_nonmp3stream_close(&str);
+    if(analyze)
+        write_report(&an, NULL);
+    return ret;
+}
+
+void himd_dumpflac(struct himd * himd, int trknum)
+{
+    struct himd_nonmp3stream str;
+    struct himd_flacsink sink;
+    struct himd_analysis an;
+    struct himderrinfo status;
+    struct trackinfo trkinfo;
+    struct himd_tags tags;
+    unsigned int len;
+    const unsigned char * data;
+
+    if(himd_get_track_info(himd, trknum, &trkinfo, &status) < 0)
+    {
+        fprintf(stderr, "Error obtaining track info: %s\n", status.statusmsg);
+        return;
+    }
+    if(trkinfo.codec_id != CODEC_LPCM)
+    {
+        fprintf(stderr, "Track %d is not an LPCM track\n", trknum);
+        return;
+    }
+    if(himd_get_tags(himd, &trkinfo, &tags, &status) < 0)
+    {
+        fprintf(stderr, "Error reading track strings: %s\n", status.statusmsg);
+        return;
+    }
+    if(himd_nonmp3stream_open(himd, trknum, &str, &status) < 0)
+    {
+        fprintf(stderr, "Error opening track %d: %s\n", trknum, status.statusmsg);
+        himd_free_tags(&tags);
+        return;
+    }
+    if(himd_nonmp3stream_set_analysis(&str, &an, &status) < 0 ||
+       himd_flacsink_open(&sink, "stream.flac", &tags, 0, &status) < 0)
+    {
+        fprintf(stderr, "%s\n", status.statusmsg);
+        himd_nonmp3stream_close(&str);
+        himd_free_tags(&tags);
+        return;
+    }
+    while(himd_nonmp3stream_read_block(&str, &data, &len, NULL, &status) >= 0)
+    {
+        if(himd_flacsink_write(&sink, data, len, &status) < 0)
+            break;
+    }
+    if(status.status != HIMD_STATUS_AUDIO_EOF)
+        fprintf(stderr,"Error dumping PCM data: %s\n", status.statusmsg);
+
+    /* closing the stream finishes the analysis */
+    himd_nonmp3stream_close(&str);
+    tags.loudness = &an.result;
+    if(status.status == HIMD_STATUS_AUDIO_EOF &&
+       himd_flacsink_retag(&sink, &tags, &status) < 0)
+        fprintf(stderr,"%s\n", status.statusmsg);
+    if(himd_flacsink_close(&sink, &status) < 0)
+        fprintf(stderr,"%s\n", status.statusmsg);
+    write_report(&an, &tags);
+    himd_free_tags(&tags);
+}
+
+/* Splits an LPCM track at silences into stream-NN.wav/.flac and stream.cue */
+void himd_dumpsplit(struct himd * himd, int trknum, enum himd_split_format format,
+                    double threshold_db, double min_silence)
+{
+    struct himd_nonmp3stream str;
+    struct himd_splitsink sink;
+    struct himderrinfo status;
+    struct trackinfo trkinfo;
+    struct himd_tags tags;
+    unsigned int len;
+    const unsigned char * data;
+
+    if(himd_get_track_info(himd, trknum, &trkinfo, &status) < 0)
+    {
+        fprintf(stderr, "Error obtaining track info: %s\n", status.statusmsg);
+        return;
+    }
+    if(trkinfo.codec_id != CODEC_LPCM)
+    {
+        fprintf(stderr, "Track %d is not an LPCM track\n", trknum);
+        return;
+    }
+    if(himd_get_tags(himd, &trkinfo, &tags, &status) < 0)
+    {
+        fprintf(stderr, "Error reading track strings: %s\n", status.statusmsg);
+        return;
+    }
+    if(himd_nonmp3stream_open(himd, trknum, &str, &status) < 0)
+    {
+        fprintf(stderr, "Error opening track %d: %s\n", trknum, status.statusmsg);
+        himd_free_tags(&tags);
+        return;
+    }
+    if(himd_splitsink_open(&sink, "stream", format, &tags, threshold_db, min_silence, &status) < 0)
+    {
+        fprintf(stderr, "%s\n", status.statusmsg);
+        himd_nonmp3stream_close(&str);
+        himd_free_tags(&tags);
+        return;
+    }
+    while(himd_nonmp3stream_read_block(&str, &data, &len, NULL, &status) >= 0)
+    {
+        if(himd_splitsink_write(&sink, data, len, &status) < 0)
+            break;
+    }
+    if(status.status != HIMD_STATUS_AUDIO_EOF)
+        fprintf(stderr,"Error dumping PCM data: %s\n", status.statusmsg);
+    if(himd_splitsink_close(&sink, &status) < 0)
+        fprintf(stderr,"%s\n", status.statusmsg);
+    else
+        printf("Split into %u parts\n", sink.part);
+    himd_nonmp3stream_close(&str);
+    himd_free_tags(&tags);
+}
+
+/* For LPCM: creates a .wav file
    For ATRAC3/ATRAC3+: creates a .oma file (with ea3 tag header)
              play with Sonic Stage (ffmpeg needs support of tagless files,
                                     ffmpeg does not support ATRAC3+)
  */
-void himd_dumpnonmp3(struct himd * himd, int trknum)
+int himd_dumpoma(struct himd * himd, int trknum, const char * filename)
 {
     struct himd_nonmp3stream str;
     struct himderrinfo status;
     struct trackinfo trkinfo;
     FILE * strdumpf;
-    const char * filename = "stream.pcm";
     unsigned int len;
     const unsigned char * data;
+    int ret = -1;
+
     if(himd_get_track_info(himd, trknum, &trkinfo, &status) < 0)
     {
         fprintf(stderr, "Error obtaining track info: %s\n", status.statusmsg);
-        return;
+        return -1;
     }
 
-    if(trkinfo.codec_id != CODEC_LPCM)
-        filename = "stream.oma";
-
-    strdumpf = fopen(filename,"wb");
+    strdumpf = g_fopen(filename,"wb");
     if(!strdumpf)
     {
-        fprintf(stderr, "opening ");
         perror(filename);
-        return;
+        return -1;
     }
     if(himd_nonmp3stream_open(himd, trknum, &str, &status) < 0)
     {
         fprintf(stderr, "Error opening track %d: %s\n", trknum, status.statusmsg);
         fclose(strdumpf);
-        return;
+        return -1;
     }
-    if(trkinfo.codec_id != CODEC_LPCM &&
-       write_oma_header(strdumpf, &trkinfo) < 0)
-        return;
+    if(write_oma_header(strdumpf, &trkinfo) < 0)
+        goto clean;
     while(himd_nonmp3stream_read_block(&str, &data, &len, NULL, &status) >= 0)
     {
         if(fwrite(data,len,1,strdumpf) != 1)
@@ -311,10 +538,31 @@ void himd_dumpnonmp3(struct himd * himd, int trknum)
         }
     }
     if(status.status != HIMD_STATUS_AUDIO_EOF)
-        fprintf(stderr,"Error reading PCM data: %s\n", status.statusmsg);
+        fprintf(stderr,"Error reading ATRAC data: %s\n", status.statusmsg);
+    else
+        ret = 0;
 clean:
-    fclose(strdumpf);
+    if(fclose(strdumpf) != 0)
+        ret = -1;
     himd_nonmp3stream_close(&str);
+    return ret;
+}
+
+void himd_dumpnonmp3(struct himd * himd, int trknum)
+{
+    struct himderrinfo status;
+    struct trackinfo trkinfo;
+
+    if(himd_get_track_info(himd, trknum, &trkinfo, &status) < 0)
+    {
+        fprintf(stderr, "Error obtaining track info: %s\n", status.statusmsg);
+        return;
+    }
+
+    if(trkinfo.codec_id == CODEC_LPCM)
+        himd_dumppcm(himd, trknum, "stream.wav", 1);
+    else
+        himd_dumpoma(himd, trknum, "stream.oma");
 }
 
 void himd_dumpholes(struct himd * h)
@@ -331,6 +579,185 @@ void himd_dumpholes(struct himd * h)
         printf("%d: %05u-%05u\n", i, holes.holes[i].firstblock, holes.holes[i].lastblock);
 }
 
+#define FSCK_MAX_THREADS 64
+
+void himd_dumpfsck(struct himd * h, unsigned int threads)
+{
+    struct himd_fsck_report report;
+    struct himderrinfo status;
+    unsigned int i;
+
+    if(himd_fsck(h, threads, &report, &status) < 0)
+    {
+        fprintf(stderr, "Checking audio data: %s\n", status.statusmsg);
+        return;
+    }
+    for(i = 0; i < report.nproblems; i++)
+        printf("track %4u: %-9s %s\n", report.problems[i].track,
+               himd_fsck_check_name(report.problems[i].check), report.problems[i].message);
+    printf("%u tracks, %u fragments, %u blocks checked, %u problems\n",
+           report.tracks, report.fragments, report.blocks, report.nproblems);
+    himd_fsck_free(&report);
+}
+
+/* a whole argument as number, 0 if it is none */
+static int parse_number(const char * arg, double * value)
+{
+    char * end;
+
+    *value = g_ascii_strtod(arg, &end);
+    return end != arg && *end == '\0' && isfinite(*value);
+}
+
+/* Parses a whole number from min to max */
+static int parse_count(const char * arg, long min, long max, unsigned int * value)
+{
+    char * end;
+    long n;
+
+    n = strtol(arg, &end, 10);
+    if(end == arg || *end != '\0' || n < min || n > max)
+        return 0;
+    *value = n;
+    return 1;
+}
+
+static unsigned int seconds_to_ms(const char * secs)
+{
+    double ms = g_ascii_strtod(secs, NULL) * 1000;
+
+    return ms > 0 ? (unsigned int)(ms + 0.5) : 0;
+}
+
+/* split, trim, join, delete and reorder only change the TIF in memory */
+static void himd_dumpedit(struct himd * h, int argc, char ** argv)
+{
+    struct himderrinfo status;
+    unsigned int slot = atoi(argv[3]), * slots;
+    int i, result = -1;
+
+    if(strcmp(argv[2],"delete") == 0 || strcmp(argv[2],"reorder") == 0)
+    {
+        slots = g_new(unsigned int, argc - 3);
+        for(i = 3; i < argc; i++)
+            slots[i-3] = atoi(argv[i]);
+        if(strcmp(argv[2],"delete") == 0)
+            result = himd_delete_tracks(h, slots, argc - 3, &status);
+        else
+            result = himd_reorder_tracks(h, slots, argc - 3, &status);
+        g_free(slots);
+        if(result < 0 || himd_write_tifdata(h, &status) < 0)
+            fprintf(stderr, "Changing tracks: %s\n", status.statusmsg);
+        else
+            printf("%d tracks %s\n", argc - 3, strcmp(argv[2],"delete") == 0 ? "deleted" : "reordered");
+        return;
+    }
+    if(strcmp(argv[2],"split") == 0 && argc > 4)
+        result = himd_track_split(h, slot, seconds_to_ms(argv[4]), &status);
+    else if(strcmp(argv[2],"trim") == 0 && argc > 5)
+        result = himd_track_trim(h, slot, seconds_to_ms(argv[4]), seconds_to_ms(argv[5]), &status);
+    else if(strcmp(argv[2],"join") == 0 && argc > 4)
+        result = himd_track_join(h, slot, atoi(argv[4]), &status);
+    else
+    {
+        fprintf(stderr, "Missing arguments for %s\n", argv[2]);
+        return;
+    }
+
+    if(result < 0 || himd_write_tifdata(h, &status) < 0)
+    {
+        fprintf(stderr, "Editing track %u: %s\n", slot, status.statusmsg);
+        return;
+    }
+    if(strcmp(argv[2],"split") == 0)
+        printf("Track %u split, the second part is track %d\n", slot, result);
+    else
+        printf("Track %u %s\n", slot, strcmp(argv[2],"trim") == 0 ? "trimmed" : "joined");
+}
+
+static void print_image_stats(const char * what, const struct himd_image_stats * stats)
+{
+    double secs = stats->usecs / 1e6;
+
+    printf("%s %.1f MB in %u extents, audio data %.1f MB with holes",
+           what, stats->data_bytes / 1048576.0, stats->extents, stats->atdata_bytes / 1048576.0);
+    if(stats->image_bytes)
+        printf(", image %.1f MB, ratio %.3f", stats->image_bytes / 1048576.0,
+               stats->data_bytes ? (double)stats->image_bytes / stats->data_bytes : 0.0);
+    printf(", %.1f MB/s\n", secs > 0 ? stats->data_bytes / 1048576.0 / secs : 0.0);
+}
+
+void himd_dumppack(struct himd * h, const char * filename, int compress)
+{
+    struct himd_image_stats stats;
+    struct himderrinfo status;
+
+    if(himd_image_pack(h, filename, compress, &stats, &status) < 0)
+    {
+        fprintf(stderr, "Packing disc image: %s\n", status.statusmsg);
+        return;
+    }
+    print_image_stats("Packed", &stats);
+}
+
+void himd_dumpunpack(struct himd * h, const char * dir)
+{
+    struct himd_image_stats stats;
+    struct himderrinfo status;
+
+    if(himd_image_unpack(h, dir, &stats, &status) < 0)
+    {
+        fprintf(stderr, "Unpacking disc image: %s\n", status.statusmsg);
+        return;
+    }
+    print_image_stats("Unpacked", &stats);
+}
+
+int himd_dumprecover(const char * root, int write)
+{
+    struct himd_recovery rec;
+    struct himd_recovered_track * t;
+    struct himderrinfo status;
+    unsigned int i;
+    int ret = 0;
+
+    if(himd_recover_scan(root, &rec, &status) < 0)
+    {
+        fprintf(stderr, "Recovering track index: %s\n", status.statusmsg);
+        return 1;
+    }
+    printf("%u blocks scanned, %u empty, %u bad; keys and strings from %s\n",
+           rec.blocks_scanned, rec.blocks_empty, rec.blocks_bad,
+           rec.template_name ? rec.template_name : "nowhere");
+    for(i = 0; i < rec.ntracks; i++)
+    {
+        t = &rec.tracks[i];
+        printf("%4u: %d:%02d %4s %08x %5u blocks at %05u, %u fragments%s%s%s",
+               t->slot, t->seconds/60, t->seconds % 60, t->codec, t->lo32_contentid,
+               t->blocks, t->firstblock, t->fragments,
+               t->from_template ? "" : ", new",
+               t->keys_lost ? ", keys lost" : "",
+               t->slot_conflict ? ", MP3 key slot unknown" : "");
+        if(t->missing || t->duplicates)
+            printf(", %u blocks missing, %u duplicates", t->missing, t->duplicates);
+        printf("\n");
+    }
+    if(rec.tracks_dropped)
+        printf("%u tracks did not fit into the track index\n", rec.tracks_dropped);
+
+    if(!write)
+        printf("Nothing written, add \"write\" to replace the track index\n");
+    else if(himd_recover_write(&rec, &status) < 0)
+    {
+        fprintf(stderr, "%s\n", status.statusmsg);
+        ret = 1;
+    }
+    else
+        printf("Track index with %u tracks written\n", rec.ntracks);
+    himd_recover_free(&rec);
+    return ret;
+}
+
 /*
  * gets artist, title and album info from an ID3 tag.
  * The output strings are to be free()d.
@@ -698,13 +1125,470 @@ void himd_writemp3(struct himd  *h, const char *filepath)
     free(artist); free(album); free(title);
 }
 
+/* sync: mirror the tracks of a disc into a directory. A manifest per disc
+   ID remembers the content ID, fragment layout, tags and output file of
+   every exported track, so a sync only exports new and changed tracks and
+   removes the files of deleted ones. */
+
+#define SYNC_DISC_GROUP "disc"
+
+/* codec, key and fragments of a track, as SHA-1 hex string */
+static gchar * sync_layout_digest(struct himd * himd, const struct trackinfo * t)
+{
+    GChecksum * sum = g_checksum_new(G_CHECKSUM_SHA1);
+    struct fraginfo f;
+    char buf[64];
+    int fnum = t->firstfrag, count = 0;
+    gchar * digest;
+
+    g_checksum_update(sum, &t->codec_id, 1);
+    g_checksum_update(sum, t->codecinfo, sizeof t->codecinfo);
+    g_checksum_update(sum, t->key, sizeof t->key);
+    while(fnum != 0 && count++ <= HIMD_LAST_FRAGMENT &&
+          himd_get_fragment_info(himd, fnum, &f, NULL) >= 0)
+    {
+        g_snprintf(buf, sizeof buf, "%u %u %u %u;", f.firstblock, f.lastblock, f.firstframe, f.lastframe);
+        g_checksum_update(sum, (const guchar *)buf, strlen(buf));
+        g_checksum_update(sum, f.key, sizeof f.key);
+        fnum = f.nextfrag;
+    }
+    digest = g_strdup(g_checksum_get_string(sum));
+    g_checksum_free(sum);
+    return digest;
+}
+
+static gchar * sync_tags_digest(const struct himd_tags * tags)
+{
+    gchar * text = g_strdup_printf("%s\n%s\n%s\n%d", tags->title ? tags->title : "",
+                                   tags->artist ? tags->artist : "",
+                                   tags->album ? tags->album : "", tags->trackinalbum);
+    gchar * digest = g_compute_checksum_for_string(G_CHECKSUM_SHA1, text, -1);
+    g_free(text);
+    return digest;
+}
+
+/* name is UTF-8 as in the manifest */
+static gchar * sync_path(const char * dir, const char * name)
+{
+    gchar * localname = g_filename_from_utf8(name, -1, NULL, NULL, NULL);
+    gchar * path = g_build_filename(dir, localname ? localname : name, NULL);
+    g_free(localname);
+    return path;
+}
+
+static int sync_file_exists(const char * dir, const char * name)
+{
+    gchar * path = sync_path(dir, name);
+    int exists = g_file_test(path, G_FILE_TEST_IS_REGULAR);
+    g_free(path);
+    return exists;
+}
+
+/* "Artist - Title.ext", safe for the file system and not used yet */
+static gchar * sync_file_name(const char * dir, const struct himd_tags * tags,
+                              struct trackinfo * t, const char * ext, GHashTable * taken,
+                              const char * oldfile)
+{
+    gchar * base, * name;
+    int i;
+
+    if(tags->title && *tags->title)
+        base = g_strdup_printf("%s - %s", tags->artist && *tags->artist ? tags->artist : "Unknown artist", tags->title);
+    else
+        base = g_strdup_printf("Track %s", hexdump(t->contentid + 16, 4));
+    g_strdelimit(base, "/\\:*?\"<>|\t\r\n", '_');
+    if(base[0] == '.')
+        base[0] = '_';
+
+    for(i = 1; ; i++)
+    {
+        if(i == 1)
+            name = g_strdup_printf("%s.%s", base, ext);
+        else
+            name = g_strdup_printf("%s (%d).%s", base, i, ext);
+        /* the track may keep its own file */
+        if(!g_hash_table_lookup(taken, name) &&
+           (!sync_file_exists(dir, name) || (oldfile && strcmp(name, oldfile) == 0)))
+            break;
+        g_free(name);
+    }
+    g_free(base);
+    return name;
+}
+
+static int sync_same_string(struct himd * a, unsigned int idxa, struct himd * b, unsigned int idxb)
+{
+    char * stra, * strb;
+    int lena, lenb, same;
+
+    if(idxa == 0 || idxb == 0)
+        return idxa == idxb;
+    stra = himd_get_string_raw(a, idxa, NULL, &lena, NULL);
+    strb = himd_get_string_raw(b, idxb, NULL, &lenb, NULL);
+    same = stra && strb && lena == lenb && memcmp(stra, strb, lena) == 0;
+    himd_free(stra);
+    himd_free(strb);
+    return same;
+}
+
+/* True if the previous generation has the same track, which is then
+   known to the manifest without decoding its strings */
+static int sync_unchanged_since_previous(struct himd * himd, struct himd * previous, GHashTable * prevslots,
+                                         const gchar * key, const struct trackinfo * t, const gchar * layout)
+{
+    struct trackinfo p;
+    gchar * prevlayout;
+    int same;
+    gpointer slot = g_hash_table_lookup(prevslots, key);
+
+    if(!slot || himd_get_track_info(previous, GPOINTER_TO_INT(slot), &p, NULL) < 0)
+        return 0;
+    prevlayout = sync_layout_digest(previous, &p);
+    same = strcmp(prevlayout, layout) == 0 && p.trackinalbum == t->trackinalbum &&
+           sync_same_string(previous, p.title, himd, t->title) &&
+           sync_same_string(previous, p.artist, himd, t->artist) &&
+           sync_same_string(previous, p.album, himd, t->album);
+    g_free(prevlayout);
+    return same;
+}
+
+/* manifest group of each track: its content ID, made unique */
+static gchar * sync_track_key(const struct trackinfo * t, GHashTable * seen)
+{
+    gchar * key = g_strdup(hexdump((unsigned char *)t->contentid, 20));
+    int i;
+
+    for(i = 2; g_hash_table_lookup(seen, key); i++)
+    {
+        g_free(key);
+        key = g_strdup_printf("%s-%d", hexdump((unsigned char *)t->contentid, 20), i);
+    }
+    return key;
+}
+
+static void sync_fill_slots(struct himd * himd, GHashTable * slots)
+{
+    struct trackinfo t;
+    int i;
+
+    for(i = HIMD_FIRST_TRACK; i <= HIMD_LAST_TRACK; i++)
+        if(himd_get_track_info(himd, i, &t, NULL) >= 0)
+            g_hash_table_insert(slots, sync_track_key(&t, slots), GINT_TO_POINTER(i));
+}
+
+static int sync_export(struct himd * himd, int slot, const char * codec, const char * path)
+{
+    if(strcmp(codec, "MPEG") == 0)
+        return himd_dumpmp3(himd, slot, path);
+    if(strcmp(codec, "LPCM") == 0)
+        return himd_dumppcm(himd, slot, path, 0);
+    return himd_dumpoma(himd, slot, path);
+}
+
+static void sync_write_manifest(GKeyFile * manifest, const char * path)
+{
+    GError * error = NULL;
+    gsize len;
+    gchar * data = g_key_file_to_data(manifest, &len, NULL);
+
+    if(!g_file_set_contents(path, data, len, &error))
+    {
+        fprintf(stderr, "Can't write manifest %s: %s\n", path, error->message);
+        g_error_free(error);
+    }
+    g_free(data);
+}
+
+/* true if the manifest entry group has value as key */
+static int sync_manifest_has(GKeyFile * manifest, const gchar * group, const gchar * key, const gchar * value)
+{
+    gchar * old = g_key_file_get_string(manifest, group, key, NULL);
+    int same = old && strcmp(old, value) == 0;
+    g_free(old);
+    return same;
+}
+
+/* Export or skip one track, returns -1 if it failed */
+static int sync_track(struct himd * himd, int slot, struct trackinfo * t, const char * dir,
+                      GKeyFile * manifest, const gchar * key, const gchar * layout,
+                      const gchar * oldfile, GHashTable * taken, int * exported, int * renamed)
+{
+    struct himderrinfo status;
+    struct himd_tags tags;
+    const char * codec = himd_get_codec_name(t);
+    const char * ext;
+    gchar * tagsdigest, * name, * path, * partpath;
+    int ret = 0;
+
+    if(strcmp(codec, "MPEG") == 0)
+        ext = "mp3";
+    else if(strcmp(codec, "LPCM") == 0)
+        ext = "wav";
+    else
+        ext = "oma";
+
+    if(himd_get_tags(himd, t, &tags, &status) < 0)
+    {
+        fprintf(stderr, "Track %d: error reading track strings: %s\n", slot, status.statusmsg);
+        return -1;
+    }
+    tagsdigest = sync_tags_digest(&tags);
+    if(oldfile && sync_manifest_has(manifest, key, "layout", layout) &&
+       sync_manifest_has(manifest, key, "tags", tagsdigest))
+    {
+        himd_free_tags(&tags);
+        g_free(tagsdigest);
+        return 0;
+    }
+
+    /* a track keeps its file unless the name would change */
+    if(oldfile && sync_manifest_has(manifest, key, "tags", tagsdigest) && g_str_has_suffix(oldfile, ext))
+        name = g_strdup(oldfile);
+    else
+        name = sync_file_name(dir, &tags, t, ext, taken, oldfile);
+    g_hash_table_insert(taken, g_strdup(name), GINT_TO_POINTER(1));
+    path = sync_path(dir, name);
+
+    /* WAV and OMA files carry no tags, new tags only change the name */
+    if(oldfile && strcmp(codec, "MPEG") != 0 && sync_manifest_has(manifest, key, "layout", layout) &&
+       g_str_has_suffix(oldfile, ext))
+    {
+        gchar * oldpath = sync_path(dir, oldfile);
+
+        if(strcmp(oldfile, name) == 0 || g_rename(oldpath, path) == 0)
+        {
+            if(strcmp(oldfile, name) != 0)
+                printf("Track %d: renaming %s to %s\n", slot, oldfile, name);
+            g_key_file_set_string(manifest, key, "tags", tagsdigest);
+            g_key_file_set_string(manifest, key, "file", name);
+            (*renamed)++;
+            g_free(oldpath);
+            g_free(path);
+            g_free(name);
+            g_free(tagsdigest);
+            himd_free_tags(&tags);
+            return 0;
+        }
+        g_free(oldpath);
+    }
+
+    partpath = g_strconcat(path, ".part", NULL);
+    printf("Track %d: exporting %s\n", slot, name);
+    if(sync_export(himd, slot, codec, partpath) < 0 || g_rename(partpath, path) < 0)
+    {
+        fprintf(stderr, "Track %d: export to %s failed\n", slot, path);
+        g_unlink(partpath);
+        ret = -1;
+    }
+    else
+    {
+        if(oldfile && strcmp(oldfile, name) != 0)
+        {
+            gchar * oldpath = sync_path(dir, oldfile);
+            g_unlink(oldpath);
+            g_free(oldpath);
+        }
+        g_key_file_set_string(manifest, key, "layout", layout);
+        g_key_file_set_string(manifest, key, "tags", tagsdigest);
+        g_key_file_set_string(manifest, key, "file", name);
+        (*exported)++;
+    }
+
+    g_free(partpath);
+    g_free(path);
+    g_free(name);
+    g_free(tagsdigest);
+    himd_free_tags(&tags);
+    return ret;
+}
+
+/* true if all tracks in the manifest have their file */
+static int sync_files_present(GKeyFile * manifest, const char * dir, int * count)
+{
+    gchar ** groups = g_key_file_get_groups(manifest, NULL);
+    gchar * name;
+    int i, present = 1;
+
+    *count = 0;
+    for(i = 0; groups[i] && present; i++)
+    {
+        if(strcmp(groups[i], SYNC_DISC_GROUP) == 0)
+            continue;
+        name = g_key_file_get_string(manifest, groups[i], "file", NULL);
+        present = name && sync_file_exists(dir, name);
+        g_free(name);
+        (*count)++;
+    }
+    g_strfreev(groups);
+    return present;
+}
+
+void himd_sync(struct himd * himd, const char * dir, int use_previous)
+{
+    struct himderrinfo status;
+    struct himd previous;
+    struct trackinfo t;
+    unsigned char digest[HIMD_TIF_DIGEST_SIZE];
+    const unsigned char * discid;
+    GKeyFile * manifest;
+    GHashTable * seen, * taken, * prevslots = NULL;
+    gchar * manifestpath, * name, * tifdigest, * synceddigest;
+    gchar ** groups;
+    int i, have_previous = 0, count, unchanged = 0, exported = 0, renamed = 0, skipped = 0, removed = 0, failed = 0;
+
+    if(!(discid = himd_get_discid(himd, &status)))
+    {
+        fprintf(stderr, "Error obtaining disc ID: %s\n", status.statusmsg);
+        return;
+    }
+    if(g_mkdir_with_parents(dir, 0755) < 0)
+    {
+        perror(dir);
+        return;
+    }
+    name = g_strdup_printf(".himdsync-%s", hexdump((unsigned char *)discid, 16));
+    manifestpath = g_build_filename(dir, name, NULL);
+    g_free(name);
+    manifest = g_key_file_new();
+    g_key_file_load_from_file(manifest, manifestpath, G_KEY_FILE_NONE, NULL);
+
+    himd_get_tif_digest(himd, digest);
+    tifdigest = g_strdup(hexdump(digest, HIMD_TIF_DIGEST_SIZE));
+    synceddigest = g_key_file_get_string(manifest, SYNC_DISC_GROUP, "tif", NULL);
+
+    /* the TIF is the one of the last sync, only the files need checking */
+    if(synceddigest && strcmp(synceddigest, tifdigest) == 0 &&
+       sync_files_present(manifest, dir, &count))
+    {
+        printf("%d tracks up to date\n", count);
+        goto done;
+    }
+
+    /* the last sync saw the TIF generation before the current one, so the
+       tracks that are still the same in both need not be decoded */
+    if(use_previous && synceddigest)
+    {
+        if(himd_open_previous(&previous, himd, &status) < 0)
+            fprintf(stderr, "%s\n", status.statusmsg);
+        else
+        {
+            himd_get_tif_digest(&previous, digest);
+            if(strcmp(synceddigest, hexdump(digest, HIMD_TIF_DIGEST_SIZE)) == 0)
+            {
+                have_previous = 1;
+                prevslots = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+                sync_fill_slots(&previous, prevslots);
+            }
+            else
+                himd_close(&previous);
+        }
+    }
+
+    seen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    taken = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    for(i = HIMD_FIRST_TRACK; i <= HIMD_LAST_TRACK; i++)
+    {
+        gchar * key, * layout, * oldfile;
+
+        if(himd_get_track_info(himd, i, &t, NULL) < 0)
+            continue;
+        key = sync_track_key(&t, seen);
+        g_hash_table_insert(seen, key, GINT_TO_POINTER(1));
+        layout = sync_layout_digest(himd, &t);
+        oldfile = g_key_file_get_string(manifest, key, "file", NULL);
+        if(oldfile && !sync_file_exists(dir, oldfile))
+        {
+            g_free(oldfile);
+            oldfile = NULL;
+        }
+        if(oldfile)
+            g_hash_table_insert(taken, g_strdup(oldfile), GINT_TO_POINTER(1));
+
+        if(oldfile && have_previous && sync_manifest_has(manifest, key, "layout", layout) &&
+           sync_unchanged_since_previous(himd, &previous, prevslots, key, &t, layout))
+            ;
+        else if(!himd_track_uploadable(himd, &t))
+        {
+            printf("Track %d: skipped, copy protected\n", i);
+            skipped++;
+        }
+        else if(sync_track(himd, i, &t, dir, manifest, key, layout, oldfile, taken, &exported, &renamed) < 0)
+            failed++;
+        g_free(layout);
+        g_free(oldfile);
+    }
+    unchanged = g_hash_table_size(seen) - exported - renamed - skipped - failed;
+
+    /* tracks deleted from the disc */
+    groups = g_key_file_get_groups(manifest, NULL);
+    for(i = 0; groups[i]; i++)
+    {
+        if(strcmp(groups[i], SYNC_DISC_GROUP) == 0 || g_hash_table_lookup(seen, groups[i]))
+            continue;
+        name = g_key_file_get_string(manifest, groups[i], "file", NULL);
+        if(name && !g_hash_table_lookup(taken, name))
+        {
+            gchar * path = sync_path(dir, name);
+            printf("Removing %s\n", name);
+            g_unlink(path);
+            g_free(path);
+        }
+        g_free(name);
+        g_key_file_remove_group(manifest, groups[i], NULL);
+        removed++;
+    }
+    g_strfreev(groups);
+
+    /* after a failure, the next sync has to look at every track again */
+    if(failed)
+        g_key_file_remove_key(manifest, SYNC_DISC_GROUP, "tif", NULL);
+    else
+        g_key_file_set_string(manifest, SYNC_DISC_GROUP, "tif", tifdigest);
+    sync_write_manifest(manifest, manifestpath);
+    printf("%d tracks exported, %d renamed, %d unchanged, %d removed, %d failed\n",
+           exported, renamed, unchanged, removed, failed);
+
+    g_hash_table_destroy(seen);
+    g_hash_table_destroy(taken);
+    if(have_previous)
+    {
+        g_hash_table_destroy(prevslots);
+        himd_close(&previous);
+    }
+done:
+    g_free(synceddigest);
+    g_free(tifdigest);
+    g_free(manifestpath);
+    g_key_file_free(manifest);
+}
+
+void himd_dumpstats(struct himd * h)
+{
+    struct himd_stats stats;
+
+    himd_get_stats(h, &stats);
+    fprintf(stderr, "blocks read:        %llu (%llu bytes)\n", stats.blocks_read, stats.bytes_read);
+    fprintf(stderr, "seeks:              %llu\n", stats.seeks);
+    fprintf(stderr, "fragment hops:      %llu\n", stats.fragment_hops);
+    fprintf(stderr, "decrypt calls:      %llu (%.3f ms)\n", stats.decrypt_calls, stats.decrypt_ns / 1e6);
+    fprintf(stderr, "key schedules:      %llu\n", stats.key_schedules);
+    fprintf(stderr, "string conversions: %llu\n", stats.string_conversions);
+}
+
 int main(int argc, char ** argv)
 {
-    int idx;
+    int idx, stats = 0;
     struct himd h;
     struct himderrinfo status;
     setlocale(LC_ALL,"");
 
+    if (argc > 1 && strcmp(argv[1], "--stats") == 0) {
+      stats = 1;
+      argv[1] = argv[0];
+      argv++;
+      argc--;
+    }
+
     if (argc == 2 && (strcmp (argv[1], "help") == 0)) {
       usage(argv[0]);
       return 0;
@@ -715,11 +1599,16 @@ int main(int argc, char ** argv)
       return 0;
     }
 
+    /* works without a readable track index */
+    if(argc > 2 && strcmp(argv[2],"recover") == 0)
+        return himd_dumprecover(argv[1], argc > 3 && strcmp(argv[3],"write") == 0);
+
     if(himd_open(&h,argv[1], &status) < 0)
     {
         puts(status.statusmsg);
         return 1;
     }
+    himd_enable_stats(&h, stats);
     if(argc == 2 || strcmp(argv[2],"tracks") == 0)
         himd_trackdump(&h, argc > 3);
     else if(strcmp(argv[2],"strings") == 0)
@@ -728,6 +1617,23 @@ int main(int argc, char ** argv)
         himd_dumpdiscid(&h);
     else if(strcmp(argv[2],"holes") == 0)
         himd_dumpholes(&h);
+    else if(strcmp(argv[2],"fsck") == 0)
+    {
+        unsigned int threads = 0;	/* one per processor */
+
+        if(argc > 3 && !parse_count(argv[3], 1, FSCK_MAX_THREADS, &threads))
+        {
+            fprintf(stderr, "fsck takes 1 to %d threads\n", FSCK_MAX_THREADS);
+            usage(argv[0]);
+            himd_close(&h);
+            return 1;
+        }
+        himd_dumpfsck(&h, threads);
+    }
+    else if(strcmp(argv[2],"pack") == 0 && argc > 3)
+        himd_dumppack(&h, argv[3], argc > 4 && strcmp(argv[4],"zstd") == 0);
+    else if(strcmp(argv[2],"unpack") == 0 && argc > 3)
+        himd_dumpunpack(&h, argv[3]);
     else if(strcmp(argv[2],"mp3key") == 0 && argc > 3)
     {
         mp3key k;
@@ -746,7 +1652,7 @@ int main(int argc, char ** argv)
     {
         idx = 1;
         sscanf(argv[3], "%d", &idx);
-        himd_dumpmp3(&h, idx);
+        himd_dumpmp3(&h, idx, "stream.mp3");
     }
     else if(strcmp(argv[2],"dumpnonmp3") == 0 && argc > 3)
     {
@@ -754,11 +1660,50 @@ int main(int argc, char ** argv)
         sscanf(argv[3], "%d", &idx);
         himd_dumpnonmp3(&h, idx);
     }
+    else if(strcmp(argv[2],"dumpflac") == 0 && argc > 3)
+    {
+        idx = 1;
+        sscanf(argv[3], "%d", &idx);
+        himd_dumpflac(&h, idx);
+    }
+    else if(strcmp(argv[2],"dumpsplit") == 0 && argc > 3)
+    {
+        enum himd_split_format format = HIMD_SPLIT_WAV;
+        double threshold_db = -50, min_silence = 2;
+
+        idx = 1;
+        sscanf(argv[3], "%d", &idx);
+        if((argc > 4 && strcmp(argv[4],"wav") != 0 && strcmp(argv[4],"flac") != 0) ||
+           (argc > 5 && (!parse_number(argv[5], &threshold_db) || threshold_db >= 0)) ||
+           (argc > 6 && (!parse_number(argv[6], &min_silence) || min_silence <= 0 || min_silence > HIMD_SPLIT_MAX_SILENCE)))
+        {
+            fprintf(stderr, "dumpsplit takes wav or flac, a level below 0 dBFS and up to %d seconds\n",
+                    HIMD_SPLIT_MAX_SILENCE);
+            usage(argv[0]);
+            himd_close(&h);
+            return 1;
+        }
+        if(argc > 4 && strcmp(argv[4],"flac") == 0)
+            format = HIMD_SPLIT_FLAC;
+        himd_dumpsplit(&h, idx, format, threshold_db, min_silence);
+    }
     else if(strcmp(argv[2],"writemp3") == 0 && argc > 3)
     {
 	himd_writemp3(&h, argv[3]);
     }
+    else if((strcmp(argv[2],"split") == 0 || strcmp(argv[2],"trim") == 0 ||
+             strcmp(argv[2],"join") == 0 || strcmp(argv[2],"delete") == 0 ||
+             strcmp(argv[2],"reorder") == 0) && argc > 3)
+    {
+        himd_dumpedit(&h, argc, argv);
+    }
+    else if(strcmp(argv[2],"sync") == 0 && argc > 3)
+    {
+        himd_sync(&h, argv[3], argc > 4 && strcmp(argv[4],"previous") == 0);
+    }
 
+    if(stats)
+        himd_dumpstats(&h);
     himd_close(&h);
     return 0;
 }
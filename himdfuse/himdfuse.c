@@ -0,0 +1,244 @@
+/*
+ *   himdfuse.c - mount the tracks of a HiMD as audio files
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <fuse.h>
+#include <glib.h>
+
+#include "himd.h"
+#include "trackfile.h"
+
+/* 512 blocks of 16KB */
+#define CACHE_BLOCKS 512
+
+struct trackentry {
+    char * name;
+    unsigned int trackno;
+    unsigned long long size;
+    time_t mtime;
+};
+
+struct openfile {
+    GMutex lock;
+    struct himd_trackfile tf;
+};
+
+static struct himd himd;
+static struct himd_blockcache * cache;
+static struct trackentry * entries;
+static unsigned int nentries;
+
+static const char * extension(enum himd_trackfile_format format)
+{
+    switch(format)
+    {
+        case HIMD_TRACKFILE_MP3: return "mp3";
+        case HIMD_TRACKFILE_OMA: return "oma";
+        default: return "wav";
+    }
+}
+
+static char * make_name(unsigned int idx, const struct himd_tags * tags, enum himd_trackfile_format format)
+{
+    char * name;
+
+    if(tags->artist && tags->title)
+        name = g_strdup_printf("%02u - %s - %s.%s", idx, tags->artist, tags->title, extension(format));
+    else if(tags->title)
+        name = g_strdup_printf("%02u - %s.%s", idx, tags->title, extension(format));
+    else
+        name = g_strdup_printf("%02u - Track %u.%s", idx, idx, extension(format));
+    return g_strdelimit(name, "/", '_');
+}
+
+/* List the tracks in play order. The sizes are determined here, as
+   directory listings need them right away. */
+static void scan_tracks(void)
+{
+    unsigned int i, count = himd_track_count(&himd);
+    struct himderrinfo status;
+    struct trackinfo trkinfo;
+    struct himd_trackfile tf;
+    struct himd_tags tags;
+    struct trackentry * e;
+
+    entries = g_new0(struct trackentry, count);
+    for(i = 0; i < count; i++)
+    {
+        e = &entries[nentries];
+        e->trackno = himd_get_trackslot(&himd, i, &status);
+        if(e->trackno == 0 ||
+           himd_get_track_info(&himd, e->trackno, &trkinfo, &status) < 0 ||
+           himd_get_tags(&himd, &trkinfo, &tags, &status) < 0)
+        {
+            fprintf(stderr, "Skipping track %u: %s\n", i+1, status.statusmsg);
+            continue;
+        }
+        if(himd_trackfile_open(&himd, e->trackno, cache, &tf, &status) < 0)
+        {
+            fprintf(stderr, "Skipping track %u: %s\n", i+1, status.statusmsg);
+            himd_free_tags(&tags);
+            continue;
+        }
+        e->name = make_name(i+1, &tags, tf.format);
+        e->size = tf.size;
+        e->mtime = mktime(&trkinfo.recordingtime);
+        himd_trackfile_close(&tf);
+        himd_free_tags(&tags);
+        nentries++;
+    }
+}
+
+static struct trackentry * find_entry(const char * path)
+{
+    unsigned int i;
+
+    if(*path++ != '/')
+        return NULL;
+    for(i = 0; i < nentries; i++)
+        if(strcmp(entries[i].name, path) == 0)
+            return &entries[i];
+    return NULL;
+}
+
+static int himdfuse_getattr(const char * path, struct stat * st)
+{
+    struct trackentry * e;
+
+    memset(st, 0, sizeof *st);
+    if(strcmp(path, "/") == 0)
+    {
+        st->st_mode = S_IFDIR | 0555;
+        st->st_nlink = 2;
+        return 0;
+    }
+    if(!(e = find_entry(path)))
+        return -ENOENT;
+    st->st_mode = S_IFREG | 0444;
+    st->st_nlink = 1;
+    st->st_size = e->size;
+    st->st_mtime = e->mtime;
+    return 0;
+}
+
+static int himdfuse_readdir(const char * path, void * buf, fuse_fill_dir_t filler,
+                            off_t offset, struct fuse_file_info * fi)
+{
+    unsigned int i;
+    (void)offset;
+    (void)fi;
+
+    if(strcmp(path, "/") != 0)
+        return -ENOENT;
+    filler(buf, ".", NULL, 0);
+    filler(buf, "..", NULL, 0);
+    for(i = 0; i < nentries; i++)
+        filler(buf, entries[i].name, NULL, 0);
+    return 0;
+}
+
+static int himdfuse_open(const char * path, struct fuse_file_info * fi)
+{
+    struct trackentry * e;
+    struct openfile * f;
+    struct himderrinfo status;
+
+    if(!(e = find_entry(path)))
+        return -ENOENT;
+    if((fi->flags & O_ACCMODE) != O_RDONLY)
+        return -EROFS;
+
+    f = g_new(struct openfile, 1);
+    if(himd_trackfile_open(&himd, e->trackno, cache, &f->tf, &status) < 0)
+    {
+        fprintf(stderr, "Can't open %s: %s\n", e->name, status.statusmsg);
+        g_free(f);
+        return -EIO;
+    }
+    g_mutex_init(&f->lock);
+    fi->fh = (uintptr_t)f;
+    /* the disc can't change while it is mounted */
+    fi->keep_cache = 1;
+    return 0;
+}
+
+static int himdfuse_read(const char * path, char * buf, size_t size, off_t offset,
+                         struct fuse_file_info * fi)
+{
+    struct openfile * f = (struct openfile *)(uintptr_t)fi->fh;
+    struct himderrinfo status;
+    long len;
+    (void)path;
+
+    g_mutex_lock(&f->lock);
+    len = himd_trackfile_pread(&f->tf, (unsigned char *)buf, size, offset, &status);
+    g_mutex_unlock(&f->lock);
+    if(len < 0)
+    {
+        fprintf(stderr, "Read error: %s\n", status.statusmsg);
+        return -EIO;
+    }
+    return len;
+}
+
+static int himdfuse_release(const char * path, struct fuse_file_info * fi)
+{
+    struct openfile * f = (struct openfile *)(uintptr_t)fi->fh;
+    (void)path;
+
+    himd_trackfile_close(&f->tf);
+    g_mutex_clear(&f->lock);
+    g_free(f);
+    return 0;
+}
+
+static struct fuse_operations himdfuse_ops = {
+    .getattr = himdfuse_getattr,
+    .readdir = himdfuse_readdir,
+    .open = himdfuse_open,
+    .read = himdfuse_read,
+    .release = himdfuse_release,
+};
+
+int main(int argc, char ** argv)
+{
+    struct himderrinfo status;
+    unsigned int i;
+    int ret;
+
+    if(argc < 3)
+    {
+        printf("Usage: %s <HiMD path> <mountpoint> [FUSE options]\n", argv[0]);
+        return 1;
+    }
+    if(himd_open(&himd, argv[1], &status) < 0)
+    {
+        fprintf(stderr, "Error opening HiMD: %s\n", status.statusmsg);
+        return 1;
+    }
+    /* MP3 keys need the disc ID, read it before any reader thread runs */
+    if(!himd_get_discid(&himd, &status))
+        fprintf(stderr, "Can't read disc ID, MP3 tracks will be missing: %s\n", status.statusmsg);
+
+    cache = himd_blockcache_new(CACHE_BLOCKS);
+    scan_tracks();
+
+    /* FUSE gets the remaining arguments */
+    argv[1] = argv[0];
+    ret = fuse_main(argc - 1, argv + 1, &himdfuse_ops, NULL);
+
+    for(i = 0; i < nentries; i++)
+        g_free(entries[i].name);
+    g_free(entries);
+    himd_blockcache_free(cache);
+    himd_close(&himd);
+    return ret;
+}
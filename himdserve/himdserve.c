@@ -0,0 +1,764 @@
+/*
+ *   himdserve.c - serve the tracks of a HiMD over HTTP
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <glib.h>
+
+#include "himd.h"
+#include "trackfile.h"
+
+#define DEFAULT_PORT 8090
+#define DEFAULT_WORKERS 4
+#define CACHE_BLOCKS 512
+#define MAX_CONNS 256
+#define MAX_REQUEST 8192
+/* audio data produced by a worker per job, the client gets it while
+   the worker is already decrypting the next piece */
+#define CHUNK_SIZE 65536
+
+enum conn_state {
+    CONN_READING,	/* waiting for (the rest of) a request */
+    CONN_WAITING,	/* a worker is busy with the connection */
+    CONN_SENDING	/* out holds data to send */
+};
+
+struct conn {
+    int fd;
+    enum conn_state state;
+    gint dead;			/* the peer went away while a worker was busy, atomic */
+    int closed;			/* freed after the current batch of events */
+
+    GString * in;		/* received, unparsed bytes */
+    GByteArray * out;
+    unsigned int outpos;
+
+    /* the request being answered */
+    int http11;
+    int keepalive;
+    int head;
+    unsigned int trackno;
+    int ranged;
+    unsigned long long first, last;	/* requested range, last is inclusive */
+
+    /* response state, only touched by the worker while CONN_WAITING */
+    int opened;
+    int headersent;
+    int sequential;
+    int chunked;
+    int finished;		/* out holds the end of the response */
+    unsigned long long pos;
+    struct himd_trackfile tf;
+};
+
+static struct himd himd;
+static struct himd_blockcache * cache;
+static GThreadPool * pool;
+static int epfd;
+static int notify_pipe[2];
+static unsigned int nconns;
+/* closed connections, other events of the same batch may still refer to them */
+static GSList * graveyard;
+
+static const char * content_type(enum himd_trackfile_format format)
+{
+    switch(format)
+    {
+        case HIMD_TRACKFILE_MP3: return "audio/mpeg";
+        case HIMD_TRACKFILE_OMA: return "audio/x-oma";
+        default: return "audio/x-wav";
+    }
+}
+
+static const char * extension(enum himd_trackfile_format format)
+{
+    switch(format)
+    {
+        case HIMD_TRACKFILE_MP3: return "mp3";
+        case HIMD_TRACKFILE_OMA: return "oma";
+        default: return "wav";
+    }
+}
+
+static void watch(struct conn * c, unsigned int events)
+{
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.ptr = c;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void close_track(struct conn * c)
+{
+    if(c->opened)
+        himd_trackfile_close(&c->tf);
+    c->opened = 0;
+}
+
+static void free_conn(struct conn * c)
+{
+    if(c->closed)
+        return;
+    c->closed = 1;
+    close_track(c);
+    close(c->fd);
+    nconns--;
+    graveyard = g_slist_prepend(graveyard, c);
+}
+
+static void bury_conns(void)
+{
+    struct conn * c;
+
+    for(; graveyard; graveyard = g_slist_delete_link(graveyard, graveyard))
+    {
+        c = graveyard->data;
+        g_string_free(c->in, TRUE);
+        g_byte_array_free(c->out, TRUE);
+        g_free(c);
+    }
+}
+
+static void start_sending(struct conn * c)
+{
+    c->outpos = 0;
+    c->state = CONN_SENDING;
+    watch(c, EPOLLOUT);
+}
+
+/* A complete response without body or with a small generated one */
+static void respond(struct conn * c, const char * code, const char * type,
+                    const char * extra, const char * body)
+{
+    GString * h = g_string_new(NULL);
+    size_t len = body ? strlen(body) : 0;
+
+    g_string_append_printf(h, "HTTP/1.1 %s\r\nServer: himdserve\r\n", code);
+    if(type)
+        g_string_append_printf(h, "Content-Type: %s\r\n", type);
+    if(extra)
+        g_string_append(h, extra);
+    g_string_append_printf(h, "Content-Length: %lu\r\n", (unsigned long)len);
+    if(!c->keepalive)
+        g_string_append(h, "Connection: close\r\n");
+    g_string_append(h, "\r\n");
+    if(body && !c->head)
+        g_string_append(h, body);
+
+    g_byte_array_set_size(c->out, 0);
+    g_byte_array_append(c->out, (guint8 *)h->str, h->len);
+    g_string_free(h, TRUE);
+    c->finished = 1;
+    start_sending(c);
+}
+
+static void respond_error(struct conn * c, const char * code)
+{
+    gchar * body = g_strdup_printf("%s\n", code);
+    respond(c, code, "text/plain", NULL, body);
+    g_free(body);
+}
+
+/* An M3U playlist of all tracks in play order */
+static void respond_playlist(struct conn * c)
+{
+    GString * m3u = g_string_new("#EXTM3U\n");
+    struct himderrinfo status;
+    struct trackinfo trkinfo;
+    struct himd_tags tags;
+    unsigned int i, slot;
+    enum himd_trackfile_format format;
+
+    for(i = 0; i < himd_track_count(&himd); i++)
+    {
+        slot = himd_get_trackslot(&himd, i, &status);
+        if(slot == 0 || himd_get_track_info(&himd, slot, &trkinfo, &status) < 0 ||
+           !himd_track_uploadable(&himd, &trkinfo) ||
+           himd_get_tags(&himd, &trkinfo, &tags, &status) < 0)
+            continue;
+        if(trkinfo.codec_id == CODEC_LPCM)
+            format = HIMD_TRACKFILE_WAV;
+        else if(trkinfo.codec_id == CODEC_ATRAC3PLUS_OR_MPEG && (trkinfo.codecinfo[0] & 3) == 3)
+            format = HIMD_TRACKFILE_MP3;
+        else
+            format = HIMD_TRACKFILE_OMA;
+        g_string_append_printf(m3u, "#EXTINF:%d,%s%s%s\n/tracks/%u.%s\n", trkinfo.seconds,
+                               tags.artist ? tags.artist : "", tags.artist ? " - " : "",
+                               tags.title ? tags.title : "", i+1, extension(format));
+        himd_free_tags(&tags);
+    }
+    respond(c, "200 OK", "audio/x-mpegurl", NULL, m3u->str);
+    g_string_free(m3u, TRUE);
+}
+
+/* Parses "bytes=a-b", "bytes=a-" and "bytes=-n". Several ranges are not
+   supported, the whole file is sent for them. */
+static int parse_range(struct conn * c, const char * value)
+{
+    char * end;
+
+    if(strncmp(value, "bytes=", 6) != 0 || strchr(value, ','))
+        return 0;
+    value += 6;
+    if(*value == '-')
+    {
+        /* suffix, resolved once the size is known */
+        c->first = G_MAXUINT64;
+        c->last = g_ascii_strtoull(value+1, &end, 10);
+    }
+    else
+    {
+        c->first = g_ascii_strtoull(value, &end, 10);
+        if(*end != '-')
+            return 0;
+        if(end[1])
+            c->last = g_ascii_strtoull(end+1, &end, 10);
+        else
+        {
+            c->last = G_MAXUINT64;
+            end++;
+        }
+    }
+    if(*end && *end != ' ')
+        return 0;
+    c->ranged = 1;
+    return 1;
+}
+
+/* Returns 0 if the request is not complete yet */
+static int parse_request(struct conn * c)
+{
+    char * end = strstr(c->in->str, "\r\n\r\n");
+    gchar ** lines, ** req;
+    const char * target;
+    char * rest;
+    unsigned int i, idx;
+    struct himderrinfo status;
+
+    if(!end)
+    {
+        if(c->in->len > MAX_REQUEST)
+        {
+            c->keepalive = 0;
+            respond_error(c, "431 Request Header Fields Too Large");
+            return 1;
+        }
+        return 0;
+    }
+
+    *end = '\0';
+    lines = g_strsplit(c->in->str, "\r\n", 0);
+    g_string_erase(c->in, 0, end + 4 - c->in->str);
+
+    c->ranged = 0;
+    c->head = 0;
+    c->finished = 0;
+    c->headersent = 0;
+    req = g_strsplit(lines[0], " ", 3);
+    if(g_strv_length(req) != 3 || strncmp(req[2], "HTTP/1.", 7) != 0)
+    {
+        c->keepalive = 0;
+        respond_error(c, "400 Bad Request");
+        goto out;
+    }
+    c->http11 = strcmp(req[2], "HTTP/1.0") != 0;
+    c->keepalive = c->http11;
+
+    for(i = 1; lines[i]; i++)
+    {
+        char * value = strchr(lines[i], ':');
+        if(!value)
+            continue;
+        *value++ = '\0';
+        while(*value == ' ')
+            value++;
+        if(g_ascii_strcasecmp(lines[i], "Connection") == 0)
+        {
+            if(g_ascii_strcasecmp(value, "close") == 0)
+                c->keepalive = 0;
+            else if(g_ascii_strcasecmp(value, "keep-alive") == 0)
+                c->keepalive = 1;
+        }
+        else if(g_ascii_strcasecmp(lines[i], "Range") == 0)
+            parse_range(c, value);
+    }
+
+    if(strcmp(req[0], "HEAD") == 0)
+        c->head = 1;
+    else if(strcmp(req[0], "GET") != 0)
+    {
+        respond(c, "405 Method Not Allowed", "text/plain", "Allow: GET, HEAD\r\n",
+                "405 Method Not Allowed\n");
+        goto out;
+    }
+
+    target = req[1];
+    if(strcmp(target, "/") == 0 || strcmp(target, "/playlist.m3u") == 0)
+    {
+        respond_playlist(c);
+        goto out;
+    }
+    if(strncmp(target, "/tracks/", 8) != 0 ||
+       (idx = strtoul(target + 8, &rest, 10)) == 0 || (*rest && *rest != '.') ||
+       idx > himd_track_count(&himd) ||
+       (c->trackno = himd_get_trackslot(&himd, idx-1, &status)) == 0)
+    {
+        respond_error(c, "404 Not Found");
+        goto out;
+    }
+
+    /* the track is opened by a worker */
+    c->state = CONN_WAITING;
+    watch(c, 0);
+    g_thread_pool_push(pool, c, NULL);
+
+out:
+    g_strfreev(req);
+    g_strfreev(lines);
+    return 1;
+}
+
+static void append_header(struct conn * c, const char * code, const char * extra)
+{
+    GString * h = g_string_new(NULL);
+
+    g_string_append_printf(h, "HTTP/1.1 %s\r\nServer: himdserve\r\n"
+                              "Content-Type: %s\r\nAccept-Ranges: bytes\r\n%s",
+                           code, content_type(c->tf.format), extra);
+    if(!c->keepalive)
+        g_string_append(h, "Connection: close\r\n");
+    g_string_append(h, "\r\n");
+    g_byte_array_append(c->out, (guint8 *)h->str, h->len);
+    g_string_free(h, TRUE);
+    c->headersent = 1;
+}
+
+static void append_body(struct conn * c, const unsigned char * data, unsigned int len)
+{
+    gchar size[16];
+
+    if(c->chunked)
+    {
+        g_snprintf(size, sizeof size, "%x\r\n", len);
+        g_byte_array_append(c->out, (guint8 *)size, strlen(size));
+    }
+    g_byte_array_append(c->out, data, len);
+    if(c->chunked)
+        g_byte_array_append(c->out, (guint8 *)"\r\n", 2);
+}
+
+/* Open the track and put the response header into out. Ranges need
+   the extent map, other requests get the file front to back. */
+static int open_response(struct conn * c, struct himderrinfo * status)
+{
+    struct himd_trackfile * tf = &c->tf;
+    gchar * extra;
+    int ret;
+
+    c->sequential = !c->ranged && !c->head;
+    if(c->sequential)
+        ret = himd_trackfile_open_sequential(&himd, c->trackno, tf, status);
+    else
+        ret = himd_trackfile_open(&himd, c->trackno, cache, tf, status);
+    if(ret < 0)
+        return -1;
+    c->opened = 1;
+    c->chunked = 0;
+
+    if(c->ranged)
+    {
+        if(c->first == G_MAXUINT64)
+        {
+            c->first = tf->size - MIN(c->last, tf->size);
+            c->last = tf->size - 1;
+        }
+        c->last = MIN(c->last, tf->size - 1);
+        if(c->first >= tf->size || c->first > c->last)
+        {
+            extra = g_strdup_printf("Content-Range: bytes */%llu\r\nContent-Length: 0\r\n", tf->size);
+            append_header(c, "416 Range Not Satisfiable", extra);
+            g_free(extra);
+            c->finished = 1;
+            return 0;
+        }
+        extra = g_strdup_printf("Content-Range: bytes %llu-%llu/%llu\r\nContent-Length: %llu\r\n",
+                                c->first, c->last, tf->size, c->last - c->first + 1);
+        append_header(c, "206 Partial Content", extra);
+        g_free(extra);
+        c->pos = c->first;
+    }
+    else if(tf->size || !c->sequential)
+    {
+        extra = g_strdup_printf("Content-Length: %llu\r\n", tf->size);
+        append_header(c, "200 OK", extra);
+        g_free(extra);
+        c->pos = 0;
+        c->last = tf->size - 1;
+    }
+    else
+    {
+        /* MP3 files are sent as they are decrypted, their size is
+           not known before the end */
+        if(c->http11)
+        {
+            c->chunked = 1;
+            append_header(c, "200 OK", "Transfer-Encoding: chunked\r\n");
+        }
+        else
+        {
+            c->keepalive = 0;
+            append_header(c, "200 OK", "");
+        }
+    }
+    if(c->head)
+        c->finished = 1;
+    else if(c->sequential)
+        append_body(c, tf->header, tf->headerlen);
+    return 0;
+}
+
+/* Put up to CHUNK_SIZE bytes of the file into out */
+static int produce(struct conn * c, struct himderrinfo * status)
+{
+    unsigned char * dst;
+    const unsigned char * data;
+    unsigned int len, start;
+    long n;
+
+    if(!c->sequential)
+    {
+        len = MIN(CHUNK_SIZE, c->last - c->pos + 1);
+        start = c->out->len;
+        g_byte_array_set_size(c->out, start + len);
+        dst = c->out->data + start;
+        /* the range ends inside the file, so this reads all of len */
+        n = himd_trackfile_pread(&c->tf, dst, len, c->pos, status);
+        if(n < 0)
+            return -1;
+        c->pos += len;
+        c->finished = c->pos > c->last;
+        return 0;
+    }
+
+    while(c->out->len < CHUNK_SIZE)
+    {
+        if(himd_trackfile_read_next(&c->tf, &data, &len, status) < 0)
+        {
+            if(status->status != HIMD_STATUS_AUDIO_EOF)
+                return -1;
+            if(c->chunked)
+                g_byte_array_append(c->out, (guint8 *)"0\r\n\r\n", 5);
+            c->finished = 1;
+            break;
+        }
+        if(len)
+            append_body(c, data, len);
+    }
+    return 0;
+}
+
+static void worker(gpointer data, gpointer user_data)
+{
+    struct conn * c = data;
+    struct himderrinfo status;
+    int ret;
+    (void)user_data;
+
+    if(g_atomic_int_get(&c->dead))
+        goto done;
+
+    g_byte_array_set_size(c->out, 0);
+    if(!c->opened)
+        ret = open_response(c, &status);
+    else
+        ret = 0;
+    if(ret == 0 && !c->finished)
+        ret = produce(c, &status);
+
+    if(ret < 0)
+    {
+        fprintf(stderr, "Track %u: %s\n", c->trackno, status.statusmsg);
+        close_track(c);
+        if(!c->headersent)
+        {
+            /* answered by the event loop, as respond touches epoll */
+            c->finished = 1;
+            g_byte_array_set_size(c->out, 0);
+        }
+        else
+            g_atomic_int_set(&c->dead, 1);
+    }
+done:
+    if(write(notify_pipe[1], &c, sizeof c) != sizeof c)
+        fprintf(stderr, "Can't notify event loop: %s\n", g_strerror(errno));
+}
+
+/* A worker is done with c */
+static void job_done(struct conn * c)
+{
+    if(g_atomic_int_get(&c->dead))
+    {
+        free_conn(c);
+        return;
+    }
+    if(c->finished && !c->headersent)
+    {
+        c->keepalive = 0;
+        respond_error(c, "500 Internal Server Error");
+        return;
+    }
+    if(c->finished)
+        close_track(c);
+    start_sending(c);
+}
+
+static void handle_input(struct conn * c)
+{
+    char buf[4096];
+    ssize_t n;
+
+    n = recv(c->fd, buf, sizeof buf, 0);
+    if(n <= 0)
+    {
+        if(n < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        free_conn(c);
+        return;
+    }
+    g_string_append_len(c->in, buf, n);
+    parse_request(c);
+}
+
+static void handle_output(struct conn * c)
+{
+    ssize_t n;
+
+    n = send(c->fd, c->out->data + c->outpos, c->out->len - c->outpos, MSG_NOSIGNAL);
+    if(n < 0)
+    {
+        if(errno == EAGAIN || errno == EINTR)
+            return;
+        free_conn(c);
+        return;
+    }
+    c->outpos += n;
+    if(c->outpos < c->out->len)
+        return;
+
+    if(!c->finished)
+    {
+        c->state = CONN_WAITING;
+        watch(c, 0);
+        g_thread_pool_push(pool, c, NULL);
+        return;
+    }
+    if(!c->keepalive)
+    {
+        free_conn(c);
+        return;
+    }
+    /* there may be a pipelined request already */
+    c->state = CONN_READING;
+    watch(c, EPOLLIN);
+    if(c->in->len)
+        parse_request(c);
+}
+
+static void handle_accept(int listenfd)
+{
+    struct epoll_event ev;
+    struct conn * c;
+    int fd, one = 1;
+
+    while((fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+    {
+        if(nconns >= MAX_CONNS)
+        {
+            close(fd);
+            continue;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+        c = g_new0(struct conn, 1);
+        c->fd = fd;
+        c->state = CONN_READING;
+        c->in = g_string_new(NULL);
+        c->out = g_byte_array_new();
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+        nconns++;
+    }
+}
+
+static int listen_tcp(unsigned short port)
+{
+    struct sockaddr_in addr;
+    int fd, one = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    /* only for this machine */
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0 || listen(fd, 64) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int listen_unix(const char * path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if(strlen(path) >= sizeof addr.sun_path)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+        return -1;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if(bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0 || listen(fd, 64) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void usage(const char * cmdname)
+{
+    printf("Usage: %s [-p <PORT> | -u <SOCKET>] [-j <WORKERS>] <HiMD path>\n\n\
+Serves the tracks on 127.0.0.1:%d or the given Unix socket, the playlist\n\
+is at /, the tracks at /tracks/<N> in play order.\n", cmdname, DEFAULT_PORT);
+}
+
+int main(int argc, char ** argv)
+{
+    struct himderrinfo status;
+    struct epoll_event ev, events[64];
+    const char * socketpath = NULL;
+    unsigned short port = DEFAULT_PORT;
+    int workers = DEFAULT_WORKERS;
+    int listenfd, i, n, opt;
+    struct conn * c;
+
+    while((opt = getopt(argc, argv, "p:u:j:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'p': port = atoi(optarg); break;
+            case 'u': socketpath = optarg; break;
+            case 'j': workers = MAX(1, atoi(optarg)); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if(optind != argc - 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if(himd_open(&himd, argv[optind], &status) < 0)
+    {
+        fprintf(stderr, "Error opening HiMD: %s\n", status.statusmsg);
+        return 1;
+    }
+    /* MP3 keys need the disc ID, read it before any worker runs */
+    if(!himd_get_discid(&himd, &status))
+        fprintf(stderr, "Can't read disc ID, MP3 tracks can't be served: %s\n", status.statusmsg);
+
+    listenfd = socketpath ? listen_unix(socketpath) : listen_tcp(port);
+    if(listenfd < 0)
+    {
+        fprintf(stderr, "Can't listen: %s\n", g_strerror(errno));
+        return 1;
+    }
+    if(pipe2(notify_pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+    {
+        fprintf(stderr, "Can't create pipe: %s\n", g_strerror(errno));
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    cache = himd_blockcache_new(CACHE_BLOCKS);
+    pool = g_thread_pool_new(worker, NULL, workers, TRUE, NULL);
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev);
+    ev.data.ptr = notify_pipe;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, notify_pipe[0], &ev);
+
+    for(;;)
+    {
+        n = epoll_wait(epfd, events, G_N_ELEMENTS(events), -1);
+        if(n < 0 && errno != EINTR)
+        {
+            fprintf(stderr, "epoll_wait failed: %s\n", g_strerror(errno));
+            break;
+        }
+        for(i = 0; i < n; i++)
+        {
+            if(events[i].data.ptr == NULL)
+                handle_accept(listenfd);
+            else if(events[i].data.ptr == notify_pipe)
+            {
+                while(read(notify_pipe[0], &c, sizeof c) == sizeof c)
+                    job_done(c);
+            }
+            else
+            {
+                c = events[i].data.ptr;
+                if(c->closed)
+                    continue;
+                if(c->state == CONN_WAITING)
+                {
+                    /* the peer hung up, the worker cleans up */
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+                    g_atomic_int_set(&c->dead, 1);
+                }
+                else if(events[i].events & (EPOLLERR | EPOLLHUP))
+                    free_conn(c);
+                else if(c->state == CONN_READING)
+                    handle_input(c);
+                else
+                    handle_output(c);
+            }
+        }
+        bury_conns();
+    }
+
+    g_thread_pool_free(pool, FALSE, TRUE);
+    himd_blockcache_free(cache);
+    himd_close(&himd);
+    return 1;
+}
@@ -0,0 +1,13 @@
+TEMPLATE=app
+CONFIG  -= qt
+CONFIG  += console link_pkgconfig link_prl
+PKGCONFIG += glib-2.0 gthread-2.0
+INCLUDEPATH += ../libhimd
+SOURCES += himdserve.c
+
+include(../libhimd/use_libhimd.pri)
+
+unix:!macx {
+	target.path = /usr/bin
+	INSTALLS += target
+}
@@ -0,0 +1,255 @@
+/*
+ *   loadtest.c - measure time to first byte and throughput of himdserve
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <glib.h>
+
+struct client {
+    GThread * thread;
+    unsigned int id;
+    GArray * ttfb;		/* microseconds per request */
+    unsigned long long bytes;
+    unsigned int errors;
+};
+
+static unsigned short port = 8090;
+static const char * socketpath;
+static unsigned int requests = 10;
+static unsigned long rangelen;
+static char ** paths;
+static unsigned int npaths;
+
+static int connect_server(void)
+{
+    int fd;
+
+    if(socketpath)
+    {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof addr);
+        addr.sun_family = AF_UNIX;
+        g_strlcpy(addr.sun_path, socketpath, sizeof addr.sun_path);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0)
+        {
+            close(fd);
+            return -1;
+        }
+    }
+    else
+    {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof addr);
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if(fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0)
+        {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+/* Sends one request and reads the response until the server closes the
+   connection. Returns the status code or -1, *ttfb is the time until the
+   first byte of the response arrived. */
+static int fetch(const char * path, const char * range, gint64 * ttfb, unsigned long long * bodylen,
+                 char * header, size_t headersize)
+{
+    char buf[65536];
+    gchar * request;
+    gint64 start;
+    unsigned long long total = 0;
+    size_t hlen = 0;
+    ssize_t n;
+    int fd, code = -1;
+    char * end;
+
+    if((fd = connect_server()) < 0)
+        return -1;
+
+    start = g_get_monotonic_time();
+    request = g_strdup_printf("GET %s HTTP/1.1\r\nHost: localhost\r\n%s%s%sConnection: close\r\n\r\n",
+                              path, range ? "Range: bytes=" : "", range ? range : "", range ? "\r\n" : "");
+    if(send(fd, request, strlen(request), 0) < 0)
+        goto out;
+
+    *ttfb = -1;
+    while((n = recv(fd, buf, sizeof buf, 0)) > 0)
+    {
+        if(*ttfb < 0)
+            *ttfb = g_get_monotonic_time() - start;
+        if(hlen < headersize - 1)
+        {
+            size_t copy = MIN((size_t)n, headersize - 1 - hlen);
+            memcpy(header + hlen, buf, copy);
+            hlen += copy;
+            header[hlen] = '\0';
+        }
+        total += n;
+    }
+    if(n < 0 || hlen < 12 || !(end = strstr(header, "\r\n\r\n")))
+        goto out;
+
+    code = atoi(header + 9);
+    *bodylen = total - (end + 4 - header);
+out:
+    g_free(request);
+    close(fd);
+    return code;
+}
+
+/* The size of the file at path, from the Content-Range of a one byte range */
+static unsigned long long file_size(const char * path)
+{
+    char header[4096];
+    gint64 ttfb;
+    unsigned long long len;
+    char * cr;
+
+    if(fetch(path, "0-0", &ttfb, &len, header, sizeof header) != 206 ||
+       !(cr = strstr(header, "Content-Range: bytes 0-0/")))
+        return 0;
+    return g_ascii_strtoull(cr + 25, NULL, 10);
+}
+
+static gpointer run_client(gpointer data)
+{
+    struct client * cl = data;
+    const char * path = paths[cl->id % npaths];
+    unsigned long long size = 0, len, first;
+    char header[4096];
+    gchar * range = NULL;
+    GRand * rand = g_rand_new_with_seed(cl->id);
+    gint64 ttfb;
+    unsigned int i;
+    int code;
+
+    if(rangelen && (size = file_size(path)) <= rangelen)
+    {
+        fprintf(stderr, "%s: can't get size or too short for the range\n", path);
+        cl->errors = requests;
+        g_rand_free(rand);
+        return NULL;
+    }
+
+    for(i = 0; i < requests; i++)
+    {
+        if(rangelen)
+        {
+            /* seek to a random position, like a player would */
+            first = (unsigned long long)(g_rand_double(rand) * (size - rangelen));
+            range = g_strdup_printf("%llu-%llu", first, first + rangelen - 1);
+        }
+        code = fetch(path, range, &ttfb, &len, header, sizeof header);
+        g_free(range);
+        range = NULL;
+        if(code != (rangelen ? 206 : 200))
+        {
+            cl->errors++;
+            continue;
+        }
+        g_array_append_val(cl->ttfb, ttfb);
+        cl->bytes += len;
+    }
+    g_rand_free(rand);
+    return NULL;
+}
+
+static gint compare_gint64(gconstpointer a, gconstpointer b)
+{
+    gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(GArray * values, double p)
+{
+    unsigned int idx = (unsigned int)(p * (values->len - 1) + 0.5);
+    return g_array_index(values, gint64, idx) / 1000.0;
+}
+
+static void usage(const char * cmdname)
+{
+    printf("Usage: %s [-p <PORT> | -u <SOCKET>] [-c <CLIENTS>] [-n <REQUESTS>] [-r <BYTES>] <PATH>...\n\n\
+Each of the clients fetches one of the paths (for example /tracks/1) as\n\
+often as requested, one request at a time. With -r, random ranges of the\n\
+given length are requested instead of the whole file.\n", cmdname);
+}
+
+int main(int argc, char ** argv)
+{
+    unsigned int nclients = 4, i;
+    struct client * clients;
+    unsigned long long bytes = 0;
+    unsigned int errors = 0;
+    GArray * all;
+    gint64 start, wall;
+    int opt;
+
+    while((opt = getopt(argc, argv, "p:u:c:n:r:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'p': port = atoi(optarg); break;
+            case 'u': socketpath = optarg; break;
+            case 'c': nclients = MAX(1, atoi(optarg)); break;
+            case 'n': requests = MAX(1, atoi(optarg)); break;
+            case 'r': rangelen = strtoul(optarg, NULL, 10); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if(optind == argc)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    paths = argv + optind;
+    npaths = argc - optind;
+
+    clients = g_new0(struct client, nclients);
+    start = g_get_monotonic_time();
+    for(i = 0; i < nclients; i++)
+    {
+        clients[i].id = i;
+        clients[i].ttfb = g_array_new(FALSE, FALSE, sizeof(gint64));
+        clients[i].thread = g_thread_new("client", run_client, &clients[i]);
+    }
+
+    all = g_array_new(FALSE, FALSE, sizeof(gint64));
+    for(i = 0; i < nclients; i++)
+    {
+        g_thread_join(clients[i].thread);
+        g_array_append_vals(all, clients[i].ttfb->data, clients[i].ttfb->len);
+        bytes += clients[i].bytes;
+        errors += clients[i].errors;
+        g_array_free(clients[i].ttfb, TRUE);
+    }
+    wall = g_get_monotonic_time() - start;
+
+    printf("clients:    %u\n", nclients);
+    printf("requests:   %u ok, %u failed\n", all->len, errors);
+    if(all->len)
+    {
+        g_array_sort(all, compare_gint64);
+        printf("ttfb (ms):  min %.2f  median %.2f  p95 %.2f  max %.2f\n",
+               percentile(all, 0), percentile(all, 0.5), percentile(all, 0.95), percentile(all, 1));
+    }
+    printf("received:   %.1f MB in %.2f s, %.2f MB/s\n", bytes / 1e6, wall / 1e6,
+           wall ? bytes / (double)wall : 0.0);
+
+    g_array_free(all, TRUE);
+    g_free(clients);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,5 @@
+TEMPLATE=app
+CONFIG  -= qt
+CONFIG  += console link_pkgconfig
+PKGCONFIG += glib-2.0 gthread-2.0
+SOURCES += loadtest.c
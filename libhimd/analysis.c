@@ -0,0 +1,332 @@
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "himd.h"
+#include "himd_private.h"
+#include "analysis.h"
+
+#define _(x) (x)
+
+#define SAMPLE_RATE 44100
+/* gating blocks are 400ms long and overlap by 75% */
+#define STEP_SAMPLES (SAMPLE_RATE / 10)
+#define STEPS_PER_BLOCK 4
+#define ABSOLUTE_GATE -70.0
+#define RELATIVE_GATE -10.0
+
+/* K-weighting filter of ITU-R BS.1770 at 44.1kHz: a high shelf
+   followed by a high pass, both as biquads with a0 == 1. */
+static const double shelf_b[3] = {1.5308412300503478, -2.6509799951547297, 1.169079079921587};
+static const double shelf_a[2] = {-1.6636551132560204, 0.7125954280732254};
+static const double hipass_b[3] = {1.0, -2.0, 1.0};
+static const double hipass_a[2] = {-1.989169673629796, 0.9891990357870393};
+
+/* Peak and sum of squares of big-endian samples. Both are accumulated
+   into *peak and *sumsq. */
+static void peak_sumsq_generic(const unsigned char * in, size_t len, unsigned int * peak, unsigned long long * sumsq)
+{
+    unsigned int pk = *peak, a;
+    unsigned long long sum = 0;
+    size_t i;
+    int s;
+
+    for(i = 0; i + 1 < len; i += 2)
+    {
+        s = (short)(in[i] << 8 | in[i+1]);
+        a = s < 0 ? -s : s;
+        if(a > pk)
+            pk = a;
+        sum += (unsigned int)(s * s);
+    }
+    *peak = pk;
+    *sumsq += sum;
+}
+
+#ifdef HIMD_X86_SIMD
+#include <immintrin.h>
+
+/* _mm_madd_epi16 sums two squares, which only overflows for two
+   samples of -32768. The result is correct as unsigned, so it is
+   zero-extended when accumulating. */
+
+__attribute__((target("ssse3")))
+static void peak_sumsq_ssse3(const unsigned char * in, size_t len, unsigned int * peak, unsigned long long * sumsq)
+{
+    const __m128i shuf = _mm_setr_epi8(1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14);
+    /* SSSE3 has no unsigned 16 bit max, so keep the peaks biased */
+    const __m128i bias = _mm_set1_epi16((short)0x8000);
+    __m128i pk = bias, acc = _mm_setzero_si128(), zero = _mm_setzero_si128();
+    unsigned short lanes[8];
+    unsigned long long sums[2];
+    size_t i;
+    int j;
+
+    for(i = 0; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(in + i)), shuf);
+        __m128i sq = _mm_madd_epi16(v, v);
+        pk = _mm_max_epi16(pk, _mm_xor_si128(_mm_abs_epi16(v), bias));
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(sq, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(sq, zero));
+    }
+    _mm_storeu_si128((__m128i *)lanes, _mm_xor_si128(pk, bias));
+    _mm_storeu_si128((__m128i *)sums, acc);
+    for(j = 0; j < 8; j++)
+        if(lanes[j] > *peak)
+            *peak = lanes[j];
+    *sumsq += sums[0] + sums[1];
+    peak_sumsq_generic(in + i, len - i, peak, sumsq);
+}
+
+__attribute__((target("avx2")))
+static void peak_sumsq_avx2(const unsigned char * in, size_t len, unsigned int * peak, unsigned long long * sumsq)
+{
+    const __m256i shuf = _mm256_setr_epi8(1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14,
+                                          1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14);
+    __m256i pk = _mm256_setzero_si256(), acc = _mm256_setzero_si256(), zero = _mm256_setzero_si256();
+    unsigned short lanes[16];
+    unsigned long long sums[4];
+    size_t i;
+    int j;
+
+    for(i = 0; i + 32 <= len; i += 32)
+    {
+        __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(in + i)), shuf);
+        __m256i sq = _mm256_madd_epi16(v, v);
+        pk = _mm256_max_epu16(pk, _mm256_abs_epi16(v));
+        acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(sq, zero));
+        acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(sq, zero));
+    }
+    _mm256_storeu_si256((__m256i *)lanes, pk);
+    _mm256_storeu_si256((__m256i *)sums, acc);
+    for(j = 0; j < 16; j++)
+        if(lanes[j] > *peak)
+            *peak = lanes[j];
+    *sumsq += sums[0] + sums[1] + sums[2] + sums[3];
+    peak_sumsq_ssse3(in + i, len - i, peak, sumsq);
+}
+#endif
+
+typedef void (*peak_sumsq_fn)(const unsigned char *, size_t, unsigned int *, unsigned long long *);
+
+static peak_sumsq_fn select_peak_sumsq(void)
+{
+#ifdef HIMD_X86_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        return peak_sumsq_avx2;
+    if(__builtin_cpu_supports("ssse3"))
+        return peak_sumsq_ssse3;
+#endif
+    return peak_sumsq_generic;
+}
+
+static inline double biquad(double x, double * z, const double * b, const double * a)
+{
+    double y = b[0]*x + z[0];
+    z[0] = b[1]*x - a[0]*y + z[1];
+    z[1] = b[2]*x - a[1]*y;
+    return y;
+}
+
+void himd_analysis_init(struct himd_analysis * an)
+{
+    g_return_if_fail(an != NULL);
+
+    memset(an, 0, sizeof *an);
+    an->steps = g_array_new(FALSE, FALSE, sizeof(double));
+}
+
+void himd_analysis_feed(struct himd_analysis * an, const unsigned char * data, unsigned int len)
+{
+    /* Racing threads all store the same pointer, so no locking needed */
+    static peak_sumsq_fn peak_sumsq;
+    unsigned int i, ch;
+    double x, y;
+
+    g_return_if_fail(an != NULL);
+
+    if(!peak_sumsq)
+        peak_sumsq = select_peak_sumsq();
+    peak_sumsq(data, len, &an->peak, &an->sumsq);
+    an->samples += len / 4;
+
+    for(i = 0; i + 4 <= len; i += 4)
+    {
+        for(ch = 0; ch < 2; ch++)
+        {
+            x = (short)(data[i+2*ch] << 8 | data[i+2*ch+1]) / 32768.0;
+            y = biquad(x, an->z[ch], shelf_b, shelf_a);
+            y = biquad(y, an->z[ch] + 2, hipass_b, hipass_a);
+            an->stepsum += y*y;
+        }
+        if(++an->stepfill == STEP_SAMPLES)
+        {
+            double meansq = an->stepsum / STEP_SAMPLES;
+            g_array_append_val((GArray *)an->steps, meansq);
+            an->stepsum = 0;
+            an->stepfill = 0;
+        }
+    }
+}
+
+static double energy_to_loudness(double energy)
+{
+    return -0.691 + 10 * log10(energy);
+}
+
+/* Gated loudness as of BS.1770-2: blocks below the absolute gate are
+   dropped, then blocks more than 10 LU below the remaining ones. */
+static double gated_loudness(const double * steps, unsigned int nsteps)
+{
+    unsigned int i, j, nblocks, count;
+    double * blocks, sum, gate;
+
+    if(nsteps < STEPS_PER_BLOCK)
+        return -HUGE_VAL;
+
+    nblocks = nsteps - STEPS_PER_BLOCK + 1;
+    blocks = g_new(double, nblocks);
+    for(i = 0; i < nblocks; i++)
+    {
+        blocks[i] = 0;
+        for(j = 0; j < STEPS_PER_BLOCK; j++)
+            blocks[i] += steps[i+j];
+        blocks[i] /= STEPS_PER_BLOCK;
+    }
+
+    gate = ABSOLUTE_GATE;
+    for(j = 0; j < 2; j++)
+    {
+        sum = 0;
+        count = 0;
+        for(i = 0; i < nblocks; i++)
+            if(energy_to_loudness(blocks[i]) > gate)
+            {
+                sum += blocks[i];
+                count++;
+            }
+        if(!count)
+        {
+            g_free(blocks);
+            return -HUGE_VAL;
+        }
+        gate = MAX(ABSOLUTE_GATE, energy_to_loudness(sum / count) + RELATIVE_GATE);
+    }
+    g_free(blocks);
+    return energy_to_loudness(sum / count);
+}
+
+void himd_analysis_finish(struct himd_analysis * an)
+{
+    GArray * steps;
+    struct himd_loudness * res;
+
+    g_return_if_fail(an != NULL);
+    steps = an->steps;
+    res = &an->result;
+
+    /* a track shorter than one gating block is measured as a whole */
+    if(steps->len < STEPS_PER_BLOCK && an->stepfill)
+    {
+        double meansq = an->stepsum;
+        unsigned int i;
+
+        for(i = 0; i < steps->len; i++)
+            meansq += g_array_index(steps, double, i) * STEP_SAMPLES;
+        meansq /= steps->len * STEP_SAMPLES + an->stepfill;
+        g_array_set_size(steps, 0);
+        while(steps->len < STEPS_PER_BLOCK)
+            g_array_append_val(steps, meansq);
+    }
+
+    res->valid = an->samples != 0;
+    res->duration = (double)an->samples / SAMPLE_RATE;
+    res->peak = an->peak / 32768.0;
+    res->rms = an->sumsq ? 10 * log10(an->sumsq / (2.0 * an->samples) / (32768.0 * 32768.0)) : -HUGE_VAL;
+    res->integrated = gated_loudness((double *)steps->data, steps->len);
+    res->gain = isinf(res->integrated) ? 0 : HIMD_REPLAYGAIN_REFERENCE - res->integrated;
+
+    g_array_free(steps, TRUE);
+    an->steps = NULL;
+}
+
+static void json_string(FILE * out, const char * key, const char * value)
+{
+    if(!value || !*value)
+        return;
+    fprintf(out, "  \"%s\": \"", key);
+    for(; *value; value++)
+    {
+        if(*value == '"' || *value == '\\')
+            fprintf(out, "\\%c", *value);
+        else if((unsigned char)*value < 0x20)
+            fprintf(out, "\\u%04x", *value);
+        else
+            fputc(*value, out);
+    }
+    fputs("\",\n", out);
+}
+
+/* doubles are written locale independent, infinities as null */
+static void json_number(FILE * out, const char * key, const char * format, double value, int last)
+{
+    char buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+    fprintf(out, "  \"%s\": %s%s\n", key,
+            isinf(value) ? "null" : g_ascii_formatd(buf, sizeof buf, format, value),
+            last ? "" : ",");
+}
+
+/**
+ * Write the analysis results of a track as JSON object. tags may be NULL,
+ * else the track strings are included in the report.
+ */
+int himd_analysis_write_report(const struct himd_loudness * loudness, const struct himd_tags * tags,
+                               const char * filename, struct himderrinfo * status)
+{
+    FILE * out;
+    int err;
+
+    g_return_val_if_fail(loudness != NULL, -1);
+    g_return_val_if_fail(filename != NULL, -1);
+
+    out = g_fopen(filename, "w");
+    if(!out)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                          _("Can't open %s for writing: %s"), filename, g_strerror(errno));
+        return -1;
+    }
+
+    fputs("{\n", out);
+    if(tags)
+    {
+        json_string(out, "title", tags->title);
+        json_string(out, "artist", tags->artist);
+        json_string(out, "album", tags->album);
+        if(tags->trackinalbum > 0)
+            fprintf(out, "  \"track\": %d,\n", tags->trackinalbum);
+    }
+    json_number(out, "duration", "%.3f", loudness->duration, 0);
+    json_number(out, "sample_peak", "%.6f", loudness->peak, 0);
+    json_number(out, "sample_peak_dbfs", "%.2f", loudness->peak > 0 ? 20 * log10(loudness->peak) : -HUGE_VAL, 0);
+    json_number(out, "rms_dbfs", "%.2f", loudness->rms, 0);
+    json_number(out, "integrated_lufs", "%.2f", loudness->integrated, 0);
+    json_number(out, "replaygain_reference_lufs", "%.1f", HIMD_REPLAYGAIN_REFERENCE, 0);
+    json_number(out, "replaygain_track_gain_db", "%.2f", loudness->gain, 0);
+    json_number(out, "replaygain_track_peak", "%.6f", loudness->peak, 1);
+    fputs("}\n", out);
+
+    err = ferror(out);
+    if(fclose(out) != 0 || err)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                          _("Can't write %s: %s"), filename, g_strerror(errno));
+        return -1;
+    }
+    return 0;
+}
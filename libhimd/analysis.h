@@ -0,0 +1,52 @@
+#ifndef INCLUDED_LIBHIMD_ANALYSIS_H
+#define INCLUDED_LIBHIMD_ANALYSIS_H
+
+#include "himd.h"
+
+/* ReplayGain 2.0 reference level */
+#define HIMD_REPLAYGAIN_REFERENCE -18.0
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Results of the analysis of an LPCM track */
+struct himd_loudness {
+    int valid;			/* zero if no samples were analyzed */
+    double duration;		/* seconds */
+    double peak;		/* sample peak, 1.0 is full scale */
+    double rms;			/* RMS of all samples in dBFS */
+    double integrated;		/* EBU R128 integrated loudness in LUFS, -HUGE_VAL if silent */
+    double gain;		/* ReplayGain 2.0 track gain in dB */
+};
+
+/* Accumulates peak, RMS and gated K-weighted loudness (ITU-R BS.1770)
+   of 44.1kHz big-endian 16 bit stereo, the format of HiMD LPCM blocks. */
+struct himd_analysis {
+    unsigned int peak;
+    unsigned long long sumsq;
+    unsigned long long samples;
+
+    /* two biquads per channel, two state values each */
+    double z[2][4];
+    /* K-weighted energy of the current 100ms step */
+    double stepsum;
+    unsigned int stepfill;
+    void * steps;		/* GArray of mean square per 100ms step */
+
+    struct himd_loudness result;
+};
+
+void himd_analysis_init(struct himd_analysis * an);
+void himd_analysis_feed(struct himd_analysis * an, const unsigned char * data, unsigned int len);
+/* fills an->result and frees the step list */
+void himd_analysis_finish(struct himd_analysis * an);
+
+int himd_analysis_write_report(const struct himd_loudness * loudness, const struct himd_tags * tags,
+                               const char * filename, struct himderrinfo * status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
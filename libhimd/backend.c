@@ -0,0 +1,105 @@
+#define _GNU_SOURCE		/* fopencookie */
+#include <stdio.h>
+#include <errno.h>
+#include <glib.h>
+
+#include "himd.h"
+#include "himd_private.h"
+
+/* Read-only FILE streams for the backends that don't have the HMDHIFI
+   files in a directory. Writes fail as they would on a read-only file. */
+
+static long stream_read(struct himd_backend_stream * s, char * buf, size_t size)
+{
+    long n;
+
+    if(s->pos >= s->size)
+        return 0;
+    size = MIN(size, (size_t)(s->size - s->pos));
+    n = s->pread(s, buf, size, s->pos);
+    if(n > 0)
+        s->pos += n;
+    return n;
+}
+
+static long long stream_seek(struct himd_backend_stream * s, long long offset, int whence)
+{
+    long long pos;
+
+    switch(whence)
+    {
+        case SEEK_SET: pos = offset; break;
+        case SEEK_CUR: pos = s->pos + offset; break;
+        case SEEK_END: pos = s->size + offset; break;
+        default: errno = EINVAL; return -1;
+    }
+    if(pos < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    s->pos = pos;
+    return pos;
+}
+
+#if defined(__GLIBC__)
+static ssize_t cookie_read(void * cookie, char * buf, size_t size)
+{
+    return stream_read(cookie, buf, size);
+}
+
+static int cookie_seek(void * cookie, off64_t * offset, int whence)
+{
+    long long pos = stream_seek(cookie, *offset, whence);
+
+    if(pos < 0)
+        return -1;
+    *offset = pos;
+    return 0;
+}
+
+static int cookie_close(void * cookie)
+{
+    struct himd_backend_stream * s = cookie;
+
+    s->free(s);
+    return 0;
+}
+
+FILE * himd_backend_fopen(struct himd_backend_stream * s)
+{
+    cookie_io_functions_t io = { cookie_read, NULL, cookie_seek, cookie_close };
+
+    return fopencookie(s, "rb", io);
+}
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || \
+      defined(__OpenBSD__) || defined(__DragonFly__)
+static int cookie_read(void * cookie, char * buf, int size)
+{
+    return stream_read(cookie, buf, size);
+}
+
+static fpos_t cookie_seek(void * cookie, fpos_t offset, int whence)
+{
+    return stream_seek(cookie, offset, whence);
+}
+
+static int cookie_close(void * cookie)
+{
+    struct himd_backend_stream * s = cookie;
+
+    s->free(s);
+    return 0;
+}
+
+FILE * himd_backend_fopen(struct himd_backend_stream * s)
+{
+    return funopen(s, cookie_read, NULL, cookie_seek, cookie_close);
+}
+#else
+FILE * himd_backend_fopen(struct himd_backend_stream * s)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+#endif
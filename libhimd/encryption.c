@@ -41,6 +41,7 @@ struct cached_cipher {
     unsigned char key[8];
     MCRYPT cipher;
     int valid;
+    unsigned int key_schedules;
 };
 
 struct descrypt_data {
@@ -56,6 +57,7 @@ static int cached_cipher_init(struct cached_cipher * cipher, char * destype)
         return -1;
 
     cipher->valid = 0;
+    cipher->key_schedules = 0;
     return 0;
 }
 
@@ -79,8 +81,10 @@ static int cached_cipher_prepare(struct cached_cipher * cipher,
 
         memcpy(cipher->key, key, 8);
         cipher->valid = 1;
+        cipher->key_schedules++;
     }
-    else if(iv)		/* update IV, works for CBC decryption */
+    else if(iv)		/* update IV, mcrypt CBC chains both directions through
+                           the same register, so this works for encryption too */
     {
         unsigned char dummy[8];
         memcpy(dummy, iv, 8);
@@ -150,12 +154,13 @@ int descrypt_open(void ** dataptr, const unsigned char * trackkey,
     return 0;
 }
 
-int descrypt_decrypt(void * dataptr, unsigned char * block, size_t cryptlen,
-                     const unsigned char * fragkey, struct himderrinfo * status)
+/* Set up the CBC cipher for the audio data of block, its key is derived
+   from the fragment key and the block's key field */
+static int prepare_block_cipher(struct descrypt_data * data, unsigned char * block,
+                                const unsigned char * fragkey, struct himderrinfo * status)
 {
     unsigned char finalfragkey[8];
     unsigned char mainkey[8];
-    struct descrypt_data * data = dataptr;
     int err;
 
     xor_keys(finalfragkey, data->masterkey, fragkey);
@@ -177,6 +182,17 @@ int descrypt_decrypt(void * dataptr, unsigned char * block, size_t cryptlen,
         set_status_printf(status, HIMD_ERROR_ENCRYPTION_FAILURE, _("Can't setup block key: %s"), mcrypt_strerror(err));
         return -1;
     }
+    return 0;
+}
+
+int descrypt_decrypt(void * dataptr, unsigned char * block, size_t cryptlen,
+                     const unsigned char * fragkey, struct himderrinfo * status)
+{
+    struct descrypt_data * data = dataptr;
+    int err;
+
+    if(prepare_block_cipher(data, block, fragkey, status) < 0)
+        return -1;
 
     if((err = mdecrypt_generic(data->block.cipher, block+32, cryptlen)) < 0)
     {
@@ -187,6 +203,33 @@ int descrypt_decrypt(void * dataptr, unsigned char * block, size_t cryptlen,
     return 0;
 }
 
+/* The counterpart of descrypt_decrypt, for writing test images. The key
+   and IV fields of block (offsets 16 and 24) must be filled in already. */
+int descrypt_encrypt(void * dataptr, unsigned char * block, size_t cryptlen,
+                     const unsigned char * fragkey, struct himderrinfo * status)
+{
+    struct descrypt_data * data = dataptr;
+    int err;
+
+    if(prepare_block_cipher(data, block, fragkey, status) < 0)
+        return -1;
+
+    if((err = mcrypt_generic(data->block.cipher, block+32, cryptlen)) < 0)
+    {
+        set_status_printf(status, HIMD_ERROR_ENCRYPTION_FAILURE, _("Can't encrypt: %s"), mcrypt_strerror(err));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Number of DES key setups so far, for the stats */
+unsigned int descrypt_key_schedules(void * dataptr)
+{
+    struct descrypt_data * data = dataptr;
+    return data->master.key_schedules + data->block.key_schedules;
+}
+
 void descrypt_close(void * dataptr)
 {
     struct descrypt_data * data = dataptr;
@@ -0,0 +1,502 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#ifdef G_OS_UNIX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "himd.h"
+#include "himd_private.h"
+
+#define _(x) (x)
+
+/* A raw image of a HiMD, as written by dd, read without mounting it. The
+   FAT12/16/32 file system is read once when the image is opened: the
+   cluster chains of all files in HMDHIFI are turned into runs of
+   contiguous clusters, reads are preads of the image from then on. The
+   image is either a bare file system or has an MBR partition table. */
+
+#define SECTOR_SIZE 512
+#define DIRENT_SIZE 32
+#define ATTR_VOLUME 0x08
+#define ATTR_DIRECTORY 0x10
+#define ATTR_LFN 0x0F
+
+enum fat_type { FAT12, FAT16, FAT32 };
+
+/* a piece of a file in contiguous clusters */
+struct fat_run {
+    long long fileoffset;
+    long long imageoffset;
+    long long length;
+};
+
+struct fat_file {
+    char name[13];		/* 8.3, upper case */
+    long long size;
+    unsigned int nruns;
+    struct fat_run * runs;	/* ascending fileoffset */
+};
+
+/* backend_data of an opened image, shared with its snapshots */
+struct fat_volume {
+    int fd;
+    enum fat_type type;
+    long long base;		/* offset of the file system in the image */
+    unsigned int clustersize;
+    unsigned int nclusters;
+    long long dataoffset;	/* offset of cluster 2 */
+    unsigned char * fat;
+    unsigned int nfiles;
+    struct fat_file * files;	/* the files in HMDHIFI */
+};
+
+struct fat_stream {
+    struct himd_backend_stream stream;
+    const struct fat_volume * vol;
+    const struct fat_file * file;
+};
+
+static inline unsigned int leword16(const unsigned char * c)
+{
+    return c[0] | c[1] << 8;
+}
+
+static inline unsigned int leword32(const unsigned char * c)
+{
+    return c[0] | c[1] << 8 | c[2] << 16 | (unsigned int)c[3] << 24;
+}
+
+#ifdef G_OS_UNIX
+static int read_fully(int fd, void * buf, size_t len, long long offset)
+{
+    ssize_t n;
+
+    while(len > 0)
+    {
+        n = pread(fd, buf, len, offset);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+        {
+            if(n == 0)
+                errno = EIO;
+            return -1;
+        }
+        buf = (char *)buf + n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/* The cluster following cluster c, 0 at the end of the chain or if it is broken */
+static unsigned int next_cluster(const struct fat_volume * vol, unsigned int c)
+{
+    unsigned int next;
+
+    switch(vol->type)
+    {
+        case FAT12:
+            next = leword16(vol->fat + c + c/2);
+            next = c & 1 ? next >> 4 : next & 0xFFF;
+            break;
+        case FAT16:
+            next = leword16(vol->fat + 2*c);
+            break;
+        default:
+            next = leword32(vol->fat + 4*c) & 0x0FFFFFFF;
+            break;
+    }
+    if(next < 2 || next >= vol->nclusters + 2)
+        return 0;
+    return next;
+}
+
+/**
+ * Resolve a cluster chain into runs of contiguous clusters.
+ *
+ * @param size bytes to resolve, -1 for the whole chain
+ * @param length receives the bytes the chain covers, at most size
+ */
+static struct fat_run * resolve_chain(const struct fat_volume * vol, unsigned int first,
+                                      long long size, unsigned int * nruns, long long * length)
+{
+    GArray * runs = g_array_new(FALSE, FALSE, sizeof(struct fat_run));
+    struct fat_run * run = NULL;
+    long long offset = 0;
+    unsigned int c, steps = 0;
+
+    for(c = first; c >= 2 && c < vol->nclusters + 2 && (size < 0 || offset < size);
+        c = next_cluster(vol, c))
+    {
+        /* a loop can't be longer than the FAT */
+        if(++steps > vol->nclusters)
+            break;
+        if(run && run->imageoffset + run->length ==
+                  vol->dataoffset + (long long)(c - 2) * vol->clustersize)
+            run->length += vol->clustersize;
+        else
+        {
+            struct fat_run r = { offset, vol->dataoffset + (long long)(c - 2) * vol->clustersize,
+                                 vol->clustersize };
+            g_array_append_val(runs, r);
+            run = &g_array_index(runs, struct fat_run, runs->len - 1);
+        }
+        offset += vol->clustersize;
+    }
+    if(size >= 0 && offset > size)
+    {
+        run->length -= offset - size;
+        offset = size;
+    }
+    *nruns = runs->len;
+    *length = offset;
+    return (struct fat_run *)g_array_free(runs, FALSE);
+}
+
+static unsigned char * read_runs(const struct fat_volume * vol, const struct fat_run * runs,
+                                 unsigned int nruns, long long length)
+{
+    unsigned char * data = g_malloc(length + 1);
+    unsigned int i;
+
+    for(i = 0; i < nruns; i++)
+        if(read_fully(vol->fd, data + runs[i].fileoffset, runs[i].length, runs[i].imageoffset) < 0)
+        {
+            g_free(data);
+            return NULL;
+        }
+    return data;
+}
+
+/* The entries of a directory, the root of FAT12/16 if cluster is 0 */
+static unsigned char * read_directory(const struct fat_volume * vol, unsigned int cluster,
+                                      long long rootoffset, unsigned int rootentries, unsigned int * nentries)
+{
+    struct fat_run * runs;
+    unsigned char * data;
+    unsigned int nruns;
+    long long length;
+
+    if(cluster == 0)
+    {
+        length = (long long)rootentries * DIRENT_SIZE;
+        data = g_malloc(length + 1);
+        if(read_fully(vol->fd, data, length, rootoffset) < 0)
+        {
+            g_free(data);
+            return NULL;
+        }
+    }
+    else
+    {
+        runs = resolve_chain(vol, cluster, -1, &nruns, &length);
+        data = read_runs(vol, runs, nruns, length);
+        g_free(runs);
+        if(!data)
+            return NULL;
+    }
+    *nentries = length / DIRENT_SIZE;
+    return data;
+}
+
+/* "NAME.EXT" of a short directory entry, NULL if it is free, deleted or an LFN entry */
+static const char * entry_name(const unsigned char * e, char * name)
+{
+    int i, len = 0;
+
+    if(e[0] == 0 || e[0] == 0xE5 || (e[11] & ATTR_LFN) == ATTR_LFN || (e[11] & ATTR_VOLUME))
+        return NULL;
+    for(i = 0; i < 8 && e[i] != ' '; i++)
+        name[len++] = g_ascii_toupper(i == 0 && e[0] == 0x05 ? 0xE5 : e[i]);
+    if(e[8] != ' ')
+    {
+        name[len++] = '.';
+        for(i = 8; i < 11 && e[i] != ' '; i++)
+            name[len++] = g_ascii_toupper(e[i]);
+    }
+    name[len] = 0;
+    return name;
+}
+
+static unsigned int entry_cluster(const struct fat_volume * vol, const unsigned char * e)
+{
+    unsigned int cluster = leword16(e + 26);
+
+    if(vol->type == FAT32)
+        cluster |= leword16(e + 20) << 16;
+    return cluster;
+}
+
+static int valid_boot_sector(const unsigned char * s)
+{
+    unsigned int bps = leword16(s + 11), spc = s[13];
+
+    return (s[0] == 0xEB || s[0] == 0xE9) &&
+           (bps == 512 || bps == 1024 || bps == 2048 || bps == 4096) &&
+           spc != 0 && (spc & (spc - 1)) == 0 &&
+           leword16(s + 14) != 0 && s[16] != 0;
+}
+
+static long fat_pread(struct himd_backend_stream * stream, char * buf, size_t size, long long pos)
+{
+    struct fat_stream * s = (struct fat_stream *)stream;
+    const struct fat_file * file = s->file;
+    const struct fat_run * run;
+    int lo = 0, hi = file->nruns - 1, mid, found = -1;
+    size_t n;
+
+    /* the run containing pos, runs cover the whole file */
+    while(lo <= hi)
+    {
+        mid = (lo + hi) / 2;
+        if(file->runs[mid].fileoffset <= pos)
+        {
+            found = mid;
+            lo = mid + 1;
+        }
+        else
+            hi = mid - 1;
+    }
+    if(found < 0)
+    {
+        errno = EIO;
+        return -1;
+    }
+    run = &file->runs[found];
+    n = MIN(size, (size_t)(run->fileoffset + run->length - pos));
+    if(read_fully(s->vol->fd, buf, n, run->imageoffset + (pos - run->fileoffset)) < 0)
+        return -1;
+    return n;
+}
+
+static void fat_stream_free(struct himd_backend_stream * s)
+{
+    g_free(s);
+}
+
+static FILE * fat_open_file(struct himd * himd, const char * fileid, enum himd_rw_mode mode)
+{
+    const struct fat_volume * vol = himd->backend_data;
+    const struct fat_file * file = NULL;
+    struct fat_stream * s;
+    char filename[13];
+    unsigned int i;
+    FILE * f;
+
+    if(mode == HIMD_READ_WRITE)
+    {
+        errno = EROFS;
+        return NULL;
+    }
+    sprintf(filename, "%s%02X.HMA", fileid, himd->datanum);
+    for(i = 0; i < vol->nfiles; i++)
+        if(strcmp(vol->files[i].name, filename) == 0)
+            file = &vol->files[i];
+    if(!file)
+    {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    s = g_new0(struct fat_stream, 1);
+    s->stream.size = file->size;
+    s->stream.pread = fat_pread;
+    s->stream.free = fat_stream_free;
+    s->vol = vol;
+    s->file = file;
+    if(!(f = himd_backend_fopen(&s->stream)))
+    {
+        g_free(s);
+        return NULL;
+    }
+    /* audio is read in whole blocks, they go straight to pread */
+    if(strcmp(fileid, "ATDATA") == 0)
+        setvbuf(f, NULL, _IONBF, 0);
+    return f;
+}
+
+static void volume_free(struct fat_volume * vol)
+{
+    unsigned int i;
+
+    if(vol->fd >= 0)
+        close(vol->fd);
+    for(i = 0; i < vol->nfiles; i++)
+        g_free(vol->files[i].runs);
+    g_free(vol->files);
+    g_free(vol->fat);
+    g_free(vol);
+}
+
+static void fat_close(struct himd * himd)
+{
+    volume_free(himd->backend_data);
+    himd->backend_data = NULL;
+}
+
+static const struct himd_backend fat_backend = { fat_open_file, fat_close, 1 };
+
+/**
+ * Read the file system of a raw image and let himd read the files in its
+ * HMDHIFI directory through the FAT backend. Fills in everything but the
+ * TIF, like himd_locate.
+ */
+int himd_fat_attach(struct himd * himd, const char * path, struct himderrinfo * status)
+{
+    unsigned char boot[SECTOR_SIZE];
+    unsigned char * dir = NULL, * e;
+    struct fat_volume * vol;
+    unsigned int bps, reserved, nfats, rootentries, fatsectors, totalsectors;
+    unsigned int rootcluster = 0, hmdhifi = 0, nentries, i, datanum;
+    long long rootoffset, length;
+    GArray * files;
+    char name[13];
+    int maxdatanum = -1;
+
+    vol = g_new0(struct fat_volume, 1);
+    if((vol->fd = g_open(path, O_RDONLY, 0)) < 0)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_ACCESS_HMDHIFI,
+                          _("Can't open %s: %s"), path, g_strerror(errno));
+        g_free(vol);
+        return -1;
+    }
+
+    if(read_fully(vol->fd, boot, SECTOR_SIZE, 0) < 0 || boot[510] != 0x55 || boot[511] != 0xAA)
+        goto not_fat;
+    if(!valid_boot_sector(boot))
+    {
+        /* the first partition of an MBR, if it has a FAT type */
+        switch(boot[446 + 4])
+        {
+            case 0x01: case 0x04: case 0x06: case 0x0B: case 0x0C: case 0x0E:
+                vol->base = (long long)leword32(boot + 446 + 8) * SECTOR_SIZE;
+                break;
+            default:
+                goto not_fat;
+        }
+        if(read_fully(vol->fd, boot, SECTOR_SIZE, vol->base) < 0 || !valid_boot_sector(boot))
+            goto not_fat;
+    }
+
+    bps = leword16(boot + 11);
+    vol->clustersize = bps * boot[13];
+    reserved = leword16(boot + 14);
+    nfats = boot[16];
+    rootentries = leword16(boot + 17);
+    totalsectors = leword16(boot + 19) ? leword16(boot + 19) : leword32(boot + 32);
+    fatsectors = leword16(boot + 22) ? leword16(boot + 22) : leword32(boot + 36);
+    rootoffset = vol->base + (long long)(reserved + nfats * fatsectors) * bps;
+    vol->dataoffset = rootoffset + ((long long)rootentries * DIRENT_SIZE + bps - 1) / bps * bps;
+    if(fatsectors == 0 || vol->dataoffset >= vol->base + (long long)totalsectors * bps)
+        goto not_fat;
+    vol->nclusters = (vol->base + (long long)totalsectors * bps - vol->dataoffset) / vol->clustersize;
+    if(vol->nclusters < 4085)
+        vol->type = FAT12;
+    else if(vol->nclusters < 65525)
+        vol->type = FAT16;
+    else
+    {
+        vol->type = FAT32;
+        rootcluster = leword32(boot + 44);
+    }
+
+    /* the first FAT, large enough for every cluster number */
+    length = (long long)fatsectors * bps;
+    if(length < (vol->type == FAT12 ? (vol->nclusters + 2) * 3 / 2 + 1 :
+                 (long long)(vol->nclusters + 2) * (vol->type == FAT16 ? 2 : 4)))
+        goto not_fat;
+    vol->fat = g_malloc(length);
+    if(read_fully(vol->fd, vol->fat, length, vol->base + (long long)reserved * bps) < 0)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_ACCESS_HMDHIFI,
+                          _("Can't read the FAT of %s: %s"), path, g_strerror(errno));
+        volume_free(vol);
+        return -1;
+    }
+
+    if(!(dir = read_directory(vol, rootcluster, rootoffset, rootentries, &nentries)))
+        goto read_error;
+    for(i = 0, e = dir; i < nentries && e[0] != 0; i++, e += DIRENT_SIZE)
+        if(entry_name(e, name) && (e[11] & ATTR_DIRECTORY) && strcmp(name, "HMDHIFI") == 0)
+            hmdhifi = entry_cluster(vol, e);
+    g_free(dir);
+    if(hmdhifi == 0)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_ACCESS_HMDHIFI,
+                          _("No HMDHIFI directory in %s"), path);
+        volume_free(vol);
+        return -1;
+    }
+
+    if(!(dir = read_directory(vol, hmdhifi, 0, 0, &nentries)))
+        goto read_error;
+    files = g_array_new(FALSE, TRUE, sizeof(struct fat_file));
+    for(i = 0, e = dir; i < nentries && e[0] != 0; i++, e += DIRENT_SIZE)
+    {
+        struct fat_file file;
+
+        if(!entry_name(e, name) || (e[11] & ATTR_DIRECTORY))
+            continue;
+        memset(&file, 0, sizeof file);
+        strcpy(file.name, name);
+        file.size = leword32(e + 28);
+        file.runs = resolve_chain(vol, entry_cluster(vol, e), file.size, &file.nruns, &length);
+        if(length < file.size)
+        {
+            g_warning("Cluster chain of %s ends after %lld of %lld bytes", name, length, file.size);
+            file.size = length;
+        }
+        g_array_append_val(files, file);
+
+        /* ATDATAnn.HMA - should be only one of them, like scanforatdata */
+        if(strncmp(name, "ATDATA0", 7) == 0 && strlen(name) == 12 &&
+           g_ascii_isxdigit(name[7]) && strcmp(name + 8, ".HMA") == 0 &&
+           sscanf(name + 6, "%x", &datanum) == 1 && (int)datanum > maxdatanum)
+            maxdatanum = datanum;
+    }
+    g_free(dir);
+    vol->nfiles = files->len;
+    vol->files = (struct fat_file *)g_array_free(files, FALSE);
+
+    if(maxdatanum == -1)
+    {
+        set_status_const(status, HIMD_ERROR_NO_TRACK_INDEX, _("No track index file found"));
+        volume_free(vol);
+        return -1;
+    }
+
+    himd_init_handle(himd, path, &fat_backend, vol);
+    himd->datanum = maxdatanum;
+    himd->need_lowercase = 0;
+    return 0;
+
+not_fat:
+    set_status_printf(status, HIMD_ERROR_CANT_ACCESS_HMDHIFI,
+                      _("%s is neither a HiMD directory nor a FAT image"), path);
+    volume_free(vol);
+    return -1;
+
+read_error:
+    set_status_printf(status, HIMD_ERROR_CANT_ACCESS_HMDHIFI,
+                      _("Can't read a directory of %s: %s"), path, g_strerror(errno));
+    volume_free(vol);
+    return -1;
+}
+
+#else
+
+int himd_fat_attach(struct himd * himd, const char * path, struct himderrinfo * status)
+{
+    set_status_const(status, HIMD_ERROR_DISABLED_FEATURE,
+                     _("Raw disk images can't be read on this platform"));
+    return -1;
+}
+
+#endif
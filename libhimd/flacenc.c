@@ -0,0 +1,380 @@
+#include <string.h>
+#include <stdlib.h>
+#include <glib.h>
+
+#include "himd.h"
+#include "himd_private.h"
+
+/* A small FLAC frame encoder: fixed blocksize, 16 bit stereo at 44.1kHz,
+   fixed predictors of order 0 to 4 and partitioned Rice coding of the
+   residual. Every frame is independent of the others, which is what
+   allows flacsink.c to encode groups of frames in parallel. */
+
+#define MAX_PARTITION_ORDER 8
+#define MAX_RICE_PARAM 14
+
+static guint8 crc8_table[256];
+static guint16 crc16_table[256];
+
+void flac_init_tables(void)
+{
+    static gsize initialized = 0;
+    unsigned int i, j;
+
+    /* two exports may start at the same time */
+    if(!g_once_init_enter(&initialized))
+        return;
+    for(i = 0; i < 256; i++)
+    {
+        unsigned int c8 = i, c16 = i << 8;
+        for(j = 0; j < 8; j++)
+        {
+            c8 = (c8 & 0x80) ? (c8 << 1) ^ 0x07 : c8 << 1;
+            c16 = (c16 & 0x8000) ? (c16 << 1) ^ 0x8005 : c16 << 1;
+        }
+        crc8_table[i] = c8 & 0xFF;
+        crc16_table[i] = c16 & 0xFFFF;
+    }
+    g_once_init_leave(&initialized, 1);
+}
+
+static unsigned int crc8(const unsigned char * data, size_t len)
+{
+    unsigned int crc = 0;
+    while(len--)
+        crc = crc8_table[crc ^ *data++];
+    return crc;
+}
+
+static unsigned int crc16(const unsigned char * data, size_t len)
+{
+    unsigned int crc = 0;
+    while(len--)
+        crc = ((crc << 8) ^ crc16_table[(crc >> 8) ^ *data++]) & 0xFFFF;
+    return crc;
+}
+
+struct bitwriter {
+    unsigned char * buf;
+    size_t pos;
+    guint64 acc;
+    unsigned int nbits;
+};
+
+static inline void bw_put(struct bitwriter * bw, guint32 val, unsigned int bits)
+{
+    if(!bits)
+        return;
+    bw->acc = (bw->acc << bits) | (val & (guint32)(((guint64)1 << bits) - 1));
+    bw->nbits += bits;
+    while(bw->nbits >= 8)
+    {
+        bw->nbits -= 8;
+        bw->buf[bw->pos++] = (unsigned char)(bw->acc >> bw->nbits);
+    }
+}
+
+static inline void bw_put_unary(struct bitwriter * bw, guint32 zeros)
+{
+    while(zeros >= 32)
+    {
+        bw_put(bw, 0, 32);
+        zeros -= 32;
+    }
+    bw_put(bw, 1, zeros + 1);
+}
+
+static void bw_align(struct bitwriter * bw)
+{
+    if(bw->nbits)
+        bw_put(bw, 0, 8 - bw->nbits);
+}
+
+/* the UTF-8 like coding of the frame number */
+static void bw_put_utf8(struct bitwriter * bw, guint32 val)
+{
+    int bytes, i;
+
+    if(val < 0x80)
+    {
+        bw_put(bw, val, 8);
+        return;
+    }
+    for(bytes = 2; bytes < 7 && val >= (1U << (5*bytes + 1)); bytes++)
+        ;
+    bw_put(bw, (0xFF00 >> bytes) | (val >> (6*(bytes-1))), 8);
+    for(i = bytes - 2; i >= 0; i--)
+        bw_put(bw, 0x80 | ((val >> (6*i)) & 0x3F), 8);
+}
+
+static inline guint32 zigzag(gint32 v)
+{
+    return ((guint32)v << 1) ^ (guint32)(v >> 31);
+}
+
+static void fixed_residual(const gint32 * x, gint32 * res, unsigned int n, unsigned int order)
+{
+    unsigned int i;
+    switch(order)
+    {
+        case 0:
+            for(i = 0; i < n; i++)
+                res[i] = x[i];
+            break;
+        case 1:
+            for(i = 1; i < n; i++)
+                res[i-1] = x[i] - x[i-1];
+            break;
+        case 2:
+            for(i = 2; i < n; i++)
+                res[i-2] = x[i] - 2*x[i-1] + x[i-2];
+            break;
+        case 3:
+            for(i = 3; i < n; i++)
+                res[i-3] = x[i] - 3*x[i-1] + 3*x[i-2] - x[i-3];
+            break;
+        case 4:
+            for(i = 4; i < n; i++)
+                res[i-4] = x[i] - 4*x[i-1] + 6*x[i-2] - 4*x[i-3] + x[i-4];
+            break;
+    }
+}
+
+/* Pick the fixed predictor order with the smallest residual magnitude,
+   returns that sum as a cheap bit estimate. */
+static unsigned int best_fixed_order(const gint32 * x, unsigned int n, guint64 * score)
+{
+    guint64 sum[5] = {0, 0, 0, 0, 0};
+    unsigned int i, order, best = 0;
+
+    if(n <= 4)
+    {
+        *score = 0;
+        return 0;
+    }
+    for(i = 4; i < n; i++)
+    {
+        gint32 e0 = x[i];
+        gint32 e1 = e0 - x[i-1];
+        gint32 e2 = e1 - (x[i-1] - x[i-2]);
+        gint32 e3 = e2 - (x[i-1] - 2*x[i-2] + x[i-3]);
+        gint32 e4 = e3 - (x[i-1] - 3*x[i-2] + 3*x[i-3] - x[i-4]);
+        sum[0] += abs(e0);
+        sum[1] += abs(e1);
+        sum[2] += abs(e2);
+        sum[3] += abs(e3);
+        sum[4] += abs(e4);
+    }
+    for(order = 1; order < 5; order++)
+        if(sum[order] < sum[best])
+            best = order;
+    *score = sum[best];
+    return best;
+}
+
+static unsigned int rice_param(guint64 sum, unsigned int n)
+{
+    unsigned int k = 0;
+    guint64 mean;
+
+    if(!n)
+        return 0;
+    mean = sum / n;
+    while(k < MAX_RICE_PARAM && ((guint64)1 << (k + 1)) <= mean)
+        k++;
+    return k;
+}
+
+static guint64 rice_bits(const gint32 * res, unsigned int n, unsigned int k)
+{
+    guint64 bits = (guint64)n * (k + 1);
+    unsigned int i;
+    for(i = 0; i < n; i++)
+        bits += zigzag(res[i]) >> k;
+    return bits;
+}
+
+struct rice_plan {
+    unsigned int order;
+    unsigned int params[1 << MAX_PARTITION_ORDER];
+    guint64 bits;
+};
+
+static void plan_residual(const gint32 * res, unsigned int blocksize, unsigned int predorder,
+                          struct rice_plan * best)
+{
+    struct rice_plan cur;
+    unsigned int porder, p;
+
+    best->bits = (guint64)-1;
+    for(porder = 0; porder <= MAX_PARTITION_ORDER; porder++)
+    {
+        unsigned int partsize = blocksize >> porder;
+        const gint32 * r = res;
+
+        if((blocksize & ((1U << porder) - 1)) || partsize <= predorder)
+            break;
+        cur.order = porder;
+        cur.bits = 2 + 4;
+        for(p = 0; p < (1U << porder); p++)
+        {
+            unsigned int n = p ? partsize : partsize - predorder;
+            guint64 sum = 0;
+            unsigned int i;
+            for(i = 0; i < n; i++)
+                sum += zigzag(r[i]);
+            cur.params[p] = rice_param(sum, n);
+            cur.bits += 4 + rice_bits(r, n, cur.params[p]);
+            r += n;
+        }
+        if(cur.bits < best->bits)
+            *best = cur;
+    }
+}
+
+static void write_residual(struct bitwriter * bw, const gint32 * res, unsigned int blocksize,
+                           unsigned int predorder, const struct rice_plan * plan)
+{
+    unsigned int p, i;
+    unsigned int partsize = blocksize >> plan->order;
+
+    bw_put(bw, 0, 2);		/* partitioned Rice, 4 bit parameters */
+    bw_put(bw, plan->order, 4);
+    for(p = 0; p < (1U << plan->order); p++)
+    {
+        unsigned int n = p ? partsize : partsize - predorder;
+        unsigned int k = plan->params[p];
+        bw_put(bw, k, 4);
+        for(i = 0; i < n; i++)
+        {
+            guint32 u = zigzag(res[i]);
+            bw_put_unary(bw, u >> k);
+            bw_put(bw, u, k);
+        }
+        res += n;
+    }
+}
+
+static void write_subframe(struct bitwriter * bw, const gint32 * x, unsigned int n,
+                           unsigned int bps, gint32 * res)
+{
+    struct rice_plan plan;
+    guint64 score, verbatim_bits = (guint64)n * bps;
+    unsigned int order, i;
+
+    for(i = 1; i < n && x[i] == x[0]; i++)
+        ;
+    if(i == n)
+    {
+        bw_put(bw, 0x00, 8);		/* CONSTANT */
+        bw_put(bw, x[0], bps);
+        return;
+    }
+
+    order = best_fixed_order(x, n, &score);
+    fixed_residual(x, res, n, order);
+    plan_residual(res, n, order, &plan);
+
+    if(plan.bits == (guint64)-1 || plan.bits + order * bps >= verbatim_bits)
+    {
+        bw_put(bw, 0x02, 8);		/* VERBATIM */
+        for(i = 0; i < n; i++)
+            bw_put(bw, x[i], bps);
+        return;
+    }
+
+    bw_put(bw, (0x08 | order) << 1, 8);	/* FIXED */
+    for(i = 0; i < order; i++)
+        bw_put(bw, x[i], bps);
+    write_residual(bw, res, n, order, &plan);
+}
+
+size_t flac_max_frame_size(unsigned int samples)
+{
+    /* two verbatim subframes, the side channel has 17 bits per sample */
+    return 32 + (size_t)samples * (16 + 17) / 8 + 8;
+}
+
+/**
+ * Encode one FLAC frame of up to FLAC_BLOCKSIZE interleaved stereo samples
+ * in native byte order. scratch needs room for 5*FLAC_BLOCKSIZE gint32s,
+ * out for flac_max_frame_size(samples) bytes.
+ *
+ * @return length of the encoded frame
+ */
+size_t flac_encode_frame(unsigned char * out, const gint16 * pcm, unsigned int samples,
+                         guint32 framenum, gint32 * scratch)
+{
+    struct bitwriter bw;
+    gint32 * left = scratch;
+    gint32 * right = scratch + FLAC_BLOCKSIZE;
+    gint32 * mid = scratch + 2*FLAC_BLOCKSIZE;
+    gint32 * side = scratch + 3*FLAC_BLOCKSIZE;
+    gint32 * res = scratch + 4*FLAC_BLOCKSIZE;
+    guint64 sl, sr, sm, ss, best;
+    unsigned int i, assignment, headerlen;
+
+    for(i = 0; i < samples; i++)
+    {
+        left[i] = pcm[2*i];
+        right[i] = pcm[2*i+1];
+        mid[i] = (left[i] + right[i]) >> 1;
+        side[i] = left[i] - right[i];
+    }
+
+    /* choose the stereo decorrelation by the residual estimate */
+    best_fixed_order(left, samples, &sl);
+    best_fixed_order(right, samples, &sr);
+    best_fixed_order(mid, samples, &sm);
+    best_fixed_order(side, samples, &ss);
+    assignment = 1; best = sl + sr;		/* independent */
+    if(sl + ss < best) { assignment = 8; best = sl + ss; }	/* left/side */
+    if(sr + ss < best) { assignment = 9; best = sr + ss; }	/* right/side */
+    if(sm + ss < best) { assignment = 10; best = sm + ss; }	/* mid/side */
+
+    bw.buf = out;
+    bw.pos = 0;
+    bw.acc = 0;
+    bw.nbits = 0;
+
+    bw_put(&bw, 0xFFF8, 16);		/* sync, fixed blocksize stream */
+    if(samples == FLAC_BLOCKSIZE)
+        bw_put(&bw, 12, 4);		/* 256 * 2^(12-8) = 4096 */
+    else if(samples <= 256)
+        bw_put(&bw, 6, 4);
+    else
+        bw_put(&bw, 7, 4);
+    bw_put(&bw, 9, 4);			/* 44.1kHz */
+    bw_put(&bw, assignment, 4);
+    bw_put(&bw, 4, 3);			/* 16 bits per sample */
+    bw_put(&bw, 0, 1);
+    bw_put_utf8(&bw, framenum);
+    if(samples != FLAC_BLOCKSIZE)
+        bw_put(&bw, samples - 1, samples <= 256 ? 8 : 16);
+    headerlen = bw.pos;
+    bw_put(&bw, crc8(out, headerlen), 8);
+
+    switch(assignment)
+    {
+        case 1:
+            write_subframe(&bw, left, samples, 16, res);
+            write_subframe(&bw, right, samples, 16, res);
+            break;
+        case 8:
+            write_subframe(&bw, left, samples, 16, res);
+            write_subframe(&bw, side, samples, 17, res);
+            break;
+        case 9:
+            write_subframe(&bw, side, samples, 17, res);
+            write_subframe(&bw, right, samples, 16, res);
+            break;
+        case 10:
+            write_subframe(&bw, mid, samples, 16, res);
+            write_subframe(&bw, side, samples, 17, res);
+            break;
+    }
+    bw_align(&bw);
+    i = crc16(out, bw.pos);
+    bw_put(&bw, i, 16);
+    return bw.pos;
+}
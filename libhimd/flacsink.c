@@ -0,0 +1,447 @@
+#include <string.h>
+#include <errno.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "himd.h"
+#include "himd_private.h"
+#include "flacsink.h"
+#include "analysis.h"
+#include "trace.h"
+
+#define _(x) (x)
+
+#define FRAMES_PER_GROUP 16
+#define GROUP_SAMPLES (FRAMES_PER_GROUP * FLAC_BLOCKSIZE)
+#define STREAMINFO_OFFSET 8
+#define COMMENT_OFFSET (STREAMINFO_OFFSET + 34)
+#define FLAC_PADDING 4096
+#define FLAC_VENDOR "libhimd"
+
+/* A run of FRAMES_PER_GROUP frames, encoded as a unit by one worker */
+struct flac_group {
+    gint16 * pcm;
+    unsigned int samples;
+    guint32 firstframe;
+    gint32 * scratch;
+    unsigned char * out;
+    size_t outlen;
+    unsigned int minframe, maxframe;
+    int done;
+};
+
+struct flac_encoder {
+    FILE * out;
+    GThreadPool * pool;
+    GMutex lock;
+    GCond cond;
+    struct flac_group * groups;
+    unsigned int ngroups;
+    unsigned int oldest, inflight;
+    guint32 nextframe;
+    guint64 totalsamples;
+    unsigned int minframe, maxframe;
+    /* comment block and padding, including the padding header */
+    unsigned int metalen;
+};
+
+static void encode_group(struct flac_group * g)
+{
+    unsigned int done, n;
+    size_t len;
+
+    HIMD_TRACE_BEGIN(encode_scope, "flac_encode");
+    g->outlen = 0;
+    g->minframe = G_MAXUINT;
+    g->maxframe = 0;
+    for(done = 0; done < g->samples; done += n)
+    {
+        n = MIN(FLAC_BLOCKSIZE, g->samples - done);
+        len = flac_encode_frame(g->out + g->outlen, g->pcm + 2*done, n,
+                                g->firstframe + done / FLAC_BLOCKSIZE, g->scratch);
+        g->outlen += len;
+        g->minframe = MIN(g->minframe, len);
+        g->maxframe = MAX(g->maxframe, len);
+    }
+    HIMD_TRACE_END(encode_scope);
+}
+
+static void encode_worker(gpointer data, gpointer user_data)
+{
+    struct flac_group * g = data;
+    struct flac_encoder * enc = user_data;
+
+    encode_group(g);
+    g_mutex_lock(&enc->lock);
+    g->done = 1;
+    g_cond_broadcast(&enc->cond);
+    g_mutex_unlock(&enc->lock);
+}
+
+static void setbeword24(unsigned char * c, unsigned int val)
+{
+    c[0] = (val >> 16) & 0xFF;
+    c[1] = (val >> 8) & 0xFF;
+    c[2] = val & 0xFF;
+}
+
+static void setleword32(unsigned char * c, unsigned int val)
+{
+    c[0] = val & 0xFF;
+    c[1] = (val >> 8) & 0xFF;
+    c[2] = (val >> 16) & 0xFF;
+    c[3] = (val >> 24) & 0xFF;
+}
+
+static void make_streaminfo(unsigned char * block, const struct flac_encoder * enc)
+{
+    guint64 packed;
+    int i;
+
+    memset(block, 0, 34);
+    setbeword16(block, FLAC_BLOCKSIZE);
+    setbeword16(block+2, FLAC_BLOCKSIZE);
+    if(enc->maxframe)
+    {
+        setbeword24(block+4, enc->minframe);
+        setbeword24(block+7, enc->maxframe);
+    }
+    /* 20 bits rate, 3 bits channels-1, 5 bits bps-1, 36 bits samples */
+    packed = ((guint64)44100 << 44) | ((guint64)1 << 41) | ((guint64)15 << 36) |
+             (enc->totalsamples & G_GUINT64_CONSTANT(0xFFFFFFFFF));
+    for(i = 0; i < 8; i++)
+        block[10+i] = (packed >> (56 - 8*i)) & 0xFF;
+    /* MD5 left zero, which means "not computed" */
+}
+
+/* returns the number of comments appended */
+static int append_comment(GString * block, const char * key, const char * value)
+{
+    unsigned char len[4];
+
+    if(!value || !*value)
+        return 0;
+    setleword32(len, strlen(key) + 1 + strlen(value));
+    g_string_append_len(block, (const char *)len, 4);
+    g_string_append(block, key);
+    g_string_append_c(block, '=');
+    g_string_append(block, value);
+    return 1;
+}
+
+static GString * make_vorbis_comment(const struct himd_tags * tags)
+{
+    GString * block = g_string_new("");
+    unsigned char len[4];
+    char buf[G_ASCII_DTOSTR_BUF_SIZE];
+    unsigned int count;
+
+    setleword32(len, strlen(FLAC_VENDOR));
+    g_string_append_len(block, (const char *)len, 4);
+    g_string_append(block, FLAC_VENDOR);
+
+    /* comment count, patched below */
+    g_string_append_len(block, "\0\0\0\0", 4);
+    count = 0;
+    if(tags)
+    {
+        count += append_comment(block, "TITLE", tags->title);
+        count += append_comment(block, "ARTIST", tags->artist);
+        count += append_comment(block, "ALBUM", tags->album);
+        if(tags->trackinalbum > 0)
+        {
+            g_snprintf(buf, sizeof buf, "%d", tags->trackinalbum);
+            count += append_comment(block, "TRACKNUMBER", buf);
+        }
+        count += append_comment(block, "COMMENT", tags->comment);
+        if(tags->loudness && tags->loudness->valid)
+        {
+            g_ascii_formatd(buf, sizeof buf - 3, "%+.2f", tags->loudness->gain);
+            count += append_comment(block, "REPLAYGAIN_TRACK_GAIN", strcat(buf, " dB"));
+            g_ascii_formatd(buf, sizeof buf, "%.6f", tags->loudness->peak);
+            count += append_comment(block, "REPLAYGAIN_TRACK_PEAK", buf);
+        }
+    }
+    setleword32((unsigned char *)block->str + 4 + strlen(FLAC_VENDOR), count);
+    return block;
+}
+
+static int write_metadata_header(FILE * out, int last, int type, unsigned int len)
+{
+    unsigned char header[4];
+    header[0] = (last ? 0x80 : 0) | type;
+    setbeword24(header+1, len);
+    return fwrite(header, 4, 1, out) == 1 ? 0 : -1;
+}
+
+static int write_headers(struct flac_encoder * enc, const struct himd_tags * tags)
+{
+    unsigned char streaminfo[34];
+    static const unsigned char padding[FLAC_PADDING];
+    GString * comment;
+    int ret = 0;
+
+    make_streaminfo(streaminfo, enc);
+    comment = make_vorbis_comment(tags);
+    if(fwrite("fLaC", 4, 1, enc->out) != 1 ||
+       write_metadata_header(enc->out, 0, 0, sizeof streaminfo) < 0 ||
+       fwrite(streaminfo, sizeof streaminfo, 1, enc->out) != 1 ||
+       write_metadata_header(enc->out, 0, 4, comment->len) < 0 ||
+       fwrite(comment->str, comment->len, 1, enc->out) != 1 ||
+       write_metadata_header(enc->out, 1, 1, FLAC_PADDING) < 0 ||
+       fwrite(padding, FLAC_PADDING, 1, enc->out) != 1)
+        ret = -1;
+    enc->metalen = comment->len + 4 + FLAC_PADDING;
+    g_string_free(comment, TRUE);
+    return ret;
+}
+
+static void free_encoder(struct flac_encoder * enc)
+{
+    unsigned int i;
+
+    if(enc->pool)
+        g_thread_pool_free(enc->pool, FALSE, TRUE);
+    for(i = 0; i < enc->ngroups; i++)
+    {
+        g_free(enc->groups[i].pcm);
+        g_free(enc->groups[i].scratch);
+        g_free(enc->groups[i].out);
+    }
+    g_free(enc->groups);
+    g_mutex_clear(&enc->lock);
+    g_cond_clear(&enc->cond);
+    g_free(enc);
+}
+
+int himd_flacsink_open(struct himd_flacsink * sink, const char * filename, const struct himd_tags * tags,
+                       unsigned int threads, struct himderrinfo * status)
+{
+    struct flac_encoder * enc;
+    unsigned int i;
+
+    g_return_val_if_fail(sink != NULL, -1);
+    g_return_val_if_fail(filename != NULL, -1);
+
+    flac_init_tables();
+
+    if(threads == 0)
+        threads = g_get_num_processors();
+
+    enc = g_new0(struct flac_encoder, 1);
+    g_mutex_init(&enc->lock);
+    g_cond_init(&enc->cond);
+    enc->minframe = G_MAXUINT;
+
+    /* two groups per thread keep the workers busy while the oldest
+       group is written out */
+    enc->ngroups = threads > 1 ? 2*threads : 1;
+    enc->groups = g_new0(struct flac_group, enc->ngroups);
+    for(i = 0; i < enc->ngroups; i++)
+    {
+        enc->groups[i].pcm = g_new(gint16, 2*GROUP_SAMPLES);
+        enc->groups[i].scratch = g_new(gint32, 5*FLAC_BLOCKSIZE);
+        enc->groups[i].out = g_malloc(FRAMES_PER_GROUP * flac_max_frame_size(FLAC_BLOCKSIZE));
+    }
+
+    if(threads > 1)
+    {
+        enc->pool = g_thread_pool_new(encode_worker, enc, threads, FALSE, NULL);
+        if(!enc->pool)
+        {
+            set_status_const(status, HIMD_ERROR_OUT_OF_MEMORY, _("Can't start FLAC encoder threads"));
+            free_encoder(enc);
+            return -1;
+        }
+    }
+
+    enc->out = g_fopen(filename, "wb");
+    if(!enc->out)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                          _("Can't open %s for writing: %s"), filename, g_strerror(errno));
+        free_encoder(enc);
+        return -1;
+    }
+    if(write_headers(enc, tags) < 0)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                          _("Can't write FLAC header: %s"), g_strerror(errno));
+        fclose(enc->out);
+        free_encoder(enc);
+        return -1;
+    }
+
+    sink->encoder = enc;
+    return 0;
+}
+
+static struct flac_group * filling_group(struct flac_encoder * enc)
+{
+    return &enc->groups[(enc->oldest + enc->inflight) % enc->ngroups];
+}
+
+static int write_group(struct flac_encoder * enc, struct flac_group * g, struct himderrinfo * status)
+{
+    int ret = 0;
+
+    HIMD_TRACE_BEGIN(write_scope, "write");
+    if(fwrite(g->out, g->outlen, 1, enc->out) != 1)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                          _("Can't write FLAC frames: %s"), g_strerror(errno));
+        ret = -1;
+    }
+    HIMD_TRACE_END(write_scope);
+    enc->minframe = MIN(enc->minframe, g->minframe);
+    enc->maxframe = MAX(enc->maxframe, g->maxframe);
+    g->samples = 0;
+    g->done = 0;
+    return ret;
+}
+
+static int write_oldest(struct flac_encoder * enc, struct himderrinfo * status)
+{
+    struct flac_group * g = &enc->groups[enc->oldest];
+
+    g_mutex_lock(&enc->lock);
+    while(!g->done)
+        g_cond_wait(&enc->cond, &enc->lock);
+    g_mutex_unlock(&enc->lock);
+
+    enc->oldest = (enc->oldest + 1) % enc->ngroups;
+    enc->inflight--;
+    return write_group(enc, g, status);
+}
+
+static int submit_group(struct flac_encoder * enc, struct himderrinfo * status)
+{
+    struct flac_group * g = filling_group(enc);
+
+    g->firstframe = enc->nextframe;
+    enc->nextframe += (g->samples + FLAC_BLOCKSIZE - 1) / FLAC_BLOCKSIZE;
+    enc->totalsamples += g->samples;
+
+    if(!enc->pool)
+    {
+        encode_group(g);
+        return write_group(enc, g, status);
+    }
+
+    enc->inflight++;
+    g_thread_pool_push(enc->pool, g, NULL);
+    if(enc->inflight == enc->ngroups)
+        return write_oldest(enc, status);
+    return 0;
+}
+
+int himd_flacsink_write(struct himd_flacsink * sink, const unsigned char * data, unsigned int len, struct himderrinfo * status)
+{
+    struct flac_encoder * enc;
+    unsigned int samples = len / 4;
+
+    g_return_val_if_fail(sink != NULL, -1);
+    enc = sink->encoder;
+
+    while(samples)
+    {
+        struct flac_group * g = filling_group(enc);
+        unsigned int n = MIN(samples, GROUP_SAMPLES - g->samples);
+
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+        pcm_swap16((unsigned char *)(g->pcm + 2*g->samples), data, n*4);
+#else
+        memcpy(g->pcm + 2*g->samples, data, n*4);
+#endif
+        g->samples += n;
+        data += n*4;
+        samples -= n;
+
+        if(g->samples == GROUP_SAMPLES && submit_group(enc, status) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Replace the tags written by himd_flacsink_open. The new comment block
+ * has to fit into the space of the old one and the padding behind it,
+ * the audio data is not moved.
+ */
+int himd_flacsink_retag(struct himd_flacsink * sink, const struct himd_tags * tags, struct himderrinfo * status)
+{
+    struct flac_encoder * enc;
+    GString * comment;
+    unsigned char * padding;
+    unsigned int padlen;
+    long pos;
+    int ret = 0;
+
+    g_return_val_if_fail(sink != NULL, -1);
+    enc = sink->encoder;
+
+    comment = make_vorbis_comment(tags);
+    if(comment->len + 4 > enc->metalen)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                          _("New FLAC tags need %u bytes, only %u available"),
+                          (unsigned int)comment->len + 4, enc->metalen);
+        g_string_free(comment, TRUE);
+        return -1;
+    }
+    padlen = enc->metalen - comment->len - 4;
+    padding = g_malloc0(padlen);
+
+    pos = ftell(enc->out);
+    if(pos < 0 ||
+       fseek(enc->out, COMMENT_OFFSET, SEEK_SET) != 0 ||
+       write_metadata_header(enc->out, 0, 4, comment->len) < 0 ||
+       fwrite(comment->str, comment->len, 1, enc->out) != 1 ||
+       write_metadata_header(enc->out, 1, 1, padlen) < 0 ||
+       (padlen && fwrite(padding, padlen, 1, enc->out) != 1) ||
+       fseek(enc->out, pos, SEEK_SET) != 0)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                          _("Can't update FLAC tags: %s"), g_strerror(errno));
+        ret = -1;
+    }
+    g_free(padding);
+    g_string_free(comment, TRUE);
+    return ret;
+}
+
+/* Closes the file in any case, returns -1 if the stream could not be finished */
+int himd_flacsink_close(struct himd_flacsink * sink, struct himderrinfo * status)
+{
+    struct flac_encoder * enc;
+    unsigned char streaminfo[34];
+    int ret = 0;
+
+    g_return_val_if_fail(sink != NULL, -1);
+    enc = sink->encoder;
+
+    if(filling_group(enc)->samples && submit_group(enc, status) < 0)
+        ret = -1;
+    while(enc->inflight)
+        if(write_oldest(enc, status) < 0)
+            ret = -1;
+
+    make_streaminfo(streaminfo, enc);
+    if(ret == 0 &&
+       (fseek(enc->out, STREAMINFO_OFFSET, SEEK_SET) != 0 ||
+        fwrite(streaminfo, sizeof streaminfo, 1, enc->out) != 1))
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                          _("Can't update FLAC stream info: %s"), g_strerror(errno));
+        ret = -1;
+    }
+    if(fclose(enc->out) != 0 && ret == 0)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                          _("Can't finish FLAC file: %s"), g_strerror(errno));
+        ret = -1;
+    }
+    free_encoder(enc);
+    sink->encoder = NULL;
+    return ret;
+}
@@ -0,0 +1,27 @@
+#ifndef INCLUDED_LIBHIMD_FLACSINK_H
+#define INCLUDED_LIBHIMD_FLACSINK_H
+
+#include "himd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Encodes decrypted LPCM blocks into a FLAC file. Groups of frames are
+   encoded on a pool of worker threads and written in order. */
+struct himd_flacsink {
+    void * encoder;
+};
+
+/* threads == 0 uses one thread per processor */
+int himd_flacsink_open(struct himd_flacsink * sink, const char * filename, const struct himd_tags * tags,
+                       unsigned int threads, struct himderrinfo * status);
+int himd_flacsink_write(struct himd_flacsink * sink, const unsigned char * data, unsigned int len, struct himderrinfo * status);
+int himd_flacsink_retag(struct himd_flacsink * sink, const struct himd_tags * tags, struct himderrinfo * status);
+int himd_flacsink_close(struct himd_flacsink * sink, struct himderrinfo * status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,485 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <glib.h>
+
+#include "himd.h"
+#include "himd_private.h"
+#include "fsck.h"
+#include "trace.h"
+
+#define _(x) (x)
+
+#define RUN_BLOCKS 64		/* blocks read at once, 1 MB */
+
+/* offsets in a block, see setblock */
+#define BLOCK_TYPE 0
+#define BLOCK_NFRAMES 4
+#define BLOCK_LENDATA 8
+#define BLOCK_SERIAL 12
+#define BLOCK_BACKUP_TYPE 16368
+#define BLOCK_LO32_CONTENTID 16376
+#define BLOCK_BACKUP_SERIAL 16380
+
+/* the track and fragment a block belongs to, slot 0 if none */
+struct fsck_owner {
+    guint16 slot;
+    guint16 frag;
+};
+
+struct fsck_track {
+    int walked;
+    unsigned int framesperblock;
+    unsigned int lo32_contentid;
+    unsigned int firstblock;	/* index into order of the first block of the track */
+    unsigned int nblocks;
+};
+
+struct fsck_run {
+    unsigned int first;
+    unsigned int count;
+    unsigned char * data;
+};
+
+struct fsck_state {
+    GArray * problems;
+    GMutex lock;
+    unsigned int nblocks;	/* size of ATDATA */
+    struct fsck_owner * owners;	/* by block */
+    struct fsck_track * tracks;	/* by slot */
+    GArray * slots;		/* tracks in play order */
+    GArray * order;		/* blocks of all tracks, track after track */
+    guint16 * fragowners;	/* slot of the track using a fragment */
+    unsigned int fragments;
+    unsigned int * serials;
+    unsigned int * lo32s;	/* lo32_contentid of the blocks */
+    unsigned char * checked;	/* the header of the block was read */
+    GAsyncQueue * freeruns;
+};
+
+static void add_problem(struct fsck_state * st, enum himd_fsck_check check, unsigned int slot,
+                        unsigned int frag, long block, const char * format, ...)
+{
+    struct himd_fsck_problem p;
+    va_list args;
+
+    p.check = check;
+    p.track = slot;
+    p.fragment = frag;
+    p.block = block;
+    va_start(args, format);
+    g_vsnprintf(p.message, sizeof p.message, format, args);
+    va_end(args);
+
+    g_mutex_lock(&st->lock);
+    g_array_append_val(st->problems, p);
+    g_mutex_unlock(&st->lock);
+}
+
+/* Whether a fragment may use a block already claimed: splitting a track
+   inside a block leaves the block at the end of one fragment and the start
+   of another, each with its own frames of it */
+static int shares_block(struct fsck_state * st, struct himd * himd, const struct fsck_track * tr,
+                        const struct fraginfo * f, unsigned int block)
+{
+    struct himderrinfo status;
+    struct fraginfo owner;
+
+    if(tr->framesperblock == TRACK_IS_MPEG ||
+       himd_get_fragment_info(himd, st->owners[block].frag, &owner, &status) < 0)
+        return 0;
+    return (owner.lastblock == block && f->firstblock == block && owner.lastframe < f->firstframe) ||
+           (owner.firstblock == block && f->lastblock == block && f->lastframe < owner.firstframe);
+}
+
+/* Follow the fragment chain of a track, claiming its fragments and blocks */
+static void walk_track(struct fsck_state * st, struct himd * himd, unsigned int slot, const struct trackinfo * t)
+{
+    struct fsck_track * tr = &st->tracks[slot];
+    struct himderrinfo status;
+    struct fraginfo f;
+    unsigned int fragnum, block;
+
+    tr->walked = 1;
+    tr->framesperblock = himd_trackinfo_framesperblock(t);
+    tr->lo32_contentid = beword32(t->contentid + 16);
+    tr->firstblock = st->order->len;
+
+    for(fragnum = t->firstfrag; fragnum != 0; fragnum = f.nextfrag)
+    {
+        if(fragnum > HIMD_LAST_FRAGMENT)
+        {
+            add_problem(st, HIMD_FSCK_CHAIN, slot, 0, -1,
+                        _("Fragment chain leads to invalid fragment %u"), fragnum);
+            break;
+        }
+        if(st->fragowners[fragnum] == slot)
+        {
+            add_problem(st, HIMD_FSCK_CHAIN, slot, fragnum, -1,
+                        _("Fragment chain loops at fragment %u"), fragnum);
+            break;
+        }
+        if(st->fragowners[fragnum])
+        {
+            add_problem(st, HIMD_FSCK_OVERLAP, slot, fragnum, -1,
+                        _("Fragment %u also belongs to track %u"), fragnum, st->fragowners[fragnum]);
+            break;
+        }
+        st->fragowners[fragnum] = slot;
+        st->fragments++;
+        if(himd_get_fragment_info(himd, fragnum, &f, &status) < 0)
+        {
+            add_problem(st, HIMD_FSCK_CHAIN, slot, fragnum, -1, "%s", status.statusmsg);
+            break;
+        }
+
+        if(f.firstblock > f.lastblock)
+            add_problem(st, HIMD_FSCK_RANGE, slot, fragnum, -1,
+                        _("Fragment %u starts at block %u after its end %u"), fragnum, f.firstblock, f.lastblock);
+        else if(f.lastblock >= st->nblocks)
+            add_problem(st, HIMD_FSCK_RANGE, slot, fragnum, -1,
+                        _("Fragment %u ends at block %u, audio data has %u blocks"), fragnum, f.lastblock, st->nblocks);
+
+        for(block = f.firstblock; block <= f.lastblock && block < st->nblocks; block++)
+        {
+            if(st->owners[block].slot && shares_block(st, himd, tr, &f, block))
+                continue;
+            if(st->owners[block].slot)
+            {
+                add_problem(st, HIMD_FSCK_OVERLAP, slot, fragnum, block,
+                            _("Block %u is also in fragment %u of track %u"),
+                            block, st->owners[block].frag, st->owners[block].slot);
+                continue;
+            }
+            st->owners[block].slot = slot;
+            st->owners[block].frag = fragnum;
+            g_array_append_val(st->order, block);
+        }
+    }
+    tr->nblocks = st->order->len - tr->firstblock;
+}
+
+static void printable_type(char * out, const unsigned char * type)
+{
+    int i;
+
+    for(i = 0; i < 4; i++)
+        out[i] = g_ascii_isprint(type[i]) ? type[i] : '.';
+    out[4] = '\0';
+}
+
+static void check_block(struct fsck_state * st, unsigned int blockno, const unsigned char * data)
+{
+    const struct fsck_owner * o = &st->owners[blockno];
+    const struct fsck_track * tr = &st->tracks[o->slot];
+    unsigned int nframes = beword16(data + BLOCK_NFRAMES);
+    unsigned int lendata = beword16(data + BLOCK_LENDATA);
+    unsigned int serial = beword32(data + BLOCK_SERIAL);
+    unsigned int backup_serial = beword32(data + BLOCK_BACKUP_SERIAL);
+    unsigned int maxframes;
+    char type[5], backup_type[5];
+
+    if(memcmp(data + BLOCK_TYPE, data + BLOCK_BACKUP_TYPE, 4) != 0)
+    {
+        printable_type(type, data + BLOCK_TYPE);
+        printable_type(backup_type, data + BLOCK_BACKUP_TYPE);
+        add_problem(st, HIMD_FSCK_TYPE, o->slot, o->frag, blockno,
+                    _("Block %u has type \"%s\", backup type \"%s\""), blockno, type, backup_type);
+    }
+
+    if(lendata == 0 || lendata > HIMD_AUDIO_SIZE)
+        add_problem(st, HIMD_FSCK_FRAMES, o->slot, o->frag, blockno,
+                    _("Block %u has %u bytes of audio data"), blockno, lendata);
+    else
+    {
+        /* every MPEG frame takes at least a byte */
+        maxframes = tr->framesperblock == TRACK_IS_MPEG ? lendata : tr->framesperblock;
+        if(nframes == 0 || nframes > maxframes)
+            add_problem(st, HIMD_FSCK_FRAMES, o->slot, o->frag, blockno,
+                        _("Block %u has %u frames, at most %u fit"), blockno, nframes, maxframes);
+    }
+
+    if(serial != backup_serial)
+        add_problem(st, HIMD_FSCK_SERIAL, o->slot, o->frag, blockno,
+                    _("Block %u has serial number %u, backup serial number %u"), blockno, serial, backup_serial);
+
+    st->serials[blockno] = serial;
+    st->lo32s[blockno] = beword32(data + BLOCK_LO32_CONTENTID);
+    st->checked[blockno] = 1;
+}
+
+static void check_worker(gpointer data, gpointer user_data)
+{
+    struct fsck_run * run = data;
+    struct fsck_state * st = user_data;
+    unsigned int i;
+
+    HIMD_TRACE_BEGIN(check_scope, "fsck_check");
+    for(i = 0; i < run->count; i++)
+        check_block(st, run->first + i, run->data + i * HIMD_BLOCKINFO_SIZE);
+    HIMD_TRACE_END(check_scope);
+    g_async_queue_push(st->freeruns, run);
+}
+
+static void read_failed(struct fsck_state * st, unsigned int first, unsigned int count, const char * error)
+{
+    unsigned int block;
+
+    for(block = first; block < first + count; block++)
+        add_problem(st, HIMD_FSCK_READ, st->owners[block].slot, st->owners[block].frag, block,
+                    _("Can't read block %u: %s"), block, error);
+}
+
+/* Read all used blocks in ascending order, runs of adjacent blocks at once */
+static void read_blocks(struct fsck_state * st, FILE * atdata, GThreadPool * pool, struct himd_stats * stats)
+{
+    struct fsck_run * run;
+    unsigned int block = 0, first, count, got;
+    long pos = -1;
+
+    while(block < st->nblocks)
+    {
+        if(!st->owners[block].slot)
+        {
+            block++;
+            continue;
+        }
+        first = block;
+        while(block < st->nblocks && st->owners[block].slot && block - first < RUN_BLOCKS)
+            block++;
+        count = block - first;
+
+        run = g_async_queue_pop(st->freeruns);
+        HIMD_TRACE_BEGIN(read_scope, "fsck_read");
+        if(pos != (long)first)
+        {
+            stats->seeks++;
+            if(fseek(atdata, first * (long)HIMD_BLOCKINFO_SIZE, SEEK_SET) < 0)
+            {
+                read_failed(st, first, count, g_strerror(errno));
+                g_async_queue_push(st->freeruns, run);
+                pos = -1;
+                continue;
+            }
+        }
+        got = fread(run->data, HIMD_BLOCKINFO_SIZE, count, atdata);
+        HIMD_TRACE_END(read_scope);
+        stats->blocks_read += got;
+        stats->bytes_read += got * (unsigned long long)HIMD_BLOCKINFO_SIZE;
+        if(got < count)
+        {
+            read_failed(st, first + got, count - got,
+                        feof(atdata) ? _("Unexpected EOF") : g_strerror(errno));
+            clearerr(atdata);
+            pos = -1;
+        }
+        else
+            pos = block;
+
+        run->first = first;
+        run->count = got;
+        if(pool)
+            g_thread_pool_push(pool, run, NULL);
+        else
+            check_worker(run, st);
+    }
+}
+
+/* Blocks carry the content ID of their recording and serial numbers
+   counting up by one. The track starts with its own recording, joined
+   tracks continue with another one at a fragment boundary. A fragment
+   may also skip ahead in its recording where a part has been cut out. */
+static void check_sequences(struct fsck_state * st)
+{
+    const struct fsck_track * tr;
+    unsigned int i, j, prev, cur, expected;
+    int boundary;
+
+    for(i = 0; i < st->slots->len; i++)
+    {
+        tr = &st->tracks[g_array_index(st->slots, guint16, i)];
+        expected = tr->lo32_contentid;
+        for(j = 0; j < tr->nblocks; j++)
+        {
+            cur = g_array_index(st->order, unsigned int, tr->firstblock + j);
+            if(!st->checked[cur])
+                continue;
+            prev = j ? g_array_index(st->order, unsigned int, tr->firstblock + j - 1) : 0;
+            boundary = j && st->owners[cur].frag != st->owners[prev].frag;
+            if(boundary && st->lo32s[cur] != expected)
+            {
+                expected = st->lo32s[cur];
+                continue;
+            }
+            if(st->lo32s[cur] != expected)
+                add_problem(st, HIMD_FSCK_CONTENTID, st->owners[cur].slot, st->owners[cur].frag, cur,
+                            _("Block %u has content ID %08x, its recording ends in %08x"),
+                            cur, st->lo32s[cur], expected);
+            else if(j && st->checked[prev] && (boundary ? st->serials[cur] <= st->serials[prev]
+                                                         : st->serials[cur] != st->serials[prev] + 1))
+                add_problem(st, HIMD_FSCK_SERIAL, st->owners[cur].slot, st->owners[cur].frag, cur,
+                            _("Block %u has serial number %u, the block before it (%u) has %u"),
+                            cur, st->serials[cur], prev, st->serials[prev]);
+        }
+    }
+}
+
+static int compare_problems(const void * a, const void * b)
+{
+    const struct himd_fsck_problem * pa = a, * pb = b;
+
+    if(pa->track != pb->track)
+        return pa->track < pb->track ? -1 : 1;
+    if(pa->block != pb->block)
+        return pa->block < pb->block ? -1 : 1;
+    return (int)pa->check - (int)pb->check;
+}
+
+/**
+ * Check the audio blocks of all tracks against the TIF.
+ *
+ * @param himd Pointer to the himd
+ * @param threads Number of threads checking blocks, 0 for one per processor
+ * @param report Filled with what has been checked and the problems found,
+ *               free with himd_fsck_free
+ * @param status Pointer to himderrinfo, returns error code after operation
+ *
+ * @return Returns 0 if the check has been done, -1 otherwise
+ */
+int himd_fsck(struct himd * himd, unsigned int threads, struct himd_fsck_report * report, struct himderrinfo * status)
+{
+    struct fsck_state st;
+    struct himd_stats stats;
+    struct himderrinfo trackstatus;
+    struct trackinfo t;
+    struct fsck_run * runs;
+    GThreadPool * pool = NULL;
+    FILE * atdata;
+    long size;
+    unsigned int i, count, nruns;
+    guint16 slot;
+
+    g_return_val_if_fail(himd != NULL, -1);
+    g_return_val_if_fail(report != NULL, -1);
+
+    memset(report, 0, sizeof *report);
+    atdata = himd_open_file(himd, "ATDATA", HIMD_READ_ONLY);
+    if(!atdata)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_OPEN_AUDIO,
+                          _("Can't open audio data: %s"), g_strerror(errno));
+        return -1;
+    }
+    if(fseek(atdata, 0, SEEK_END) < 0 || (size = ftell(atdata)) < 0)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_SEEK_AUDIO,
+                          _("Can't determine size of audio data: %s"), g_strerror(errno));
+        fclose(atdata);
+        return -1;
+    }
+
+    if(threads == 0)
+        threads = g_get_num_processors();
+
+    memset(&st, 0, sizeof st);
+    memset(&stats, 0, sizeof stats);
+    g_mutex_init(&st.lock);
+    st.problems = g_array_new(FALSE, FALSE, sizeof(struct himd_fsck_problem));
+    st.nblocks = size / HIMD_BLOCKINFO_SIZE;
+    st.owners = g_new0(struct fsck_owner, st.nblocks);
+    st.tracks = g_new0(struct fsck_track, HIMD_LAST_TRACK + 1);
+    st.slots = g_array_new(FALSE, FALSE, sizeof(guint16));
+    st.order = g_array_new(FALSE, FALSE, sizeof(unsigned int));
+    st.fragowners = g_new0(guint16, HIMD_LAST_FRAGMENT + 1);
+    st.serials = g_new0(unsigned int, st.nblocks);
+    st.lo32s = g_new0(unsigned int, st.nblocks);
+    st.checked = g_new0(unsigned char, st.nblocks);
+
+    /* the index is small, it is walked before any block is read */
+    HIMD_TRACE_BEGIN(index_scope, "fsck_index");
+    count = himd_track_count(himd);
+    for(i = 0; i < count; i++)
+    {
+        slot = himd_get_trackslot(himd, i, NULL);
+        if(slot < HIMD_FIRST_TRACK || slot > HIMD_LAST_TRACK)
+            add_problem(&st, HIMD_FSCK_RANGE, 0, 0, -1,
+                        _("Entry %u of the play order refers to invalid track %u"), i, slot);
+        else if(st.tracks[slot].walked)
+            add_problem(&st, HIMD_FSCK_OVERLAP, slot, 0, -1,
+                        _("Track %u is in the play order more than once"), slot);
+        else if(himd_get_track_info(himd, slot, &t, &trackstatus) < 0)
+            add_problem(&st, HIMD_FSCK_CHAIN, slot, 0, -1, "%s", trackstatus.statusmsg);
+        else
+        {
+            walk_track(&st, himd, slot, &t);
+            g_array_append_val(st.slots, slot);
+        }
+    }
+    HIMD_TRACE_END(index_scope);
+
+    /* two runs per thread keep the workers busy while the next run is read */
+    nruns = threads > 1 ? 2*threads : 1;
+    runs = g_new0(struct fsck_run, nruns);
+    st.freeruns = g_async_queue_new();
+    for(i = 0; i < nruns; i++)
+    {
+        runs[i].data = g_malloc(RUN_BLOCKS * HIMD_BLOCKINFO_SIZE);
+        g_async_queue_push(st.freeruns, &runs[i]);
+    }
+    if(threads > 1)
+        pool = g_thread_pool_new(check_worker, &st, threads, FALSE, NULL);
+
+    read_blocks(&st, atdata, pool, &stats);
+    if(pool)
+        g_thread_pool_free(pool, FALSE, TRUE);
+    fclose(atdata);
+    check_sequences(&st);
+    himd_add_stats(himd, &stats);
+
+    report->tracks = st.slots->len;
+    report->fragments = st.fragments;
+    for(i = 0; i < st.nblocks; i++)
+        report->blocks += st.checked[i];
+    qsort(st.problems->data, st.problems->len, sizeof(struct himd_fsck_problem), compare_problems);
+    report->nproblems = st.problems->len;
+    report->problems = (struct himd_fsck_problem *)g_array_free(st.problems, FALSE);
+
+    for(i = 0; i < nruns; i++)
+        g_free(runs[i].data);
+    g_free(runs);
+    g_async_queue_unref(st.freeruns);
+    g_free(st.checked);
+    g_free(st.serials);
+    g_free(st.lo32s);
+    g_free(st.fragowners);
+    g_array_free(st.order, TRUE);
+    g_array_free(st.slots, TRUE);
+    g_free(st.tracks);
+    g_free(st.owners);
+    g_mutex_clear(&st.lock);
+    return 0;
+}
+
+void himd_fsck_free(struct himd_fsck_report * report)
+{
+    g_free(report->problems);
+    report->problems = NULL;
+    report->nproblems = 0;
+}
+
+const char * himd_fsck_check_name(enum himd_fsck_check check)
+{
+    switch(check)
+    {
+        case HIMD_FSCK_CHAIN:     return "chain";
+        case HIMD_FSCK_OVERLAP:   return "overlap";
+        case HIMD_FSCK_RANGE:     return "range";
+        case HIMD_FSCK_READ:      return "read";
+        case HIMD_FSCK_TYPE:      return "type";
+        case HIMD_FSCK_FRAMES:    return "frames";
+        case HIMD_FSCK_SERIAL:    return "serial";
+        case HIMD_FSCK_CONTENTID: return "contentid";
+    }
+    return "unknown";
+}
@@ -0,0 +1,50 @@
+#ifndef INCLUDED_LIBHIMD_FSCK_H
+#define INCLUDED_LIBHIMD_FSCK_H
+
+#include "himd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum himd_fsck_check {
+    HIMD_FSCK_CHAIN,		/* fragment chain loops or ends in a bad fragment */
+    HIMD_FSCK_OVERLAP,		/* fragment or block used by more than one track */
+    HIMD_FSCK_RANGE,		/* fragment reversed or beyond the end of ATDATA */
+    HIMD_FSCK_READ,		/* block could not be read */
+    HIMD_FSCK_TYPE,		/* block type differs from backup_type */
+    HIMD_FSCK_FRAMES,		/* nframes or lendata out of bounds */
+    HIMD_FSCK_SERIAL,		/* serial number not counting up or differs from its backup */
+    HIMD_FSCK_CONTENTID		/* lo32_contentid differs from the recording's content ID */
+};
+
+struct himd_fsck_problem {
+    enum himd_fsck_check check;
+    unsigned int track;		/* slot of the track */
+    unsigned int fragment;	/* 0 if not about a fragment */
+    long block;			/* -1 if not about a block */
+    char message[128];
+};
+
+struct himd_fsck_report {
+    unsigned int tracks;
+    unsigned int fragments;
+    unsigned int blocks;	/* blocks referenced by fragments and read */
+    unsigned int nproblems;
+    struct himd_fsck_problem * problems;	/* sorted by track and block */
+};
+
+/* Checks every block referenced by a fragment of a track in the play order
+   against the TIF. ATDATA is read in ascending block order in large runs,
+   the blocks of a run are checked on a pool of threads. threads == 0 uses
+   one thread per processor. Returns -1 only if the check could not be done
+   at all, problems found go into the report. */
+int himd_fsck(struct himd * himd, unsigned int threads, struct himd_fsck_report * report, struct himderrinfo * status);
+void himd_fsck_free(struct himd_fsck_report * report);
+const char * himd_fsck_check_name(enum himd_fsck_check check);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
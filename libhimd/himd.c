@@ -10,6 +10,8 @@
 #include <glib/gprintf.h>
 #include <glib/gfileutils.h>
 #include "himd.h"
+#include "himd_private.h"
+#include "trace.h"
 
 #define _(x) (x)
 
@@ -116,23 +118,110 @@ static void nong_inplace_ascii_up(gchar * string)
     }
 }
 
-FILE * himd_open_file(struct himd * himd, const char * fileid, enum himd_rw_mode mode)
+/* path of one of the HMDHIFI files of the himd, to be g_free()d */
+char * himd_file_path(struct himd * himd, const char * fileid)
 {
     char filename[13];
-    FILE * file;
-    char * filepath;
 
     sprintf(filename,"%s%02X.HMA",fileid,himd->datanum);
     if(himd->need_lowercase)
         nong_inplace_ascii_down(filename);
     else
         nong_inplace_ascii_up(filename);
-    filepath = g_build_filename(himd->rootpath,himd->need_lowercase ? "hmdhifi" : "HMDHIFI",filename,NULL);
+    return g_build_filename(himd->rootpath,himd->need_lowercase ? "hmdhifi" : "HMDHIFI",filename,NULL);
+}
+
+static FILE * dir_open_file(struct himd * himd, const char * fileid, enum himd_rw_mode mode)
+{
+    FILE * file;
+    char * filepath;
+
+    filepath = himd_file_path(himd, fileid);
     file = fopen(filepath,mode == HIMD_READ_WRITE ? "rb+" : "rb");
     g_free(filepath);
     return file;
 }
 
+static const struct himd_backend dir_backend = { dir_open_file, NULL, 0 };
+
+FILE * himd_open_file(struct himd * himd, const char * fileid, enum himd_rw_mode mode)
+{
+    if(!himd->backend)
+        return dir_open_file(himd, fileid, mode);
+    return himd->backend->open_file(himd, fileid, mode);
+}
+
+
+static struct himd_tif * tif_new(unsigned char * data)
+{
+    struct himd_tif * tif = g_new(struct himd_tif, 1);
+    tif->refcount = 1;
+    tif->data = data;
+    return tif;
+}
+
+static void tif_unref(struct himd_tif * tif)
+{
+    if(tif && g_atomic_int_dec_and_test(&tif->refcount))
+    {
+        g_free(tif->data);
+        g_free(tif);
+    }
+}
+
+/* A thread taking a snapshot announces itself in himd->acquiring, so
+   publish_tif can't drop the old TIF between the snapshot loading the
+   pointer and taking its reference. */
+static struct himd_tif * acquire_tif(struct himd * himd)
+{
+    struct himd_tif * tif;
+
+    g_atomic_int_inc(&himd->acquiring);
+    tif = g_atomic_pointer_get(&himd->tif);
+    g_atomic_int_inc(&tif->refcount);
+    g_atomic_int_add(&himd->acquiring, -1);
+    return tif;
+}
+
+/* make the working copy the TIF new snapshots see */
+static void publish_tif(struct himd * himd)
+{
+    struct himd_tif * old = himd->tif;
+
+    g_atomic_pointer_set(&himd->tif, himd->working);
+    himd->working = NULL;
+    while(g_atomic_int_get(&himd->acquiring))
+        g_thread_yield();
+    tif_unref(old);
+}
+
+/**
+ * Called before changing the TIF. The changes go to a private copy, which
+ * himd_write_tifdata writes and publishes, so snapshots never see half of
+ * an update.
+ */
+int himd_prepare_write(struct himd * himd, struct himderrinfo * status)
+{
+    if(himd->parent)
+    {
+        set_status_const(status, HIMD_ERROR_READ_ONLY_SNAPSHOT,
+                         _("Can't change the TIF through a snapshot"));
+        return -1;
+    }
+    if(himd->backend && himd->backend->read_only)
+    {
+        set_status_const(status, HIMD_ERROR_READ_ONLY_IMAGE,
+                         _("Can't change the TIF of a disc image"));
+        return -1;
+    }
+    if(!himd->working)
+    {
+        himd->working = tif_new(g_malloc(HIMD_TIFFILE_SIZE));
+        memcpy(himd->working->data, himd->tif->data, HIMD_TIFFILE_SIZE);
+        himd->tifdata = himd->working->data;
+    }
+    return 0;
+}
 
 int himd_write_tifdata(struct himd * himd, struct himderrinfo * status)
 {
@@ -141,7 +230,19 @@ int himd_write_tifdata(struct himd * himd, struct himderrinfo * status)
     gchar *filepath;
     GDir * dir;
     GError * error = NULL;
-    status = status;
+
+    if(himd->parent)
+    {
+        set_status_const(status, HIMD_ERROR_READ_ONLY_SNAPSHOT,
+                         _("Can't write the TIF of a snapshot"));
+        return -1;
+    }
+    if(himd->backend && himd->backend->read_only)
+    {
+        set_status_const(status, HIMD_ERROR_READ_ONLY_IMAGE,
+                         _("Can't write the TIF of a disc image"));
+        return -1;
+    }
 
     filepath = g_build_filename(himd->rootpath,himd->need_lowercase ? "hmdhifi" : "HMDHIFI", NULL);
     dir      = g_dir_open(filepath,0,&error);
@@ -198,43 +299,47 @@ int himd_write_tifdata(struct himd * himd, struct himderrinfo * status)
     g_free(filepath);
     g_dir_close(dir);
 
+    if(himd->working)
+        publish_tif(himd);
     return 0;
 }
 
-static int himd_read_discid(struct himd * himd, struct himderrinfo * status)
+static unsigned char * himd_read_discid(struct himd * himd, struct himderrinfo * status)
 {
+    unsigned char * discid;
     FILE * mclistfile = himd_open_file(himd, "MCLIST", HIMD_READ_ONLY);
 
     if(!mclistfile)
     {
         set_status_printf(status, HIMD_ERROR_CANT_OPEN_MCLIST,
                           _("Can't open mclist file: %s\n"), g_strerror(errno));
-        return -1;
+        return NULL;
     }
 
+    discid = g_malloc(16);
     fseek(mclistfile,0x40L,SEEK_SET);
-    if(fread(himd->discid,16,1,mclistfile) != 1)
+    if(fread(discid,16,1,mclistfile) != 1)
     {
         set_status_printf(status, HIMD_ERROR_CANT_READ_MCLIST,
                           _("Can't read mclist file: %s\n"), g_strerror(errno));
         fclose(mclistfile);
-        return -1;
+        g_free(discid);
+        return NULL;
     }
     fclose(mclistfile);
-    himd->discid_valid = 1;
-    return 0;
+    return discid;
 }
 
-int himd_open(struct himd * himd, const char * himdroot, struct himderrinfo * status)
+/**
+ * Find the HMDHIFI directory and the data number of its files, without
+ * reading the TIF. Fills in everything but the TIF, so himd_open_file
+ * and himd_get_discid work. Used by himd_open and by the TIF recovery.
+ */
+int himd_locate(struct himd * himd, const char * himdroot, struct himderrinfo * status)
 {
     char * filepath;
-    char indexfilename[13];
-    gsize filelen;
     GDir * dir;
     GError * error = NULL;
-    
-    g_return_val_if_fail(himd != NULL, -1);
-    g_return_val_if_fail(himdroot != NULL, -1);
 
     himd->need_lowercase = 0;
     filepath = g_build_filename(himdroot,"HMDHIFI",NULL);
@@ -261,59 +366,285 @@ int himd_open(struct himd * himd, const char * himdroot, struct himderrinfo * st
         set_status_const(status, HIMD_ERROR_NO_TRACK_INDEX, _("No track index file found"));
         return -1;		/* ERROR: track index not found */
     }
-    
-    sprintf(indexfilename,
-            himd->need_lowercase ? "trkidx%02x.hma" : "TRKIDX%02X.HMA",
-            himd->datanum);
-    filepath = g_build_filename(himdroot,himd->need_lowercase ? "hmdhifi" : 
-                                "HMDHIFI",indexfilename,NULL);
-    if(!g_file_get_contents(filepath, (char**)&himd->tifdata, &filelen, &error))
+
+    himd_init_handle(himd, himdroot, &dir_backend, NULL);
+    return 0;
+}
+
+/* Everything but datanum and need_lowercase, which depend on the backend */
+void himd_init_handle(struct himd * himd, const char * rootpath,
+                      const struct himd_backend * backend, void * backend_data)
+{
+    himd->rootpath = g_strdup(rootpath);
+    himd->backend = backend;
+    himd->backend_data = backend_data;
+    himd->tifdata = NULL;
+    himd->tif = NULL;
+    himd->working = NULL;
+    himd->acquiring = 0;
+    himd->parent = NULL;
+    himd->discid = NULL;
+    himd->stats_enabled = 0;
+    memset(&himd->stats, 0, sizeof himd->stats);
+}
+
+/* Reads the TIF through the backend, so it works for images as well */
+static unsigned char * himd_load_tif(struct himd * himd, struct himderrinfo * status)
+{
+    unsigned char * data;
+    size_t filelen;
+    FILE * f;
+
+    if(!(f = himd_open_file(himd, "TRKIDX", HIMD_READ_ONLY)))
     {
         set_status_printf(status, HIMD_ERROR_CANT_READ_TIF,
-                          _("Can't load TIF data from %s: %s"),
-                          filepath, error->message);
-        g_free(filepath);
-        return -1;
+                          _("Can't load TIF data: %s"), g_strerror(errno));
+        return NULL;
     }
-    g_free(filepath);
-    
-    if(filelen != 0x50000)
+    /* one byte more to notice a TIF that is too long */
+    data = g_malloc(HIMD_TIFFILE_SIZE + 1);
+    filelen = fread(data, 1, HIMD_TIFFILE_SIZE + 1, f);
+    if(ferror(f))
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_READ_TIF,
+                          _("Can't load TIF data: %s"), g_strerror(errno));
+        fclose(f);
+        g_free(data);
+        return NULL;
+    }
+    fclose(f);
+
+    if(filelen != HIMD_TIFFILE_SIZE)
     {
         set_status_printf(status, HIMD_ERROR_WRONG_TIF_SIZE,
                           _("TIF file is 0x%x bytes instead of 0x50000"),
                           (int)filelen);
-        g_free(himd->tifdata);
-        return -1;
+        g_free(data);
+        return NULL;
     }
 
-    if(memcmp(himd->tifdata,"TIF ",4) != 0)
+    if(memcmp(data,"TIF ",4) != 0)
     {
         set_status_printf(status, HIMD_ERROR_WRONG_TIF_MAGIC,
                          _("TIF file starts with wrong magic: %02x %02x %02x %02x"),
-                         himd->tifdata[0],himd->tifdata[1],himd->tifdata[2],himd->tifdata[3]);
-        g_free(himd->tifdata);
+                         data[0],data[1],data[2],data[3]);
+        g_free(data);
+        return NULL;
+    }
+    return data;
+}
+
+/**
+ * Open a himd, himdroot is either the root of the disc, a disc image
+ * written by himd_image_pack or a raw image or device with a FAT file
+ * system. Images are read-only.
+ */
+int himd_open(struct himd * himd, const char * himdroot, struct himderrinfo * status)
+{
+    g_return_val_if_fail(himd != NULL, -1);
+    g_return_val_if_fail(himdroot != NULL, -1);
+
+    HIMD_TRACE_BEGIN(open_scope, "himd_open");
+    if(himd_image_detect(himdroot))
+    {
+        if(himd_image_attach(himd, himdroot, status) < 0)
+            return -1;
+    }
+    else if(g_file_test(himdroot, G_FILE_TEST_EXISTS) && !g_file_test(himdroot, G_FILE_TEST_IS_DIR))
+    {
+        if(himd_fat_attach(himd, himdroot, status) < 0)
+            return -1;
+    }
+    else if(himd_locate(himd, himdroot, status) < 0)
+        return -1;
+
+    HIMD_TRACE_BEGIN(tif_scope, "tif_load");
+    if(!(himd->tifdata = himd_load_tif(himd, status)))
+    {
+        if(himd->backend->close)
+            himd->backend->close(himd);
+        g_free(himd->rootpath);
         return -1;
     }
+    HIMD_TRACE_END(tif_scope);
 
-    himd->rootpath = g_strdup(himdroot);
-    himd->discid_valid = 0;
+    himd->tif = tif_new(himd->tifdata);
 
+    HIMD_TRACE_END(open_scope);
     return 0;
 }
 
+/* Threads may race to read the disc ID, the first one to finish wins */
 const unsigned char * himd_get_discid(struct himd * himd, struct himderrinfo * status)
 {
-    if(!himd->discid_valid && himd_read_discid(himd, status) < 0)
-        return 0;
-    return himd->discid;
+    unsigned char * discid;
+
+    if(himd->parent)
+        himd = himd->parent;
+    discid = g_atomic_pointer_get(&himd->discid);
+    if(discid)
+        return discid;
+
+    if(!(discid = himd_read_discid(himd, status)))
+        return NULL;
+    if(!g_atomic_pointer_compare_and_exchange(&himd->discid, NULL, discid))
+    {
+        g_free(discid);
+        discid = g_atomic_pointer_get(&himd->discid);
+    }
+    return discid;
+}
+
+/**
+ * Open a read-only view of himd, which keeps the TIF as last written with
+ * himd_write_tifdata, however the himd changes later. Snapshots can be
+ * taken from any thread, each one is used by one thread at a time. Close
+ * them with himd_close before himd itself.
+ */
+void himd_open_snapshot(struct himd * snapshot, struct himd * himd)
+{
+    g_return_if_fail(snapshot != NULL);
+    g_return_if_fail(himd != NULL);
+
+    memset(snapshot, 0, sizeof *snapshot);
+    snapshot->parent = himd->parent ? himd->parent : himd;
+    snapshot->rootpath = g_strdup(himd->rootpath);
+    snapshot->backend = himd->backend;
+    snapshot->backend_data = himd->backend_data;
+    snapshot->tif = acquire_tif(himd);
+    snapshot->tifdata = snapshot->tif->data;
+    snapshot->datanum = himd->datanum;
+    snapshot->need_lowercase = himd->need_lowercase;
+    snapshot->stats_enabled = himd->stats_enabled;
+}
+
+/**
+ * Open a read-only view of the TIF generation before the current one,
+ * which himd_write_tifdata keeps in the _RKIDX file. It behaves like a
+ * snapshot of himd and is closed with himd_close.
+ */
+int himd_open_previous(struct himd * previous, struct himd * himd, struct himderrinfo * status)
+{
+    unsigned char * data;
+    FILE * f;
+
+    g_return_val_if_fail(previous != NULL, -1);
+    g_return_val_if_fail(himd != NULL, -1);
+
+    if(!(f = himd_open_file(himd, "_RKIDX", HIMD_READ_ONLY)))
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_READ_TIF,
+                          _("Can't open previous TIF: %s"), g_strerror(errno));
+        return -1;
+    }
+    data = g_malloc(HIMD_TIFFILE_SIZE);
+    if(fread(data, HIMD_TIFFILE_SIZE, 1, f) != 1)
+    {
+        set_status_const(status, HIMD_ERROR_WRONG_TIF_SIZE, _("Previous TIF is too short"));
+        fclose(f);
+        g_free(data);
+        return -1;
+    }
+    fclose(f);
+    if(memcmp(data, "TIF ", 4) != 0)
+    {
+        set_status_printf(status, HIMD_ERROR_WRONG_TIF_MAGIC,
+                         _("Previous TIF starts with wrong magic: %02x %02x %02x %02x"),
+                         data[0], data[1], data[2], data[3]);
+        g_free(data);
+        return -1;
+    }
+
+    memset(previous, 0, sizeof *previous);
+    previous->parent = himd->parent ? himd->parent : himd;
+    previous->rootpath = g_strdup(himd->rootpath);
+    previous->backend = himd->backend;
+    previous->backend_data = himd->backend_data;
+    previous->tif = tif_new(data);
+    previous->tifdata = data;
+    previous->datanum = himd->datanum;
+    previous->need_lowercase = himd->need_lowercase;
+    previous->stats_enabled = himd->stats_enabled;
+    return 0;
+}
+
+/**
+ * SHA-1 of the TIF as this handle sees it, including unwritten changes.
+ * Equal digests mean nothing about the tracks changed.
+ */
+void himd_get_tif_digest(struct himd * himd, unsigned char * digest)
+{
+    GChecksum * sum;
+    gsize len = HIMD_TIF_DIGEST_SIZE;
+
+    g_return_if_fail(himd != NULL);
+    g_return_if_fail(digest != NULL);
+
+    sum = g_checksum_new(G_CHECKSUM_SHA1);
+    g_checksum_update(sum, himd->tifdata, HIMD_TIFFILE_SIZE);
+    g_checksum_get_digest(sum, digest, &len);
+    g_checksum_free(sum);
 }
 
 void himd_close(struct himd * himd)
 {
-    g_free(himd->tifdata);
+    tif_unref(himd->tif);
+    tif_unref(himd->working);
+    if(!himd->parent)
+    {
+        g_free(himd->discid);
+        if(himd->backend && himd->backend->close)
+            himd->backend->close(himd);
+    }
     g_free(himd->rootpath);
 }
 
+/* streams of one himd may be closed from different threads */
+static GMutex stats_lock;
+
+/**
+ * Start or stop collecting performance counters. Counting is cheap, but
+ * timing decryption and adding up the counters of closed streams only
+ * happens while enabled.
+ */
+void himd_enable_stats(struct himd * himd, int enable)
+{
+    g_return_if_fail(himd != NULL);
+    himd->stats_enabled = enable;
+}
+
+/**
+ * Copy the counters of all streams closed while stats were enabled, plus
+ * the string conversions of the himd itself.
+ */
+void himd_get_stats(struct himd * himd, struct himd_stats * stats)
+{
+    g_return_if_fail(himd != NULL);
+    g_return_if_fail(stats != NULL);
+
+    g_mutex_lock(&stats_lock);
+    *stats = himd->stats;
+    g_mutex_unlock(&stats_lock);
+}
+
+void himd_add_stats(struct himd * himd, const struct himd_stats * stats)
+{
+    if(!himd->stats_enabled)
+        return;
+    if(himd->parent)
+        himd = himd->parent;
+    g_mutex_lock(&stats_lock);
+    himd->stats.blocks_read += stats->blocks_read;
+    himd->stats.bytes_read += stats->bytes_read;
+    himd->stats.seeks += stats->seeks;
+    himd->stats.fragment_hops += stats->fragment_hops;
+    himd->stats.decrypt_calls += stats->decrypt_calls;
+    himd->stats.decrypt_ns += stats->decrypt_ns;
+    himd->stats.key_schedules += stats->key_schedules;
+    himd->stats.string_conversions += stats->string_conversions;
+    g_mutex_unlock(&stats_lock);
+}
+
 void himd_free(void * data)
 {
     g_free(data);
@@ -66,7 +66,14 @@ enum himdstatus { HIMD_OK,
                   HIMD_ERROR_BAD_DATA_FORMAT,
                   HIMD_ERROR_UNSUPPORTED_ENCRYPTION,
                   HIMD_ERROR_ENCRYPTION_FAILURE,
-                  HIMD_ERROR_OUT_OF_MEMORY };
+                  HIMD_ERROR_OUT_OF_MEMORY,
+                  HIMD_ERROR_CANT_WRITE_OUTPUT,
+                  HIMD_ERROR_READ_ONLY_SNAPSHOT,
+                  HIMD_ERROR_READ_ONLY_IMAGE,
+                  HIMD_ERROR_BAD_IMAGE,
+                  HIMD_ERROR_OUT_OF_TRACKS,
+                  HIMD_ERROR_OUT_OF_FRAGMENTS,
+                  HIMD_ERROR_CANT_EDIT_TRACK };
 
 enum himd_rw_mode { HIMD_READ_ONLY, HIMD_READ_WRITE };
 
@@ -130,14 +137,41 @@ struct himdstring {
     unsigned int nextstring : 12;
 };
 
+/* Performance counters. Block streams count into their own copy, which
+   is added to the totals of their himd when they are closed. */
+struct himd_stats {
+    unsigned long long blocks_read;
+    unsigned long long bytes_read;
+    unsigned long long seeks;
+    unsigned long long fragment_hops;
+    unsigned long long decrypt_calls;
+    unsigned long long decrypt_ns;
+    unsigned long long key_schedules;	/* DES key setups, the rest are cache hits */
+    unsigned long long string_conversions;
+};
+
+struct himd_tif;
+
+/* A himd opened with himd_open may be changed by one writer thread. Other
+   threads use read-only snapshots from himd_open_snapshot, which keep the
+   TIF as it was last written by himd_write_tifdata. */
+struct himd_backend;
+
 struct himd {
     /* everything below this line is private, i.e. no API stability. */
     char * rootpath;
-    unsigned char * tifdata;
-    int discid_valid;
-    unsigned char discid[16];
+    const struct himd_backend * backend;	/* where the HMDHIFI files come from */
+    void * backend_data;
+    unsigned char * tifdata;	/* the TIF this handle reads and changes */
+    struct himd_tif * tif;	/* last written TIF, or the one of a snapshot */
+    struct himd_tif * working;	/* copy with unwritten changes, or NULL */
+    int acquiring;		/* snapshots being taken right now */
+    struct himd * parent;	/* the himd a snapshot was taken of */
+    unsigned char * discid;	/* NULL until read */
     int datanum;
     int need_lowercase;
+    int stats_enabled;
+    struct himd_stats stats;
 };
 
 struct himderrinfo {
@@ -147,6 +181,12 @@ struct himderrinfo {
 
 int himd_open(struct himd * himd, const char * himdroot, struct himderrinfo * status);
 void himd_close(struct himd * himd);
+void himd_open_snapshot(struct himd * snapshot, struct himd * himd);
+int himd_open_previous(struct himd * previous, struct himd * himd, struct himderrinfo * status);
+#define HIMD_TIF_DIGEST_SIZE 20
+void himd_get_tif_digest(struct himd * himd, unsigned char * digest);
+void himd_enable_stats(struct himd * himd, int enable);
+void himd_get_stats(struct himd * himd, struct himd_stats * stats);
 char* himd_get_string_raw(struct himd * himd, unsigned int idx, int*type, int* length, struct himderrinfo * status);
 char* himd_get_string_utf8(struct himd * himd, unsigned int idx, int*type, struct himderrinfo * status);
 int himd_add_string(struct himd * himd, char *string, int type, struct himderrinfo * status);
@@ -166,6 +206,32 @@ int himd_get_free_trackindex(struct himd * himd);
 int himd_add_track_info(struct himd * himd, struct trackinfo * track, struct himderrinfo * status);
 int himd_add_fragment_info(struct himd * himd, struct fraginfo * f, struct himderrinfo * status);
 
+/* trackedit.c: editing tracks by changing only the TIF, the audio stays
+   where it is. Times are rounded to audio frames. Every edit is checked
+   completely before anything changes and goes to the working copy of the
+   TIF, commit it with himd_write_tifdata. MP3 tracks can't be edited. */
+int himd_track_split(struct himd * himd, unsigned int slot, unsigned int ms, struct himderrinfo * status);
+int himd_track_trim(struct himd * himd, unsigned int slot, unsigned int head_ms, unsigned int tail_ms,
+                    struct himderrinfo * status);
+int himd_track_join(struct himd * himd, unsigned int slot, unsigned int nextslot, struct himderrinfo * status);
+/* These work on tracks of any codec */
+int himd_delete_tracks(struct himd * himd, const unsigned int * slots, unsigned int n, struct himderrinfo * status);
+int himd_reorder_tracks(struct himd * himd, const unsigned int * slots, unsigned int n, struct himderrinfo * status);
+
+/* UTF-8 metadata of a track, as written into tags of exported files */
+struct himd_tags {
+    char * title;
+    char * artist;
+    char * album;
+    int trackinalbum;
+    /* not from the TIF, left to the caller */
+    const char * comment;
+    const struct himd_loudness * loudness;
+};
+
+int himd_get_tags(struct himd * himd, const struct trackinfo * track, struct himd_tags * tags, struct himderrinfo * status);
+void himd_free_tags(struct himd_tags * tags);
+
 const char * himd_get_codec_name(const struct trackinfo * t);
 unsigned int himd_trackinfo_framesize(const struct trackinfo * track);
 unsigned int himd_trackinfo_framesperblock(const struct trackinfo * track);
@@ -184,12 +250,14 @@ struct himd_blockstream {
     unsigned int fragcount;
     unsigned int blockcount;
     unsigned int frames_per_block;
+    struct himd_stats stats;
 };
 
 #define TRACK_IS_MPEG 0
 
 int himd_blockstream_open(struct himd * himd, unsigned int firstfrag, unsigned int frames_per_block, struct himd_blockstream * stream, struct himderrinfo * status);
 void himd_blockstream_close(struct himd_blockstream * stream);
+int himd_blockstream_seek(struct himd_blockstream * stream, unsigned int blockidx, struct himderrinfo * status);
 int himd_blockstream_read(struct himd_blockstream * stream, unsigned char * block,
                             unsigned int * firstframe, unsigned int * lastframe,
                             unsigned char * fragkey, struct himderrinfo * status);
@@ -219,10 +287,13 @@ struct himd_mp3stream {
 int himd_mp3stream_open(struct himd * himd, unsigned int trackno, struct himd_mp3stream * stream, struct himderrinfo * status);
 int himd_mp3stream_read_frame(struct himd_mp3stream * stream, const unsigned char ** frameout, unsigned int * lenout, struct himderrinfo * status);
 int himd_mp3stream_read_block(struct himd_mp3stream * stream, const unsigned char ** frameout, unsigned int * lenout, unsigned int * framecount, struct himderrinfo * status);
+int himd_mp3stream_seek(struct himd_mp3stream * stream, unsigned int blockidx, struct himderrinfo * status);
 void himd_mp3stream_close(struct himd_mp3stream * stream);
 
 #define HIMD_MAX_PCMFRAME_SAMPLES (0x3FC0/4)
 
+struct himd_analysis;
+
 struct himd_nonmp3stream {
     struct himd_blockstream stream;
     void * cryptinfo;
@@ -230,12 +301,16 @@ struct himd_nonmp3stream {
     int framesize;
     const unsigned char * frameptr;
     unsigned int framesleft;
+    int lpcm;
+    struct himd_analysis * analysis;
 };
 
 int himd_nonmp3stream_open(struct himd * himd, unsigned int trackno, struct himd_nonmp3stream * stream, struct himderrinfo * status);
 int himd_nonmp3stream_read_frame(struct himd_nonmp3stream * stream, const unsigned char ** frameout, unsigned int * lenout, struct himderrinfo * status);
 int himd_nonmp3stream_read_block(struct himd_nonmp3stream * stream, const unsigned char ** frameout, unsigned int * lenout, unsigned int * framecount, struct himderrinfo * status);
+int himd_nonmp3stream_seek(struct himd_nonmp3stream * stream, unsigned int blockidx, struct himderrinfo * status);
 void himd_nonmp3stream_close(struct himd_nonmp3stream * stream);
+int himd_nonmp3stream_set_analysis(struct himd_nonmp3stream * stream, struct himd_analysis * an, struct himderrinfo * status);
 
 /* frag.c */
 struct himd_hole {
@@ -25,9 +25,89 @@ static inline void setbeword32(unsigned char * c, unsigned int val)
 
 void set_status_const(struct himderrinfo * status, enum himdstatus code, const char * msg);
 void set_status_printf(struct himderrinfo * status, enum himdstatus code, const char * format, ...);
+void himd_add_stats(struct himd * himd, const struct himd_stats * stats);
+
+/* himd.c: reference counted TIF contents, never changed once shared */
+struct himd_tif {
+    int refcount;
+    unsigned char * data;
+};
+
+/* himd.c: how the HMDHIFI files of a himd are opened. The directory on
+   the disc is the default, himdimg.c reads them from a disc image and
+   fatimage.c from a raw image of the file system. */
+struct himd_backend {
+    FILE * (*open_file)(struct himd * himd, const char * fileid, enum himd_rw_mode mode);
+    void (*close)(struct himd * himd);	/* frees backend_data, may be NULL */
+    int read_only;
+};
+
+int himd_prepare_write(struct himd * himd, struct himderrinfo * status);
+void himd_init_handle(struct himd * himd, const char * rootpath,
+                      const struct himd_backend * backend, void * backend_data);
+int himd_locate(struct himd * himd, const char * himdroot, struct himderrinfo * status);
+char * himd_file_path(struct himd * himd, const char * fileid);
+
+/* backend.c: a read-only FILE on top of a backend's stream, which starts
+   with this struct. free is called by fclose. */
+struct himd_backend_stream {
+    long long size;
+    long long pos;
+    /* reads up to size bytes at offset, returns the bytes read or -1 with errno set */
+    long (*pread)(struct himd_backend_stream * s, char * buf, size_t size, long long offset);
+    void (*free)(struct himd_backend_stream * s);
+};
+
+FILE * himd_backend_fopen(struct himd_backend_stream * s);
+
+/* himdimg.c */
+int himd_image_detect(const char * path);
+int himd_image_attach(struct himd * himd, const char * path, struct himderrinfo * status);
+
+/* fatimage.c */
+int himd_fat_attach(struct himd * himd, const char * path, struct himderrinfo * status);
 
 int descrypt_open(void ** dataptr, const unsigned char * trackkey, 
                   unsigned int ekbnum, struct himderrinfo * status);
 int descrypt_decrypt(void * dataptr, unsigned char * block, size_t cryptlen,
                      const unsigned char * fragkey, struct himderrinfo * status);
+int descrypt_encrypt(void * dataptr, unsigned char * block, size_t cryptlen,
+                     const unsigned char * fragkey, struct himderrinfo * status);
+unsigned int descrypt_key_schedules(void * dataptr);
 void descrypt_close(void * dataptr);
+
+/* trackindex.c */
+void settrack(struct trackinfo * t, unsigned char * trackbuffer);
+void setfrag(struct fraginfo * f, unsigned char * fragbuffer);
+
+/* mdstream.c */
+void setblock(struct blockinfo * b, unsigned char * blockbuffer);
+void mp3_unscramble(unsigned char * data, unsigned int len, const mp3key key);
+#ifdef CONFIG_WITH_MAD
+int himd_mp3stream_split_frames(struct himd_mp3stream * stream, unsigned int databytes,
+                                unsigned int firstframe, unsigned int lastframe, struct himderrinfo * status);
+#endif
+
+/* x86 SIMD kernels are selected at runtime, which needs the target
+   attribute and __builtin_cpu_supports (gcc 4.9 or newer, clang). */
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define HIMD_X86_SIMD 1
+#endif
+
+/* pcmswap.c */
+void pcm_swap16(unsigned char * out, const unsigned char * in, size_t len);
+
+/* wavsink.c */
+void make_wav_header(unsigned char * header, unsigned long datalen);
+int sink_check_tail(FILE * out, long offset, const unsigned char * expected, unsigned int len, struct himderrinfo * status);
+
+/* flacenc.c */
+#define FLAC_BLOCKSIZE 4096
+void flac_init_tables(void);
+size_t flac_max_frame_size(unsigned int samples);
+size_t flac_encode_frame(unsigned char * out, const short * pcm, unsigned int samples,
+                         unsigned int framenum, int * scratch);
+
+/* id3.c */
+unsigned char * id3v2_make_tag(const struct himd_tags * tags, unsigned int padding, size_t * len);
@@ -0,0 +1,897 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#ifdef CONFIG_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include "himd.h"
+#include "himd_private.h"
+#include "himdimg.h"
+#include "trace.h"
+
+#define _(x) (x)
+
+#define IMAGE_MAGIC "HiMDimg1"
+#define IMAGE_VERSION 1
+#define IMAGE_HEADER_SIZE 32
+#define IMAGE_FILE_RECORD_SIZE 32
+#define IMAGE_EXTENT_RECORD_SIZE 24
+#define IMAGE_MAX_FILES 8
+#define EXTENT_BLOCKS 64	/* the unit of random access, 1 MB */
+#define ZSTD_LEVEL 3
+
+enum image_compression { IMAGE_STORED, IMAGE_ZSTD };
+
+/* the files besides ATDATA an image holds */
+static const struct {
+    const char * id;
+    int required;
+} image_files[] = { { "TRKIDX", 1 }, { "_RKIDX", 0 }, { "MCLIST", 1 } };
+
+struct image_file {
+    char id[9];
+    guint64 offset;
+    unsigned int length;
+    unsigned int stored;	/* bytes in the image */
+    unsigned int compression;
+};
+
+struct image_extent {
+    unsigned int firstblock;
+    unsigned int nblocks;
+    guint64 offset;
+    unsigned int stored;
+    unsigned int compression;
+};
+
+/* backend_data of an opened image, shared with its snapshots */
+struct himd_image {
+    char * path;
+    unsigned int atdatablocks;
+    unsigned int nfiles;
+    unsigned int nextents;
+    struct image_file * files;
+    struct image_extent * extents;	/* ascending */
+};
+
+/* one file opened through the image backend */
+struct image_stream {
+    struct himd_backend_stream stream;
+    const struct himd_image * image;
+    FILE * f;			/* own handle on the image, ATDATA only */
+    unsigned char * data;	/* all of any other file */
+    unsigned char * extent;	/* the extent last read from ATDATA */
+    int cached;			/* its index, -1 if none */
+};
+
+static guint64 beword64(const unsigned char * c)
+{
+    return ((guint64)beword32(c) << 32) | beword32(c + 4);
+}
+
+static void setbeword64(unsigned char * c, guint64 val)
+{
+    setbeword32(c, val >> 32);
+    setbeword32(c + 4, val & 0xFFFFFFFF);
+}
+
+/**
+ * Read a file or extent from the image.
+ *
+ * @param out receives length bytes
+ * @return 0 on success, -1 with errno set on failure
+ */
+static int read_stored(FILE * f, guint64 offset, unsigned int stored, unsigned int compression,
+                       unsigned char * out, unsigned int length)
+{
+    if(fseek(f, (long)offset, SEEK_SET) < 0)
+        return -1;
+
+    if(compression == IMAGE_STORED)
+    {
+        if(stored == length && fread(out, length, 1, f) == 1)
+            return 0;
+        errno = EIO;
+        return -1;
+    }
+#ifdef CONFIG_WITH_ZSTD
+    if(compression == IMAGE_ZSTD)
+    {
+        unsigned char * packed = g_malloc(stored);
+        int ok;
+
+        ok = fread(packed, stored, 1, f) == 1 &&
+             ZSTD_decompress(out, length, packed, stored) == length;
+        g_free(packed);
+        if(ok)
+            return 0;
+        errno = EIO;
+        return -1;
+    }
+#endif
+    errno = ENOTSUP;
+    return -1;
+}
+
+/* Whether stored bytes at offset lie within an image of imagesize bytes */
+static int stored_fits(guint64 offset, unsigned int stored, guint64 imagesize)
+{
+    return stored <= imagesize && offset <= imagesize - stored;
+}
+
+/* Index of the last extent starting at or before block, -1 if none */
+static int find_extent(const struct himd_image * image, unsigned int block)
+{
+    int lo = 0, hi = (int)image->nextents - 1, mid, found = -1;
+
+    while(lo <= hi)
+    {
+        mid = (lo + hi) / 2;
+        if(image->extents[mid].firstblock <= block)
+        {
+            found = mid;
+            lo = mid + 1;
+        }
+        else
+            hi = mid - 1;
+    }
+    return found;
+}
+
+static int load_extent(struct image_stream * s, int idx)
+{
+    const struct image_extent * e = &s->image->extents[idx];
+
+    if(!s->extent)
+        s->extent = g_malloc(EXTENT_BLOCKS * HIMD_BLOCKINFO_SIZE);
+    s->cached = -1;
+    if(read_stored(s->f, e->offset, e->stored, e->compression,
+                   s->extent, e->nblocks * HIMD_BLOCKINFO_SIZE) < 0)
+        return -1;
+    s->cached = idx;
+    return 0;
+}
+
+static long stream_pread(struct himd_backend_stream * stream, char * buf, size_t size, long long pos)
+{
+    struct image_stream * s = (struct image_stream *)stream;
+    const struct himd_image * image = s->image;
+    const struct image_extent * e;
+    long long start, end, next;
+    size_t done = 0, n;
+    unsigned int block;
+    int idx;
+
+    if(s->data)
+    {
+        memcpy(buf, s->data + pos, size);
+        return size;
+    }
+    while(done < size)
+    {
+        n = size - done;
+        block = pos / HIMD_BLOCKINFO_SIZE;
+        idx = find_extent(image, block);
+        e = idx >= 0 ? &image->extents[idx] : NULL;
+        if(!e || block >= e->firstblock + e->nblocks)
+        {
+            /* a hole, zeros up to the next extent */
+            next = idx + 1 < (int)image->nextents ?
+                   (long long)image->extents[idx + 1].firstblock * HIMD_BLOCKINFO_SIZE : stream->size;
+            n = MIN(n, (size_t)(next - pos));
+            memset(buf + done, 0, n);
+        }
+        else
+        {
+            if(s->cached != idx && load_extent(s, idx) < 0)
+                return done ? (long)done : -1;
+            start = (long long)e->firstblock * HIMD_BLOCKINFO_SIZE;
+            end = start + (long long)e->nblocks * HIMD_BLOCKINFO_SIZE;
+            n = MIN(n, (size_t)(end - pos));
+            memcpy(buf + done, s->extent + (pos - start), n);
+        }
+        done += n;
+        pos += n;
+    }
+    return done;
+}
+
+static void stream_free(struct himd_backend_stream * stream)
+{
+    struct image_stream * s = (struct image_stream *)stream;
+
+    if(s->f)
+        fclose(s->f);
+    g_free(s->data);
+    g_free(s->extent);
+    g_free(s);
+}
+
+static FILE * image_open_file(struct himd * himd, const char * fileid, enum himd_rw_mode mode)
+{
+    const struct himd_image * image = himd->backend_data;
+    const struct image_file * file = NULL;
+    struct image_stream * s;
+    unsigned int i;
+    int saved_errno;
+    FILE * f;
+
+    if(mode == HIMD_READ_WRITE)
+    {
+        errno = EROFS;
+        return NULL;
+    }
+    if(strcmp(fileid, "ATDATA") != 0)
+    {
+        for(i = 0; i < image->nfiles; i++)
+            if(strcmp(image->files[i].id, fileid) == 0)
+                file = &image->files[i];
+        if(!file)
+        {
+            errno = ENOENT;
+            return NULL;
+        }
+    }
+
+    s = g_new0(struct image_stream, 1);
+    s->stream.pread = stream_pread;
+    s->stream.free = stream_free;
+    s->image = image;
+    s->cached = -1;
+    if(!(s->f = g_fopen(image->path, "rb")))
+    {
+        g_free(s);
+        return NULL;
+    }
+    if(file)
+    {
+        s->stream.size = file->length;
+        s->data = g_malloc(file->length + 1);
+        if(read_stored(s->f, file->offset, file->stored, file->compression,
+                       s->data, file->length) < 0)
+        {
+            saved_errno = errno;
+            stream_free(&s->stream);
+            errno = saved_errno;
+            return NULL;
+        }
+        fclose(s->f);
+        s->f = NULL;
+    }
+    else
+        s->stream.size = (long long)image->atdatablocks * HIMD_BLOCKINFO_SIZE;
+
+    if(!(f = himd_backend_fopen(&s->stream)))
+    {
+        saved_errno = errno;
+        stream_free(&s->stream);
+        errno = saved_errno;
+    }
+    return f;
+}
+
+static void image_free(struct himd_image * image)
+{
+    g_free(image->path);
+    g_free(image->files);
+    g_free(image->extents);
+    g_free(image);
+}
+
+static void image_close(struct himd * himd)
+{
+    image_free(himd->backend_data);
+    himd->backend_data = NULL;
+}
+
+static const struct himd_backend image_backend = { image_open_file, image_close, 1 };
+
+/* Whether path is a disc image rather than the root of a disc */
+int himd_image_detect(const char * path)
+{
+    char magic[8];
+    FILE * f;
+    int found;
+
+    if(!g_file_test(path, G_FILE_TEST_IS_REGULAR))
+        return 0;
+    if(!(f = g_fopen(path, "rb")))
+        return 0;
+    found = fread(magic, sizeof magic, 1, f) == 1 && memcmp(magic, IMAGE_MAGIC, 8) == 0;
+    fclose(f);
+    return found;
+}
+
+/**
+ * Read the tables of a disc image and let himd read its files through
+ * the image backend. Fills in everything but the TIF, like himd_locate.
+ */
+int himd_image_attach(struct himd * himd, const char * path, struct himderrinfo * status)
+{
+    unsigned char header[IMAGE_HEADER_SIZE];
+    unsigned char * table, * p;
+    struct himd_image * image;
+    unsigned int i, datanum, end = 0;
+    size_t tablesize;
+    guint64 imagesize;
+    long size;
+    FILE * f;
+
+    if(!(f = g_fopen(path, "rb")))
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_ACCESS_HMDHIFI,
+                          _("Can't open disc image %s: %s"), path, g_strerror(errno));
+        return -1;
+    }
+    if(fread(header, sizeof header, 1, f) != 1 || memcmp(header, IMAGE_MAGIC, 8) != 0)
+    {
+        set_status_printf(status, HIMD_ERROR_BAD_IMAGE, _("%s is not a disc image"), path);
+        fclose(f);
+        return -1;
+    }
+    if(beword32(header + 8) != IMAGE_VERSION)
+    {
+        set_status_printf(status, HIMD_ERROR_BAD_IMAGE,
+                          _("Disc image version %u is not supported"), beword32(header + 8));
+        fclose(f);
+        return -1;
+    }
+
+    image = g_new0(struct himd_image, 1);
+    datanum = beword32(header + 12);
+    image->atdatablocks = beword32(header + 16);
+    image->nfiles = beword32(header + 20);
+    image->nextents = beword32(header + 24);
+    if(datanum > 0xFF || image->nfiles > IMAGE_MAX_FILES || image->nextents > image->atdatablocks)
+    {
+        set_status_const(status, HIMD_ERROR_BAD_IMAGE, _("Disc image header is corrupt"));
+        image_free(image);
+        fclose(f);
+        return -1;
+    }
+
+    tablesize = image->nfiles * IMAGE_FILE_RECORD_SIZE + image->nextents * IMAGE_EXTENT_RECORD_SIZE;
+    table = g_malloc(tablesize + 1);
+    if(fread(table, 1, tablesize, f) != tablesize)
+    {
+        set_status_const(status, HIMD_ERROR_BAD_IMAGE, _("Disc image is truncated"));
+        g_free(table);
+        image_free(image);
+        fclose(f);
+        return -1;
+    }
+    if(fseek(f, 0, SEEK_END) < 0 || (size = ftell(f)) < 0)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_ACCESS_HMDHIFI,
+                          _("Can't read disc image %s: %s"), path, g_strerror(errno));
+        g_free(table);
+        image_free(image);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    imagesize = size;
+
+    p = table;
+    image->files = g_new0(struct image_file, image->nfiles);
+    for(i = 0; i < image->nfiles; i++, p += IMAGE_FILE_RECORD_SIZE)
+    {
+        memcpy(image->files[i].id, p, 8);
+        image->files[i].offset = beword64(p + 8);
+        image->files[i].length = beword32(p + 16);
+        image->files[i].stored = beword32(p + 20);
+        image->files[i].compression = beword32(p + 24);
+        if(image->files[i].length > HIMD_TIFFILE_SIZE ||
+           !stored_fits(image->files[i].offset, image->files[i].stored, imagesize))
+        {
+            set_status_printf(status, HIMD_ERROR_BAD_IMAGE,
+                              _("Disc image file record %u is corrupt"), i);
+            g_free(table);
+            image_free(image);
+            return -1;
+        }
+    }
+    image->extents = g_new0(struct image_extent, image->nextents);
+    for(i = 0; i < image->nextents; i++, p += IMAGE_EXTENT_RECORD_SIZE)
+    {
+        struct image_extent * e = &image->extents[i];
+
+        e->firstblock = beword32(p);
+        e->nblocks = beword32(p + 4);
+        e->offset = beword64(p + 8);
+        e->stored = beword32(p + 16);
+        e->compression = beword32(p + 20);
+        if(e->firstblock < end || e->firstblock > image->atdatablocks ||
+           e->nblocks == 0 || e->nblocks > EXTENT_BLOCKS ||
+           e->nblocks > image->atdatablocks - e->firstblock ||
+           !stored_fits(e->offset, e->stored, imagesize))
+        {
+            set_status_printf(status, HIMD_ERROR_BAD_IMAGE,
+                              _("Disc image extent %u is corrupt"), i);
+            g_free(table);
+            image_free(image);
+            return -1;
+        }
+        end = e->firstblock + e->nblocks;
+    }
+    g_free(table);
+
+    image->path = g_strdup(path);
+    himd_init_handle(himd, path, &image_backend, image);
+    himd->datanum = datanum;
+    himd->need_lowercase = 0;
+    return 0;
+}
+
+/* Reads a file to its end, NULL with errno set on errors */
+static unsigned char * read_all(FILE * f, unsigned int * len)
+{
+    GByteArray * data = g_byte_array_new();
+    unsigned char chunk[16384];
+    size_t n;
+
+    while((n = fread(chunk, 1, sizeof chunk, f)) > 0)
+        g_byte_array_append(data, chunk, n);
+    if(ferror(f))
+    {
+        g_byte_array_free(data, TRUE);
+        return NULL;
+    }
+    *len = data->len;
+    return g_byte_array_free(data, FALSE);
+}
+
+static FILE * open_atdata(struct himd * himd, unsigned int * nblocks, struct himderrinfo * status)
+{
+    FILE * atdata;
+    long size;
+
+    if(!(atdata = himd_open_file(himd, "ATDATA", HIMD_READ_ONLY)))
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_OPEN_AUDIO,
+                          _("Can't open audio data: %s"), g_strerror(errno));
+        return NULL;
+    }
+    if(fseek(atdata, 0, SEEK_END) < 0 || (size = ftell(atdata)) < 0)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_SEEK_AUDIO,
+                          _("Can't determine size of audio data: %s"), g_strerror(errno));
+        fclose(atdata);
+        return NULL;
+    }
+    *nblocks = size / HIMD_BLOCKINFO_SIZE;
+    return atdata;
+}
+
+/**
+ * Mark the blocks referenced by the fragments of the tracks in the play
+ * order. Fragments beyond the end of ATDATA are cut off, a broken chain
+ * is an error as the image would silently miss audio.
+ *
+ * @return an array of nblocks flags, NULL on errors
+ */
+static unsigned char * used_blocks(struct himd * himd, unsigned int nblocks, struct himderrinfo * status)
+{
+    unsigned char * used, * seen;
+    unsigned int i, count, slot, fragnum, block;
+    struct trackinfo t;
+    struct fraginfo f;
+
+    used = g_new0(unsigned char, nblocks + 1);
+    seen = g_new0(unsigned char, HIMD_LAST_FRAGMENT + 1);
+    count = himd_track_count(himd);
+    for(i = 0; i < count; i++)
+    {
+        slot = himd_get_trackslot(himd, i, status);
+        if(himd_get_track_info(himd, slot, &t, status) < 0)
+            goto fail;
+        for(fragnum = t.firstfrag; fragnum != 0; fragnum = f.nextfrag)
+        {
+            if(fragnum > HIMD_LAST_FRAGMENT || seen[fragnum])
+            {
+                set_status_printf(status, HIMD_ERROR_FRAGMENT_CHAIN_BROKEN,
+                                  _("Fragment chain of track %u is broken at fragment %u"),
+                                  slot, fragnum);
+                goto fail;
+            }
+            seen[fragnum] = 1;
+            if(himd_get_fragment_info(himd, fragnum, &f, status) < 0)
+                goto fail;
+            for(block = f.firstblock; block <= f.lastblock && block < nblocks; block++)
+                used[block] = 1;
+        }
+    }
+    g_free(seen);
+    return used;
+
+fail:
+    g_free(seen);
+    g_free(used);
+    return NULL;
+}
+
+struct image_writer {
+    FILE * out;
+    guint64 offset;		/* where the next data goes */
+#ifdef CONFIG_WITH_ZSTD
+    ZSTD_CCtx * cctx;		/* NULL if not compressing */
+    unsigned char * packed;
+    size_t packedsize;
+#endif
+};
+
+/* Appends len bytes, compressed if that makes them smaller */
+static int store_data(struct image_writer * w, const unsigned char * data, unsigned int len,
+                      guint64 * offset, unsigned int * stored, unsigned int * compression)
+{
+    *offset = w->offset;
+    *stored = len;
+    *compression = IMAGE_STORED;
+#ifdef CONFIG_WITH_ZSTD
+    if(w->cctx)
+    {
+        size_t n, bound = ZSTD_compressBound(len);
+
+        if(bound > w->packedsize)
+        {
+            g_free(w->packed);
+            w->packed = g_malloc(bound);
+            w->packedsize = bound;
+        }
+        n = ZSTD_compressCCtx(w->cctx, w->packed, w->packedsize, data, len, ZSTD_LEVEL);
+        if(!ZSTD_isError(n) && n < len)
+        {
+            data = w->packed;
+            *stored = n;
+            *compression = IMAGE_ZSTD;
+        }
+    }
+#endif
+    if(*stored && fwrite(data, *stored, 1, w->out) != 1)
+        return -1;
+    w->offset += *stored;
+    return 0;
+}
+
+/**
+ * Write a disc image of himd, see himdimg.h for the format. The TIF is
+ * taken from the TRKIDX file, unwritten changes are not in the image.
+ *
+ * @param filename image to create, replaced if it exists
+ * @param compress zstd compress the files and extents
+ * @param stats receives sizes and the time taken
+ * @return 0 on success, -1 on failure
+ */
+int himd_image_pack(struct himd * himd, const char * filename, int compress,
+                    struct himd_image_stats * stats, struct himderrinfo * status)
+{
+    const unsigned int nfiles_max = G_N_ELEMENTS(image_files);
+    unsigned char * filedata[G_N_ELEMENTS(image_files)];
+    struct image_file files[G_N_ELEMENTS(image_files)];
+    unsigned char header[IMAGE_HEADER_SIZE];
+    unsigned char * used = NULL, * buf = NULL, * table = NULL, * p;
+    struct image_writer w;
+    struct image_extent * e;
+    GArray * extents = NULL;
+    FILE * atdata, * in;
+    unsigned int nblocks, block, i, nfiles = 0;
+    size_t tablesize;
+    gint64 start = g_get_monotonic_time();
+    int ret = -1;
+
+    g_return_val_if_fail(himd != NULL, -1);
+    g_return_val_if_fail(filename != NULL, -1);
+    g_return_val_if_fail(stats != NULL, -1);
+
+#ifndef CONFIG_WITH_ZSTD
+    if(compress)
+    {
+        set_status_const(status, HIMD_ERROR_DISABLED_FEATURE,
+                         _("Compressed images need libhimd built with zstd"));
+        return -1;
+    }
+#endif
+
+    memset(stats, 0, sizeof *stats);
+    memset(&w, 0, sizeof w);
+    memset(filedata, 0, sizeof filedata);
+    HIMD_TRACE_BEGIN(pack_scope, "image_pack");
+    if(!(atdata = open_atdata(himd, &nblocks, status)))
+        return -1;
+    if(!(used = used_blocks(himd, nblocks, status)))
+        goto out;
+
+    extents = g_array_new(FALSE, FALSE, sizeof(struct image_extent));
+    for(block = 0; block < nblocks; block++)
+    {
+        if(!used[block])
+            continue;
+        e = extents->len ? &g_array_index(extents, struct image_extent, extents->len - 1) : NULL;
+        if(e && e->firstblock + e->nblocks == block && e->nblocks < EXTENT_BLOCKS)
+            e->nblocks++;
+        else
+        {
+            struct image_extent n = { block, 1, 0, 0, 0 };
+            g_array_append_val(extents, n);
+        }
+    }
+
+    for(i = 0; i < nfiles_max; i++)
+    {
+        if(!(in = himd_open_file(himd, image_files[i].id, HIMD_READ_ONLY)))
+        {
+            if(!image_files[i].required && errno == ENOENT)
+                continue;
+            set_status_printf(status, HIMD_ERROR_CANT_READ_TIF,
+                              _("Can't open %s: %s"), image_files[i].id, g_strerror(errno));
+            goto out;
+        }
+        memset(&files[nfiles], 0, sizeof files[nfiles]);
+        strcpy(files[nfiles].id, image_files[i].id);
+        filedata[nfiles] = read_all(in, &files[nfiles].length);
+        fclose(in);
+        if(!filedata[nfiles])
+        {
+            set_status_printf(status, HIMD_ERROR_CANT_READ_TIF,
+                              _("Can't read %s: %s"), image_files[i].id, g_strerror(errno));
+            goto out;
+        }
+        nfiles++;
+    }
+
+    if(!(w.out = g_fopen(filename, "wb")))
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                          _("Can't create %s: %s"), filename, g_strerror(errno));
+        goto out;
+    }
+#ifdef CONFIG_WITH_ZSTD
+    if(compress)
+        w.cctx = ZSTD_createCCtx();
+#endif
+
+    /* the data goes behind the tables, which are written last */
+    tablesize = nfiles * IMAGE_FILE_RECORD_SIZE + extents->len * IMAGE_EXTENT_RECORD_SIZE;
+    w.offset = IMAGE_HEADER_SIZE + tablesize;
+    if(fseek(w.out, (long)w.offset, SEEK_SET) < 0)
+        goto write_error;
+
+    for(i = 0; i < nfiles; i++)
+    {
+        if(store_data(&w, filedata[i], files[i].length,
+                      &files[i].offset, &files[i].stored, &files[i].compression) < 0)
+            goto write_error;
+        stats->data_bytes += files[i].length;
+    }
+
+    buf = g_malloc(EXTENT_BLOCKS * HIMD_BLOCKINFO_SIZE);
+    for(i = 0; i < extents->len; i++)
+    {
+        e = &g_array_index(extents, struct image_extent, i);
+        if(fseek(atdata, (long)e->firstblock * HIMD_BLOCKINFO_SIZE, SEEK_SET) < 0 ||
+           fread(buf, e->nblocks * HIMD_BLOCKINFO_SIZE, 1, atdata) != 1)
+        {
+            set_status_printf(status, HIMD_ERROR_CANT_READ_AUDIO,
+                              _("Can't read blocks %u to %u: %s"), e->firstblock,
+                              e->firstblock + e->nblocks - 1, g_strerror(errno));
+            goto out;
+        }
+        if(store_data(&w, buf, e->nblocks * HIMD_BLOCKINFO_SIZE,
+                      &e->offset, &e->stored, &e->compression) < 0)
+            goto write_error;
+        stats->data_bytes += e->nblocks * HIMD_BLOCKINFO_SIZE;
+    }
+
+    memset(header, 0, sizeof header);
+    memcpy(header, IMAGE_MAGIC, 8);
+    setbeword32(header + 8, IMAGE_VERSION);
+    setbeword32(header + 12, himd->datanum);
+    setbeword32(header + 16, nblocks);
+    setbeword32(header + 20, nfiles);
+    setbeword32(header + 24, extents->len);
+
+    table = g_malloc0(tablesize + 1);
+    p = table;
+    for(i = 0; i < nfiles; i++, p += IMAGE_FILE_RECORD_SIZE)
+    {
+        memcpy(p, files[i].id, strlen(files[i].id));
+        setbeword64(p + 8, files[i].offset);
+        setbeword32(p + 16, files[i].length);
+        setbeword32(p + 20, files[i].stored);
+        setbeword32(p + 24, files[i].compression);
+    }
+    for(i = 0; i < extents->len; i++, p += IMAGE_EXTENT_RECORD_SIZE)
+    {
+        e = &g_array_index(extents, struct image_extent, i);
+        setbeword32(p, e->firstblock);
+        setbeword32(p + 4, e->nblocks);
+        setbeword64(p + 8, e->offset);
+        setbeword32(p + 16, e->stored);
+        setbeword32(p + 20, e->compression);
+    }
+    if(fseek(w.out, 0, SEEK_SET) < 0 ||
+       fwrite(header, sizeof header, 1, w.out) != 1 ||
+       (tablesize && fwrite(table, tablesize, 1, w.out) != 1))
+        goto write_error;
+    if(fclose(w.out) != 0)
+    {
+        w.out = NULL;
+        goto write_error;
+    }
+    w.out = NULL;
+
+    stats->atdata_bytes = (unsigned long long)nblocks * HIMD_BLOCKINFO_SIZE;
+    stats->image_bytes = w.offset;
+    stats->extents = extents->len;
+    stats->usecs = g_get_monotonic_time() - start;
+    HIMD_TRACE_END(pack_scope);
+    ret = 0;
+    goto out;
+
+write_error:
+    set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                      _("Can't write %s: %s"), filename, g_strerror(errno));
+out:
+    if(w.out)
+    {
+        fclose(w.out);
+        g_unlink(filename);
+    }
+#ifdef CONFIG_WITH_ZSTD
+    if(w.cctx)
+        ZSTD_freeCCtx(w.cctx);
+    g_free(w.packed);
+#endif
+    for(i = 0; i < nfiles; i++)
+        g_free(filedata[i]);
+    if(extents)
+        g_array_free(extents, TRUE);
+    g_free(table);
+    g_free(buf);
+    g_free(used);
+    fclose(atdata);
+    return ret;
+}
+
+/**
+ * Copy himd to an HMDHIFI directory below dir, which can be opened with
+ * himd_open. The source is usually an image, but any himd works and gives
+ * a copy without the blocks of deleted tracks.
+ *
+ * @param stats receives sizes and the time taken, image_bytes is 0
+ * @return 0 on success, -1 on failure
+ */
+int himd_image_unpack(struct himd * himd, const char * dir,
+                      struct himd_image_stats * stats, struct himderrinfo * status)
+{
+    unsigned char * used = NULL, * buf = NULL, * data;
+    char * hmdhifi, * path = NULL;
+    char filename[13];
+    unsigned int nblocks, block, run, i, len;
+    FILE * atdata, * in, * out = NULL;
+    GError * error = NULL;
+    gint64 start = g_get_monotonic_time();
+    int ret = -1;
+
+    g_return_val_if_fail(himd != NULL, -1);
+    g_return_val_if_fail(dir != NULL, -1);
+    g_return_val_if_fail(stats != NULL, -1);
+
+    memset(stats, 0, sizeof *stats);
+    hmdhifi = g_build_filename(dir, "HMDHIFI", NULL);
+    if(g_mkdir_with_parents(hmdhifi, 0777) < 0)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                          _("Can't create %s: %s"), hmdhifi, g_strerror(errno));
+        g_free(hmdhifi);
+        return -1;
+    }
+    HIMD_TRACE_BEGIN(unpack_scope, "image_unpack");
+    if(!(atdata = open_atdata(himd, &nblocks, status)))
+    {
+        g_free(hmdhifi);
+        return -1;
+    }
+
+    for(i = 0; i < G_N_ELEMENTS(image_files); i++)
+    {
+        if(!(in = himd_open_file(himd, image_files[i].id, HIMD_READ_ONLY)))
+        {
+            if(!image_files[i].required && errno == ENOENT)
+                continue;
+            set_status_printf(status, HIMD_ERROR_CANT_READ_TIF,
+                              _("Can't open %s: %s"), image_files[i].id, g_strerror(errno));
+            goto out;
+        }
+        data = read_all(in, &len);
+        fclose(in);
+        if(!data)
+        {
+            set_status_printf(status, HIMD_ERROR_CANT_READ_TIF,
+                              _("Can't read %s: %s"), image_files[i].id, g_strerror(errno));
+            goto out;
+        }
+        sprintf(filename, "%s%02X.HMA", image_files[i].id, himd->datanum);
+        g_free(path);
+        path = g_build_filename(hmdhifi, filename, NULL);
+        if(!g_file_set_contents(path, (const char *)data, len, &error))
+        {
+            set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                              _("Can't write %s: %s"), path, error->message);
+            g_error_free(error);
+            g_free(data);
+            goto out;
+        }
+        g_free(data);
+        stats->data_bytes += len;
+    }
+
+    if(!(used = used_blocks(himd, nblocks, status)))
+        goto out;
+    sprintf(filename, "ATDATA%02X.HMA", himd->datanum);
+    g_free(path);
+    path = g_build_filename(hmdhifi, filename, NULL);
+    if(!(out = g_fopen(path, "wb")))
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                          _("Can't create %s: %s"), path, g_strerror(errno));
+        goto out;
+    }
+
+    /* only the used runs are written, seeking over the rest leaves holes */
+    buf = g_malloc(EXTENT_BLOCKS * HIMD_BLOCKINFO_SIZE);
+    for(block = 0; block < nblocks; block += run)
+    {
+        for(run = 0; block + run < nblocks && run < EXTENT_BLOCKS &&
+                     used[block + run] == used[block]; run++)
+            ;
+        if(!used[block])
+            continue;
+        if(fseek(atdata, (long)block * HIMD_BLOCKINFO_SIZE, SEEK_SET) < 0 ||
+           fread(buf, run * HIMD_BLOCKINFO_SIZE, 1, atdata) != 1)
+        {
+            set_status_printf(status, HIMD_ERROR_CANT_READ_AUDIO,
+                              _("Can't read blocks %u to %u: %s"),
+                              block, block + run - 1, g_strerror(errno));
+            goto out;
+        }
+        if(fseek(out, (long)block * HIMD_BLOCKINFO_SIZE, SEEK_SET) < 0 ||
+           fwrite(buf, run * HIMD_BLOCKINFO_SIZE, 1, out) != 1)
+            goto write_error;
+        stats->data_bytes += run * HIMD_BLOCKINFO_SIZE;
+        stats->extents++;
+    }
+    /* a last byte gives ATDATA its full size */
+    if(nblocks && !used[nblocks - 1] &&
+       (fseek(out, (long)nblocks * HIMD_BLOCKINFO_SIZE - 1, SEEK_SET) < 0 || fputc(0, out) == EOF))
+        goto write_error;
+    if(fclose(out) != 0)
+    {
+        out = NULL;
+        goto write_error;
+    }
+    out = NULL;
+
+    stats->atdata_bytes = (unsigned long long)nblocks * HIMD_BLOCKINFO_SIZE;
+    stats->usecs = g_get_monotonic_time() - start;
+    HIMD_TRACE_END(unpack_scope);
+    ret = 0;
+    goto out;
+
+write_error:
+    set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                      _("Can't write %s: %s"), path, g_strerror(errno));
+out:
+    if(out)
+        fclose(out);
+    g_free(buf);
+    g_free(used);
+    g_free(path);
+    g_free(hmdhifi);
+    fclose(atdata);
+    return ret;
+}
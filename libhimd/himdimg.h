@@ -0,0 +1,47 @@
+#ifndef INCLUDED_LIBHIMD_HIMDIMG_H
+#define INCLUDED_LIBHIMD_HIMDIMG_H
+
+#include "himd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A .himdimg archives a disc without the holes in ATDATA. It holds the
+   TRKIDX, _RKIDX and MCLIST files and the runs of ATDATA blocks referenced
+   by the fragments of the tracks in the play order, each run stored as an
+   extent of at most 1 MB that is zstd compressed if that makes it smaller.
+   himd_open opens an image read-only, blocks outside the extents read as
+   zeros. All numbers are big-endian:
+
+     header    "HiMDimg1", version, datanum, ATDATA blocks, files, extents
+               (32 bytes)
+     files     name[8], offset[8], length, stored length, compression
+               (32 bytes each)
+     extents   first block, blocks, offset[8], stored length, compression
+               (24 bytes each, ascending and not overlapping)
+     data      the file contents and extents the records point to */
+
+#define HIMD_IMAGE_EXTENSION ".himdimg"
+
+struct himd_image_stats {
+    unsigned long long atdata_bytes;	/* ATDATA of the disc, holes included */
+    unsigned long long data_bytes;	/* files and ATDATA blocks copied */
+    unsigned long long image_bytes;	/* size of the image */
+    unsigned int extents;
+    unsigned long long usecs;		/* time taken */
+};
+
+/* compress != 0 needs libhimd built with with_zstd */
+int himd_image_pack(struct himd * himd, const char * filename, int compress,
+                    struct himd_image_stats * stats, struct himderrinfo * status);
+/* Writes the himd as HMDHIFI directory below dir, ATDATA keeps its size but
+   only the referenced blocks are written, the rest stays a hole */
+int himd_image_unpack(struct himd * himd, const char * dir,
+                      struct himd_image_stats * stats, struct himderrinfo * status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
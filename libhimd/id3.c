@@ -0,0 +1,68 @@
+#include <string.h>
+#include <glib.h>
+
+#include "himd.h"
+#include "himd_private.h"
+
+/* Just enough ID3v2.4 to store the strings of a HiMD track: UTF-8 text
+   frames, one comment frame and zero padding. */
+
+#define ID3_HEADER_SIZE 10
+
+static void setsyncsafe32(unsigned char * c, unsigned int val)
+{
+    c[0] = (val >> 21) & 0x7F;
+    c[1] = (val >> 14) & 0x7F;
+    c[2] = (val >> 7) & 0x7F;
+    c[3] = val & 0x7F;
+}
+
+static void append_frame(GString * tag, const char * id, const char * prefix, gsize prefixlen, const char * text)
+{
+    unsigned char header[10];
+    gsize len;
+
+    if(!text || !*text)
+        return;
+    len = strlen(text);
+    memcpy(header, id, 4);
+    setsyncsafe32(header+4, 1 + prefixlen + len);
+    header[8] = header[9] = 0;
+    g_string_append_len(tag, (const char *)header, 10);
+    g_string_append_c(tag, 3);		/* UTF-8 */
+    g_string_append_len(tag, prefix, prefixlen);
+    g_string_append_len(tag, text, len);
+}
+
+/**
+ * Build an ID3v2.4 tag from the given track strings, followed by padding
+ * zero bytes so the tag can be edited in place later on.
+ *
+ * @return the tag, to be freed with g_free. Its length is stored in *len.
+ */
+unsigned char * id3v2_make_tag(const struct himd_tags * tags, unsigned int padding, size_t * len)
+{
+    GString * tag = g_string_new("");
+    char tracknum[12];
+
+    g_string_append_len(tag, "ID3\x04\x00\x00\x00\x00\x00\x00", ID3_HEADER_SIZE);
+    if(tags)
+    {
+        append_frame(tag, "TIT2", "", 0, tags->title);
+        append_frame(tag, "TPE1", "", 0, tags->artist);
+        append_frame(tag, "TALB", "", 0, tags->album);
+        if(tags->trackinalbum > 0)
+        {
+            g_snprintf(tracknum, sizeof tracknum, "%d", tags->trackinalbum);
+            append_frame(tag, "TRCK", "", 0, tracknum);
+        }
+        /* language, then an empty description */
+        append_frame(tag, "COMM", "eng", 4, tags->comment);
+    }
+    while(padding--)
+        g_string_append_c(tag, 0);
+
+    setsyncsafe32((unsigned char *)tag->str + 6, tag->len - ID3_HEADER_SIZE);
+    *len = tag->len;
+    return (unsigned char *)g_string_free(tag, FALSE);
+}
@@ -0,0 +1,621 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "himd.h"
+#include "himd_private.h"
+#include "imagegen.h"
+
+#define _(x) (x)
+
+#define MP3_FRAMESIZE 417	/* 128 kbit/s at 44.1 kHz without padding */
+#define MP3_FRAME_SAMPLES 1152
+#define ATRAC3_FRAMESIZE 384	/* LP2 */
+#define ATRAC3_FRAME_SAMPLES HIMD_ATRAC3_SAMPLES_PER_FRAME
+#define LPCM_FRAME_SAMPLES (HIMD_LPCM_FRAMESIZE / 4)
+
+#define SAMPLERATE 44100
+#define RH1_EKB 0x00010012
+#define MAX_BLOCKS 0x10000	/* block numbers in the TIF have 16 bits */
+
+/* a fragment while the image is laid out */
+struct genfrag {
+    unsigned int idx;
+    struct fraginfo frag;
+};
+
+struct gentrack {
+    enum himd_image_codec codec;
+    unsigned int slot;
+    unsigned int frames;
+    unsigned int framesize;
+    unsigned int fpb;		/* frames per block */
+    unsigned int blocks;
+    unsigned int blocksdone;
+    unsigned char contentid[20];
+    mp3key key;
+    GArray * frags;
+};
+
+struct generator {
+    const struct himd_image_spec * spec;
+    unsigned char * tif;
+    unsigned int nextfrag;
+    unsigned int nextstring;
+    FILE * atdata;
+    unsigned int nextblock;
+    GRand * rand;
+    void * crypt;
+    short * sine;		/* one second of LPCM, 1 Hz steps repeat after that */
+};
+
+static unsigned char * tif_track(struct generator * g, unsigned int idx)
+{
+    return g->tif + 0x8000 + 0x50 * idx;
+}
+
+static unsigned char * tif_frag(struct generator * g, unsigned int idx)
+{
+    return g->tif + 0x30000 + 0x10 * idx;
+}
+
+static unsigned char * tif_string(struct generator * g, unsigned int idx)
+{
+    return g->tif + 0x40000 + 0x10 * idx;
+}
+
+void himd_image_spec_init(struct himd_image_spec * spec)
+{
+    g_return_if_fail(spec != NULL);
+
+    spec->tracks = 12;
+    spec->codecs[0] = HIMD_IMAGE_MP3;
+    spec->codecs[1] = HIMD_IMAGE_LPCM;
+    spec->codecs[2] = HIMD_IMAGE_ATRAC3;
+    spec->ncodecs = 3;
+    spec->seconds = 30;
+    spec->layout = HIMD_IMAGE_CONTIGUOUS;
+    spec->chunkblocks = 16;
+    spec->encoding = HIMD_IMAGE_LATIN1;
+    spec->seed = 1;
+}
+
+/* An empty TIF: all slots are on the free lists */
+static void init_tif(struct generator * g)
+{
+    unsigned int i;
+
+    memcpy(g->tif, "TIF ", 4);
+    for(i = 0; i <= HIMD_LAST_TRACK; i++)
+        setbeword16(tif_track(g, i) + 38, i < HIMD_LAST_TRACK ? i + 1 : 0);
+    for(i = 0; i <= HIMD_LAST_FRAGMENT; i++)
+        setbeword16(tif_frag(g, i) + 14, i < HIMD_LAST_FRAGMENT ? i + 1 : 0);
+    for(i = 0; i <= HIMD_LAST_STRING; i++)
+        setbeword16(tif_string(g, i) + 14, i < HIMD_LAST_STRING ? i + 1 : 0);
+    g->nextfrag = HIMD_FIRST_FRAGMENT;
+    g->nextstring = HIMD_FIRST_STRING;
+}
+
+static int add_string(struct generator * g, const char * utf8, int type,
+                      enum himd_image_encoding encoding, struct himderrinfo * status)
+{
+    static const char * const charsets[] = { "ISO-8859-1", "UTF-16BE", "SHIFT_JIS" };
+    static const unsigned char ids[] = { HIMD_ENCODING_LATIN1, HIMD_ENCODING_UTF16BE, HIMD_ENCODING_SHIFT_JIS };
+    gchar * raw, * converted;
+    gsize len;
+    unsigned int i, nslots, first = g->nextstring;
+    unsigned char * chunk;
+
+    converted = g_convert(utf8, -1, charsets[encoding], "UTF-8", NULL, &len, NULL);
+    if(!converted)
+    {
+        set_status_printf(status, HIMD_ERROR_STRING_ENCODING_ERROR,
+                          _("Can't convert '%s' to %s"), utf8, charsets[encoding]);
+        return -1;
+    }
+    nslots = (len + 1 + 13) / 14;
+    if(first + nslots - 1 > HIMD_LAST_STRING)
+    {
+        g_free(converted);
+        set_status_printf(status, HIMD_ERROR_OUT_OF_STRINGS,
+                          _("Not enough string slots for %u tracks"), g->spec->tracks);
+        return -1;
+    }
+
+    /* the encoding byte comes first, the last slot is padded with zeros */
+    raw = g_malloc0(nslots * 14);
+    raw[0] = ids[encoding];
+    memcpy(raw + 1, converted, len);
+    for(i = 0; i < nslots; i++)
+    {
+        chunk = tif_string(g, first + i);
+        memcpy(chunk, raw + 14 * i, 14);
+        setbeword16(chunk + 14, ((i == 0 ? type : STRING_TYPE_CONTINUATION) << 12) |
+                                (i < nslots - 1 ? first + i + 1 : 0));
+    }
+    g->nextstring += nslots;
+    g_free(raw);
+    g_free(converted);
+    return first;
+}
+
+static enum himd_image_encoding track_encoding(const struct himd_image_spec * spec, unsigned int i)
+{
+    if(spec->encoding == HIMD_IMAGE_MIXED)
+        return i % 3;
+    return spec->encoding;
+}
+
+static int add_track_strings(struct generator * g, unsigned int i, int album, struct trackinfo * t,
+                             struct himderrinfo * status)
+{
+    enum himd_image_encoding encoding = track_encoding(g->spec, i);
+    gchar * title, * artist;
+
+    switch(encoding)
+    {
+        case HIMD_IMAGE_UTF16:
+            title = g_strdup_printf("Track %03u \342\231\252", i + 1);		/* eighth note */
+            artist = g_strdup_printf("K\303\274nstler %u \342\234\223", i % 4 + 1);	/* check mark */
+            break;
+        case HIMD_IMAGE_SHIFT_JIS:
+            /* "track" and "artist" in katakana */
+            title = g_strdup_printf("\343\203\210\343\203\251\343\203\203\343\202\257 %03u", i + 1);
+            artist = g_strdup_printf("\343\202\242\343\203\274\343\203\206\343\202\243\343\202\271\343\203\210 %u", i % 4 + 1);
+            break;
+        default:
+            title = g_strdup_printf("Caf\303\251 Track %03u", i + 1);
+            artist = g_strdup_printf("Artist %u", i % 4 + 1);
+            break;
+    }
+    t->title = add_string(g, title, STRING_TYPE_TITLE, encoding, status);
+    t->artist = t->title < 0 ? -1 : add_string(g, artist, STRING_TYPE_ARTIST, encoding, status);
+    t->album = album;
+    g_free(title);
+    g_free(artist);
+    return t->artist < 0 ? -1 : 0;
+}
+
+static void fill_mp3(const struct gentrack * tr, unsigned int frames, struct blockinfo * b)
+{
+    /* MPEG-1 layer III, 128 kbit/s, 44.1 kHz, joint stereo. All-zero
+       side info makes them silent frames. */
+    static const unsigned char header[4] = { 0xFF, 0xFB, 0x90, 0x44 };
+    unsigned int i, len = frames * MP3_FRAMESIZE;
+
+    memcpy(&b->type, "SPMA", 4);
+    memset(b->audio_data, 0, sizeof b->audio_data);
+    for(i = 0; i < frames; i++)
+        memcpy(b->audio_data + i * MP3_FRAMESIZE, header, 4);
+    b->nframes = frames;
+    b->lendata = len;
+    mp3_unscramble(b->audio_data, len, tr->key);
+}
+
+static void fill_lpcm(struct generator * g, unsigned long long firstframe, unsigned int frames, struct blockinfo * b)
+{
+    unsigned long long sample = firstframe * LPCM_FRAME_SAMPLES;
+    unsigned int i, n = frames * LPCM_FRAME_SAMPLES;
+    unsigned char * out = b->audio_data;
+    short l, r;
+
+    memcpy(&b->type, "LPCM", 4);
+    memset(b->audio_data, 0, sizeof b->audio_data);
+    for(i = 0; i < n; i++, sample++)
+    {
+        l = g->sine[2 * (sample % SAMPLERATE)];
+        r = g->sine[2 * (sample % SAMPLERATE) + 1];
+        out[4*i] = l >> 8;
+        out[4*i+1] = l & 0xFF;
+        out[4*i+2] = r >> 8;
+        out[4*i+3] = r & 0xFF;
+    }
+}
+
+static void fill_atrac3(struct generator * g, unsigned int frames, struct blockinfo * b)
+{
+    unsigned int i;
+
+    memcpy(&b->type, "A3D ", 4);
+    memset(b->audio_data, 0, sizeof b->audio_data);
+    for(i = 0; i < frames * ATRAC3_FRAMESIZE; i++)
+        b->audio_data[i] = g_rand_int(g->rand);
+}
+
+static int write_block(struct generator * g, struct gentrack * tr, const struct fraginfo * frag,
+                       unsigned int blockno, struct himderrinfo * status)
+{
+    struct blockinfo b;
+    unsigned char data[HIMD_BLOCKINFO_SIZE];
+    unsigned long long firstframe = (unsigned long long)tr->blocksdone * tr->fpb;
+    unsigned int frames = MIN(tr->fpb, tr->frames - firstframe);
+    unsigned int i;
+
+    memset(&b, 0, sizeof b);
+    if(tr->codec == HIMD_IMAGE_MP3)
+        fill_mp3(tr, frames, &b);
+    else
+    {
+        if(tr->codec == HIMD_IMAGE_LPCM)
+            fill_lpcm(g, firstframe, frames, &b);
+        else
+            fill_atrac3(g, frames, &b);
+        b.nframes = frames;
+        b.lendata = tr->fpb * tr->framesize;
+        for(i = 0; i < 8; i++)
+        {
+            b.key[i] = g_rand_int(g->rand);
+            b.iv[i] = g_rand_int(g->rand);
+        }
+    }
+    b.serial_number = tr->blocksdone;
+    b.backup_type = b.type;
+    b.backup_serial_number = b.serial_number;
+    b.lo32_contentid = beword32(tr->contentid + 16);
+    setblock(&b, data);
+
+    if(tr->codec != HIMD_IMAGE_MP3)
+    {
+#ifdef CONFIG_WITH_MCRYPT
+        if(descrypt_encrypt(g->crypt, data, tr->fpb * tr->framesize, frag->key, status) < 0)
+            return -1;
+#else
+        (void)frag;
+        set_status_const(status, HIMD_ERROR_DISABLED_FEATURE,
+                         _("Can't write LPCM or ATRAC3 tracks: Compiled without mcrypt library"));
+        return -1;
+#endif
+    }
+
+    if(fseek(g->atdata, blockno * (long)HIMD_BLOCKINFO_SIZE, SEEK_SET) < 0 ||
+       fwrite(data, sizeof data, 1, g->atdata) != 1)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                          _("Can't write audio block %u: %s"), blockno, g_strerror(errno));
+        return -1;
+    }
+    tr->blocksdone++;
+    return 0;
+}
+
+/* Put the next count blocks of a track at the end of ATDATA, as one fragment */
+static int add_fragment(struct generator * g, struct gentrack * tr, unsigned int count,
+                        struct himderrinfo * status)
+{
+    struct genfrag f;
+    unsigned int i, lastframes;
+
+    if(g->nextfrag > HIMD_LAST_FRAGMENT)
+    {
+        set_status_const(status, HIMD_ERROR_BAD_DATA_FORMAT,
+                         _("Layout needs more fragments than a TIF holds, use bigger chunks"));
+        return -1;
+    }
+    memset(&f, 0, sizeof f);
+    f.idx = g->nextfrag++;
+    f.frag.firstblock = g->nextblock;
+    f.frag.lastblock = g->nextblock + count - 1;
+    f.frag.firstframe = 0;
+    if(tr->codec != HIMD_IMAGE_MP3)
+        for(i = 0; i < 8; i++)
+            f.frag.key[i] = g_rand_int(g->rand);
+
+    /* frames in the last block of the fragment */
+    if(tr->blocksdone + count == tr->blocks)
+        lastframes = tr->frames - (tr->blocks - 1) * tr->fpb;
+    else
+        lastframes = tr->fpb;
+    /* MPEG fragments count the frames of their last block, the others
+       give the index of the last frame */
+    f.frag.lastframe = tr->codec == HIMD_IMAGE_MP3 ? lastframes : lastframes - 1;
+
+    for(i = 0; i < count; i++)
+        if(write_block(g, tr, &f.frag, g->nextblock + i, status) < 0)
+            return -1;
+    g->nextblock += count;
+    g_array_append_val(tr->frags, f);
+    return 0;
+}
+
+static void setup_track(struct generator * g, struct gentrack * tr, unsigned int i)
+{
+    const struct himd_image_spec * spec = g->spec;
+    unsigned long long samples = (unsigned long long)spec->seconds * SAMPLERATE;
+    struct himd fakehimd;
+    unsigned int j;
+
+    tr->codec = spec->codecs[i % spec->ncodecs];
+    tr->slot = HIMD_FIRST_TRACK + i;
+    switch(tr->codec)
+    {
+        case HIMD_IMAGE_MP3:
+            tr->framesize = MP3_FRAMESIZE;
+            tr->fpb = HIMD_AUDIO_SIZE / MP3_FRAMESIZE;
+            tr->frames = (samples + MP3_FRAME_SAMPLES - 1) / MP3_FRAME_SAMPLES;
+            break;
+        case HIMD_IMAGE_LPCM:
+            tr->framesize = HIMD_LPCM_FRAMESIZE;
+            tr->fpb = HIMD_AUDIO_SIZE / HIMD_LPCM_FRAMESIZE;
+            tr->frames = (samples + LPCM_FRAME_SAMPLES - 1) / LPCM_FRAME_SAMPLES;
+            break;
+        default:
+            tr->framesize = ATRAC3_FRAMESIZE;
+            tr->fpb = 0x3FBF / ATRAC3_FRAMESIZE;
+            tr->frames = (samples + ATRAC3_FRAME_SAMPLES - 1) / ATRAC3_FRAME_SAMPLES;
+            break;
+    }
+    tr->frames = MAX(tr->frames, 1);
+    tr->blocks = (tr->frames + tr->fpb - 1) / tr->fpb;
+    tr->blocksdone = 0;
+    tr->frags = g_array_new(FALSE, FALSE, sizeof(struct genfrag));
+
+    tr->contentid[0] = 0x02;
+    tr->contentid[1] = 0x03;
+    for(j = 4; j < 20; j++)
+        tr->contentid[j] = g_rand_int(g->rand);
+
+    /* the MP3 key only needs the disc ID, which is in the MCLIST image */
+    memset(&fakehimd, 0, sizeof fakehimd);
+    fakehimd.discid = g->tif + 0x1000;
+    himd_obtain_mp3key(&fakehimd, tr->slot, &tr->key, NULL);
+}
+
+static void write_trackinfo(struct generator * g, struct gentrack * tr, struct trackinfo * t)
+{
+    struct genfrag * f;
+    unsigned int j;
+
+    for(j = 0; j < tr->frags->len; j++)
+    {
+        f = &g_array_index(tr->frags, struct genfrag, j);
+        f->frag.nextfrag = j + 1 < tr->frags->len ? g_array_index(tr->frags, struct genfrag, j+1).idx : 0;
+        setfrag(&f->frag, tif_frag(g, f->idx));
+    }
+
+    t->trackinalbum = tr->slot;
+    t->firstfrag = g_array_index(tr->frags, struct genfrag, 0).idx;
+    t->tracknum = tr->slot;
+    t->seconds = g->spec->seconds;
+    memset(t->key, 0, sizeof t->key);
+    memset(t->mac, 0, sizeof t->mac);
+    memset(t->codecinfo, 0, sizeof t->codecinfo);
+    memcpy(t->contentid, tr->contentid, 20);
+    memset(&t->starttime, 0, sizeof t->starttime);
+    memset(&t->endtime, 0, sizeof t->endtime);
+    memset(&t->recordingtime, 0, sizeof t->recordingtime);
+    t->recordingtime.tm_year = 108;
+    t->recordingtime.tm_mon = 5;
+    t->recordingtime.tm_mday = 1;
+    t->recordingtime.tm_hour = 12 + tr->slot / 60 % 12;
+    t->recordingtime.tm_min = tr->slot % 60;
+    t->Lt = 0x10;
+    t->Dest = 1;
+    t->Xcc = 1;
+    t->Cc = 0x40;
+
+    switch(tr->codec)
+    {
+        case HIMD_IMAGE_MP3:
+            /* values of a 128 kbit/s stereo upload by SonicStage */
+            t->codec_id = CODEC_ATRAC3PLUS_OR_MPEG;
+            t->codecinfo[0] = 3;
+            t->codecinfo[2] = 0xB0;
+            t->codecinfo[3] = 0xD9;
+            t->codecinfo[4] = 0x10;
+            t->ekbnum = 0;
+            break;
+        case HIMD_IMAGE_LPCM:
+            t->codec_id = CODEC_LPCM;
+            t->ekbnum = RH1_EKB;
+            break;
+        default:
+            /* 44.1 kHz, frame size in units of 8 bytes */
+            t->codec_id = CODEC_ATRAC3;
+            t->codecinfo[1] = 0x20;
+            t->codecinfo[2] = ATRAC3_FRAMESIZE / 8;
+            t->ekbnum = RH1_EKB;
+            break;
+    }
+    settrack(t, tif_track(g, tr->slot));
+}
+
+static int layout_blocks(struct generator * g, struct gentrack * tracks, struct himderrinfo * status)
+{
+    const struct himd_image_spec * spec = g->spec;
+    unsigned int i, count, left;
+    int done;
+
+    if(spec->layout == HIMD_IMAGE_CONTIGUOUS)
+    {
+        for(i = 0; i < spec->tracks; i++)
+            if(add_fragment(g, &tracks[i], tracks[i].blocks, status) < 0)
+                return -1;
+        return 0;
+    }
+
+    /* round robin over the tracks that still have blocks left */
+    do
+    {
+        done = 1;
+        for(i = 0; i < spec->tracks; i++)
+        {
+            left = tracks[i].blocks - tracks[i].blocksdone;
+            if(!left)
+                continue;
+            count = MIN(left, MAX(spec->chunkblocks, 1));
+            if(add_fragment(g, &tracks[i], count, status) < 0)
+                return -1;
+            done = 0;
+        }
+    } while(!done);
+    return 0;
+}
+
+static int write_file(const char * dir, const char * name, const unsigned char * data, gsize len,
+                      struct himderrinfo * status)
+{
+    gchar * filename = g_build_filename(dir, name, NULL);
+    GError * err = NULL;
+    int ret = 0;
+
+    if(!g_file_set_contents(filename, (const gchar *)data, len, &err))
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT, _("Can't write %s: %s"), filename, err->message);
+        g_error_free(err);
+        ret = -1;
+    }
+    g_free(filename);
+    return ret;
+}
+
+static void make_sine(struct generator * g)
+{
+    unsigned int i;
+
+    /* 440 Hz left, 660 Hz right, both -12 dBFS */
+    g->sine = g_new(short, 2 * SAMPLERATE);
+    for(i = 0; i < SAMPLERATE; i++)
+    {
+        g->sine[2*i] = (short)(8192 * sin(2 * G_PI * 440 * i / SAMPLERATE));
+        g->sine[2*i+1] = (short)(8192 * sin(2 * G_PI * 660 * i / SAMPLERATE));
+    }
+}
+
+/**
+ * Generate a synthetic HiMD as described by spec. The same spec always
+ * gives the same image.
+ */
+int himd_generate_image(const char * path, const struct himd_image_spec * spec, struct himderrinfo * status)
+{
+    static const unsigned char zerokey[8] = {0,0,0,0,0,0,0,0};
+    struct generator g;
+    struct gentrack * tracks = NULL;
+    struct trackinfo t;
+    unsigned char mclist[0x100];
+    unsigned long long blocks = 0;
+    gchar * dir = NULL, * filename;
+    unsigned int i;
+    int album, ret = -1;
+
+    g_return_val_if_fail(path != NULL, -1);
+    g_return_val_if_fail(spec != NULL, -1);
+    g_return_val_if_fail(spec->ncodecs >= 1 && spec->ncodecs <= 3, -1);
+
+    memset(&g, 0, sizeof g);
+    g.spec = spec;
+    if(spec->tracks > HIMD_LAST_TRACK)
+    {
+        set_status_printf(status, HIMD_ERROR_BAD_DATA_FORMAT,
+                          _("A HiMD holds at most %d tracks"), HIMD_LAST_TRACK);
+        return -1;
+    }
+
+    dir = g_build_filename(path, "HMDHIFI", NULL);
+    if(g_mkdir_with_parents(dir, 0777) < 0)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                          _("Can't create %s: %s"), dir, g_strerror(errno));
+        g_free(dir);
+        return -1;
+    }
+
+    g.rand = g_rand_new_with_seed(spec->seed);
+    g.tif = g_malloc0(HIMD_TIFFILE_SIZE);
+    init_tif(&g);
+    make_sine(&g);
+
+    /* the disc ID goes to MCLIST, keep a copy in an unused part of the
+       TIF buffer for the MP3 keys until the TIF is complete */
+    memset(mclist, 0, sizeof mclist);
+    for(i = 0; i < 16; i++)
+        mclist[0x40 + i] = g_rand_int(g.rand);
+    memcpy(g.tif + 0x1000, mclist + 0x40, 16);
+
+    tracks = g_new0(struct gentrack, spec->tracks);
+    for(i = 0; i < spec->tracks; i++)
+    {
+        setup_track(&g, &tracks[i], i);
+        blocks += tracks[i].blocks;
+    }
+    memset(g.tif + 0x1000, 0, 16);
+    if(blocks > MAX_BLOCKS)
+    {
+        set_status_printf(status, HIMD_ERROR_BAD_DATA_FORMAT,
+                          _("%llu blocks of audio don't fit on a HiMD, use fewer or shorter tracks"), blocks);
+        goto out;
+    }
+
+#ifdef CONFIG_WITH_MCRYPT
+    for(i = 0; i < spec->ncodecs; i++)
+        if(spec->codecs[i] != HIMD_IMAGE_MP3 && !g.crypt &&
+           descrypt_open(&g.crypt, zerokey, RH1_EKB, status) < 0)
+            goto out;
+#else
+    (void)zerokey;
+#endif
+
+    filename = g_build_filename(dir, "ATDATA01.HMA", NULL);
+    g.atdata = g_fopen(filename, "wb");
+    if(!g.atdata)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                          _("Can't create %s: %s"), filename, g_strerror(errno));
+        g_free(filename);
+        goto out;
+    }
+    g_free(filename);
+    if(layout_blocks(&g, tracks, status) < 0)
+        goto out;
+    if(fclose(g.atdata) != 0)
+    {
+        g.atdata = NULL;
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                          _("Can't write audio data: %s"), g_strerror(errno));
+        goto out;
+    }
+    g.atdata = NULL;
+
+    /* all tracks share the album */
+    if((album = add_string(&g, "Synthetic HiMD", STRING_TYPE_ALBUM, track_encoding(spec, 0), status)) < 0)
+        goto out;
+    memset(&t, 0, sizeof t);
+    for(i = 0; i < spec->tracks; i++)
+    {
+        if(add_track_strings(&g, i, album, &t, status) < 0)
+            goto out;
+        write_trackinfo(&g, &tracks[i], &t);
+        setbeword16(g.tif + 0x102 + 2*i, tracks[i].slot);
+    }
+    setbeword16(g.tif + 0x100, spec->tracks);
+
+    /* heads of the free lists */
+    setbeword16(tif_track(&g, 0) + 38, spec->tracks < HIMD_LAST_TRACK ? spec->tracks + 1 : 0);
+    setbeword16(tif_frag(&g, 0) + 14, g.nextfrag <= HIMD_LAST_FRAGMENT ? g.nextfrag : 0);
+    setbeword16(tif_string(&g, 0) + 14, g.nextstring <= HIMD_LAST_STRING ? g.nextstring : 0);
+
+    if(write_file(dir, "TRKIDX01.HMA", g.tif, HIMD_TIFFILE_SIZE, status) < 0 ||
+       write_file(dir, "_RKIDX01.HMA", g.tif, HIMD_TIFFILE_SIZE, status) < 0 ||
+       write_file(dir, "MCLIST01.HMA", mclist, sizeof mclist, status) < 0)
+        goto out;
+    ret = 0;
+
+out:
+    if(g.atdata)
+        fclose(g.atdata);
+#ifdef CONFIG_WITH_MCRYPT
+    if(g.crypt)
+        descrypt_close(g.crypt);
+#endif
+    for(i = 0; tracks && i < spec->tracks; i++)
+        if(tracks[i].frags)
+            g_array_free(tracks[i].frags, TRUE);
+    g_free(tracks);
+    g_free(g.sine);
+    g_free(g.tif);
+    g_rand_free(g.rand);
+    g_free(dir);
+    return ret;
+}
@@ -0,0 +1,42 @@
+#ifndef INCLUDED_LIBHIMD_IMAGEGEN_H
+#define INCLUDED_LIBHIMD_IMAGEGEN_H
+
+#include "himd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum himd_image_codec { HIMD_IMAGE_MP3, HIMD_IMAGE_LPCM, HIMD_IMAGE_ATRAC3 };
+enum himd_image_layout { HIMD_IMAGE_CONTIGUOUS, HIMD_IMAGE_INTERLEAVED };
+enum himd_image_encoding { HIMD_IMAGE_LATIN1, HIMD_IMAGE_UTF16, HIMD_IMAGE_SHIFT_JIS, HIMD_IMAGE_MIXED };
+
+/* Description of a synthetic HiMD, for tests and benchmarks that can't
+   depend on a real disc. The tracks get the codecs in turn. MP3 tracks
+   hold silent 128 kbit/s frames, LPCM tracks a sine per channel, and
+   ATRAC3 tracks (LP2) random data in frames of the right size. LPCM and
+   ATRAC3 tracks are encrypted with the zero RH1 track key, which needs
+   mcrypt. Interleaved layouts put chunkblocks blocks of each track in
+   turn, giving every track many fragments. With HIMD_IMAGE_MIXED the
+   tracks use the string encodings in turn. */
+struct himd_image_spec {
+    unsigned int tracks;
+    enum himd_image_codec codecs[3];
+    unsigned int ncodecs;
+    unsigned int seconds;	/* length of each track */
+    enum himd_image_layout layout;
+    unsigned int chunkblocks;
+    enum himd_image_encoding encoding;
+    unsigned int seed;		/* same seed, same image */
+};
+
+void himd_image_spec_init(struct himd_image_spec * spec);
+/* Writes HMDHIFI with TRKIDX01, _RKIDX01, MCLIST01 and ATDATA01 into
+   path, which is created if needed. */
+int himd_generate_image(const char * path, const struct himd_image_spec * spec, struct himderrinfo * status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
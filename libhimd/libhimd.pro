@@ -16,7 +16,15 @@ else: !build_pass: message(You disabled mcrypt: No PCM and ATRAC transfer will b
 }
 else: !build_pass: message(You disabled mad: MP3 transfer will be limited)
 
-PKGCONFIG += glib-2.0
-HEADERS += himd.h himd_private.h sony_oma.h
-SOURCES += encryption.c himd.c mdstream.c trackindex.c sony_oma.c frag.c
+with_trace: DEFINES += CONFIG_WITH_TRACE
+
+with_zstd: {
+  LIBS += -lzstd
+  DEFINES += CONFIG_WITH_ZSTD
+}
+
+PKGCONFIG += glib-2.0 gthread-2.0
+LIBS += -lm
+HEADERS += himd.h himd_private.h sony_oma.h wavsink.h flacsink.h mp3sink.h analysis.h splitsink.h trackfile.h imagegen.h trace.h fsck.h recover.h himdimg.h
+SOURCES += encryption.c himd.c mdstream.c trackindex.c sony_oma.c frag.c pcmswap.c wavsink.c flacenc.c flacsink.c id3.c mp3sink.c analysis.c splitsink.c trackfile.c imagegen.c trace.c fsck.c recover.c himdimg.c backend.c fatimage.c trackedit.c
 LIBS    += -lmad -lmcrypt
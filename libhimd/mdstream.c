@@ -5,6 +5,8 @@
 
 #include "himd.h"
 #include "himd_private.h"
+#include "analysis.h"
+#include "trace.h"
 
 #define _(x) (x)
 
@@ -64,16 +66,55 @@ int himd_blockstream_open(struct himd * himd, unsigned int firstfrag, unsigned i
 
     stream->curblockno = stream->frags[0].firstblock;
     stream->frames_per_block = frags_per_block;
+    memset(&stream->stats, 0, sizeof stream->stats);
     
     return 0;
 }
 
 void himd_blockstream_close(struct himd_blockstream * stream)
 {
+    himd_add_stats(stream->himd, &stream->stats);
     fclose(stream->atdata);
     free(stream->frags);
 }
 
+/**
+ * Position the stream so that the next call to himd_blockstream_read
+ * returns the block with index blockidx, counting from the first block
+ * of the stream.
+ */
+int himd_blockstream_seek(struct himd_blockstream * stream, unsigned int blockidx, struct himderrinfo * status)
+{
+    unsigned int fragno, blocks;
+
+    g_return_val_if_fail(stream != NULL, -1);
+
+    if(blockidx >= stream->blockcount)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_SEEK_AUDIO,
+                          _("Block %u requested, stream has %u blocks"), blockidx, stream->blockcount);
+        return -1;
+    }
+    for(fragno = 0; ; fragno++)
+    {
+        blocks = stream->frags[fragno].lastblock - stream->frags[fragno].firstblock + 1;
+        if(blockidx < blocks)
+            break;
+        blockidx -= blocks;
+    }
+
+    stream->curfragno = fragno;
+    stream->curblockno = stream->frags[fragno].firstblock + blockidx;
+    stream->stats.seeks++;
+    if(fseek(stream->atdata, stream->curblockno*16384L, SEEK_SET) < 0)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_SEEK_AUDIO,
+                          _("Can't seek in audio data: %s"), g_strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
 static inline int is_mpeg(struct himd_blockstream * stream)
 {
     return stream->frames_per_block == TRACK_IS_MPEG;
@@ -96,10 +137,12 @@ int himd_blockstream_read(struct himd_blockstream * stream, unsigned char * bloc
 
     curfrag = &stream->frags[stream->curfragno];
 
+    HIMD_TRACE_BEGIN(read_scope, "blockstream_read");
     if(stream->curblockno == curfrag->firstblock)
     {
         if(firstframe)
             *firstframe = curfrag->firstframe;
+        stream->stats.seeks++;
         if(fseek(stream->atdata, stream->curblockno*16384L, SEEK_SET) < 0)
         {
             set_status_printf(status, HIMD_ERROR_CANT_SEEK_AUDIO,
@@ -118,6 +161,9 @@ int himd_blockstream_read(struct himd_blockstream * stream, unsigned char * bloc
             set_status_printf(status, HIMD_ERROR_CANT_READ_AUDIO, _("Read error on block audio %d: %s"), stream->curblockno, g_strerror(errno));
         return -1;
     }
+    stream->stats.blocks_read++;
+    stream->stats.bytes_read += 16384;
+    HIMD_TRACE_END(read_scope);
 
     if(fragkey)
         memcpy(fragkey, curfrag->key, sizeof curfrag->key);
@@ -134,7 +180,10 @@ int himd_blockstream_read(struct himd_blockstream * stream, unsigned char * bloc
         stream->curfragno++;
         curfrag++;
         if(stream->curfragno < stream->fragcount)
+        {
             stream->curblockno = curfrag->firstblock;
+            stream->stats.fragment_hops++;
+        }
     }
     else
     {
@@ -204,7 +253,7 @@ void himd_writestream_close(struct himd_writestream * stream)
     fclose(stream->atdata);
 }
 
-static void setblock(struct blockinfo * b, unsigned char * blockbuffer)
+void setblock(struct blockinfo * b, unsigned char * blockbuffer)
 {
     memset(blockbuffer, 0, HIMD_BLOCKINFO_SIZE);
     setbeword32(blockbuffer, GUINT32_TO_BE(b->type)); /* ensure to use big endian on all platforms */
@@ -233,12 +282,14 @@ int himd_writestream_write(struct himd_writestream * stream, struct blockinfo *
     setblock(audioblock, data);
 
     // write the block descriptor to the current position in the stream at 'stream->curblockno'
+    HIMD_TRACE_BEGIN(write_scope, "write");
     if(fwrite(data, 16384, 1, stream->atdata) != 1)
 	{
 	    perror("fwrite block\n");
 	    fprintf(stderr, "Error writing block to position %d\n", stream->curblockno);
 	    return -1;
 	}
+    HIMD_TRACE_END(write_scope);
     return 0;
 }
 
@@ -277,7 +328,7 @@ int himd_mp3stream_open(struct himd * himd, unsigned int trackno, struct himd_mp
 #ifdef CONFIG_WITH_MAD
 #include <mad.h>
 
-static int himd_mp3stream_split_frames(struct himd_mp3stream * stream, unsigned int databytes, unsigned int firstframe, unsigned int lastframe, struct himderrinfo * status)
+int himd_mp3stream_split_frames(struct himd_mp3stream * stream, unsigned int databytes, unsigned int firstframe, unsigned int lastframe, struct himderrinfo * status)
 {
     int gotdata = 1;
     unsigned int i;
@@ -296,6 +347,7 @@ static int himd_mp3stream_split_frames(struct himd_mp3stream * stream, unsigned
         return -1;
     }
     /* parse block */
+    HIMD_TRACE_BEGIN(split_scope, "split_frames");
     mad_stream_init(&madstream);
     mad_header_init(&madheader);
 
@@ -337,6 +389,7 @@ static int himd_mp3stream_split_frames(struct himd_mp3stream * stream, unsigned
 cleanup_decoder:
     mad_header_finish(&madheader);
     mad_stream_finish(&madstream);
+    HIMD_TRACE_END(split_scope);
 
     if(!gotdata)
         return -1;
@@ -346,9 +399,18 @@ cleanup_decoder:
 
 #endif
 
-int himd_mp3stream_read_block(struct himd_mp3stream * stream, const unsigned char ** frameout, unsigned int * lenout, unsigned int * framecount, struct himderrinfo * status)
+/* The MP3 key is applied to whole groups of 8 bytes only, a partial
+   group at the end stays as is. The same call scrambles and unscrambles. */
+void mp3_unscramble(unsigned char * data, unsigned int len, const mp3key key)
 {
     unsigned int i;
+
+    for(i = 0;i < (len & ~7U);i++)
+        data[i] ^= key[i & 3];
+}
+
+int himd_mp3stream_read_block(struct himd_mp3stream * stream, const unsigned char ** frameout, unsigned int * lenout, unsigned int * framecount, struct himderrinfo * status)
+{
     unsigned int firstframe, lastframe;
     unsigned int dataframes, databytes;
 
@@ -403,8 +465,7 @@ int himd_mp3stream_read_block(struct himd_mp3stream * stream, const unsigned cha
     }
 
     /* Decrypt block */
-    for(i = 0;i < (databytes & ~7U);i++)
-        stream->blockbuf[i+0x20] ^= stream->key[i & 3];
+    mp3_unscramble(stream->blockbuf+0x20, databytes, stream->key);
 
     /* Indicate completely consumed block 
        be sure to set this *before* writing to *framecont,
@@ -478,6 +539,21 @@ int himd_mp3stream_read_frame(struct himd_mp3stream * stream, const unsigned cha
 
 #endif
 
+/**
+ * Position the stream so that the next block read is the block with index
+ * blockidx, counting from the first block of the track.
+ */
+int himd_mp3stream_seek(struct himd_mp3stream * stream, unsigned int blockidx, struct himderrinfo * status)
+{
+    g_return_val_if_fail(stream != NULL, -1);
+
+    free(stream->frameptrs);
+    stream->frameptrs = NULL;
+    stream->frames = 0;
+    stream->curframe = 0;
+    return himd_blockstream_seek(&stream->stream, blockidx, status);
+}
+
 void himd_mp3stream_close(struct himd_mp3stream * stream)
 {
     g_return_if_fail(stream != NULL);
@@ -518,6 +594,8 @@ int himd_nonmp3stream_open(struct himd * himd, unsigned int trackno, struct himd
     }
     stream->framesize = himd_trackinfo_framesize(&trkinfo);
     stream->framesleft = 0;
+    stream->lpcm = trkinfo.codec_id == CODEC_LPCM;
+    stream->analysis = NULL;
     return 0;
 }
 
@@ -543,6 +621,7 @@ int himd_nonmp3stream_read_block(struct himd_nonmp3stream * stream, const unsign
 {
     unsigned int firstframe, lastframe;
     unsigned char fragkey[8];
+    gint64 start = 0;
 
     g_return_val_if_fail(stream != NULL, -1);
     /* if partial block left */
@@ -562,10 +641,22 @@ int himd_nonmp3stream_read_block(struct himd_nonmp3stream * stream, const unsign
     if(himd_blockstream_read(&stream->stream, stream->blockbuf,
                              &firstframe, &lastframe, fragkey, status) < 0)
         return -1;
+    if(stream->stream.himd->stats_enabled)
+        start = g_get_monotonic_time();
+    HIMD_TRACE_BEGIN(decrypt_scope, "decrypt");
     if(descrypt_decrypt(stream->cryptinfo, stream->blockbuf,
                         stream->framesize * stream->stream.frames_per_block,
                         fragkey, status) < 0)
         return -1;
+    HIMD_TRACE_END(decrypt_scope);
+    stream->stream.stats.decrypt_calls++;
+    stream->stream.stats.key_schedules = descrypt_key_schedules(stream->cryptinfo);
+    if(stream->stream.himd->stats_enabled)
+        stream->stream.stats.decrypt_ns += (g_get_monotonic_time() - start) * 1000;
+    if(stream->analysis)
+        himd_analysis_feed(stream->analysis,
+                           stream->blockbuf+32 + firstframe * stream->framesize,
+                           stream->framesize * ((lastframe-firstframe)+1));
     if(frameout)
         *frameout = stream->blockbuf+32 + firstframe * stream->framesize;
     if(lenout)
@@ -576,10 +667,46 @@ int himd_nonmp3stream_read_block(struct himd_nonmp3stream * stream, const unsign
     return 0;
 }
 
+/**
+ * Analyze the decrypted audio of an LPCM stream while it is read. Has to
+ * be called before the first block is read, the results are in an->result
+ * after the stream is closed.
+ */
+int himd_nonmp3stream_set_analysis(struct himd_nonmp3stream * stream, struct himd_analysis * an, struct himderrinfo * status)
+{
+    g_return_val_if_fail(stream != NULL, -1);
+    g_return_val_if_fail(an != NULL, -1);
+
+    if(!stream->lpcm)
+    {
+        set_status_const(status, HIMD_ERROR_BAD_AUDIO_CODEC, _("Only LPCM tracks can be analyzed"));
+        return -1;
+    }
+    himd_analysis_init(an);
+    stream->analysis = an;
+    return 0;
+}
+
+/**
+ * Position the stream so that the next block read is the block with index
+ * blockidx, counting from the first block of the track. Not possible while
+ * the stream is analyzed, the analysis has to see every block.
+ */
+int himd_nonmp3stream_seek(struct himd_nonmp3stream * stream, unsigned int blockidx, struct himderrinfo * status)
+{
+    g_return_val_if_fail(stream != NULL, -1);
+    g_return_val_if_fail(stream->analysis == NULL, -1);
+
+    stream->framesleft = 0;
+    return himd_blockstream_seek(&stream->stream, blockidx, status);
+}
+
 void himd_nonmp3stream_close(struct himd_nonmp3stream * stream)
 {
     g_return_if_fail(stream != NULL);
 
+    if(stream->analysis)
+        himd_analysis_finish(stream->analysis);
     himd_blockstream_close(&stream->stream);
     descrypt_close(stream->cryptinfo);
 }
@@ -598,6 +725,24 @@ int himd_nonmp3stream_read_frame(struct himd_nonmp3stream * stream, const unsign
     return -1;
 }
 
+int himd_nonmp3stream_read_block(struct himd_nonmp3stream * stream, const unsigned char ** frameout, unsigned int * lenout, unsigned int * framecount, struct himderrinfo * status)
+{
+    set_status_const(status, HIMD_ERROR_DISABLED_FEATURE, _("Can't do non-mp3 read: Compiled without mcrypt library"));
+    return -1;
+}
+
+int himd_nonmp3stream_seek(struct himd_nonmp3stream * stream, unsigned int blockidx, struct himderrinfo * status)
+{
+    set_status_const(status, HIMD_ERROR_DISABLED_FEATURE, _("Can't seek in non-mp3 track: Compiled without mcrypt library"));
+    return -1;
+}
+
+int himd_nonmp3stream_set_analysis(struct himd_nonmp3stream * stream, struct himd_analysis * an, struct himderrinfo * status)
+{
+    set_status_const(status, HIMD_ERROR_DISABLED_FEATURE, _("Can't analyze non-mp3 track: Compiled without mcrypt library"));
+    return -1;
+}
+
 void himd_nonmp3stream_close(struct himd_nonmp3stream * stream)
 {
 }
@@ -0,0 +1,371 @@
+#include <string.h>
+#include <errno.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "himd.h"
+#include "himd_private.h"
+#include "mp3sink.h"
+#include "trace.h"
+
+#define _(x) (x)
+
+/* bytes of the Xing frame after the side information:
+   tag, flags, frame count, byte count and 100 TOC entries */
+#define XING_DATA_SIZE (4 + 4 + 4 + 4 + 100)
+#define XING_FRAMES_FLAG 1
+#define XING_BYTES_FLAG 2
+#define XING_TOC_FLAG 4
+
+static const unsigned short bitrates[2][16] = {
+    /* MPEG 1 layer III */
+    {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0},
+    /* MPEG 2 and 2.5 layer III */
+    {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0}
+};
+static const unsigned short samplerates[3] = {44100, 48000, 32000};
+
+/* Return the length of the layer III frame starting with the header hdr,
+   or 0 if hdr is not a valid header. */
+static unsigned int mp3_frame_length(const unsigned char * hdr)
+{
+    unsigned int version = (hdr[1] >> 3) & 3;	/* 0: 2.5, 2: 2, 3: 1 */
+    unsigned int bitrate, samplerate;
+
+    if(hdr[0] != 0xFF || (hdr[1] & 0xE0) != 0xE0 || version == 1 ||
+       ((hdr[1] >> 1) & 3) != 1 ||
+       (hdr[2] >> 4) == 0 || (hdr[2] >> 4) == 15 || ((hdr[2] >> 2) & 3) == 3)
+        return 0;
+
+    bitrate = bitrates[version != 3][hdr[2] >> 4] * 1000;
+    samplerate = samplerates[(hdr[2] >> 2) & 3];
+    if(version == 3)
+        return 144 * bitrate / samplerate + ((hdr[2] >> 1) & 1);
+    samplerate >>= (version == 2) ? 1 : 2;
+    return 72 * bitrate / samplerate + ((hdr[2] >> 1) & 1);
+}
+
+/* offset of the Xing tag in the frame, behind the side information */
+static unsigned int xing_offset(const unsigned char * hdr)
+{
+    int mono = (hdr[3] >> 6) == 3;
+    if(((hdr[1] >> 3) & 3) == 3)
+        return 4 + (mono ? 17 : 32);
+    return 4 + (mono ? 9 : 17);
+}
+
+/* Build the header of the Xing frame from the header of the first audio
+   frame, picking the lowest bitrate that leaves room for the Xing data. */
+static unsigned int make_xing_header(unsigned char * hdr, const unsigned char * first)
+{
+    unsigned int idx, len = 0;
+
+    for(idx = 1; idx < 15; idx++)
+    {
+        hdr[0] = 0xFF;
+        hdr[1] = first[1] | 1;			/* no CRC */
+        hdr[2] = (idx << 4) | (first[2] & 0x0D);	/* no padding */
+        hdr[3] = first[3];
+        len = mp3_frame_length(hdr);
+        if(len >= xing_offset(hdr) + XING_DATA_SIZE)
+            break;
+    }
+    return len;
+}
+
+static void record_frame(struct himd_mp3sink * sink, const unsigned char * hdr, unsigned long offset)
+{
+    unsigned int i;
+
+    if(sink->frames % sink->stride == 0)
+    {
+        if(sink->frames / sink->stride == MP3SINK_OFFSETS)
+        {
+            for(i = 0; i < MP3SINK_OFFSETS / 2; i++)
+                sink->offsets[i] = sink->offsets[2*i];
+            sink->stride *= 2;
+        }
+        sink->offsets[sink->frames / sink->stride] = offset;
+    }
+    if((hdr[2] >> 4) != (sink->firsthdr[2] >> 4))
+        sink->vbr = 1;
+    sink->frames++;
+}
+
+/* Collect the frame offsets of the data written, tolerating frames and
+   headers that span several calls. */
+static void parse_frames(struct himd_mp3sink * sink, const unsigned char * data, unsigned int len)
+{
+    unsigned int pos = 0, n, framelen;
+
+    while(pos < len)
+    {
+        if(sink->frameleft)
+        {
+            n = MIN(sink->frameleft, len - pos);
+            sink->frameleft -= n;
+            pos += n;
+            continue;
+        }
+        sink->hdrbuf[sink->hdrbytes++] = data[pos++];
+        if(sink->hdrbytes < 4)
+            continue;
+
+        framelen = mp3_frame_length(sink->hdrbuf);
+        if(framelen < 4)
+        {
+            /* lost sync, look for the next header one byte later */
+            memmove(sink->hdrbuf, sink->hdrbuf + 1, 3);
+            sink->hdrbytes = 3;
+            continue;
+        }
+        record_frame(sink, sink->hdrbuf, sink->bytes + pos - 4);
+        sink->frameleft = framelen - 4;
+        sink->hdrbytes = 0;
+    }
+    sink->bytes += len;
+}
+
+/* Offset of (possibly fractional) frame f, interpolated between the
+   recorded frame offsets. */
+static double frame_offset(const struct himd_mp3sink * sink, double f)
+{
+    unsigned int slot = f / sink->stride;
+    unsigned long first = (unsigned long)slot * sink->stride;
+    unsigned long next = first + sink->stride;
+    unsigned long endoffset;
+
+    if(next < sink->frames)
+        endoffset = sink->offsets[slot + 1];
+    else
+    {
+        next = sink->frames;
+        endoffset = sink->bytes;
+    }
+    return sink->offsets[slot] +
+           (double)(endoffset - sink->offsets[slot]) * (f - first) / (next - first);
+}
+
+static void make_xing_frame(const struct himd_mp3sink * sink, unsigned char * frame)
+{
+    unsigned char * xing;
+    unsigned long total = sink->bytes + sink->xinglen;
+    unsigned int i;
+    double pos;
+
+    memset(frame, 0, sink->xinglen);
+    make_xing_header(frame, sink->firsthdr);
+    xing = frame + xing_offset(frame);
+
+    /* "Info" marks constant bitrate files, as LAME does */
+    memcpy(xing, sink->vbr ? "Xing" : "Info", 4);
+    setbeword32(xing+4, XING_FRAMES_FLAG | XING_BYTES_FLAG | XING_TOC_FLAG);
+    setbeword32(xing+8, sink->frames);
+    setbeword32(xing+12, total);
+    for(i = 0; i < 100; i++)
+    {
+        pos = frame_offset(sink, (double)i * sink->frames / 100) + sink->xinglen;
+        xing[16+i] = MIN(255, (unsigned int)(pos * 256 / total));
+    }
+}
+
+static void reset_parser(struct himd_mp3sink * sink)
+{
+    sink->vbr = 0;
+    sink->hdrbytes = 0;
+    sink->frameleft = 0;
+    sink->frames = 0;
+    sink->bytes = 0;
+    sink->stride = 1;
+}
+
+int himd_mp3sink_open(struct himd_mp3sink * sink, const char * filename, const struct himd_tags * tags, struct himderrinfo * status)
+{
+    unsigned char * tag;
+    size_t taglen;
+
+    g_return_val_if_fail(sink != NULL, -1);
+    g_return_val_if_fail(filename != NULL, -1);
+
+    sink->out = g_fopen(filename, "wb");
+    if(!sink->out)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                          _("Can't open %s for writing: %s"), filename, g_strerror(errno));
+        return -1;
+    }
+
+    tag = id3v2_make_tag(tags, ID3_PADDING, &taglen);
+    if(fwrite(tag, taglen, 1, sink->out) != 1)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                          _("Can't write ID3 tag: %s"), g_strerror(errno));
+        g_free(tag);
+        fclose(sink->out);
+        return -1;
+    }
+    g_free(tag);
+
+    sink->xingpos = 0;
+    sink->xinglen = 0;
+    reset_parser(sink);
+    return 0;
+}
+
+/**
+ * Continue an MP3 file written up to offset by an interrupted export. The
+ * file must end at offset, and the last taillen bytes before it must be
+ * the tail of the MPEG data, which is checked. The audio data already in
+ * the file is parsed again to rebuild the seek table.
+ */
+int himd_mp3sink_resume(struct himd_mp3sink * sink, const char * filename, long offset,
+                        const unsigned char * tail, unsigned int taillen, struct himderrinfo * status)
+{
+    unsigned char buf[16384];
+    long pos, audiopos;
+    size_t len, i;
+
+    g_return_val_if_fail(sink != NULL, -1);
+    g_return_val_if_fail(filename != NULL, -1);
+
+    sink->out = g_fopen(filename, "r+b");
+    if(!sink->out)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                          _("Can't open %s for writing: %s"), filename, g_strerror(errno));
+        return -1;
+    }
+    if(sink_check_tail(sink->out, offset, tail, taillen, status) < 0)
+        goto fail;
+
+    /* the ID3 tag size is syncsafe and does not count the header */
+    if(fseek(sink->out, 0, SEEK_SET) != 0 || fread(buf, 10, 1, sink->out) != 1 ||
+       memcmp(buf, "ID3", 3) != 0)
+    {
+        set_status_const(status, HIMD_ERROR_BAD_DATA_FORMAT, _("Output file has no ID3 tag"));
+        goto fail;
+    }
+    sink->xingpos = 10 + ((buf[6] & 0x7F) << 21 | (buf[7] & 0x7F) << 14 | (buf[8] & 0x7F) << 7 | (buf[9] & 0x7F));
+    sink->xinglen = 0;
+    reset_parser(sink);
+    audiopos = sink->xingpos;
+
+    /* the reserved Xing frame is zero behind the header, unless the
+       interrupted export closed the file */
+    if(offset > sink->xingpos)
+    {
+        if(fseek(sink->out, sink->xingpos, SEEK_SET) != 0)
+            goto seekfail;
+        len = fread(buf, 1, MIN(sizeof buf, (size_t)(offset - sink->xingpos)), sink->out);
+        sink->xinglen = len >= 4 ? mp3_frame_length(buf) : 0;
+        i = sink->xinglen >= 4 ? xing_offset(buf) : 0;
+        if(sink->xinglen < i + XING_DATA_SIZE || len < i + 4 ||
+           (memcmp(buf + i, "\0\0\0\0", 4) != 0 && memcmp(buf + i, "Xing", 4) != 0 &&
+            memcmp(buf + i, "Info", 4) != 0))
+        {
+            sink->xinglen = 0;
+            sink->xingpos = -1;
+        }
+        audiopos += sink->xinglen;
+    }
+    else
+        sink->xingpos = 0;	/* reserved by the first write */
+    if(audiopos + 4 <= offset)
+    {
+        if(fseek(sink->out, audiopos, SEEK_SET) != 0 || fread(sink->firsthdr, 4, 1, sink->out) != 1)
+        {
+            set_status_printf(status, HIMD_ERROR_BAD_DATA_FORMAT,
+                              _("Can't read MP3 data: %s"), g_strerror(errno));
+            goto fail;
+        }
+    }
+
+    if(fseek(sink->out, audiopos, SEEK_SET) != 0)
+        goto seekfail;
+    for(pos = audiopos; pos < offset; pos += len)
+    {
+        len = fread(buf, 1, MIN(sizeof buf, (size_t)(offset - pos)), sink->out);
+        if(len == 0)
+        {
+            set_status_printf(status, HIMD_ERROR_BAD_DATA_FORMAT,
+                              _("Can't read MP3 data: %s"), g_strerror(errno));
+            goto fail;
+        }
+        parse_frames(sink, buf, len);
+    }
+    if(fseek(sink->out, offset, SEEK_SET) != 0)
+        goto seekfail;
+    return 0;
+
+seekfail:
+    set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                      _("Can't seek in %s: %s"), filename, g_strerror(errno));
+fail:
+    fclose(sink->out);
+    return -1;
+}
+
+int himd_mp3sink_write(struct himd_mp3sink * sink, const unsigned char * data, unsigned int len, struct himderrinfo * status)
+{
+    unsigned char xing[1441];
+
+    g_return_val_if_fail(sink != NULL, -1);
+
+    /* reserve the Xing frame in front of the first audio frame */
+    if(sink->xingpos == 0)
+    {
+        sink->xingpos = -1;
+        if(len >= 4 && mp3_frame_length(data) >= 4)
+        {
+            memcpy(sink->firsthdr, data, 4);
+            sink->xinglen = make_xing_header(xing, data);
+            memset(xing + 4, 0, sink->xinglen - 4);
+            sink->xingpos = ftell(sink->out);
+            if(fwrite(xing, sink->xinglen, 1, sink->out) != 1)
+            {
+                set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                                  _("Can't write audio data: %s"), g_strerror(errno));
+                return -1;
+            }
+        }
+    }
+    parse_frames(sink, data, len);
+
+    HIMD_TRACE_BEGIN(write_scope, "write");
+    if(fwrite(data, len, 1, sink->out) != 1)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                          _("Can't write audio data: %s"), g_strerror(errno));
+        return -1;
+    }
+    HIMD_TRACE_END(write_scope);
+    return 0;
+}
+
+int himd_mp3sink_close(struct himd_mp3sink * sink, struct himderrinfo * status)
+{
+    unsigned char xing[1441];
+
+    g_return_val_if_fail(sink != NULL, -1);
+
+    if(sink->xingpos > 0 && sink->frames > 0)
+    {
+        make_xing_frame(sink, xing);
+        if(fseek(sink->out, sink->xingpos, SEEK_SET) != 0 ||
+           fwrite(xing, sink->xinglen, 1, sink->out) != 1)
+        {
+            set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                              _("Can't write Xing header: %s"), g_strerror(errno));
+            fclose(sink->out);
+            return -1;
+        }
+    }
+
+    if(fclose(sink->out) != 0)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                          _("Can't finish MP3 file: %s"), g_strerror(errno));
+        return -1;
+    }
+    return 0;
+}
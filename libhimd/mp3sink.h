@@ -0,0 +1,52 @@
+#ifndef INCLUDED_LIBHIMD_MP3SINK_H
+#define INCLUDED_LIBHIMD_MP3SINK_H
+
+#include <stdio.h>
+#include "himd.h"
+
+#define ID3_PADDING 4096
+
+/* number of frame offsets kept for building the seek table */
+#define MP3SINK_OFFSETS 4096
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Writes MPEG blocks as MP3 file, preceded by an ID3v2.4 tag built from
+   the track strings. The tag is written before the first audio block and
+   has ID3_PADDING bytes of padding for later edits.
+
+   A Xing frame is reserved in front of the audio data. The frame headers
+   are parsed while writing, and the frame count, byte count and seek table
+   are filled into the Xing frame on close. */
+struct himd_mp3sink {
+    FILE * out;
+    long xingpos;		/* file offset of the Xing frame */
+    unsigned int xinglen;	/* 0 until the first frame header was seen */
+    unsigned char firsthdr[4];
+    int vbr;
+
+    /* frame parser state */
+    unsigned char hdrbuf[4];
+    unsigned int hdrbytes;
+    unsigned int frameleft;
+
+    unsigned long frames;
+    unsigned long bytes;	/* audio bytes, without the Xing frame */
+    /* offsets[i] is the offset of frame i*stride in the audio data */
+    unsigned long offsets[MP3SINK_OFFSETS];
+    unsigned int stride;
+};
+
+int himd_mp3sink_open(struct himd_mp3sink * sink, const char * filename, const struct himd_tags * tags, struct himderrinfo * status);
+int himd_mp3sink_resume(struct himd_mp3sink * sink, const char * filename, long offset,
+                        const unsigned char * tail, unsigned int taillen, struct himderrinfo * status);
+int himd_mp3sink_write(struct himd_mp3sink * sink, const unsigned char * data, unsigned int len, struct himderrinfo * status);
+int himd_mp3sink_close(struct himd_mp3sink * sink, struct himderrinfo * status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
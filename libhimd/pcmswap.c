@@ -0,0 +1,82 @@
+#include <string.h>
+#include "himd.h"
+#include "himd_private.h"
+
+/* HiMD stores LPCM as big-endian 16 bit stereo, WAV and most other
+   consumers want native little-endian samples. Swapping the bytes is
+   the only conversion needed, so the fast paths just run pshufb over
+   the whole buffer. */
+
+static void pcm_swap16_generic(unsigned char * out, const unsigned char * in, size_t len)
+{
+    size_t i;
+    for(i = 0; i + 1 < len; i += 2)
+    {
+        unsigned char hi = in[i];
+        out[i] = in[i+1];
+        out[i+1] = hi;
+    }
+}
+
+#ifdef HIMD_X86_SIMD
+#include <immintrin.h>
+
+__attribute__((target("ssse3")))
+static void pcm_swap16_ssse3(unsigned char * out, const unsigned char * in, size_t len)
+{
+    const __m128i shuf = _mm_setr_epi8(1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14);
+    size_t i;
+
+    for(i = 0; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_shuffle_epi8(v, shuf));
+    }
+    pcm_swap16_generic(out + i, in + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void pcm_swap16_avx2(unsigned char * out, const unsigned char * in, size_t len)
+{
+    const __m256i shuf = _mm256_setr_epi8(1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14,
+                                          1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14);
+    size_t i;
+
+    for(i = 0; i + 64 <= len; i += 64)
+    {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)(in + i));
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(in + i + 32));
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_shuffle_epi8(v0, shuf));
+        _mm256_storeu_si256((__m256i *)(out + i + 32), _mm256_shuffle_epi8(v1, shuf));
+    }
+    pcm_swap16_ssse3(out + i, in + i, len - i);
+}
+#endif
+
+typedef void (*swap16_fn)(unsigned char *, const unsigned char *, size_t);
+
+static swap16_fn select_swap16(void)
+{
+#ifdef HIMD_X86_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        return pcm_swap16_avx2;
+    if(__builtin_cpu_supports("ssse3"))
+        return pcm_swap16_ssse3;
+#endif
+    return pcm_swap16_generic;
+}
+
+/**
+ * Convert big-endian 16 bit samples to little-endian ones.
+ * in and out may point to the same buffer, but must not overlap otherwise.
+ * An odd trailing byte is left alone.
+ */
+void pcm_swap16(unsigned char * out, const unsigned char * in, size_t len)
+{
+    /* Racing threads all store the same pointer, so no locking needed */
+    static swap16_fn impl;
+    if(!impl)
+        impl = select_swap16();
+    impl(out, in, len);
+}
@@ -0,0 +1,772 @@
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <glib.h>
+
+#include "himd.h"
+#include "himd_private.h"
+#include "recover.h"
+#include "trace.h"
+
+#define _(x) (x)
+
+#define RUN_BLOCKS 64		/* blocks read at once, 1 MB */
+#define MAX_BLOCKS 0x10000	/* block numbers in the TIF have 16 bits */
+#define MAX_FRAG_FRAMES 0xFF	/* frame numbers in fragments have 8 bits */
+
+#define TIF_PLAY_ORDER 0x100
+#define TIF_TRACKS 0x8000
+#define TIF_FRAGMENTS 0x30000
+#define TIF_STRINGS 0x40000
+
+#define SAMPLERATE 44100
+
+enum rcodec { RCODEC_MPEG, RCODEC_LPCM, RCODEC_ATRAC3, RCODEC_ATRAC3PLUS };
+
+struct rblock {
+    unsigned int block;
+    unsigned int serial;
+    unsigned int nframes;
+    unsigned int lendata;
+};
+
+/* the blocks of one track, as found in ATDATA */
+struct rgroup {
+    guint64 key;
+    unsigned int lo32;
+    enum rcodec codec;
+    GArray * blocks;		/* struct rblock */
+    GArray * frags;		/* struct fraginfo */
+    unsigned int tslot;		/* matching track of the template, 0 if none */
+    unsigned int torder;	/* its play order position, G_MAXUINT if none */
+    unsigned int wantslot;	/* slot the MP3 key needs, 0 if any will do */
+    unsigned int samples, rate;	/* per MP3 frame */
+    int split;			/* split off another group, not in the hash table */
+    struct himd_recovered_track info;
+};
+
+static unsigned char * tif_track(unsigned char * tif, unsigned int idx)
+{
+    return tif + TIF_TRACKS + 0x50 * idx;
+}
+
+static unsigned char * tif_frag(unsigned char * tif, unsigned int idx)
+{
+    return tif + TIF_FRAGMENTS + 0x10 * idx;
+}
+
+static unsigned char * tif_string(unsigned char * tif, unsigned int idx)
+{
+    return tif + TIF_STRINGS + 0x10 * idx;
+}
+
+static int codec_of_block(const unsigned char * type, enum rcodec * codec)
+{
+    if(memcmp(type, "LPCM", 4) == 0)
+        *codec = RCODEC_LPCM;
+    else if(memcmp(type, "A3D ", 4) == 0)
+        *codec = RCODEC_ATRAC3;
+    else if(memcmp(type, "ATX", 3) == 0)
+        *codec = RCODEC_ATRAC3PLUS;
+    else if(memcmp(type, "SMPA", 4) == 0 || memcmp(type, "SPMA", 4) == 0)
+        *codec = RCODEC_MPEG;
+    else
+        return -1;
+    return 0;
+}
+
+static int codec_matches(enum rcodec codec, const struct trackinfo * t)
+{
+    switch(codec)
+    {
+        case RCODEC_LPCM:
+            return t->codec_id == CODEC_LPCM;
+        case RCODEC_ATRAC3:
+            return t->codec_id == CODEC_ATRAC3;
+        case RCODEC_ATRAC3PLUS:
+            return t->codec_id == CODEC_ATRAC3PLUS_OR_MPEG && (t->codecinfo[0] & 3) == 0;
+        case RCODEC_MPEG:
+            return t->codec_id == CODEC_ATRAC3PLUS_OR_MPEG && (t->codecinfo[0] & 3) == 3;
+    }
+    return 0;
+}
+
+static struct rgroup * new_group(guint64 key, unsigned int lo32, enum rcodec codec)
+{
+    struct rgroup * g = g_new0(struct rgroup, 1);
+
+    g->key = key;
+    g->lo32 = lo32;
+    g->codec = codec;
+    g->blocks = g_array_new(FALSE, FALSE, sizeof(struct rblock));
+    g->frags = g_array_new(FALSE, FALSE, sizeof(struct fraginfo));
+    g->torder = G_MAXUINT;
+    return g;
+}
+
+static void free_group(gpointer data)
+{
+    struct rgroup * g = data;
+
+    g_array_free(g->blocks, TRUE);
+    g_array_free(g->frags, TRUE);
+    g_free(g);
+}
+
+/* Put a block into the group of its track. Blocks that are zero where
+   the type should be have never been written. */
+static void add_block(struct himd_recovery * rec, GHashTable * groups, unsigned int blockno,
+                      const unsigned char * data)
+{
+    static const unsigned char zero[4] = {0, 0, 0, 0};
+    struct rgroup * g;
+    struct rblock b;
+    enum rcodec codec;
+    guint64 key;
+
+    if(memcmp(data, zero, 4) == 0)
+    {
+        rec->blocks_empty++;
+        return;
+    }
+    b.block = blockno;
+    b.nframes = beword16(data + 4);
+    b.lendata = beword16(data + 8);
+    b.serial = beword32(data + 12);
+    if(codec_of_block(data, &codec) < 0 || memcmp(data, data + 16368, 4) != 0 ||
+       b.serial != beword32(data + 16380) ||
+       b.nframes == 0 || b.lendata == 0 || b.lendata > HIMD_AUDIO_SIZE)
+    {
+        rec->blocks_bad++;
+        return;
+    }
+
+    key = ((guint64)beword32(data + 16376) << 8) | codec;
+    g = g_hash_table_lookup(groups, &key);
+    if(!g)
+    {
+        g = new_group(key, beword32(data + 16376), codec);
+        g_hash_table_insert(groups, &g->key, g);
+    }
+    g_array_append_val(g->blocks, b);
+}
+
+/* One sequential pass over ATDATA */
+static int scan_atdata(struct himd_recovery * rec, GHashTable * groups, struct himderrinfo * status)
+{
+    struct himd_stats stats;
+    unsigned char * buffer;
+    unsigned int blockno = 0, got, i;
+    FILE * atdata;
+    int ret = 0;
+
+    atdata = himd_open_file(&rec->himd, "ATDATA", HIMD_READ_ONLY);
+    if(!atdata)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_OPEN_AUDIO,
+                          _("Can't open audio data: %s"), g_strerror(errno));
+        return -1;
+    }
+
+    memset(&stats, 0, sizeof stats);
+    buffer = g_malloc(RUN_BLOCKS * HIMD_BLOCKINFO_SIZE);
+    while(blockno < MAX_BLOCKS)
+    {
+        HIMD_TRACE_BEGIN(read_scope, "recover_read");
+        got = fread(buffer, HIMD_BLOCKINFO_SIZE, MIN(RUN_BLOCKS, MAX_BLOCKS - blockno), atdata);
+        HIMD_TRACE_END(read_scope);
+        stats.blocks_read += got;
+        stats.bytes_read += got * (unsigned long long)HIMD_BLOCKINFO_SIZE;
+        for(i = 0; i < got; i++)
+            add_block(rec, groups, blockno + i, buffer + i * HIMD_BLOCKINFO_SIZE);
+        blockno += got;
+        if(got == 0 || ferror(atdata))
+            break;
+    }
+    if(ferror(atdata))
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_READ_AUDIO,
+                          _("Read error on audio block %u: %s"), blockno, g_strerror(errno));
+        ret = -1;
+    }
+    rec->blocks_scanned = blockno;
+    himd_add_stats(&rec->himd, &stats);
+    g_free(buffer);
+    fclose(atdata);
+    return ret;
+}
+
+/* A TIF generation good enough to take keys and strings from */
+static unsigned char * load_template(struct himd * himd, const char * fileid)
+{
+    gchar * path = himd_file_path(himd, fileid);
+    gchar * data = NULL;
+    gsize len;
+
+    if(!g_file_get_contents(path, &data, &len, NULL) ||
+       len != HIMD_TIFFILE_SIZE || memcmp(data, "TIF ", 4) != 0)
+    {
+        g_free(data);
+        data = NULL;
+    }
+    g_free(path);
+    return (unsigned char *)data;
+}
+
+static int compare_serials(const void * a, const void * b)
+{
+    const struct rblock * ba = a, * bb = b;
+
+    if(ba->serial != bb->serial)
+        return ba->serial < bb->serial ? -1 : 1;
+    return ba->block < bb->block ? -1 : ba->block > bb->block;
+}
+
+/* Order the blocks of a group, drop repeated serial numbers */
+static void sort_group(struct rgroup * g)
+{
+    struct rblock * blocks;
+    unsigned int i, kept = 0;
+
+    g_array_sort(g->blocks, compare_serials);
+    blocks = (struct rblock *)g->blocks->data;
+    for(i = 0; i < g->blocks->len; i++)
+    {
+        if(kept > 0 && blocks[i].serial == blocks[kept-1].serial)
+        {
+            g->info.duplicates++;
+            continue;
+        }
+        if(kept > 0)
+            g->info.missing += blocks[i].serial - blocks[kept-1].serial - 1;
+        blocks[kept++] = blocks[i];
+    }
+    g_array_set_size(g->blocks, kept);
+}
+
+/* length of the MPEG audio layer III frame with header h, 0 if h is no such header */
+static unsigned int mp3_frame_length(const unsigned char * h, unsigned int * samples, unsigned int * rate)
+{
+    static const unsigned short bitrates[2][16] = {
+        { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0 },	/* MPEG-1 */
+        { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0 }	/* MPEG-2 and 2.5 */
+    };
+    static const unsigned int rates[3] = { 44100, 48000, 32000 };
+    unsigned int version, bitrate, rateidx, lsf;
+
+    if(h[0] != 0xFF || (h[1] & 0xE0) != 0xE0)
+        return 0;
+    version = (h[1] >> 3) & 3;		/* 3: MPEG-1, 2: MPEG-2, 0: MPEG-2.5 */
+    bitrate = h[2] >> 4;
+    rateidx = (h[2] >> 2) & 3;
+    if(version == 1 || ((h[1] >> 1) & 3) != 1 || bitrate == 0 || bitrate == 15 || rateidx == 3)
+        return 0;
+    lsf = version != 3;
+    *rate = rates[rateidx] >> (version == 3 ? 0 : version == 2 ? 1 : 2);
+    *samples = lsf ? 576 : 1152;
+    return (lsf ? 72 : 144) * bitrates[lsf][bitrate] * 1000 / *rate + ((h[2] >> 1) & 1);
+}
+
+static int unscrambled_header(const unsigned char * audio, unsigned int offset, const mp3key key,
+                              unsigned int * samples, unsigned int * rate)
+{
+    unsigned char h[4];
+    unsigned int i;
+
+    for(i = 0; i < 4; i++)
+        h[i] = audio[offset + i] ^ key[(offset + i) & 3];
+    return mp3_frame_length(h, samples, rate);
+}
+
+/* The MP3 key depends on the slot. The right one turns the first two
+   frames of the first block into valid headers. */
+static unsigned int find_mp3_slot(struct himd * himd, FILE * atdata, struct rgroup * g)
+{
+    const struct rblock * first = &g_array_index(g->blocks, struct rblock, 0);
+    unsigned char block[HIMD_BLOCKINFO_SIZE];
+    const unsigned char * audio = block + 32;
+    unsigned int slot, len, samples, rate, scrambled = first->lendata & ~7U;
+    mp3key key;
+
+    if(fseek(atdata, first->block * (long)HIMD_BLOCKINFO_SIZE, SEEK_SET) < 0 ||
+       fread(block, sizeof block, 1, atdata) != 1)
+        return 0;
+    for(slot = HIMD_FIRST_TRACK; slot <= HIMD_LAST_TRACK; slot++)
+    {
+        if(himd_obtain_mp3key(himd, slot, &key, NULL) < 0)
+            return 0;
+        if(scrambled < 4 || !(len = unscrambled_header(audio, 0, key, &samples, &rate)))
+            continue;
+        if(first->nframes > 1 &&
+           (len + 4 > scrambled || !unscrambled_header(audio, len, key, &samples, &rate)))
+            continue;
+        g->samples = samples;
+        g->rate = rate;
+        return slot;
+    }
+    return 0;
+}
+
+/* Fragments are runs of adjacent blocks, as long as their frame numbers fit */
+static void make_fragments(struct rgroup * g)
+{
+    const struct rblock * blocks = (const struct rblock *)g->blocks->data;
+    struct fraginfo f;
+    unsigned int i;
+
+    for(i = 0; i < g->blocks->len; i++)
+    {
+        if(i == 0 || blocks[i].block != blocks[i-1].block + 1)
+        {
+            if(i > 0)
+                g_array_append_val(g->frags, f);
+            memset(&f, 0, sizeof f);
+            f.firstblock = blocks[i].block;
+        }
+        f.lastblock = blocks[i].block;
+        /* MPEG fragments count the frames of their last block, the others
+           give the index of the last frame */
+        f.lastframe = MIN(blocks[i].nframes, MAX_FRAG_FRAMES);
+        if(g->codec != RCODEC_MPEG)
+            f.lastframe--;
+    }
+    if(g->blocks->len > 0)
+        g_array_append_val(g->frags, f);
+}
+
+/* the template fragment of track tslot holding block */
+static int template_frag(struct himd * tmpl, unsigned int tslot, unsigned int block, struct fraginfo * f)
+{
+    struct trackinfo t;
+    unsigned int fragnum, count = 0;
+
+    if(himd_get_track_info(tmpl, tslot, &t, NULL) < 0)
+        return -1;
+    for(fragnum = t.firstfrag; fragnum >= HIMD_FIRST_FRAGMENT && fragnum <= HIMD_LAST_FRAGMENT &&
+        count++ <= HIMD_LAST_FRAGMENT; fragnum = f->nextfrag)
+    {
+        if(himd_get_fragment_info(tmpl, fragnum, f, NULL) < 0)
+            return -1;
+        if(block >= f->firstblock && block <= f->lastblock)
+            return 0;
+    }
+    return -1;
+}
+
+/* Take the key of a fragment from the template. A fragment starting or
+   ending where one of the template does gets its frame numbers as well,
+   a track split inside a block plays only its frames of it. */
+static int template_fraginfo(struct himd * tmpl, unsigned int tslot, enum rcodec codec, struct fraginfo * f)
+{
+    struct fraginfo tf;
+
+    if(template_frag(tmpl, tslot, f->lastblock, &tf) == 0 && tf.lastblock == f->lastblock &&
+       codec != RCODEC_MPEG)
+        f->lastframe = tf.lastframe;
+    if(template_frag(tmpl, tslot, f->firstblock, &tf) < 0)
+        return -1;
+    memcpy(f->key, tf.key, sizeof tf.key);
+    if(tf.firstblock == f->firstblock && codec != RCODEC_MPEG)
+        f->firstframe = tf.firstframe;
+    return 0;
+}
+
+/* Track info for a group without a template, as much as the blocks tell */
+static void make_trackinfo(struct rgroup * g, struct trackinfo * t)
+{
+    const struct rblock * blocks = (const struct rblock *)g->blocks->data;
+    unsigned long long frames = 0, samples;
+    unsigned int i, maxframes = 0, framesize = 0;
+
+    memset(t, 0, sizeof *t);
+    for(i = 0; i < g->blocks->len; i++)
+    {
+        frames += blocks[i].nframes;
+        if(blocks[i].nframes > maxframes)
+        {
+            maxframes = blocks[i].nframes;
+            framesize = blocks[i].lendata / maxframes & ~7U;
+        }
+    }
+
+    switch(g->codec)
+    {
+        case RCODEC_MPEG:
+            t->codec_id = CODEC_ATRAC3PLUS_OR_MPEG;
+            t->codecinfo[0] = 3;
+            samples = frames * (g->samples ? g->samples : 1152);
+            t->seconds = samples / (g->rate ? g->rate : SAMPLERATE);
+            break;
+        case RCODEC_LPCM:
+            t->codec_id = CODEC_LPCM;
+            t->seconds = frames * (HIMD_LPCM_FRAMESIZE / 4) / SAMPLERATE;
+            break;
+        case RCODEC_ATRAC3:
+            /* 44.1 kHz, frame size in units of 8 bytes */
+            t->codec_id = CODEC_ATRAC3;
+            t->codecinfo[1] = 0x20;
+            t->codecinfo[2] = framesize / 8;
+            t->seconds = frames * HIMD_ATRAC3_SAMPLES_PER_FRAME / SAMPLERATE;
+            break;
+        case RCODEC_ATRAC3PLUS:
+            t->codec_id = CODEC_ATRAC3PLUS_OR_MPEG;
+            t->codecinfo[1] = 0x20;
+            t->codecinfo[2] = framesize > 0 ? framesize / 8 - 1 : 0;
+            t->seconds = frames * HIMD_ATRAC3P_SAMPLES_PER_FRAME / SAMPLERATE;
+            break;
+    }
+    setbeword32(t->contentid + 16, g->lo32);
+}
+
+static int compare_groups(const void * a, const void * b)
+{
+    const struct rgroup * ga = *(struct rgroup * const *)a, * gb = *(struct rgroup * const *)b;
+    unsigned int firsta = g_array_index(ga->blocks, struct rblock, 0).block;
+    unsigned int firstb = g_array_index(gb->blocks, struct rblock, 0).block;
+
+    if(ga->torder != gb->torder)
+        return ga->torder < gb->torder ? -1 : 1;
+    return firsta < firstb ? -1 : firsta > firstb;
+}
+
+/* An empty TIF: all slots are on the free lists */
+static unsigned char * blank_tif(void)
+{
+    unsigned char * tif = g_malloc0(HIMD_TIFFILE_SIZE);
+    unsigned int i;
+
+    memcpy(tif, "TIF ", 4);
+    for(i = 0; i <= HIMD_LAST_STRING; i++)
+        setbeword16(tif_string(tif, i) + 14, i < HIMD_LAST_STRING ? i + 1 : 0);
+    return tif;
+}
+
+/* Splitting a track keeps the content ID, so a recording can belong to
+   several tracks of the template. Each of them gets the blocks its
+   fragments cover, a block split between two tracks goes to both. Blocks
+   none of them covers, cut out or of a deleted part, stay in g as a
+   track of their own. If the fragments cover nothing at all, the first
+   track with the content ID gets all blocks. */
+static void match_template(struct rgroup * g, struct himd * tmpl, GPtrArray * list)
+{
+    GPtrArray * parts = g_ptr_array_new();
+    struct rgroup * part;
+    struct trackinfo t;
+    struct fraginfo f;
+    struct rblock * b;
+    unsigned char * covered = g_malloc(MAX_BLOCKS), * claimed = g_malloc0(MAX_BLOCKS);
+    unsigned int i, j, k, count, slot, fragnum, n, block, firstslot = 0, firstorder = 0;
+    GArray * rest;
+
+    count = MIN(himd_track_count(tmpl), HIMD_LAST_TRACK);
+    for(j = 0; j < count; j++)
+    {
+        slot = himd_get_trackslot(tmpl, j, NULL);
+        if(slot < HIMD_FIRST_TRACK || slot > HIMD_LAST_TRACK ||
+           himd_get_track_info(tmpl, slot, &t, NULL) < 0 ||
+           beword32(t.contentid + 16) != g->lo32 || !codec_matches(g->codec, &t))
+            continue;
+        if(!firstslot)
+        {
+            firstslot = slot;
+            firstorder = j;
+        }
+
+        memset(covered, 0, MAX_BLOCKS);
+        for(fragnum = t.firstfrag, n = 0; fragnum >= HIMD_FIRST_FRAGMENT && fragnum <= HIMD_LAST_FRAGMENT &&
+            n++ <= HIMD_LAST_FRAGMENT; fragnum = f.nextfrag)
+        {
+            if(himd_get_fragment_info(tmpl, fragnum, &f, NULL) < 0)
+                break;
+            for(block = f.firstblock; block <= f.lastblock && block < MAX_BLOCKS; block++)
+                covered[block] = 1;
+        }
+        part = new_group(g->key, g->lo32, g->codec);
+        part->tslot = slot;
+        part->torder = j;
+        part->split = 1;
+        for(k = 0; k < g->blocks->len; k++)
+        {
+            b = &g_array_index(g->blocks, struct rblock, k);
+            if(covered[b->block])
+            {
+                g_array_append_val(part->blocks, *b);
+                claimed[b->block] = 1;
+            }
+        }
+        if(part->blocks->len)
+            g_ptr_array_add(parts, part);
+        else
+            free_group(part);
+    }
+
+    if(parts->len == 0)
+    {
+        g->tslot = firstslot;
+        g->torder = firstslot ? firstorder : G_MAXUINT;
+    }
+    else
+    {
+        rest = g_array_new(FALSE, FALSE, sizeof(struct rblock));
+        for(k = 0; k < g->blocks->len; k++)
+            if(!claimed[g_array_index(g->blocks, struct rblock, k).block])
+                g_array_append_val(rest, g_array_index(g->blocks, struct rblock, k));
+        g_array_free(g->blocks, TRUE);
+        g->blocks = rest;
+        i = 0;
+        if(rest->len == 0)
+        {
+            /* g becomes the first part */
+            part = g_ptr_array_index(parts, 0);
+            g_array_free(g->blocks, TRUE);
+            g->blocks = part->blocks;
+            part->blocks = g_array_new(FALSE, FALSE, sizeof(struct rblock));
+            g->tslot = part->tslot;
+            g->torder = part->torder;
+            free_group(part);
+            i = 1;
+        }
+        for(; i < parts->len; i++)
+            g_ptr_array_add(list, g_ptr_array_index(parts, i));
+    }
+    g_ptr_array_free(parts, TRUE);
+    g_free(covered);
+    g_free(claimed);
+}
+
+/* Match the groups with the tracks of the template and find their slots */
+static void identify_groups(struct himd_recovery * rec, struct himd * tmpl, GPtrArray * list)
+{
+    struct rgroup * g;
+    unsigned int i;
+    FILE * atdata = himd_open_file(&rec->himd, "ATDATA", HIMD_READ_ONLY);
+
+    /* parts of recordings split between tracks are added to list */
+    for(i = 0; i < list->len; i++)
+    {
+        g = g_ptr_array_index(list, i);
+        if(tmpl && !g->tslot)
+            match_template(g, tmpl, list);
+        sort_group(g);
+        if(g->tslot)
+            g->wantslot = g->codec == RCODEC_MPEG ? g->tslot : 0;
+        else if(g->codec == RCODEC_MPEG && atdata)
+            g->wantslot = find_mp3_slot(&rec->himd, atdata, g);
+    }
+    if(atdata)
+        fclose(atdata);
+}
+
+/* Give every group a slot, those whose MP3 key needs one first */
+static void assign_slots(struct himd_recovery * rec, GPtrArray * list)
+{
+    struct rgroup * g;
+    unsigned char used[HIMD_LAST_TRACK + 1];
+    unsigned int i, slot = HIMD_FIRST_TRACK;
+
+    memset(used, 0, sizeof used);
+    for(i = 0; i < list->len; i++)
+    {
+        g = g_ptr_array_index(list, i);
+        if(g->tslot && !used[g->tslot])
+            g->info.slot = g->tslot;
+        else if(g->wantslot && !used[g->wantslot])
+            g->info.slot = g->wantslot;
+        else
+            continue;
+        used[g->info.slot] = 1;
+    }
+    for(i = 0; i < list->len; i++)
+    {
+        g = g_ptr_array_index(list, i);
+        if(g->info.slot)
+            continue;
+        while(slot <= HIMD_LAST_TRACK && used[slot])
+            slot++;
+        if(slot > HIMD_LAST_TRACK)
+        {
+            rec->tracks_dropped++;
+            continue;
+        }
+        g->info.slot = slot;
+        used[slot] = 1;
+        g->info.slot_conflict = g->codec == RCODEC_MPEG;
+    }
+}
+
+/* Write the tracks and fragments of the groups into the new TIF */
+static void build_tif(struct himd_recovery * rec, struct himd * tmpl, GPtrArray * list)
+{
+    unsigned char * tif = rec->tifdata;
+    struct rgroup * g;
+    struct fraginfo * f;
+    struct trackinfo t;
+    GArray * tracks = g_array_new(FALSE, FALSE, sizeof(struct himd_recovered_track));
+    unsigned int i, j, nextfrag = HIMD_FIRST_FRAGMENT, count = 0, lastfree = 0;
+
+    memset(tif + TIF_PLAY_ORDER, 0, 2 + 2 * HIMD_LAST_TRACK);
+    memset(tif + TIF_TRACKS, 0, 0x50 * (HIMD_LAST_TRACK + 1));
+    memset(tif + TIF_FRAGMENTS, 0, 0x10 * (HIMD_LAST_FRAGMENT + 1));
+
+    for(i = 0; i < list->len; i++)
+    {
+        g = g_ptr_array_index(list, i);
+        if(!g->info.slot)
+            continue;
+        make_fragments(g);
+        if(nextfrag + g->frags->len - 1 > HIMD_LAST_FRAGMENT)
+        {
+            g->info.slot = 0;
+            rec->tracks_dropped++;
+            continue;
+        }
+
+        if(g->tslot && himd_get_track_info(tmpl, g->tslot, &t, NULL) >= 0)
+            g->info.from_template = 1;
+        else
+            make_trackinfo(g, &t);
+        t.firstfrag = nextfrag;
+        t.tracknum = g->info.slot;
+
+        for(j = 0; j < g->frags->len; j++)
+        {
+            f = &g_array_index(g->frags, struct fraginfo, j);
+            if(g->codec != RCODEC_MPEG &&
+               (!g->info.from_template || template_fraginfo(tmpl, g->tslot, g->codec, f) < 0))
+                g->info.keys_lost = 1;
+            f->nextfrag = j + 1 < g->frags->len ? nextfrag + 1 : 0;
+            setfrag(f, tif_frag(tif, nextfrag++));
+        }
+        settrack(&t, tif_track(tif, g->info.slot));
+        setbeword16(tif + TIF_PLAY_ORDER + 2 + 2 * count++, g->info.slot);
+
+        g_strlcpy(g->info.codec, himd_get_codec_name(&t), sizeof g->info.codec);
+        g->info.lo32_contentid = g->lo32;
+        g->info.firstblock = g_array_index(g->blocks, struct rblock, 0).block;
+        g->info.blocks = g->blocks->len;
+        g->info.fragments = g->frags->len;
+        g->info.seconds = t.seconds;
+        g_array_append_val(tracks, g->info);
+    }
+    setbeword16(tif + TIF_PLAY_ORDER, count);
+
+    /* free lists, slot 0 holds their heads */
+    for(i = HIMD_FIRST_TRACK; i <= HIMD_LAST_TRACK; i++)
+        if(beword16(tif_track(tif, i) + 36) == 0)
+        {
+            setbeword16(tif_track(tif, lastfree) + 38, i);
+            lastfree = i;
+        }
+    for(i = nextfrag; i <= HIMD_LAST_FRAGMENT; i++)
+        setbeword16(tif_frag(tif, i) + 14, i < HIMD_LAST_FRAGMENT ? i + 1 : 0);
+    setbeword16(tif_frag(tif, 0) + 14, nextfrag <= HIMD_LAST_FRAGMENT ? nextfrag : 0);
+
+    rec->ntracks = tracks->len;
+    rec->tracks = (struct himd_recovered_track *)g_array_free(tracks, FALSE);
+}
+
+/**
+ * Rebuild the TIF of the HiMD at himdroot from ATDATA. The result is
+ * only in memory, see himd_recover_write.
+ *
+ * @param himdroot The directory holding HMDHIFI
+ * @param rec Filled with the new TIF and what went into it, free with himd_recover_free
+ * @param status Pointer to himderrinfo, returns error code after operation
+ *
+ * @return Returns 0 if successful, -1 otherwise
+ */
+int himd_recover_scan(const char * himdroot, struct himd_recovery * rec, struct himderrinfo * status)
+{
+    GHashTable * groups;
+    GHashTableIter iter;
+    GPtrArray * list;
+    gpointer value;
+    struct himd tmpl;
+    unsigned char * template = NULL;
+    unsigned int i;
+
+    g_return_val_if_fail(himdroot != NULL, -1);
+    g_return_val_if_fail(rec != NULL, -1);
+
+    memset(rec, 0, sizeof *rec);
+    if(himd_locate(&rec->himd, himdroot, status) < 0)
+        return -1;
+
+    groups = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, free_group);
+    HIMD_TRACE_BEGIN(scan_scope, "recover_scan");
+    if(scan_atdata(rec, groups, status) < 0)
+    {
+        g_hash_table_destroy(groups);
+        g_free(rec->himd.rootpath);
+        return -1;
+    }
+    HIMD_TRACE_END(scan_scope);
+
+    /* the current TIF may be only partly damaged, the previous one is
+       the next best source of keys and strings */
+    if((template = load_template(&rec->himd, "TRKIDX")))
+        rec->template_name = "TRKIDX";
+    else if((template = load_template(&rec->himd, "_RKIDX")))
+        rec->template_name = "_RKIDX";
+    if(template)
+    {
+        tmpl = rec->himd;
+        tmpl.tifdata = template;
+        rec->tifdata = g_malloc(HIMD_TIFFILE_SIZE);
+        memcpy(rec->tifdata, template, HIMD_TIFFILE_SIZE);
+    }
+    else
+        rec->tifdata = blank_tif();
+
+    list = g_ptr_array_new();
+    g_hash_table_iter_init(&iter, groups);
+    while(g_hash_table_iter_next(&iter, NULL, &value))
+        g_ptr_array_add(list, value);
+
+    identify_groups(rec, template ? &tmpl : NULL, list);
+    g_ptr_array_sort(list, compare_groups);
+    assign_slots(rec, list);
+    build_tif(rec, template ? &tmpl : NULL, list);
+
+    /* groups split off by identify_groups are not in the hash table */
+    for(i = 0; i < list->len; i++)
+        if(((struct rgroup *)g_ptr_array_index(list, i))->split)
+            free_group(g_ptr_array_index(list, i));
+    g_ptr_array_free(list, TRUE);
+    g_hash_table_destroy(groups);
+    g_free(template);
+    return 0;
+}
+
+int himd_recover_write(struct himd_recovery * rec, struct himderrinfo * status)
+{
+    gchar * path;
+    GError * error = NULL;
+    int ret = 0;
+
+    g_return_val_if_fail(rec != NULL, -1);
+    g_return_val_if_fail(rec->tifdata != NULL, -1);
+
+    path = himd_file_path(&rec->himd, "TRKIDX");
+    if(!g_file_set_contents(path, (const gchar *)rec->tifdata, HIMD_TIFFILE_SIZE, &error))
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                          _("Can't write %s: %s"), path, error->message);
+        g_error_free(error);
+        ret = -1;
+    }
+    g_free(path);
+    return ret;
+}
+
+void himd_recover_free(struct himd_recovery * rec)
+{
+    g_free(rec->tracks);
+    g_free(rec->tifdata);
+    g_free(rec->himd.discid);
+    g_free(rec->himd.rootpath);
+    rec->tracks = NULL;
+    rec->tifdata = NULL;
+    rec->himd.discid = NULL;
+    rec->himd.rootpath = NULL;
+}
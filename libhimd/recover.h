@@ -0,0 +1,57 @@
+#ifndef INCLUDED_LIBHIMD_RECOVER_H
+#define INCLUDED_LIBHIMD_RECOVER_H
+
+#include "himd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct himd_recovered_track {
+    unsigned int slot;
+    char codec[5];		/* as from himd_get_codec_name */
+    unsigned int lo32_contentid;
+    unsigned int firstblock;	/* block with the lowest serial number */
+    unsigned int blocks;
+    unsigned int fragments;
+    unsigned int seconds;
+    unsigned int missing;	/* serial numbers missing between the first and last block */
+    unsigned int duplicates;	/* blocks dropped for repeating a serial number */
+    int from_template;		/* keys and strings come from an intact TIF */
+    int keys_lost;		/* encrypted audio without its keys, can't be played */
+    int slot_conflict;		/* MP3 audio not in the slot its key was made for */
+};
+
+/* A TIF rebuilt from the block headers in ATDATA, for discs whose track
+   index is lost or damaged. Blocks are grouped into tracks by the low
+   word of their content ID and their codec, ordered by serial number,
+   and adjacent blocks become fragments. Keys, strings and the play order
+   are taken from the current or the previous TIF generation where their
+   content IDs match; MP3 tracks without a match are put into the slot
+   that unscrambles their first frames. A recording split into several
+   tracks is divided along their fragments in that TIF. Blocks of deleted
+   tracks are still in ATDATA, so those tracks come back as well, as do
+   parts cut off a track. */
+struct himd_recovery {
+    struct himd himd;		/* located, but without a TIF */
+    unsigned char * tifdata;	/* the rebuilt TIF */
+    const char * template_name;	/* "TRKIDX", "_RKIDX" or NULL if built from scratch */
+    unsigned int blocks_scanned;
+    unsigned int blocks_empty;
+    unsigned int blocks_bad;	/* inconsistent headers or unknown block types */
+    unsigned int tracks_dropped;	/* did not fit into the TIF */
+    unsigned int ntracks;
+    struct himd_recovered_track * tracks;	/* in the new play order */
+};
+
+/* One sequential pass over ATDATA, nothing is written */
+int himd_recover_scan(const char * himdroot, struct himd_recovery * rec, struct himderrinfo * status);
+/* Replace the TRKIDX file with the rebuilt TIF, _RKIDX is left alone */
+int himd_recover_write(struct himd_recovery * rec, struct himderrinfo * status);
+void himd_recover_free(struct himd_recovery * rec);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
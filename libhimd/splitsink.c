@@ -0,0 +1,342 @@
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "himd.h"
+#include "himd_private.h"
+#include "splitsink.h"
+
+#define _(x) (x)
+
+#define FRAME_SAMPLES (HIMD_LPCM_FRAMESIZE / 4)
+#define CD_FRAME_SAMPLES 588	/* cue sheets count in 1/75 seconds */
+
+/* Check whether no big-endian sample in the buffer exceeds threshold in
+   magnitude. */
+static int quiet_generic(const unsigned char * in, size_t len, unsigned int threshold)
+{
+    size_t i;
+    int s;
+
+    for(i = 0; i + 1 < len; i += 2)
+    {
+        s = (short)(in[i] << 8 | in[i+1]);
+        if((unsigned int)(s < 0 ? -s : s) > threshold)
+            return 0;
+    }
+    return 1;
+}
+
+#ifdef HIMD_X86_SIMD
+#include <immintrin.h>
+
+/* The magnitudes are compared unsigned by flipping their sign bits, as
+   the magnitude of -32768 does not fit a signed 16 bit value. */
+
+__attribute__((target("ssse3")))
+static int quiet_ssse3(const unsigned char * in, size_t len, unsigned int threshold)
+{
+    const __m128i shuf = _mm_setr_epi8(1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14);
+    const __m128i bias = _mm_set1_epi16((short)0x8000);
+    const __m128i limit = _mm_xor_si128(_mm_set1_epi16((short)threshold), bias);
+    size_t i;
+
+    for(i = 0; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(in + i)), shuf);
+        __m128i mag = _mm_xor_si128(_mm_abs_epi16(v), bias);
+        if(_mm_movemask_epi8(_mm_cmpgt_epi16(mag, limit)))
+            return 0;
+    }
+    return quiet_generic(in + i, len - i, threshold);
+}
+
+__attribute__((target("avx2")))
+static int quiet_avx2(const unsigned char * in, size_t len, unsigned int threshold)
+{
+    const __m256i shuf = _mm256_setr_epi8(1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14,
+                                          1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14);
+    const __m256i bias = _mm256_set1_epi16((short)0x8000);
+    const __m256i limit = _mm256_xor_si256(_mm256_set1_epi16((short)threshold), bias);
+    size_t i;
+
+    for(i = 0; i + 32 <= len; i += 32)
+    {
+        __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(in + i)), shuf);
+        __m256i mag = _mm256_xor_si256(_mm256_abs_epi16(v), bias);
+        if(_mm256_movemask_epi8(_mm256_cmpgt_epi16(mag, limit)))
+            return 0;
+    }
+    return quiet_ssse3(in + i, len - i, threshold);
+}
+#endif
+
+typedef int (*quiet_fn)(const unsigned char *, size_t, unsigned int);
+
+static quiet_fn select_quiet(void)
+{
+#ifdef HIMD_X86_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        return quiet_avx2;
+    if(__builtin_cpu_supports("ssse3"))
+        return quiet_ssse3;
+#endif
+    return quiet_generic;
+}
+
+static int open_part(struct himd_splitsink * sink, struct himderrinfo * status)
+{
+    struct himd_tags parttags;
+    gchar * filename;
+    int ret;
+
+    sink->part++;
+    sink->partloud = 0;
+    g_array_append_val((GArray *)sink->starts, sink->pos);
+
+    filename = g_strdup_printf("%s-%02u.%s", sink->basename, sink->part,
+                               sink->format == HIMD_SPLIT_FLAC ? "flac" : "wav");
+    if(sink->format == HIMD_SPLIT_FLAC)
+    {
+        memset(&parttags, 0, sizeof parttags);
+        if(sink->tags)
+            parttags = *sink->tags;
+        parttags.trackinalbum = sink->part;
+        ret = himd_flacsink_open(&sink->flac, filename, &parttags, 0, status);
+    }
+    else
+        ret = himd_wavsink_open(&sink->wav, filename, status);
+    g_free(filename);
+    return ret;
+}
+
+static int close_part(struct himd_splitsink * sink, struct himderrinfo * status)
+{
+    if(sink->format == HIMD_SPLIT_FLAC)
+        return himd_flacsink_close(&sink->flac, status);
+    return himd_wavsink_close(&sink->wav, status);
+}
+
+static int part_write(struct himd_splitsink * sink, const unsigned char * data, unsigned int frames, struct himderrinfo * status)
+{
+    unsigned int len = frames * HIMD_LPCM_FRAMESIZE, n;
+
+    sink->pos += frames;
+    if(sink->format == HIMD_SPLIT_FLAC)
+        return himd_flacsink_write(&sink->flac, data, len, status);
+
+    /* the WAV sink takes at most one block at once */
+    for(; len; len -= n, data += n)
+    {
+        n = MIN(len, HIMD_AUDIO_SIZE);
+        if(himd_wavsink_write(&sink->wav, data, n, status) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int flush_held(struct himd_splitsink * sink, struct himderrinfo * status)
+{
+    unsigned int frames = sink->heldframes;
+
+    sink->heldframes = 0;
+    return part_write(sink, sink->held, frames, status);
+}
+
+/* The silence run just got long enough: cut half-way into it */
+static int cut(struct himd_splitsink * sink, struct himderrinfo * status)
+{
+    unsigned int first = sink->minframes / 2;
+
+    sink->heldframes = 0;
+    if(part_write(sink, sink->held, first, status) < 0 ||
+       close_part(sink, status) < 0 ||
+       open_part(sink, status) < 0)
+        return -1;
+    return part_write(sink, sink->held + first * HIMD_LPCM_FRAMESIZE,
+                      sink->minframes - first, status);
+}
+
+/**
+ * Start splitting. Samples up to threshold_db (dBFS) count as silence,
+ * a cut needs min_silence seconds of it, at most HIMD_SPLIT_MAX_SILENCE.
+ * tags may be NULL; FLAC parts get the given tags with the part number
+ * as track number.
+ */
+int himd_splitsink_open(struct himd_splitsink * sink, const char * basename, enum himd_split_format format,
+                        const struct himd_tags * tags, double threshold_db, double min_silence,
+                        struct himderrinfo * status)
+{
+    g_return_val_if_fail(sink != NULL, -1);
+    g_return_val_if_fail(basename != NULL, -1);
+    g_return_val_if_fail(min_silence <= HIMD_SPLIT_MAX_SILENCE, -1);
+
+    sink->minframes = MAX(2, (unsigned int)(min_silence * 44100 / FRAME_SAMPLES));
+    sink->held = g_try_malloc(sink->minframes * HIMD_LPCM_FRAMESIZE);
+    if(!sink->held)
+    {
+        set_status_printf(status, HIMD_ERROR_OUT_OF_MEMORY,
+                          _("Can't hold %g seconds of silence in memory"), min_silence);
+        return -1;
+    }
+    sink->basename = g_strdup(basename);
+    sink->format = format;
+    sink->tags = tags;
+    sink->threshold = MIN(32768, (unsigned int)(32768 * pow(10, threshold_db / 20)));
+    sink->heldframes = 0;
+    sink->insilence = 0;
+    sink->part = 0;
+    sink->pos = 0;
+    sink->starts = g_array_new(FALSE, FALSE, sizeof(unsigned long long));
+
+    if(open_part(sink, status) < 0)
+    {
+        g_array_free(sink->starts, TRUE);
+        g_free(sink->held);
+        g_free(sink->basename);
+        return -1;
+    }
+    return 0;
+}
+
+int himd_splitsink_write(struct himd_splitsink * sink, const unsigned char * data, unsigned int len, struct himderrinfo * status)
+{
+    /* Racing threads all store the same pointer, so no locking needed */
+    static quiet_fn quiet;
+    unsigned int frames = len / HIMD_LPCM_FRAMESIZE;
+    unsigned int i, run = 0;
+    const unsigned char * frame;
+
+    g_return_val_if_fail(sink != NULL, -1);
+
+    if(!quiet)
+        quiet = select_quiet();
+
+    /* frames run..i-1 are passed on to the open part unchanged */
+    for(i = 0; i < frames; i++)
+    {
+        frame = data + i * HIMD_LPCM_FRAMESIZE;
+        if(!quiet(frame, HIMD_LPCM_FRAMESIZE, sink->threshold))
+        {
+            if(sink->heldframes && flush_held(sink, status) < 0)
+                return -1;
+            sink->insilence = 0;
+            sink->partloud = 1;
+            continue;
+        }
+
+        /* leading silence of a part and the rest of a silence that
+           already caused a cut stay where they are */
+        if(sink->insilence || !sink->partloud)
+            continue;
+
+        if(part_write(sink, data + run * HIMD_LPCM_FRAMESIZE, i - run, status) < 0)
+            return -1;
+        run = i + 1;
+        memcpy(sink->held + sink->heldframes * HIMD_LPCM_FRAMESIZE, frame, HIMD_LPCM_FRAMESIZE);
+        if(++sink->heldframes == sink->minframes)
+        {
+            if(cut(sink, status) < 0)
+                return -1;
+            sink->insilence = 1;
+        }
+    }
+    return part_write(sink, data + run * HIMD_LPCM_FRAMESIZE, frames - run, status);
+}
+
+static void cue_time(GString * cue, unsigned long long frames)
+{
+    unsigned long long cdframes = frames * FRAME_SAMPLES / CD_FRAME_SAMPLES;
+
+    g_string_append_printf(cue, "%02u:%02u:%02u", (unsigned int)(cdframes / (75*60)),
+                           (unsigned int)(cdframes / 75 % 60), (unsigned int)(cdframes % 75));
+}
+
+/* Cue sheet strings are quoted, so replace quotes in them */
+static void cue_string(GString * cue, const char * indent, const char * cmd, const char * value)
+{
+    const char * c;
+
+    if(!value || !*value)
+        return;
+    g_string_append_printf(cue, "%s%s \"", indent, cmd);
+    for(c = value; *c; c++)
+        g_string_append_c(cue, *c == '"' ? '\'' : *c);
+    g_string_append(cue, "\"\n");
+}
+
+static int write_cue(struct himd_splitsink * sink, struct himderrinfo * status)
+{
+    GArray * starts = sink->starts;
+    GString * cue = g_string_new("");
+    GError * err = NULL;
+    gchar * filename, * partname;
+    gchar * basename = g_path_get_basename(sink->basename);
+    unsigned int i;
+    int ret = 0;
+
+    if(sink->tags)
+    {
+        cue_string(cue, "", "PERFORMER", sink->tags->artist);
+        cue_string(cue, "", "TITLE", sink->tags->title);
+    }
+    for(i = 0; i < starts->len; i++)
+    {
+        /* the parts are next to the cue sheet */
+        partname = g_strdup_printf("%s-%02u.%s", basename, i+1,
+                                   sink->format == HIMD_SPLIT_FLAC ? "flac" : "wav");
+        g_string_append_printf(cue, "FILE \"%s\" WAVE\n", partname);
+        g_free(partname);
+        g_string_append_printf(cue, "  TRACK %02u AUDIO\n", i+1);
+        g_string_append(cue, "    REM RECORDING_OFFSET ");
+        cue_time(cue, g_array_index(starts, unsigned long long, i));
+        g_string_append(cue, "\n    INDEX 01 00:00:00\n");
+    }
+
+    filename = g_strdup_printf("%s.cue", sink->basename);
+    if(!g_file_set_contents(filename, cue->str, cue->len, &err))
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                          _("Can't write cue sheet: %s"), err->message);
+        g_error_free(err);
+        ret = -1;
+    }
+    g_free(filename);
+    g_free(basename);
+    g_string_free(cue, TRUE);
+    return ret;
+}
+
+/* Closes the open part in any case */
+int himd_splitsink_close(struct himd_splitsink * sink, struct himderrinfo * status)
+{
+    int ret = 0;
+
+    g_return_val_if_fail(sink != NULL, -1);
+
+    if(sink->heldframes && flush_held(sink, status) < 0)
+        ret = -1;
+    if(close_part(sink, ret < 0 ? NULL : status) < 0)
+        ret = -1;
+
+    /* a last part holding nothing but the end of the final silence
+       is not worth keeping */
+    if(ret == 0 && sink->part > 1 && !sink->partloud)
+    {
+        gchar * filename = g_strdup_printf("%s-%02u.%s", sink->basename, sink->part,
+                                           sink->format == HIMD_SPLIT_FLAC ? "flac" : "wav");
+        g_remove(filename);
+        g_free(filename);
+        g_array_set_size(sink->starts, --sink->part);
+    }
+    if(ret == 0 && write_cue(sink, status) < 0)
+        ret = -1;
+
+    g_array_free(sink->starts, TRUE);
+    g_free(sink->held);
+    g_free(sink->basename);
+    return ret;
+}
@@ -0,0 +1,55 @@
+#ifndef INCLUDED_LIBHIMD_SPLITSINK_H
+#define INCLUDED_LIBHIMD_SPLITSINK_H
+
+#include "himd.h"
+#include "wavsink.h"
+#include "flacsink.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum himd_split_format { HIMD_SPLIT_WAV, HIMD_SPLIT_FLAC };
+
+/* longest minimum silence in seconds, as that much audio is held in memory */
+#define HIMD_SPLIT_MAX_SILENCE 300
+
+/* Writes decrypted LPCM blocks into a series of WAV or FLAC files, starting
+   a new file in every run of silence that lasts at least the minimum
+   duration. Cuts are made at LPCM frame boundaries, half the minimum
+   duration into the silence. A last part with nothing but silence is
+   dropped. A cue sheet listing the parts is written on close. Files are
+   named <basename>-01.wav ..., and <basename>.cue. */
+struct himd_splitsink {
+    char * basename;
+    enum himd_split_format format;
+    const struct himd_tags * tags;
+    unsigned int threshold;	/* highest sample value counted as silence */
+
+    struct himd_wavsink wav;
+    struct himd_flacsink flac;
+    unsigned int part;		/* number of the open part, starting at 1 */
+    int partloud;		/* the open part has audio above the threshold */
+
+    /* silent frames not yet written, held back until the run of silence
+       is either long enough for a cut or ends */
+    unsigned char * held;
+    unsigned int heldframes;
+    unsigned int minframes;
+    int insilence;		/* the current run of silence already caused a cut */
+
+    unsigned long long pos;	/* frames written in all parts */
+    void * starts;		/* GArray of the first frame of each part */
+};
+
+int himd_splitsink_open(struct himd_splitsink * sink, const char * basename, enum himd_split_format format,
+                        const struct himd_tags * tags, double threshold_db, double min_silence,
+                        struct himderrinfo * status);
+int himd_splitsink_write(struct himd_splitsink * sink, const unsigned char * data, unsigned int len, struct himderrinfo * status);
+int himd_splitsink_close(struct himd_splitsink * sink, struct himderrinfo * status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "trace.h"
+
+#ifdef CONFIG_WITH_TRACE
+
+#define RING_EVENTS 32768	/* per thread, a power of two */
+
+struct trace_event {
+    const char * name;
+    gint64 start;
+    gint64 dur;
+};
+
+struct trace_ring {
+    unsigned int tid;
+    gint head;		/* number of events written, the writer publishes it */
+    struct trace_event events[RING_EVENTS];
+};
+
+static GPrivate current_ring = G_PRIVATE_INIT(NULL);
+static GMutex rings_lock;
+static GPtrArray * rings;
+static gchar * outfile;
+
+static void dump_at_exit(void)
+{
+    if(himd_trace_dump(outfile) < 0)
+        fprintf(stderr, "Can't write trace to %s\n", outfile);
+}
+
+static gboolean recording(void)
+{
+    static gsize initialized = 0;
+
+    if(g_once_init_enter(&initialized))
+    {
+        const gchar * name = g_getenv("HIMD_TRACE");
+        if(name && *name)
+        {
+            outfile = g_strdup(name);
+            rings = g_ptr_array_new();
+            atexit(dump_at_exit);
+        }
+        g_once_init_leave(&initialized, 1);
+    }
+    return outfile != NULL;
+}
+
+/* Rings live until the process ends, so events of finished threads
+   still make it into the trace */
+static struct trace_ring * thread_ring(void)
+{
+    struct trace_ring * ring = g_private_get(&current_ring);
+
+    if(!ring)
+    {
+        ring = g_new0(struct trace_ring, 1);
+        g_mutex_lock(&rings_lock);
+        g_ptr_array_add(rings, ring);
+        ring->tid = rings->len;
+        g_mutex_unlock(&rings_lock);
+        g_private_set(&current_ring, ring);
+    }
+    return ring;
+}
+
+void himd_trace_begin(struct himd_trace_scope * scope, const char * name)
+{
+    scope->name = name;
+    scope->start = recording() ? g_get_monotonic_time() : -1;
+}
+
+void himd_trace_end(struct himd_trace_scope * scope)
+{
+    struct trace_ring * ring;
+    struct trace_event * ev;
+    gint head;
+
+    if(scope->start < 0)
+        return;
+    ring = thread_ring();
+    head = ring->head;
+    ev = &ring->events[head & (RING_EVENTS - 1)];
+    ev->name = scope->name;
+    ev->start = scope->start;
+    ev->dur = g_get_monotonic_time() - scope->start;
+    g_atomic_int_set(&ring->head, head + 1);
+}
+
+/**
+ * Write all recorded events as Chrome trace JSON. Threads may go on
+ * recording meanwhile; events they overwrite in the process can come out
+ * garbled, everything else is consistent.
+ */
+int himd_trace_dump(const char * filename)
+{
+    struct trace_ring * ring;
+    struct trace_event * ev;
+    unsigned int i;
+    gint head, first, j;
+    FILE * out;
+    int sep = 0;
+
+    if(!recording())
+        return 0;
+    if(!(out = g_fopen(filename, "w")))
+        return -1;
+
+    fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    g_mutex_lock(&rings_lock);
+    for(i = 0; i < rings->len; i++)
+    {
+        ring = g_ptr_array_index(rings, i);
+        fprintf(out, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, "
+                     "\"args\": {\"name\": \"thread %u\"}}",
+                sep ? ",\n" : "", ring->tid, ring->tid);
+        sep = 1;
+        head = g_atomic_int_get(&ring->head);
+        first = head > RING_EVENTS ? head - RING_EVENTS : 0;
+        for(j = first; j < head; j++)
+        {
+            ev = &ring->events[j & (RING_EVENTS - 1)];
+            /* names are string literals from the trace points, they need no escaping */
+            fprintf(out, ",\n{\"name\": \"%s\", \"cat\": \"himd\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, "
+                         "\"ts\": %" G_GINT64_FORMAT ", \"dur\": %" G_GINT64_FORMAT "}",
+                    ev->name, ring->tid, ev->start, ev->dur);
+        }
+    }
+    g_mutex_unlock(&rings_lock);
+    fprintf(out, "\n]}\n");
+    return fclose(out) == 0 ? 0 : -1;
+}
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef INCLUDED_LIBHIMD_TRACE_H
+#define INCLUDED_LIBHIMD_TRACE_H
+
+/* Timeline tracing in the Chrome trace event format, for Perfetto or
+   chrome://tracing. The trace points only exist in builds with
+   CONFIG+=with_trace (CONFIG_WITH_TRACE), otherwise the macros expand to
+   nothing. Even then nothing is recorded unless the environment variable
+   HIMD_TRACE names the file the trace is written to at exit.
+
+   Each thread records into its own ring buffer, so recording needs no
+   locks. When a ring is full, the oldest events are overwritten. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef CONFIG_WITH_TRACE
+
+struct himd_trace_scope {
+    const char * name;
+    long long start;	/* microseconds, -1 while not recording */
+};
+
+void himd_trace_begin(struct himd_trace_scope * scope, const char * name);
+void himd_trace_end(struct himd_trace_scope * scope);
+int himd_trace_dump(const char * filename);
+
+/* A scope ending on an error path before HIMD_TRACE_END is not recorded */
+#define HIMD_TRACE_BEGIN(scope, name) struct himd_trace_scope scope; himd_trace_begin(&scope, name)
+#define HIMD_TRACE_END(scope) himd_trace_end(&scope)
+
+#else
+
+#define HIMD_TRACE_BEGIN(scope, name) do { } while(0)
+#define HIMD_TRACE_END(scope) do { } while(0)
+
+#endif
+
+#ifdef __cplusplus
+}
+
+#ifdef CONFIG_WITH_TRACE
+/* records the lifetime of a C++ block */
+class HiMDTraceScope {
+public:
+    explicit HiMDTraceScope(const char * name) { himd_trace_begin(&scope, name); }
+    ~HiMDTraceScope() { himd_trace_end(&scope); }
+private:
+    HiMDTraceScope(const HiMDTraceScope &);
+    HiMDTraceScope & operator=(const HiMDTraceScope &);
+    struct himd_trace_scope scope;
+};
+#define HIMD_TRACE_SCOPE(var, name) HiMDTraceScope var(name)
+#else
+#define HIMD_TRACE_SCOPE(var, name) do { } while(0)
+#endif
+
+#endif
+
+#endif
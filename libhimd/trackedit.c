@@ -0,0 +1,758 @@
+#include <string.h>
+#include <glib.h>
+#include "himd.h"
+
+#include "himd_private.h"
+
+#define _(x) (x)
+
+#define SAMPLERATE 44100
+
+/* offsets in a track entry, see settrack */
+#define TRACK_TITLE 8
+#define TRACK_ARTIST 10
+#define TRACK_ALBUM 12
+#define TRACK_FIRSTFRAG 36
+#define TRACK_LINK 38		/* tracknum of used, next free slot of unused entries */
+#define TRACK_SECONDS 40
+#define TRACK_CONTENTID 48
+#define TRACK_SIZE 0x50
+
+/* a fragment of a track being edited */
+struct edit_frag {
+    unsigned int idx;
+    struct fraginfo f;
+    unsigned int frames;
+};
+
+struct edit_track {
+    unsigned int slot;
+    struct trackinfo t;
+    unsigned int fpb;		/* frames per block */
+    unsigned int spf;		/* samples per frame */
+    unsigned int frames;
+    GArray * frags;		/* struct edit_frag, in chain order */
+};
+
+static unsigned char * get_track(struct himd * himd, unsigned int idx)
+{
+    return himd->tifdata + 0x8000 + 0x50 * idx;
+}
+
+static unsigned char * get_frag(struct himd * himd, unsigned int idx)
+{
+    return himd->tifdata + 0x30000 + 0x10 * idx;
+}
+
+static unsigned char * get_strchunk(struct himd * himd, unsigned int idx)
+{
+    return himd->tifdata + 0x40000 + 0x10 * idx;
+}
+
+static unsigned int fraglink(const unsigned char * fragbuffer)
+{
+    return beword16(fragbuffer + 14) & 0xFFF;
+}
+
+static unsigned int strlink(const unsigned char * stringchunk)
+{
+    return beword16(stringchunk + 14) & 0xFFF;
+}
+
+static struct edit_frag * frag_at(struct edit_track * et, unsigned int i)
+{
+    return &g_array_index(et->frags, struct edit_frag, i);
+}
+
+/* frames in a fragment, lastframe is an index for all but MPEG */
+static unsigned int frag_frames(const struct edit_track * et, const struct fraginfo * f)
+{
+    return (f->lastblock - f->firstblock) * et->fpb + f->lastframe + 1 - f->firstframe;
+}
+
+static unsigned int ms_to_frames(const struct edit_track * et, unsigned int ms)
+{
+    return ((guint64)ms * SAMPLERATE + 500 * et->spf) / (1000 * et->spf);
+}
+
+static unsigned int frames_to_seconds(const struct edit_track * et, unsigned int frames)
+{
+    return ((guint64)frames * et->spf + SAMPLERATE / 2) / SAMPLERATE;
+}
+
+static void free_edit_track(struct edit_track * et)
+{
+    if(et->frags)
+        g_array_free(et->frags, TRUE);
+    et->frags = NULL;
+}
+
+/**
+ * Read a track and its fragment chain and check that it can be edited.
+ * Frame numbers are checked, edits compute block numbers from them.
+ *
+ * @return 0 on success, -1 on failure, et needs free_edit_track either way
+ */
+static int load_track(struct himd * himd, unsigned int slot, struct edit_track * et, struct himderrinfo * status)
+{
+    struct edit_frag ef;
+    unsigned int fragnum;
+
+    memset(et, 0, sizeof *et);
+    et->slot = slot;
+    et->frags = g_array_new(FALSE, FALSE, sizeof(struct edit_frag));
+    if(slot < HIMD_FIRST_TRACK || slot > HIMD_LAST_TRACK)
+    {
+        set_status_printf(status, HIMD_ERROR_NO_SUCH_TRACK,
+                          _("Track %u is not present on disc"), slot);
+        return -1;
+    }
+    if(himd_get_track_info(himd, slot, &et->t, status) < 0)
+        return -1;
+
+    et->fpb = himd_trackinfo_framesperblock(&et->t);
+    if(et->fpb == TRACK_IS_MPEG)
+    {
+        /* the MP3 key depends on the slot, and only the blocks know their frames */
+        set_status_printf(status, HIMD_ERROR_CANT_EDIT_TRACK,
+                          _("Track %u is an MP3 track, which can't be edited"), slot);
+        return -1;
+    }
+    if(et->t.codec_id == CODEC_LPCM)
+        et->spf = HIMD_LPCM_FRAMESIZE / 4;
+    else if(et->t.codec_id == CODEC_ATRAC3)
+        et->spf = HIMD_ATRAC3_SAMPLES_PER_FRAME;
+    else
+        et->spf = HIMD_ATRAC3P_SAMPLES_PER_FRAME;
+
+    for(fragnum = et->t.firstfrag; fragnum != 0; fragnum = ef.f.nextfrag)
+    {
+        if(fragnum > HIMD_LAST_FRAGMENT || et->frags->len > HIMD_LAST_FRAGMENT)
+        {
+            set_status_printf(status, HIMD_ERROR_FRAGMENT_CHAIN_BROKEN,
+                              _("Fragment chain of track %u is broken at fragment %u"), slot, fragnum);
+            return -1;
+        }
+        ef.idx = fragnum;
+        if(himd_get_fragment_info(himd, fragnum, &ef.f, status) < 0)
+            return -1;
+        if(ef.f.firstblock > ef.f.lastblock || ef.f.firstframe >= et->fpb || ef.f.lastframe >= et->fpb ||
+           (ef.f.firstblock == ef.f.lastblock && ef.f.firstframe > ef.f.lastframe))
+        {
+            set_status_printf(status, HIMD_ERROR_BAD_FRAME_NUMBERS,
+                              _("Fragment %u of track %u has bad block or frame numbers"), fragnum, slot);
+            return -1;
+        }
+        ef.frames = frag_frames(et, &ef.f);
+        et->frames += ef.frames;
+        g_array_append_val(et->frags, ef);
+    }
+    return 0;
+}
+
+/* Index of the fragment containing frame pos of the track, pos is made relative to it */
+static unsigned int find_frame(struct edit_track * et, unsigned int * pos)
+{
+    unsigned int i;
+
+    for(i = 0; i + 1 < et->frags->len && *pos >= frag_at(et, i)->frames; i++)
+        *pos -= frag_at(et, i)->frames;
+    return i;
+}
+
+/* the block and frame of frame pos of a fragment */
+static void frag_position(const struct edit_track * et, const struct fraginfo * f, unsigned int pos,
+                          unsigned int * block, unsigned int * frame)
+{
+    unsigned int abs = f->firstframe + pos;
+
+    *block = f->firstblock + abs / et->fpb;
+    *frame = abs % et->fpb;
+}
+
+/* setfrag, keeping the fragment type */
+static void write_frag(struct himd * himd, unsigned int idx, struct fraginfo * f)
+{
+    unsigned char * fragbuffer = get_frag(himd, idx);
+
+    setfrag(f, fragbuffer);
+    fragbuffer[14] = (fragbuffer[14] & 0x0F) | (f->fragtype << 4);
+}
+
+static unsigned int alloc_frag(struct himd * himd)
+{
+    unsigned char * head = get_frag(himd, 0);
+    unsigned int idx = fraglink(head);
+
+    if(idx != 0)
+        setbeword16(head + 14, fraglink(get_frag(himd, idx)));
+    return idx;
+}
+
+static void free_frag(struct himd * himd, unsigned int idx)
+{
+    unsigned char * head = get_frag(himd, 0);
+    unsigned char * fragbuffer = get_frag(himd, idx);
+
+    memset(fragbuffer, 0, 16);
+    setbeword16(fragbuffer + 14, fraglink(head));
+    setbeword16(head + 14, idx);
+}
+
+static unsigned int alloc_track(struct himd * himd)
+{
+    unsigned char * head = get_track(himd, 0);
+    unsigned int slot = beword16(head + TRACK_LINK);
+
+    if(slot != 0)
+        setbeword16(head + TRACK_LINK, beword16(get_track(himd, slot) + TRACK_LINK));
+    return slot;
+}
+
+static void free_track(struct himd * himd, unsigned int slot)
+{
+    unsigned char * head = get_track(himd, 0);
+    unsigned char * trackbuffer = get_track(himd, slot);
+
+    memset(trackbuffer, 0, TRACK_SIZE);
+    setbeword16(trackbuffer + TRACK_LINK, beword16(head + TRACK_LINK));
+    setbeword16(head + TRACK_LINK, slot);
+}
+
+/* Number of tracks referring to each string */
+static guint16 * count_string_refs(struct himd * himd)
+{
+    guint16 * refs = g_new0(guint16, 4096);
+    unsigned char * trackbuffer;
+    unsigned int i;
+
+    for(i = HIMD_FIRST_TRACK; i <= HIMD_LAST_TRACK; i++)
+    {
+        trackbuffer = get_track(himd, i);
+        if(beword16(trackbuffer + TRACK_FIRSTFRAG) == 0)
+            continue;
+        refs[beword16(trackbuffer + TRACK_TITLE) & 0xFFF]++;
+        refs[beword16(trackbuffer + TRACK_ARTIST) & 0xFFF]++;
+        refs[beword16(trackbuffer + TRACK_ALBUM) & 0xFFF]++;
+    }
+    return refs;
+}
+
+/* Last slot of the string starting at idx, 0 if its chain is broken */
+static unsigned int string_end(struct himd * himd, unsigned int idx)
+{
+    unsigned int cur, last = idx, len = 1;
+
+    if(idx == 0 || idx > 4095 || (get_strchunk(himd, idx)[14] >> 4) < 8)
+        return 0;
+    for(cur = strlink(get_strchunk(himd, idx)); cur != 0; cur = strlink(get_strchunk(himd, cur)))
+    {
+        if((get_strchunk(himd, cur)[14] >> 4) != STRING_TYPE_CONTINUATION || ++len >= 4096)
+            return 0;
+        last = cur;
+    }
+    return last;
+}
+
+/* Check the strings of a track before they get freed */
+static int check_strings(struct himd * himd, unsigned int slot, struct himderrinfo * status)
+{
+    const int offsets[3] = { TRACK_TITLE, TRACK_ARTIST, TRACK_ALBUM };
+    unsigned int i, idx;
+
+    for(i = 0; i < 3; i++)
+    {
+        idx = beword16(get_track(himd, slot) + offsets[i]);
+        if(idx != 0 && string_end(himd, idx) == 0)
+        {
+            set_status_printf(status, HIMD_ERROR_STRING_CHAIN_BROKEN,
+                              _("String %u of track %u is broken"), idx, slot);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Put the slots of a string checked by string_end back on the free list */
+static void free_string(struct himd * himd, unsigned int idx)
+{
+    unsigned char * chunk, * head = get_strchunk(himd, 0);
+    unsigned int cur, last = string_end(himd, idx);
+
+    for(cur = idx; ; cur = strlink(chunk))
+    {
+        chunk = get_strchunk(himd, cur);
+        memset(chunk, 0, 14);
+        chunk[14] &= 0x0F;		/* STRING_TYPE_UNUSED */
+        if(cur == last)
+            break;
+    }
+    setbeword16(chunk + 14, strlink(head));
+    setbeword16(head + 14, (beword16(head + 14) & 0xF000) | idx);
+}
+
+/* Drop the references of a track to its strings, freeing the unused ones */
+static void release_strings(struct himd * himd, unsigned int slot, guint16 * refs)
+{
+    const int offsets[3] = { TRACK_TITLE, TRACK_ARTIST, TRACK_ALBUM };
+    unsigned int i, idx;
+
+    for(i = 0; i < 3; i++)
+    {
+        idx = beword16(get_track(himd, slot) + offsets[i]);
+        if(idx != 0 && --refs[idx] == 0)
+            free_string(himd, idx);
+    }
+}
+
+/* Copy a string for a new track, 0 stays 0 */
+static int copy_string(struct himd * himd, int idx, struct himderrinfo * status)
+{
+    char * string;
+    int type, newidx;
+
+    if(idx == 0)
+        return 0;
+    if(!(string = himd_get_string_utf8(himd, idx, &type, status)))
+        return -1;
+    newidx = himd_add_string(himd, string, type, status);
+    g_free(string);
+    return newidx;
+}
+
+/* Position of slot in the play order, -1 if not in it */
+static int play_order_index(struct himd * himd, unsigned int slot)
+{
+    unsigned int i, count = himd_track_count(himd);
+
+    for(i = 0; i < count; i++)
+        if(beword16(himd->tifdata + 0x102 + 2*i) == slot)
+            return i;
+    return -1;
+}
+
+static void play_order_insert(struct himd * himd, unsigned int pos, unsigned int slot)
+{
+    unsigned char * order = himd->tifdata + 0x102;
+    unsigned int count = himd_track_count(himd);
+
+    memmove(order + 2*(pos+1), order + 2*pos, 2*(count - pos));
+    setbeword16(order + 2*pos, slot);
+    setbeword16(himd->tifdata + 0x100, count + 1);
+}
+
+static void play_order_remove(struct himd * himd, unsigned int pos)
+{
+    unsigned char * order = himd->tifdata + 0x102;
+    unsigned int count = himd_track_count(himd);
+
+    memmove(order + 2*pos, order + 2*(pos+1), 2*(count - pos - 1));
+    setbeword16(order + 2*(count-1), 0);
+    setbeword16(himd->tifdata + 0x100, count - 1);
+}
+
+/**
+ * Split a track in two, the second part becomes a new track right after
+ * it in the play order. It gets copies of the strings and a content ID
+ * that differs from the first part's but ends the same, as that is what
+ * the blocks of the part carry. A split inside a block leaves the block
+ * in both tracks, each playing its own frames of it.
+ *
+ * @param slot track to split
+ * @param ms where the second part starts
+ * @return slot of the new track, -1 on failure
+ */
+int himd_track_split(struct himd * himd, unsigned int slot, unsigned int ms, struct himderrinfo * status)
+{
+    struct edit_track et;
+    struct edit_frag * ef;
+    struct fraginfo second;
+    unsigned char * trackbuffer;
+    unsigned int pos, frames, i, j, block, frame, newslot, newfrag = 0;
+    int order, strings[3] = { 0, 0, 0 };
+    const int offsets[3] = { TRACK_TITLE, TRACK_ARTIST, TRACK_ALBUM };
+
+    g_return_val_if_fail(himd != NULL, -1);
+
+    if(load_track(himd, slot, &et, status) < 0)
+        goto fail;
+    pos = frames = ms_to_frames(&et, ms);
+    if(pos == 0 || pos >= et.frames)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_EDIT_TRACK,
+                          _("Can't split track %u of %u frames at frame %u"), slot, et.frames, pos);
+        goto fail;
+    }
+    if((order = play_order_index(himd, slot)) < 0)
+    {
+        set_status_printf(status, HIMD_ERROR_NO_SUCH_TRACK,
+                          _("Track %u is not in the play order"), slot);
+        goto fail;
+    }
+    i = find_frame(&et, &pos);
+    ef = frag_at(&et, i);
+
+    /* everything that can fail before changing anything */
+    if(himd_prepare_write(himd, status) < 0)
+        goto fail;
+    if(himd_get_free_trackindex(himd) == 0)
+    {
+        set_status_const(status, HIMD_ERROR_OUT_OF_TRACKS, _("No free track slot left"));
+        goto fail;
+    }
+    if(pos != 0 && fraglink(get_frag(himd, 0)) == 0)
+    {
+        set_status_const(status, HIMD_ERROR_OUT_OF_FRAGMENTS, _("No free fragment left"));
+        goto fail;
+    }
+    for(j = 0; j < 3; j++)
+        if((strings[j] = copy_string(himd, beword16(get_track(himd, slot) + offsets[j]), status)) < 0)
+        {
+            while(j-- > 0)
+                if(strings[j])
+                    free_string(himd, strings[j]);
+            goto fail;
+        }
+
+    newslot = alloc_track(himd);
+    if(pos == 0)
+    {
+        /* at a fragment boundary, the chain is just cut */
+        frag_at(&et, i-1)->f.nextfrag = 0;
+        write_frag(himd, frag_at(&et, i-1)->idx, &frag_at(&et, i-1)->f);
+        newfrag = ef->idx;
+    }
+    else
+    {
+        frag_position(&et, &ef->f, pos, &block, &frame);
+        second = ef->f;
+        second.firstblock = block;
+        second.firstframe = frame;
+        ef->f.lastblock = frame ? block : block - 1;
+        ef->f.lastframe = frame ? frame - 1 : et.fpb - 1;
+        ef->f.nextfrag = 0;
+        newfrag = alloc_frag(himd);
+        write_frag(himd, ef->idx, &ef->f);
+        write_frag(himd, newfrag, &second);
+    }
+
+    trackbuffer = get_track(himd, newslot);
+    memcpy(trackbuffer, get_track(himd, slot), TRACK_SIZE);
+    for(j = 0; j < 3; j++)
+        setbeword16(trackbuffer + offsets[j], strings[j]);
+    setbeword16(trackbuffer + TRACK_FIRSTFRAG, newfrag);
+    setbeword16(trackbuffer + TRACK_LINK, newslot);
+    setbeword16(trackbuffer + TRACK_SECONDS, frames_to_seconds(&et, et.frames - frames));
+    for(j = 4; j < 16; j++)
+        trackbuffer[TRACK_CONTENTID + j] = g_random_int_range(0, 0x100);
+    setbeword16(get_track(himd, slot) + TRACK_SECONDS, frames_to_seconds(&et, frames));
+    play_order_insert(himd, order + 1, newslot);
+
+    free_edit_track(&et);
+    return newslot;
+
+fail:
+    free_edit_track(&et);
+    return -1;
+}
+
+/**
+ * Cut the start and the end of a track. Fragments that are cut away
+ * completely go back to the free list, their blocks become free space.
+ *
+ * @param head_ms time to cut from the start
+ * @param tail_ms time to cut from the end
+ * @return 0 on success, -1 on failure
+ */
+int himd_track_trim(struct himd * himd, unsigned int slot, unsigned int head_ms, unsigned int tail_ms,
+                    struct himderrinfo * status)
+{
+    struct edit_track et;
+    struct edit_frag * first, * last;
+    struct fraginfo f;
+    unsigned int head, tail, end, kept, fi, li, i;
+
+    g_return_val_if_fail(himd != NULL, -1);
+
+    if(load_track(himd, slot, &et, status) < 0)
+        goto fail;
+    head = ms_to_frames(&et, head_ms);
+    tail = ms_to_frames(&et, tail_ms);
+    if(head + tail >= et.frames)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_EDIT_TRACK,
+                          _("Cutting %u and %u frames leaves nothing of the %u frames of track %u"),
+                          head, tail, et.frames, slot);
+        goto fail;
+    }
+    if(head == 0 && tail == 0)
+    {
+        free_edit_track(&et);
+        return 0;
+    }
+    if(himd_prepare_write(himd, status) < 0)
+        goto fail;
+
+    /* the first frame kept and the one after the last kept */
+    kept = et.frames - head - tail;
+    end = et.frames - tail;
+    fi = find_frame(&et, &head);
+    li = find_frame(&et, &end);
+    if(end == 0)
+        end = frag_at(&et, --li)->frames;
+    first = frag_at(&et, fi);
+    last = frag_at(&et, li);
+
+    /* both ends are computed from the fragments as they were */
+    f = last->f;
+    frag_position(&et, &f, end - 1, &last->f.lastblock, &last->f.lastframe);
+    last->f.nextfrag = 0;
+    f = first->f;
+    frag_position(&et, &f, head, &first->f.firstblock, &first->f.firstframe);
+    if(first == last)
+        frag_position(&et, &f, end - 1, &first->f.lastblock, &first->f.lastframe);
+
+    for(i = 0; i < et.frags->len; i++)
+        if(i < fi || i > li)
+            free_frag(himd, frag_at(&et, i)->idx);
+    write_frag(himd, first->idx, &first->f);
+    if(last != first)
+        write_frag(himd, last->idx, &last->f);
+
+    setbeword16(get_track(himd, slot) + TRACK_FIRSTFRAG, first->idx);
+    setbeword16(get_track(himd, slot) + TRACK_SECONDS,
+                frames_to_seconds(&et, kept));
+    free_edit_track(&et);
+    return 0;
+
+fail:
+    free_edit_track(&et);
+    return -1;
+}
+
+/* Whether b continues a without a gap, so they can become one fragment */
+static int frags_continue(const struct edit_track * et, const struct fraginfo * a, const struct fraginfo * b)
+{
+    if(memcmp(a->key, b->key, sizeof a->key) != 0 || a->fragtype != b->fragtype)
+        return 0;
+    if(a->lastblock == b->firstblock)
+        return a->lastframe + 1 == b->firstframe;
+    return a->lastblock + 1 == b->firstblock && a->lastframe == et->fpb - 1 && b->firstframe == 0;
+}
+
+/**
+ * Append a track to another one and remove it, with its strings unless
+ * other tracks use them. Both tracks need the same codec and track key.
+ * Joining the parts of a split track again gives the original fragments.
+ *
+ * @param slot track that stays
+ * @param nextslot track appended to it
+ * @return 0 on success, -1 on failure
+ */
+int himd_track_join(struct himd * himd, unsigned int slot, unsigned int nextslot, struct himderrinfo * status)
+{
+    struct edit_track a, b;
+    struct edit_frag * last, * first;
+    guint16 * refs;
+    int order;
+
+    g_return_val_if_fail(himd != NULL, -1);
+
+    memset(&b, 0, sizeof b);
+    if(load_track(himd, slot, &a, status) < 0 || load_track(himd, nextslot, &b, status) < 0)
+        goto fail;
+    if(slot == nextslot)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_EDIT_TRACK, _("Can't join track %u to itself"), slot);
+        goto fail;
+    }
+    if(a.t.codec_id != b.t.codec_id || memcmp(a.t.codecinfo, b.t.codecinfo, sizeof a.t.codecinfo) != 0)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_EDIT_TRACK,
+                          _("Tracks %u and %u have different audio formats"), slot, nextslot);
+        goto fail;
+    }
+    /* the fragment keys only work with their own track key */
+    if(a.t.ekbnum != b.t.ekbnum || memcmp(a.t.key, b.t.key, sizeof a.t.key) != 0)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_EDIT_TRACK,
+                          _("Tracks %u and %u are encrypted with different keys"), slot, nextslot);
+        goto fail;
+    }
+    if((order = play_order_index(himd, nextslot)) < 0)
+    {
+        set_status_printf(status, HIMD_ERROR_NO_SUCH_TRACK,
+                          _("Track %u is not in the play order"), nextslot);
+        goto fail;
+    }
+    if(check_strings(himd, nextslot, status) < 0 || himd_prepare_write(himd, status) < 0)
+        goto fail;
+
+    last = frag_at(&a, a.frags->len - 1);
+    first = frag_at(&b, 0);
+    if(frags_continue(&a, &last->f, &first->f))
+    {
+        last->f.lastblock = first->f.lastblock;
+        last->f.lastframe = first->f.lastframe;
+        last->f.nextfrag = first->f.nextfrag;
+        free_frag(himd, first->idx);
+    }
+    else
+        last->f.nextfrag = first->idx;
+    write_frag(himd, last->idx, &last->f);
+    setbeword16(get_track(himd, slot) + TRACK_SECONDS, frames_to_seconds(&a, a.frames + b.frames));
+
+    refs = count_string_refs(himd);
+    release_strings(himd, nextslot, refs);
+    g_free(refs);
+    play_order_remove(himd, order);
+    free_track(himd, nextslot);
+
+    free_edit_track(&a);
+    free_edit_track(&b);
+    return 0;
+
+fail:
+    free_edit_track(&a);
+    free_edit_track(&b);
+    return -1;
+}
+
+/* Mark the fragments of a track, a chain running into marked fragments
+   loops or shares them with another track */
+static int mark_fragments(struct himd * himd, unsigned int slot, unsigned char * marked, struct himderrinfo * status)
+{
+    unsigned int fragnum;
+
+    for(fragnum = beword16(get_track(himd, slot) + TRACK_FIRSTFRAG); fragnum != 0;
+        fragnum = fraglink(get_frag(himd, fragnum)))
+    {
+        if(fragnum > HIMD_LAST_FRAGMENT || marked[fragnum])
+        {
+            set_status_printf(status, HIMD_ERROR_FRAGMENT_CHAIN_BROKEN,
+                              _("Fragment chain of track %u is broken at fragment %u"), slot, fragnum);
+            return -1;
+        }
+        marked[fragnum] = 1;
+    }
+    return 0;
+}
+
+/**
+ * Delete tracks of any codec. Their fragments, strings and slots go back
+ * to the free lists, so their blocks show up as holes, and the play
+ * order closes up. All tracks are checked before anything changes.
+ *
+ * @param slots tracks to delete
+ * @param n number of tracks
+ * @return 0 on success, -1 on failure
+ */
+int himd_delete_tracks(struct himd * himd, const unsigned int * slots, unsigned int n, struct himderrinfo * status)
+{
+    unsigned char * deleted, * frags, * order;
+    guint16 * refs;
+    unsigned int i, slot, count, kept;
+
+    g_return_val_if_fail(himd != NULL, -1);
+    g_return_val_if_fail(slots != NULL || n == 0, -1);
+
+    deleted = g_new0(unsigned char, HIMD_LAST_TRACK + 1);
+    frags = g_new0(unsigned char, HIMD_LAST_FRAGMENT + 1);
+    for(i = 0; i < n; i++)
+    {
+        slot = slots[i];
+        if(slot < HIMD_FIRST_TRACK || slot > HIMD_LAST_TRACK ||
+           beword16(get_track(himd, slot) + TRACK_FIRSTFRAG) == 0)
+        {
+            set_status_printf(status, HIMD_ERROR_NO_SUCH_TRACK,
+                              _("Track %u is not present on disc"), slot);
+            goto fail;
+        }
+        if(deleted[slot])
+            continue;
+        deleted[slot] = 1;
+        if(mark_fragments(himd, slot, frags, status) < 0 || check_strings(himd, slot, status) < 0)
+            goto fail;
+    }
+    if(himd_prepare_write(himd, status) < 0)
+        goto fail;
+    order = himd->tifdata + 0x102;
+
+    count = himd_track_count(himd);
+    for(i = kept = 0; i < count; i++)
+    {
+        slot = beword16(order + 2*i);
+        if(slot > HIMD_LAST_TRACK || !deleted[slot])
+            setbeword16(order + 2*kept++, slot);
+    }
+    memset(order + 2*kept, 0, 2*(count - kept));
+    setbeword16(himd->tifdata + 0x100, kept);
+
+    refs = count_string_refs(himd);
+    for(slot = HIMD_FIRST_TRACK; slot <= HIMD_LAST_TRACK; slot++)
+        if(deleted[slot])
+        {
+            release_strings(himd, slot, refs);
+            free_track(himd, slot);
+        }
+    g_free(refs);
+    for(i = HIMD_FIRST_FRAGMENT; i <= HIMD_LAST_FRAGMENT; i++)
+        if(frags[i])
+            free_frag(himd, i);
+
+    g_free(deleted);
+    g_free(frags);
+    return 0;
+
+fail:
+    g_free(deleted);
+    g_free(frags);
+    return -1;
+}
+
+/**
+ * Replace the play order. The new one has to list the tracks of the
+ * current play order, each of them once.
+ *
+ * @param slots tracks in their new order
+ * @param n number of tracks, the track count
+ * @return 0 on success, -1 on failure
+ */
+int himd_reorder_tracks(struct himd * himd, const unsigned int * slots, unsigned int n, struct himderrinfo * status)
+{
+    unsigned char * listed;
+    unsigned int i, count = himd_track_count(himd);
+
+    g_return_val_if_fail(himd != NULL, -1);
+    g_return_val_if_fail(slots != NULL || n == 0, -1);
+
+    if(n != count)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_EDIT_TRACK,
+                          _("The play order has %u tracks, not %u"), count, n);
+        return -1;
+    }
+    /* 1 for tracks in the play order, 2 once seen in the new one */
+    listed = g_new0(unsigned char, HIMD_LAST_TRACK + 1);
+    for(i = 0; i < count; i++)
+        if(beword16(himd->tifdata + 0x102 + 2*i) <= HIMD_LAST_TRACK)
+            listed[beword16(himd->tifdata + 0x102 + 2*i)] = 1;
+    for(i = 0; i < n; i++)
+    {
+        if(slots[i] > HIMD_LAST_TRACK || listed[slots[i]] != 1)
+        {
+            set_status_printf(status, HIMD_ERROR_CANT_EDIT_TRACK,
+                              _("Track %u is not in the play order or listed twice"), slots[i]);
+            g_free(listed);
+            return -1;
+        }
+        listed[slots[i]] = 2;
+    }
+    g_free(listed);
+
+    if(himd_prepare_write(himd, status) < 0)
+        return -1;
+    for(i = 0; i < n; i++)
+        setbeword16(himd->tifdata + 0x102 + 2*i, slots[i]);
+    return 0;
+}
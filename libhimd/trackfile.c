@@ -0,0 +1,435 @@
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <glib.h>
+
+#include "himd.h"
+#include "himd_private.h"
+#include "sony_oma.h"
+#include "wavsink.h"
+#include "trackfile.h"
+
+#define _(x) (x)
+
+/* Blocks at the ends of a fragment may be shared by two tracks, each
+   getting different frames out of them, so the track is part of the key. */
+struct blockkey {
+    unsigned int trackno;
+    unsigned int blockno;
+};
+
+struct cached_block {
+    struct blockkey key;
+    unsigned int len;
+    unsigned char data[HIMD_AUDIO_SIZE];
+};
+
+struct himd_blockcache {
+    GMutex lock;
+    GHashTable * index;		/* key -> link in lru */
+    GQueue lru;			/* most recently used block first */
+    unsigned int maxblocks;
+};
+
+static guint blockkey_hash(gconstpointer k)
+{
+    const struct blockkey * key = k;
+    return key->trackno * 65537u ^ key->blockno;
+}
+
+static gboolean blockkey_equal(gconstpointer a, gconstpointer b)
+{
+    const struct blockkey * ka = a, * kb = b;
+    return ka->trackno == kb->trackno && ka->blockno == kb->blockno;
+}
+
+struct himd_blockcache * himd_blockcache_new(unsigned int maxblocks)
+{
+    struct himd_blockcache * cache;
+
+    g_return_val_if_fail(maxblocks > 0, NULL);
+
+    cache = g_new0(struct himd_blockcache, 1);
+    g_mutex_init(&cache->lock);
+    cache->index = g_hash_table_new(blockkey_hash, blockkey_equal);
+    g_queue_init(&cache->lru);
+    cache->maxblocks = maxblocks;
+    return cache;
+}
+
+void himd_blockcache_free(struct himd_blockcache * cache)
+{
+    struct cached_block * b;
+
+    g_return_if_fail(cache != NULL);
+
+    while((b = g_queue_pop_head(&cache->lru)))
+        g_free(b);
+    g_hash_table_destroy(cache->index);
+    g_mutex_clear(&cache->lock);
+    g_free(cache);
+}
+
+/* Copy len bytes at offset from a cached block, returns 0 on a miss */
+static int cache_read(struct himd_blockcache * cache, unsigned int trackno, unsigned int blockno,
+                      unsigned char * buf, unsigned int offset, unsigned int len)
+{
+    struct blockkey key = { trackno, blockno };
+    GList * link;
+    struct cached_block * b;
+
+    if(!cache)
+        return 0;
+
+    g_mutex_lock(&cache->lock);
+    link = g_hash_table_lookup(cache->index, &key);
+    if(link)
+    {
+        b = link->data;
+        g_queue_unlink(&cache->lru, link);
+        g_queue_push_head_link(&cache->lru, link);
+        memcpy(buf, b->data + offset, len);
+    }
+    g_mutex_unlock(&cache->lock);
+    return link != NULL;
+}
+
+static void cache_insert(struct himd_blockcache * cache, unsigned int trackno, unsigned int blockno,
+                         const unsigned char * data, unsigned int len)
+{
+    struct blockkey key = { trackno, blockno };
+    struct cached_block * b;
+
+    if(!cache)
+        return;
+
+    g_mutex_lock(&cache->lock);
+    /* another reader may have been faster */
+    if(!g_hash_table_lookup(cache->index, &key))
+    {
+        if(cache->lru.length >= cache->maxblocks)
+        {
+            b = g_queue_pop_tail(&cache->lru);
+            g_hash_table_remove(cache->index, &b->key);
+        }
+        else
+            b = g_new(struct cached_block, 1);
+
+        b->key = key;
+        b->len = len;
+        memcpy(b->data, data, len);
+        g_queue_push_head(&cache->lru, b);
+        g_hash_table_insert(cache->index, &b->key, cache->lru.head);
+    }
+    g_mutex_unlock(&cache->lock);
+}
+
+static struct himd_blockstream * blockstream(struct himd_trackfile * tf)
+{
+    if(tf->format == HIMD_TRACKFILE_MP3)
+        return &tf->stream.mp3.stream;
+    return &tf->stream.nonmp3.stream;
+}
+
+/* Read the decrypted audio data of block i through the track's stream */
+static int fetch_block(struct himd_trackfile * tf, unsigned int i, const unsigned char ** data,
+                       unsigned int * len, struct himderrinfo * status)
+{
+    int ret;
+
+    if(tf->nextblock != i &&
+       himd_blockstream_seek(blockstream(tf), i, status) < 0)
+        return -1;
+
+    /* drop whatever is left of the previous block */
+    tf->nextblock = G_MAXUINT;
+    if(tf->format == HIMD_TRACKFILE_MP3)
+    {
+        free(tf->stream.mp3.frameptrs);
+        tf->stream.mp3.frameptrs = NULL;
+        tf->stream.mp3.frames = tf->stream.mp3.curframe = 0;
+        ret = himd_mp3stream_read_block(&tf->stream.mp3, data, len, NULL, status);
+    }
+    else
+    {
+        tf->stream.nonmp3.framesleft = 0;
+        ret = himd_nonmp3stream_read_block(&tf->stream.nonmp3, data, len, NULL, status);
+    }
+    if(ret < 0)
+        return -1;
+    tf->nextblock = i + 1;
+
+    /* LPCM is big endian on the disc, WAV files are little endian */
+    if(tf->format == HIMD_TRACKFILE_WAV)
+    {
+        pcm_swap16(tf->swapped, *data, *len);
+        *data = tf->swapped;
+    }
+    return 0;
+}
+
+/* Length of the MPEG data in a block that belongs to the track
+   completely, taken from its header without decrypting it. */
+static int mpeg_block_length(struct himd_blockstream * bs, unsigned int blockno,
+                             unsigned int * len, struct himderrinfo * status)
+{
+    unsigned char header[32];
+
+    if(fseek(bs->atdata, blockno*16384L, SEEK_SET) < 0)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_SEEK_AUDIO,
+                          _("Can't seek in audio data: %s"), g_strerror(errno));
+        return -1;
+    }
+    if(fread(header, sizeof header, 1, bs->atdata) != 1)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_READ_AUDIO,
+                          _("Can't read header of audio block %u"), blockno);
+        return -1;
+    }
+    *len = beword16(header+8);
+    if(*len > HIMD_AUDIO_SIZE)
+    {
+        set_status_printf(status, HIMD_ERROR_BAD_DATA_FORMAT,
+                   _("Block contains %u MPEG data bytes, which is too much"), *len);
+        return -1;
+    }
+    return 0;
+}
+
+/* Build the extent map: where the data of each block goes in the file.
+   For ATRAC and LPCM this follows from the fragment list, MPEG blocks
+   only need their header read, except for the blocks at the ends of a
+   fragment, which may be shared with another track. */
+static int map_blocks(struct himd_trackfile * tf, const struct trackinfo * trkinfo, struct himderrinfo * status)
+{
+    struct himd_blockstream * bs = blockstream(tf);
+    unsigned int framesize = himd_trackinfo_framesize(trkinfo);
+    unsigned int fpb = himd_trackinfo_framesperblock(trkinfo);
+    unsigned long long pos = tf->headerlen;
+    unsigned int f, b, i, first, last, len;
+    const unsigned char * data;
+    struct fraginfo * frag;
+
+    tf->blockcount = bs->blockcount;
+    tf->offsets = g_new(unsigned long long, bs->blockcount + 1);
+    tf->blocknos = g_new(unsigned int, bs->blockcount);
+
+    for(f = 0, i = 0; f < bs->fragcount; f++)
+    {
+        frag = &bs->frags[f];
+        for(b = frag->firstblock; b <= frag->lastblock; b++, i++)
+        {
+            tf->blocknos[i] = b;
+            tf->offsets[i] = pos;
+            if(tf->format != HIMD_TRACKFILE_MP3)
+            {
+                first = b == frag->firstblock ? frag->firstframe : 0;
+                last = b == frag->lastblock ? frag->lastframe : fpb - 1;
+                len = (last - first + 1) * framesize;
+            }
+            else if(b != frag->firstblock && b != frag->lastblock)
+            {
+                if(mpeg_block_length(bs, b, &len, status) < 0)
+                    return -1;
+                tf->nextblock = G_MAXUINT;
+            }
+            else
+            {
+                if(fetch_block(tf, i, &data, &len, status) < 0)
+                    return -1;
+                cache_insert(tf->cache, tf->trackno, b, data, len);
+            }
+            pos += len;
+        }
+    }
+    tf->offsets[i] = pos;
+    tf->size = pos;
+    return 0;
+}
+
+static int open_track(struct himd * himd, unsigned int trackno, struct himd_blockcache * cache,
+                      int map, struct himd_trackfile * tf, struct himderrinfo * status)
+{
+    struct trackinfo trkinfo;
+    struct himd_tags tags;
+    size_t taglen;
+
+    g_return_val_if_fail(himd != NULL, -1);
+    g_return_val_if_fail(tf != NULL, -1);
+
+    if(himd_get_track_info(himd, trackno, &trkinfo, status) < 0)
+        return -1;
+    if(!himd_track_uploadable(himd, &trkinfo))
+    {
+        set_status_printf(status, HIMD_ERROR_UNSUPPORTED_ENCRYPTION,
+                          _("Track %d is copy protected"), trackno);
+        return -1;
+    }
+
+    memset(tf, 0, sizeof *tf);
+    tf->trackno = trackno;
+    tf->cache = cache;
+    tf->nextblock = 0;
+
+    if(trkinfo.codec_id == CODEC_ATRAC3PLUS_OR_MPEG && (trkinfo.codecinfo[0] & 3) == 3)
+    {
+        tf->format = HIMD_TRACKFILE_MP3;
+        if(himd_get_tags(himd, &trkinfo, &tags, status) < 0)
+            return -1;
+        tf->header = id3v2_make_tag(&tags, 0, &taglen);
+        tf->headerlen = taglen;
+        himd_free_tags(&tags);
+        if(himd_mp3stream_open(himd, trackno, &tf->stream.mp3, status) < 0)
+        {
+            g_free(tf->header);
+            return -1;
+        }
+    }
+    else
+    {
+        if(trkinfo.codec_id == CODEC_LPCM)
+        {
+            tf->format = HIMD_TRACKFILE_WAV;
+            tf->headerlen = WAV_HEADER_SIZE;
+            tf->header = g_malloc(tf->headerlen);
+            tf->swapped = g_malloc(HIMD_AUDIO_SIZE);
+        }
+        else
+        {
+            tf->format = HIMD_TRACKFILE_OMA;
+            tf->headerlen = EA3_FORMAT_HEADER_SIZE;
+            tf->header = g_malloc(tf->headerlen);
+            make_ea3_format_header((char *)tf->header, &trkinfo);
+        }
+        if(himd_nonmp3stream_open(himd, trackno, &tf->stream.nonmp3, status) < 0)
+        {
+            g_free(tf->header);
+            g_free(tf->swapped);
+            return -1;
+        }
+    }
+
+    /* mapping ATRAC and LPCM tracks does not touch the audio data */
+    if((map || tf->format != HIMD_TRACKFILE_MP3) && map_blocks(tf, &trkinfo, status) < 0)
+    {
+        himd_trackfile_close(tf);
+        return -1;
+    }
+    if(tf->format == HIMD_TRACKFILE_WAV)
+        make_wav_header(tf->header, tf->size - tf->headerlen);
+    return 0;
+}
+
+/**
+ * Open a track for reading it as a file. MPEG tracks are presented as
+ * MP3 file with an ID3 tag, ATRAC tracks as OMA and LPCM tracks as WAV
+ * file. cache may be NULL.
+ */
+int himd_trackfile_open(struct himd * himd, unsigned int trackno, struct himd_blockcache * cache,
+                        struct himd_trackfile * tf, struct himderrinfo * status)
+{
+    return open_track(himd, trackno, cache, 1, tf, status);
+}
+
+/**
+ * Open a track for reading the file front to back, the header first and
+ * then the audio data block by block with himd_trackfile_read_next. This
+ * does not scan the track, so the size of MP3 files is 0, as it is not
+ * known before reading all of it.
+ */
+int himd_trackfile_open_sequential(struct himd * himd, unsigned int trackno,
+                                   struct himd_trackfile * tf, struct himderrinfo * status)
+{
+    return open_track(himd, trackno, NULL, 0, tf, status);
+}
+
+/* Returns -1 with status HIMD_STATUS_AUDIO_EOF after the last block */
+int himd_trackfile_read_next(struct himd_trackfile * tf, const unsigned char ** data,
+                             unsigned int * len, struct himderrinfo * status)
+{
+    g_return_val_if_fail(tf != NULL, -1);
+    g_return_val_if_fail(data != NULL, -1);
+    g_return_val_if_fail(len != NULL, -1);
+
+    return fetch_block(tf, tf->nextblock, data, len, status);
+}
+
+/* index of the block containing the file offset pos, which must be
+   inside the audio data */
+static unsigned int find_block(const struct himd_trackfile * tf, unsigned long long pos)
+{
+    unsigned int lo = 0, hi = tf->blockcount - 1, mid;
+
+    while(lo < hi)
+    {
+        mid = (lo + hi + 1) / 2;
+        if(tf->offsets[mid] <= pos)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+long himd_trackfile_pread(struct himd_trackfile * tf, unsigned char * buf, unsigned long len,
+                          unsigned long long offset, struct himderrinfo * status)
+{
+    unsigned long done = 0, n;
+    unsigned int i, blocklen, within, datalen;
+    unsigned long long pos;
+    const unsigned char * data;
+
+    g_return_val_if_fail(tf != NULL, -1);
+    g_return_val_if_fail(buf != NULL, -1);
+
+    if(offset >= tf->size)
+        return 0;
+    len = MIN(len, tf->size - offset);
+
+    if(offset < tf->headerlen)
+    {
+        done = MIN(len, tf->headerlen - offset);
+        memcpy(buf, tf->header + offset, done);
+    }
+
+    while(done < len)
+    {
+        pos = offset + done;
+        i = find_block(tf, pos);
+        blocklen = tf->offsets[i+1] - tf->offsets[i];
+        within = pos - tf->offsets[i];
+        n = MIN(len - done, blocklen - within);
+
+        if(!cache_read(tf->cache, tf->trackno, tf->blocknos[i], buf + done, within, n))
+        {
+            if(fetch_block(tf, i, &data, &datalen, status) < 0)
+                return -1;
+            if(datalen != blocklen)
+            {
+                set_status_printf(status, HIMD_ERROR_BAD_DATA_FORMAT,
+                                  _("Block %u has %u bytes of audio data instead of %u"),
+                                  tf->blocknos[i], datalen, blocklen);
+                return -1;
+            }
+            cache_insert(tf->cache, tf->trackno, tf->blocknos[i], data, datalen);
+            memcpy(buf + done, data + within, n);
+        }
+        done += n;
+    }
+    return done;
+}
+
+void himd_trackfile_close(struct himd_trackfile * tf)
+{
+    g_return_if_fail(tf != NULL);
+
+    if(tf->format == HIMD_TRACKFILE_MP3)
+        himd_mp3stream_close(&tf->stream.mp3);
+    else
+        himd_nonmp3stream_close(&tf->stream.nonmp3);
+    g_free(tf->header);
+    g_free(tf->offsets);
+    g_free(tf->blocknos);
+    g_free(tf->swapped);
+}
@@ -0,0 +1,65 @@
+#ifndef INCLUDED_LIBHIMD_TRACKFILE_H
+#define INCLUDED_LIBHIMD_TRACKFILE_H
+
+#include "himd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum himd_trackfile_format { HIMD_TRACKFILE_MP3, HIMD_TRACKFILE_OMA, HIMD_TRACKFILE_WAV };
+
+/* An LRU cache of decrypted audio blocks, keyed by track and position
+   in ATDATA. It may be shared by any number of track files, also from
+   different threads. */
+struct himd_blockcache;
+
+struct himd_blockcache * himd_blockcache_new(unsigned int maxblocks);
+void himd_blockcache_free(struct himd_blockcache * cache);
+
+/* A track presented as a file (MP3 with ID3 tag, OMA or WAV) that can be
+   read at arbitrary offsets. The size and the position of each block's
+   audio data in the file are determined on open, so a read only touches
+   the blocks it needs. A track file opened sequentially can only be read
+   front to back, but opening it does not scan MPEG tracks.
+
+   A track file is not thread safe itself, the caller has to serialize
+   reads on it. */
+struct himd_trackfile {
+    unsigned int trackno;
+    enum himd_trackfile_format format;
+    unsigned char * header;
+    unsigned int headerlen;
+    unsigned long long size;
+
+    unsigned int blockcount;
+    /* offsets[i] is the file offset of the data of block i,
+       offsets[blockcount] is the file size */
+    unsigned long long * offsets;
+    unsigned int * blocknos;	/* position of block i in ATDATA */
+
+    struct himd_blockcache * cache;
+    union {
+        struct himd_mp3stream mp3;
+        struct himd_nonmp3stream nonmp3;
+    } stream;
+    unsigned int nextblock;	/* index of the block the stream reads next */
+    unsigned char * swapped;	/* little endian copy of the last LPCM block, WAV only */
+};
+
+int himd_trackfile_open(struct himd * himd, unsigned int trackno, struct himd_blockcache * cache,
+                        struct himd_trackfile * tf, struct himderrinfo * status);
+/* returns the number of bytes read, which is less than len only at the end of the file */
+long himd_trackfile_pread(struct himd_trackfile * tf, unsigned char * buf, unsigned long len,
+                          unsigned long long offset, struct himderrinfo * status);
+int himd_trackfile_open_sequential(struct himd * himd, unsigned int trackno,
+                                   struct himd_trackfile * tf, struct himderrinfo * status);
+int himd_trackfile_read_next(struct himd_trackfile * tf, const unsigned char ** data,
+                             unsigned int * len, struct himderrinfo * status);
+void himd_trackfile_close(struct himd_trackfile * tf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -56,6 +56,17 @@ unsigned int himd_get_trackslot(struct himd * himd, unsigned int idx, struct him
     return beword16(himd->tifdata + 0x102 + 2*idx);
 }
 
+static void count_string_conversion(struct himd * himd)
+{
+    struct himd_stats one;
+
+    if(!himd->stats_enabled)
+        return;
+    memset(&one, 0, sizeof one);
+    one.string_conversions = 1;
+    himd_add_stats(himd, &one);
+}
+
 static void get_dostime(struct tm * tm, unsigned const char * bytes)
 {
     unsigned int thetime = beword16(bytes+2);
@@ -93,7 +104,7 @@ static void dos_settime(unsigned char * buffer, const struct tm * tm)
    }
 }
 
-static void settrack(struct trackinfo *t, unsigned char * trackbuffer)
+void settrack(struct trackinfo *t, unsigned char * trackbuffer)
 {
   dos_settime(trackbuffer+0,  &t->recordingtime);
   setbeword32(trackbuffer+4,  t->ekbnum);
@@ -124,7 +135,7 @@ static void settrack(struct trackinfo *t, unsigned char * trackbuffer)
   trackbuffer[78] = t->Cc;
 }
 
-static void setfrag(struct fraginfo *f, unsigned char * fragbuffer)
+void setfrag(struct fraginfo *f, unsigned char * fragbuffer)
 {
   memcpy(fragbuffer, &f->key, 8);
   setbeword16(fragbuffer+8,  f->firstblock);
@@ -188,18 +199,27 @@ int himd_get_track_info(struct himd * himd, unsigned int idx, struct trackinfo *
 int himd_add_track_info(struct himd * himd, struct trackinfo * t, struct himderrinfo * status)
 {
     int idx_freeslot;
+    unsigned int count;
     unsigned char * linkbuffer;
     unsigned char * trackbuffer;
-    unsigned char * play_order_table = himd->tifdata+0x100;
-
-    status = status;
+    unsigned char * play_order_table;
 
     g_return_val_if_fail(himd != NULL, -1);
     g_return_val_if_fail(t != NULL, -1);
 
+    if(himd_prepare_write(himd, status) < 0)
+        return -1;
+    play_order_table = himd->tifdata+0x100;
+
     /* get track[0] - the free-chain index */
     linkbuffer   = get_track(himd, 0);
     idx_freeslot = beword16(&linkbuffer[38]);
+    count        = himd_track_count(himd);
+    if(idx_freeslot == 0)
+    {
+        set_status_const(status, HIMD_ERROR_OUT_OF_TRACKS, _("No free track slot left"));
+        return -1;
+    }
 
     /* allocate slot idx_freeslot for the new track*/
     trackbuffer  = get_track(himd, idx_freeslot);
@@ -212,14 +232,56 @@ int himd_add_track_info(struct himd * himd, struct trackinfo * t, struct himderr
     settrack(t, trackbuffer);
 
     /* increase track count */
-    setbeword16(play_order_table, himd_track_count(himd)+1);
+    setbeword16(play_order_table, count+1);
 
-    /* add entry for new track in play order table */
-    setbeword16(play_order_table+2*idx_freeslot, t->tracknum);
+    /* append the new track to the play order */
+    setbeword16(play_order_table+2+2*count, t->tracknum);
     return idx_freeslot;
 }
 
 
+static char * get_tag_string(struct himd * himd, int idx, struct himderrinfo * status)
+{
+    if(idx == 0)
+        return NULL;
+    return himd_get_string_utf8(himd, idx, NULL, status);
+}
+
+/**
+ * Collect the strings of a track for tagging an exported file.
+ * Missing strings are NULL. Free the result with himd_free_tags.
+ */
+int himd_get_tags(struct himd * himd, const struct trackinfo * track, struct himd_tags * tags, struct himderrinfo * status)
+{
+    g_return_val_if_fail(himd != NULL, -1);
+    g_return_val_if_fail(track != NULL, -1);
+    g_return_val_if_fail(tags != NULL, -1);
+
+    tags->title = tags->artist = tags->album = NULL;
+    tags->trackinalbum = track->trackinalbum;
+    tags->comment = NULL;
+    tags->loudness = NULL;
+
+    if((track->title && !(tags->title = get_tag_string(himd, track->title, status))) ||
+       (track->artist && !(tags->artist = get_tag_string(himd, track->artist, status))) ||
+       (track->album && !(tags->album = get_tag_string(himd, track->album, status))))
+    {
+        himd_free_tags(tags);
+        return -1;
+    }
+    return 0;
+}
+
+void himd_free_tags(struct himd_tags * tags)
+{
+    g_return_if_fail(tags != NULL);
+
+    g_free(tags->title);
+    g_free(tags->artist);
+    g_free(tags->album);
+    tags->title = tags->artist = tags->album = NULL;
+}
+
 const char * himd_get_codec_name(const struct trackinfo * track)
 {
     static char buffer[5];
@@ -335,14 +397,21 @@ int himd_add_fragment_info(struct himd * himd, struct fraginfo * f, struct himde
     int idx_freefrag;
     unsigned char * linkbuffer;
     unsigned char * fragbuffer;
-    status = status;
 
     g_return_val_if_fail(himd != NULL, -1);
     g_return_val_if_fail(f != NULL, -1);
 
+    if(himd_prepare_write(himd, status) < 0)
+        return -1;
+
     linkbuffer    = get_frag(himd, 0);
 
     idx_freefrag  = beword16(linkbuffer+14) & 0xFFF;
+    if(idx_freefrag == 0)
+    {
+        set_status_const(status, HIMD_ERROR_OUT_OF_FRAGMENTS, _("No free fragment left"));
+        return -1;
+    }
     fragbuffer    = get_frag(himd, idx_freefrag);
 
     setbeword16(linkbuffer+14, beword16(fragbuffer+14) & 0xFFF);
@@ -454,7 +523,13 @@ char* himd_get_string_utf8(struct himd * himd, unsigned int idx, int*type, struc
             himd_free(rawstr);
             return NULL;
     }
-    out = g_convert(rawstr+1,length-1,"UTF-8",srcencoding,NULL,NULL,&err);
+    /* the slots hold an odd number of bytes after the encoding byte,
+       the last one is padding for UTF-16 */
+    length--;
+    if((unsigned char)rawstr[0] == HIMD_ENCODING_UTF16BE)
+        length &= ~1;
+    out = g_convert(rawstr+1,length,"UTF-8",srcencoding,NULL,NULL,&err);
+    count_string_conversion(himd);
     himd_free(rawstr);
     if(err)
     {
@@ -480,6 +555,8 @@ int himd_add_string(struct himd * himd, char *string, int type, struct himderrin
     g_return_val_if_fail(himd != NULL, -1);
     g_return_val_if_fail(string != NULL, -1);
 
+    if(himd_prepare_write(himd, status) < 0)
+        return -1;
 
     /* try to use Latin-1 or Shift-JIS. If that fails, use Unicode. */
     if((convertedstring = g_convert(string,-1,"ISO-8859-1","UTF8",
@@ -499,13 +576,15 @@ int himd_add_string(struct himd * himd, char *string, int type, struct himderrin
         return -1;
     }
 
+    count_string_conversion(himd);
+
     /* how many number of slots to store string in? */
     nslots = (length+14)/14;	/* +13 for rounding up, +1 for the encoding byte */
 
     /* check that there are enough free slots. Start at slot 0 which
        is the head of the free list. */
     curidx = 0;
-    for(i = 0; i < nslots; i--)
+    for(i = 0; i < nslots; i++)
     {
         curtype = strtype(get_strchunk(himd, curidx));
         curidx = strlink(get_strchunk(himd, curidx));
@@ -20,4 +20,7 @@ QMAKE_LIBDIR += ../libhimd
 LIBS += -L../libhimd
 
 INCLUDEPATH += ../libhimd
+
+# the trace points in the programs must match the library
+with_trace: DEFINES += CONFIG_WITH_TRACE
 LIBS    += -lhimd
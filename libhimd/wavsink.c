@@ -0,0 +1,170 @@
+#include <string.h>
+#include <errno.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "himd.h"
+#include "himd_private.h"
+#include "wavsink.h"
+#include "trace.h"
+
+#define _(x) (x)
+
+static void setleword16(unsigned char * c, unsigned int val)
+{
+    c[0] = val & 0xFF;
+    c[1] = (val >> 8) & 0xFF;
+}
+
+static void setleword32(unsigned char * c, unsigned long val)
+{
+    c[0] = val & 0xFF;
+    c[1] = (val >> 8) & 0xFF;
+    c[2] = (val >> 16) & 0xFF;
+    c[3] = (val >> 24) & 0xFF;
+}
+
+void make_wav_header(unsigned char * header, unsigned long datalen)
+{
+    memcpy(header, "RIFF", 4);
+    setleword32(header+4, datalen + WAV_HEADER_SIZE - 8);
+    memcpy(header+8, "WAVEfmt ", 8);
+    setleword32(header+16, 16);		/* fmt chunk size */
+    setleword16(header+20, 1);		/* PCM */
+    setleword16(header+22, 2);		/* channels */
+    setleword32(header+24, 44100);	/* sample rate */
+    setleword32(header+28, 44100*4);	/* bytes per second */
+    setleword16(header+32, 4);		/* bytes per sample frame */
+    setleword16(header+34, 16);		/* bits per sample */
+    memcpy(header+36, "data", 4);
+    setleword32(header+40, datalen);
+}
+
+int himd_wavsink_open(struct himd_wavsink * sink, const char * filename, struct himderrinfo * status)
+{
+    unsigned char header[WAV_HEADER_SIZE];
+
+    g_return_val_if_fail(sink != NULL, -1);
+    g_return_val_if_fail(filename != NULL, -1);
+
+    sink->out = g_fopen(filename, "wb");
+    if(!sink->out)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                          _("Can't open %s for writing: %s"), filename, g_strerror(errno));
+        return -1;
+    }
+
+    sink->datalen = 0;
+    make_wav_header(header, 0);
+    if(fwrite(header, WAV_HEADER_SIZE, 1, sink->out) != 1)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                          _("Can't write WAV header: %s"), g_strerror(errno));
+        fclose(sink->out);
+        return -1;
+    }
+    return 0;
+}
+
+/* Check that the len bytes in front of offset are the expected ones */
+int sink_check_tail(FILE * out, long offset, const unsigned char * expected, unsigned int len, struct himderrinfo * status)
+{
+    unsigned char buf[HIMD_AUDIO_SIZE];
+
+    g_return_val_if_fail(len <= sizeof buf, -1);
+
+    if(offset < (long)len || fseek(out, offset - len, SEEK_SET) != 0 ||
+       fread(buf, 1, len, out) != len)
+    {
+        set_status_const(status, HIMD_ERROR_BAD_DATA_FORMAT, _("Output file is shorter than expected"));
+        return -1;
+    }
+    if(memcmp(buf, expected, len) != 0)
+    {
+        set_status_const(status, HIMD_ERROR_BAD_DATA_FORMAT, _("Output file does not end with the expected audio data"));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Continue a WAV file written up to offset by an interrupted export. The
+ * file must end at offset, and the last taillen bytes before it must be
+ * the decrypted LPCM data tail, which is checked.
+ */
+int himd_wavsink_resume(struct himd_wavsink * sink, const char * filename, long offset,
+                        const unsigned char * tail, unsigned int taillen, struct himderrinfo * status)
+{
+    g_return_val_if_fail(sink != NULL, -1);
+    g_return_val_if_fail(filename != NULL, -1);
+    g_return_val_if_fail(offset >= WAV_HEADER_SIZE, -1);
+    g_return_val_if_fail(taillen <= sizeof sink->buf, -1);
+
+    sink->out = g_fopen(filename, "r+b");
+    if(!sink->out)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                          _("Can't open %s for writing: %s"), filename, g_strerror(errno));
+        return -1;
+    }
+
+    pcm_swap16(sink->buf, tail, taillen);
+    if(sink_check_tail(sink->out, offset, sink->buf, taillen, status) < 0)
+    {
+        fclose(sink->out);
+        return -1;
+    }
+    if(fseek(sink->out, offset, SEEK_SET) != 0)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                          _("Can't seek in %s: %s"), filename, g_strerror(errno));
+        fclose(sink->out);
+        return -1;
+    }
+    sink->datalen = offset - WAV_HEADER_SIZE;
+    return 0;
+}
+
+int himd_wavsink_write(struct himd_wavsink * sink, const unsigned char * data, unsigned int len, struct himderrinfo * status)
+{
+    g_return_val_if_fail(sink != NULL, -1);
+    g_return_val_if_fail(len <= sizeof sink->buf, -1);
+
+    HIMD_TRACE_BEGIN(write_scope, "write");
+    pcm_swap16(sink->buf, data, len);
+    if(fwrite(sink->buf, len, 1, sink->out) != 1)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                          _("Can't write audio data: %s"), g_strerror(errno));
+        return -1;
+    }
+    HIMD_TRACE_END(write_scope);
+    sink->datalen += len;
+    return 0;
+}
+
+/* Closes the file in any case, returns -1 if the header could not be fixed up */
+int himd_wavsink_close(struct himd_wavsink * sink, struct himderrinfo * status)
+{
+    unsigned char header[WAV_HEADER_SIZE];
+    int ret = 0;
+
+    g_return_val_if_fail(sink != NULL, -1);
+
+    make_wav_header(header, sink->datalen);
+    if(fseek(sink->out, 0, SEEK_SET) != 0 ||
+       fwrite(header, WAV_HEADER_SIZE, 1, sink->out) != 1)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                          _("Can't update WAV header: %s"), g_strerror(errno));
+        ret = -1;
+    }
+    if(fclose(sink->out) != 0 && ret == 0)
+    {
+        set_status_printf(status, HIMD_ERROR_CANT_WRITE_OUTPUT,
+                          _("Can't finish WAV file: %s"), g_strerror(errno));
+        ret = -1;
+    }
+    return ret;
+}
@@ -0,0 +1,31 @@
+#ifndef INCLUDED_LIBHIMD_WAVSINK_H
+#define INCLUDED_LIBHIMD_WAVSINK_H
+
+#include <stdio.h>
+#include "himd.h"
+
+#define WAV_HEADER_SIZE 44
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Writes decrypted LPCM blocks as RIFF/WAVE file (44.1kHz, 16 bit, stereo).
+   The header is written with zero lengths and patched on close. */
+struct himd_wavsink {
+    FILE * out;
+    unsigned long datalen;
+    unsigned char buf[HIMD_AUDIO_SIZE];
+};
+
+int himd_wavsink_open(struct himd_wavsink * sink, const char * filename, struct himderrinfo * status);
+int himd_wavsink_resume(struct himd_wavsink * sink, const char * filename, long offset,
+                        const unsigned char * tail, unsigned int taillen, struct himderrinfo * status);
+int himd_wavsink_write(struct himd_wavsink * sink, const unsigned char * data, unsigned int len, struct himderrinfo * status);
+int himd_wavsink_close(struct himd_wavsink * sink, struct himderrinfo * status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,419 @@
+/*
+ *   microbench.c - time the hot functions of libhimd one by one
+ *
+ *   Runs on a synthetic HiMD in a temporary directory. Each kernel is
+ *   warmed up, then timed in several samples of a calibrated number of
+ *   operations. The median is reported with the median absolute deviation
+ *   of the samples, so changes can be told apart from noise.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "himd.h"
+#include "himd_private.h"
+#include "imagegen.h"
+
+#define DEFAULT_SAMPLES 15
+#define SAMPLE_NS 20000000	/* aim for 20ms per sample */
+#define WARMUP_NS 50000000
+#define DECRYPT_BLOCKS 16
+
+/* Allocations are counted by wrapping the glibc allocator. This also
+   counts allocations in glib, mcrypt and mad, which is intended. */
+#ifdef __GLIBC__
+extern void * __libc_malloc(size_t size);
+extern void * __libc_calloc(size_t n, size_t size);
+extern void * __libc_realloc(void * p, size_t size);
+
+static unsigned long long allocations;
+
+void * malloc(size_t size)
+{
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void * calloc(size_t n, size_t size)
+{
+    allocations++;
+    return __libc_calloc(n, size);
+}
+
+void * realloc(void * p, size_t size)
+{
+    allocations++;
+    return __libc_realloc(p, size);
+}
+#define HAVE_ALLOCATION_COUNT 1
+#else
+static unsigned long long allocations;
+#endif
+
+struct context {
+    struct himd himd;
+    unsigned int mp3slot, lpcmslot;
+    unsigned int nslots;
+    unsigned int * slots;
+    unsigned int nstrings;
+    unsigned int * strings;
+    unsigned int next;
+
+    struct himd_blockstream blockstream;
+    unsigned char block[HIMD_BLOCKINFO_SIZE];
+    unsigned char scramble[HIMD_AUDIO_SIZE];
+    mp3key key;
+    struct himd_holelist holes;
+#ifdef CONFIG_WITH_MCRYPT
+    void * crypt;
+    unsigned char cryptblocks[DECRYPT_BLOCKS][HIMD_BLOCKINFO_SIZE];
+    unsigned char fragkey[8];
+    size_t cryptlen;
+#endif
+#ifdef CONFIG_WITH_MAD
+    struct himd_mp3stream mp3;
+    unsigned int mp3bytes, mp3frames;
+#endif
+};
+
+struct kernel {
+    const char * name;
+    void (*op)(struct context * ctx);
+    unsigned int (*bytes)(struct context * ctx);	/* per operation, may be NULL */
+};
+
+static void fail(const char * what, const struct himderrinfo * status)
+{
+    fprintf(stderr, "%s: %s\n", what, status->statusmsg);
+    exit(1);
+}
+
+static gint64 now_ns(void)
+{
+    return g_get_monotonic_time() * 1000;
+}
+
+static void op_blockstream_read(struct context * ctx)
+{
+    struct himderrinfo status;
+
+    if(himd_blockstream_read(&ctx->blockstream, ctx->block, NULL, NULL, NULL, &status) < 0)
+    {
+        if(status.status != HIMD_STATUS_AUDIO_EOF)
+            fail("himd_blockstream_read", &status);
+        if(himd_blockstream_seek(&ctx->blockstream, 0, &status) < 0 ||
+           himd_blockstream_read(&ctx->blockstream, ctx->block, NULL, NULL, NULL, &status) < 0)
+            fail("himd_blockstream_read", &status);
+    }
+}
+
+static unsigned int block_bytes(struct context * ctx)
+{
+    (void)ctx;
+    return HIMD_BLOCKINFO_SIZE;
+}
+
+static void op_mp3_unscramble(struct context * ctx)
+{
+    mp3_unscramble(ctx->scramble, sizeof ctx->scramble, ctx->key);
+}
+
+static unsigned int audio_bytes(struct context * ctx)
+{
+    (void)ctx;
+    return HIMD_AUDIO_SIZE;
+}
+
+#ifdef CONFIG_WITH_MCRYPT
+/* Cycles through real blocks, so the block key changes like it does
+   while reading a track. Decrypting a block again only garbles its
+   audio data, the keys stay intact. */
+static void op_descrypt_decrypt(struct context * ctx)
+{
+    struct himderrinfo status;
+
+    if(descrypt_decrypt(ctx->crypt, ctx->cryptblocks[ctx->next++ % DECRYPT_BLOCKS],
+                        ctx->cryptlen, ctx->fragkey, &status) < 0)
+        fail("descrypt_decrypt", &status);
+}
+
+static unsigned int crypt_bytes(struct context * ctx)
+{
+    return ctx->cryptlen;
+}
+#endif
+
+#ifdef CONFIG_WITH_MAD
+static void op_split_frames(struct context * ctx)
+{
+    struct himderrinfo status;
+
+    if(himd_mp3stream_split_frames(&ctx->mp3, ctx->mp3bytes, 0, ctx->mp3frames - 1, &status) < 0)
+        fail("himd_mp3stream_split_frames", &status);
+    free(ctx->mp3.frameptrs);
+    ctx->mp3.frameptrs = NULL;
+}
+
+static unsigned int mp3_bytes(struct context * ctx)
+{
+    return ctx->mp3bytes;
+}
+#endif
+
+static void op_get_string_utf8(struct context * ctx)
+{
+    struct himderrinfo status;
+    char * str;
+
+    if(!(str = himd_get_string_utf8(&ctx->himd, ctx->strings[ctx->next++ % ctx->nstrings], NULL, &status)))
+        fail("himd_get_string_utf8", &status);
+    himd_free(str);
+}
+
+static void op_get_track_info(struct context * ctx)
+{
+    struct himderrinfo status;
+    struct trackinfo t;
+
+    if(himd_get_track_info(&ctx->himd, ctx->slots[ctx->next++ % ctx->nslots], &t, &status) < 0)
+        fail("himd_get_track_info", &status);
+}
+
+static void op_find_holes(struct context * ctx)
+{
+    struct himderrinfo status;
+
+    if(himd_find_holes(&ctx->himd, &ctx->holes, &status) < 0)
+        fail("himd_find_holes", &status);
+}
+
+static const struct kernel kernels[] = {
+    { "blockstream_read", op_blockstream_read, block_bytes },
+#ifdef CONFIG_WITH_MCRYPT
+    { "descrypt_decrypt", op_descrypt_decrypt, crypt_bytes },
+#endif
+    { "mp3_unscramble", op_mp3_unscramble, audio_bytes },
+#ifdef CONFIG_WITH_MAD
+    { "mp3stream_split_frames", op_split_frames, mp3_bytes },
+#endif
+    { "get_string_utf8", op_get_string_utf8, NULL },
+    { "get_track_info", op_get_track_info, NULL },
+    { "find_holes", op_find_holes, NULL },
+};
+
+static void setup(struct context * ctx, const char * path)
+{
+    struct himd_image_spec spec;
+    struct himderrinfo status;
+    struct trackinfo t;
+    unsigned int i;
+
+    himd_image_spec_init(&spec);
+    spec.tracks = 24;
+    spec.seconds = 60;
+    spec.encoding = HIMD_IMAGE_MIXED;
+    spec.codecs[0] = HIMD_IMAGE_MP3;
+    spec.codecs[1] = HIMD_IMAGE_LPCM;
+#ifdef CONFIG_WITH_MCRYPT
+    spec.ncodecs = 2;
+#else
+    spec.ncodecs = 1;
+#endif
+    if(himd_generate_image(path, &spec, &status) < 0)
+        fail("Can't generate image", &status);
+    if(himd_open(&ctx->himd, path, &status) < 0)
+        fail("Can't open image", &status);
+
+    ctx->nslots = himd_track_count(&ctx->himd);
+    ctx->slots = g_new(unsigned int, ctx->nslots);
+    ctx->strings = g_new(unsigned int, 2 * ctx->nslots);
+    for(i = 0; i < ctx->nslots; i++)
+    {
+        ctx->slots[i] = himd_get_trackslot(&ctx->himd, i, &status);
+        if(himd_get_track_info(&ctx->himd, ctx->slots[i], &t, &status) < 0)
+            fail("Can't read track", &status);
+        ctx->strings[ctx->nstrings++] = t.title;
+        ctx->strings[ctx->nstrings++] = t.artist;
+        if(t.codec_id == CODEC_LPCM && !ctx->lpcmslot)
+            ctx->lpcmslot = ctx->slots[i];
+        else if(t.codec_id == CODEC_ATRAC3PLUS_OR_MPEG && !ctx->mp3slot)
+            ctx->mp3slot = ctx->slots[i];
+    }
+
+    if(himd_get_track_info(&ctx->himd, ctx->mp3slot, &t, &status) < 0 ||
+       himd_blockstream_open(&ctx->himd, t.firstfrag, TRACK_IS_MPEG, &ctx->blockstream, &status) < 0 ||
+       himd_obtain_mp3key(&ctx->himd, ctx->mp3slot, &ctx->key, &status) < 0)
+        fail("Can't open MP3 track", &status);
+    memset(ctx->scramble, 0x5A, sizeof ctx->scramble);
+
+#ifdef CONFIG_WITH_MAD
+    if(himd_mp3stream_open(&ctx->himd, ctx->mp3slot, &ctx->mp3, &status) < 0 ||
+       himd_blockstream_read(&ctx->mp3.stream, ctx->mp3.blockbuf, NULL, NULL, NULL, &status) < 0)
+        fail("Can't read MP3 block", &status);
+    ctx->mp3frames = beword16(ctx->mp3.blockbuf + 4);
+    ctx->mp3bytes = beword16(ctx->mp3.blockbuf + 8);
+    mp3_unscramble(ctx->mp3.blockbuf + 0x20, ctx->mp3bytes, ctx->mp3.key);
+#endif
+
+#ifdef CONFIG_WITH_MCRYPT
+    {
+        struct himd_blockstream stream;
+
+        if(himd_get_track_info(&ctx->himd, ctx->lpcmslot, &t, &status) < 0 ||
+           descrypt_open(&ctx->crypt, t.key, t.ekbnum, &status) < 0 ||
+           himd_blockstream_open(&ctx->himd, t.firstfrag, himd_trackinfo_framesperblock(&t), &stream, &status) < 0)
+            fail("Can't open LPCM track", &status);
+        for(i = 0; i < DECRYPT_BLOCKS; i++)
+            if(himd_blockstream_read(&stream, ctx->cryptblocks[i], NULL, NULL, ctx->fragkey, &status) < 0)
+                fail("Can't read LPCM block", &status);
+        himd_blockstream_close(&stream);
+        ctx->cryptlen = himd_trackinfo_framesize(&t) * himd_trackinfo_framesperblock(&t);
+    }
+#endif
+}
+
+static void teardown(struct context * ctx)
+{
+#ifdef CONFIG_WITH_MCRYPT
+    descrypt_close(ctx->crypt);
+#endif
+#ifdef CONFIG_WITH_MAD
+    himd_mp3stream_close(&ctx->mp3);
+#endif
+    himd_blockstream_close(&ctx->blockstream);
+    himd_close(&ctx->himd);
+    g_free(ctx->slots);
+    g_free(ctx->strings);
+}
+
+static int cmp_double(const void * a, const void * b)
+{
+    double da = *(const double*)a, db = *(const double*)b;
+    return da < db ? -1 : da > db;
+}
+
+static void run_kernel(struct context * ctx, const struct kernel * k, unsigned int samples)
+{
+    unsigned long long iters = 1, i, ops = 0, allocs;
+    double * ns = g_new(double, samples), * dev = g_new(double, samples);
+    double median, mad;
+    gint64 start, elapsed;
+    unsigned int s;
+
+    /* warm up caches and the branch predictor, and find out how many
+       operations fill a sample */
+    start = now_ns();
+    do
+    {
+        for(i = 0; i < iters; i++)
+            k->op(ctx);
+        elapsed = now_ns() - start;
+        if(elapsed < WARMUP_NS)
+            iters *= 2;
+    } while(elapsed < WARMUP_NS);
+    start = now_ns();
+    for(i = 0; i < iters; i++)
+        k->op(ctx);
+    elapsed = MAX(now_ns() - start, 1);
+    iters = MAX(1, iters * SAMPLE_NS / elapsed);
+
+    allocs = allocations;
+    for(s = 0; s < samples; s++)
+    {
+        start = now_ns();
+        for(i = 0; i < iters; i++)
+            k->op(ctx);
+        ns[s] = (double)(now_ns() - start) / iters;
+        ops += iters;
+    }
+    allocs = allocations - allocs;
+
+    qsort(ns, samples, sizeof ns[0], cmp_double);
+    median = ns[samples / 2];
+    for(s = 0; s < samples; s++)
+        dev[s] = ns[s] > median ? ns[s] - median : median - ns[s];
+    qsort(dev, samples, sizeof dev[0], cmp_double);
+    mad = dev[samples / 2];
+
+    printf("%-24s %12.1f %6.1f%% %12.1f", k->name, median, median > 0 ? 100 * mad / median : 0.0, ns[0]);
+    if(k->bytes)
+        printf(" %10.1f", k->bytes(ctx) / median * 1e9 / 1e6);
+    else
+        printf(" %10s", "-");
+#ifdef HAVE_ALLOCATION_COUNT
+    printf(" %10.2f\n", (double)allocs / ops);
+#else
+    (void)allocs;
+    printf(" %10s\n", "-");
+#endif
+    g_free(ns);
+    g_free(dev);
+}
+
+static void remove_image(const char * path)
+{
+    const char * const files[] = { "TRKIDX01.HMA", "_RKIDX01.HMA", "MCLIST01.HMA", "ATDATA01.HMA" };
+    gchar * dir = g_build_filename(path, "HMDHIFI", NULL), * file;
+    unsigned int i;
+
+    for(i = 0; i < G_N_ELEMENTS(files); i++)
+    {
+        file = g_build_filename(dir, files[i], NULL);
+        g_unlink(file);
+        g_free(file);
+    }
+    g_rmdir(dir);
+    g_rmdir(path);
+    g_free(dir);
+}
+
+int main(int argc, char ** argv)
+{
+    struct context ctx;
+    unsigned int samples = DEFAULT_SAMPLES, i;
+    gchar * tmpdir;
+    int argi = 1, j, selected;
+
+    if(argc > 2 && strcmp(argv[1], "-n") == 0)
+    {
+        samples = MAX(3, atoi(argv[2]));
+        argi = 3;
+    }
+    if(argi < argc && argv[argi][0] == '-')
+    {
+        printf("Usage: %s [-n <SAMPLES>] [<kernel>...]\n\nKernels:", argv[0]);
+        for(i = 0; i < G_N_ELEMENTS(kernels); i++)
+            printf(" %s", kernels[i].name);
+        printf("\n");
+        return 1;
+    }
+
+    if(!(tmpdir = g_dir_make_tmp("himdmicro-XXXXXX", NULL)))
+    {
+        fprintf(stderr, "Can't create temporary directory: %s\n", g_strerror(errno));
+        return 1;
+    }
+    memset(&ctx, 0, sizeof ctx);
+    setup(&ctx, tmpdir);
+
+    printf("%u samples per kernel, median ns/op with median absolute deviation\n\n", samples);
+    printf("%-24s %12s %7s %12s %10s %10s\n", "kernel", "ns/op", "+-", "min ns/op", "MB/s", "allocs/op");
+    for(i = 0; i < G_N_ELEMENTS(kernels); i++)
+    {
+        selected = argi == argc;
+        for(j = argi; j < argc; j++)
+            if(strcmp(argv[j], kernels[i].name) == 0)
+                selected = 1;
+        if(selected)
+            run_kernel(&ctx, &kernels[i], samples);
+    }
+
+    teardown(&ctx);
+    remove_image(tmpdir);
+    g_free(tmpdir);
+    return 0;
+}
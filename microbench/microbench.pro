@@ -0,0 +1,12 @@
+TEMPLATE=app
+TARGET  =himdmicrobench
+CONFIG  -= qt
+CONFIG  += console link_pkgconfig link_prl
+PKGCONFIG += glib-2.0
+SOURCES += microbench.c
+
+# the kernels behind these switches only exist if libhimd has them
+!without_mcrypt: DEFINES += CONFIG_WITH_MCRYPT
+!without_mad: DEFINES += CONFIG_WITH_MAD
+
+include(../libhimd/use_libhimd.pri)
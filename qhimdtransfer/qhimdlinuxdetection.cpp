@@ -0,0 +1,352 @@
+#include <QtCore/QDebug>
+#include <QtCore/QtAlgorithms>
+#include <QtCore/QList>
+#include <QtCore/QPair>
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QSocketNotifier>
+#include "qhimddetection.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+/* Devices are found when they are mounted. Changes of the mount table
+   are reported by /proc/self/mounts as an exceptional condition, the
+   kernel reports removals and media changes as uevents on a netlink
+   socket. Both are watched with QSocketNotifier in the GUI thread. */
+
+#define UEVENT_BUFFER 8192
+
+struct linux_himd_device : himd_device {
+                    QString devnode;    /* the mounted block device, e.g. /dev/sdb1 */
+                    QString syspath;    /* the block device in /sys */
+                    };
+
+typedef QPair<QString, QString> mount_entry;    /* device node, mount point */
+
+static QString unescape_mount_field(const QByteArray & field);
+static QString find_syspath(QString devnode);
+static bool identified(QString syspath, QString & name);
+
+class QHiMDLinuxDetection : public QHiMDDetection {
+    Q_OBJECT
+
+public:
+    void scan_for_himd_devices();
+    QHiMDLinuxDetection(QObject * parent = NULL);
+    ~QHiMDLinuxDetection();
+    linux_himd_device *find_by_path(QString path);
+
+private:
+    int ueventfd;
+    int mountsfd;
+    QSocketNotifier * uevents;
+    QSocketNotifier * mounts;
+    linux_himd_device *linux_dev_at(int idx);
+    QList<mount_entry> read_mounts();
+    void add_himddevice(QString devnode, QString path);
+    void remove_himddevice(QString path);
+    void media_changed(QString syspath);
+    void device_removed(QString syspath);
+
+private slots:
+    void read_uevents();
+    void mounts_changed();
+};
+
+
+QHiMDDetection * createDetection(QObject * parent)
+{
+    return new QHiMDLinuxDetection(parent);
+}
+
+QHiMDLinuxDetection::QHiMDLinuxDetection(QObject * parent)
+  : QHiMDDetection(parent), uevents(NULL), mounts(NULL)
+{
+    struct sockaddr_nl addr;
+
+    ueventfd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    if(ueventfd >= 0)
+    {
+        memset(&addr, 0, sizeof(addr));
+        addr.nl_family = AF_NETLINK;
+        addr.nl_groups = 1;     /* kernel events, udev may still be working on them */
+        if(bind(ueventfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        {
+            ::close(ueventfd);
+            ueventfd = -1;
+        }
+    }
+    if(ueventfd >= 0)
+    {
+        uevents = new QSocketNotifier(ueventfd, QSocketNotifier::Read, this);
+        connect(uevents, SIGNAL(activated(int)), this, SLOT(read_uevents()));
+    }
+    else
+        qDebug() << "can't listen to uevents, media changes won't be noticed";
+
+    mountsfd = open("/proc/self/mounts", O_RDONLY | O_CLOEXEC);
+    if(mountsfd >= 0)
+    {
+        mounts = new QSocketNotifier(mountsfd, QSocketNotifier::Exception, this);
+        connect(mounts, SIGNAL(activated(int)), this, SLOT(mounts_changed()));
+    }
+    else
+        qDebug() << "can't watch the mount table, himd devices won't be found";
+}
+
+QHiMDLinuxDetection::~QHiMDLinuxDetection()
+{
+    delete uevents;
+    delete mounts;
+    if(ueventfd >= 0)
+        ::close(ueventfd);
+    if(mountsfd >= 0)
+        ::close(mountsfd);
+    /* no signals, the receivers may be gone already */
+    qDeleteAll(device_list);
+}
+
+void QHiMDLinuxDetection::scan_for_himd_devices()
+{
+    mounts_changed();
+}
+
+linux_himd_device *QHiMDLinuxDetection::linux_dev_at(int idx)
+{
+    return static_cast<linux_himd_device*>(device_list.at(idx));
+}
+
+linux_himd_device *QHiMDLinuxDetection::find_by_path(QString path)
+{
+    return static_cast<linux_himd_device*>(QHiMDDetection::find_by_path(path));
+}
+
+/* mount points with blanks and the like are written as octal escapes */
+static QString unescape_mount_field(const QByteArray & field)
+{
+    QByteArray res;
+
+    for(int i = 0; i < field.size(); i++)
+    {
+        if(field[i] == '\\' && i + 3 < field.size())
+        {
+            res.append((char)field.mid(i + 1, 3).toInt(NULL, 8));
+            i += 3;
+        }
+        else
+            res.append(field[i]);
+    }
+    return QFile::decodeName(res);
+}
+
+QList<mount_entry> QHiMDLinuxDetection::read_mounts()
+{
+    QList<mount_entry> entries;
+    QByteArray table;
+    char buffer[4096];
+    ssize_t len;
+
+    if(mountsfd < 0 || lseek(mountsfd, 0, SEEK_SET) < 0)
+        return entries;
+    while((len = read(mountsfd, buffer, sizeof(buffer))) > 0)
+        table.append(buffer, len);
+
+    foreach(QByteArray line, table.split('\n'))
+    {
+        QList<QByteArray> fields = line.split(' ');
+        if(fields.size() < 2 || !fields[0].startsWith("/dev/"))
+            continue;
+        entries.append(mount_entry(unescape_mount_field(fields[0]), unescape_mount_field(fields[1])));
+    }
+    return entries;
+}
+
+/* the block device in /sys, e.g. /sys/devices/.../block/sdb/sdb1 */
+static QString find_syspath(QString devnode)
+{
+    struct stat st;
+
+    if(stat(QFile::encodeName(devnode), &st) < 0 || !S_ISBLK(st.st_mode))
+        return QString();
+
+    return QFileInfo(QString("/sys/dev/block/%1:%2").arg(major(st.st_rdev)).arg(minor(st.st_rdev))).canonicalFilePath();
+}
+
+/* the USB device is the first parent having a vendor and product ID */
+static bool identified(QString syspath, QString & name)
+{
+    QDir dir(syspath);
+
+    do
+    {
+        QFile vendor(dir.filePath("idVendor"));
+        QFile product(dir.filePath("idProduct"));
+        if(vendor.open(QIODevice::ReadOnly) && product.open(QIODevice::ReadOnly))
+        {
+            int vid = vendor.readAll().trimmed().toInt(NULL, 16);
+            int pid = product.readAll().trimmed().toInt(NULL, 16);
+            const char * devname = identify_usb_device(vid, pid);
+            if (!devname)
+                return false;
+            name = devname;
+            return true;
+        }
+    } while(dir.cdUp() && dir.path() != "/sys" && !dir.isRoot());
+    return false;
+}
+
+void QHiMDLinuxDetection::add_himddevice(QString devnode, QString path)
+{
+    QString name;
+    QString syspath;
+
+    if (find_by_path(path))
+        return;
+
+    syspath = find_syspath(devnode);
+    if(syspath.isEmpty() || !identified(syspath, name))
+        return;
+
+    linux_himd_device * new_device = new linux_himd_device;
+    new_device->devnode = devnode;
+    new_device->syspath = syspath;
+    new_device->is_busy = false;
+    new_device->path = path;
+    new_device->recorder_name = name;
+    device_list.append(new_device);
+
+    if(QFile::exists(path + "/HI-MD.IND"))
+    {
+        new_device->md_inserted = true;
+        emit himd_found(new_device->path);
+        qDebug() << "himd device at " + new_device->path + " added (" + new_device->recorder_name + ")";
+    }
+    else
+    {
+        qDebug() << "himd device at " + new_device->path + " added (" + new_device->recorder_name + ")" + " ; without MD";
+        new_device->md_inserted = false;
+    }
+}
+
+void QHiMDLinuxDetection::remove_himddevice(QString path)
+{
+    linux_himd_device * dev = find_by_path(path);
+    if (!dev)
+        return;
+
+    if(dev->md_inserted)
+        emit himd_removed(dev->path);
+
+    qDebug() << "himd device at " + dev->path + " removed (" + dev->recorder_name + ")";
+
+    device_list.removeAll(dev);
+    delete dev;
+}
+
+/* a device vanished from /sys, the mount point may stay until it is lazily unmounted */
+void QHiMDLinuxDetection::device_removed(QString syspath)
+{
+    for (int i = device_list.size() - 1; i >= 0; i--)
+    {
+        linux_himd_device * dev = linux_dev_at(i);
+        if(dev->syspath == syspath || dev->syspath.startsWith(syspath + "/"))
+            remove_himddevice(dev->path);
+    }
+}
+
+/* the MD was ejected or inserted, the disk reports a size of 0 without media */
+void QHiMDLinuxDetection::media_changed(QString syspath)
+{
+    QFile size(syspath + "/size");
+    bool inserted = size.open(QIODevice::ReadOnly) && size.readAll().trimmed().toLongLong() != 0;
+
+    for (int i = 0; i < device_list.size(); i++)
+    {
+        linux_himd_device * dev = linux_dev_at(i);
+        if(dev->syspath != syspath && !dev->syspath.startsWith(syspath + "/"))
+            continue;
+
+        if(inserted && !dev->md_inserted && QFile::exists(dev->path + "/HI-MD.IND"))
+        {
+            dev->md_inserted = true;
+            emit himd_found(dev->path);
+            qDebug() << "himd device at " + dev->path + " : md inserted";
+        }
+        else if(!inserted && dev->md_inserted)
+        {
+            dev->md_inserted = false;
+            emit himd_removed(dev->path);
+            qDebug() << "himd device at " + dev->path + " :  md removed";
+        }
+    }
+}
+
+// slots
+
+/* a uevent is "ACTION@DEVPATH" followed by KEY=value pairs, all null terminated */
+void QHiMDLinuxDetection::read_uevents()
+{
+    char buffer[UEVENT_BUFFER];
+    struct sockaddr_nl sender;
+    socklen_t senderlen;
+    ssize_t len;
+
+    for(;;)
+    {
+        senderlen = sizeof(sender);
+        len = recvfrom(ueventfd, buffer, sizeof(buffer) - 1, 0, (struct sockaddr *)&sender, &senderlen);
+        if(len <= 0)
+            break;
+        if(sender.nl_pid != 0)      /* only trust the kernel */
+            continue;
+        buffer[len] = '\0';
+
+        QByteArray action, devpath, subsystem;
+        bool mediachange = false;
+        for(char * p = buffer + strlen(buffer) + 1; p < buffer + len; p += strlen(p) + 1)
+        {
+            if(!strncmp(p, "ACTION=", 7))
+                action = p + 7;
+            else if(!strncmp(p, "DEVPATH=", 8))
+                devpath = p + 8;
+            else if(!strncmp(p, "SUBSYSTEM=", 10))
+                subsystem = p + 10;
+            else if(!strcmp(p, "DISK_MEDIA_CHANGE=1"))
+                mediachange = true;
+        }
+        if(devpath.isEmpty())
+            continue;
+
+        if(action == "remove")
+            device_removed("/sys" + QFile::decodeName(devpath));
+        else if(action == "change" && subsystem == "block" && mediachange)
+            media_changed("/sys" + QFile::decodeName(devpath));
+    }
+}
+
+void QHiMDLinuxDetection::mounts_changed()
+{
+    QList<mount_entry> entries = read_mounts();
+    int i, j;
+
+    /* unmounted, or something else mounted in its place */
+    for (i = device_list.size() - 1; i >= 0; i--)
+    {
+        linux_himd_device * dev = linux_dev_at(i);
+        if(!entries.contains(mount_entry(dev->devnode, dev->path)))
+            remove_himddevice(dev->path);
+    }
+
+    for (j = 0; j < entries.size(); j++)
+        add_himddevice(entries[j].first, entries[j].second);
+}
+
+#include "qhimdlinuxdetection.moc"
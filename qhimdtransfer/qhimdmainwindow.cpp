@@ -4,201 +4,23 @@
 #include "qhimduploaddialog.h"
 #include <QtGui/QMessageBox>
 #include <QtGui/QApplication>
+#include <QtGui/QProgressBar>
 
 #include <QtCore/QDebug>
 
 
-QString QHiMDMainWindow::dumpmp3(const QHiMDTrack & trk, QString file)
-{
-    QString errmsg;
-    struct himd_mp3stream str;
-    struct himderrinfo status;
-    unsigned int len;
-    const unsigned char * data;
-    QFile f(file);
-
-    if(!f.open(QIODevice::ReadWrite))
-    {
-        return tr("Error opening file for MP3 output");
-    }
-    if(!(errmsg = trk.openMpegStream(&str)).isNull())
-    {
-        f.remove();
-        return tr("Error opening track: ") + errmsg;
-    }
-    while(himd_mp3stream_read_block(&str, &data, &len, NULL, &status) >= 0)
-    {
-        if(f.write((const char*)data,len) == -1)
-        {
-            errmsg = tr("Error writing audio data");
-            goto clean;
-        }
-        uploadDialog->blockTransferred();
-        QApplication::processEvents();
-        if(uploadDialog->upload_canceled())
-        {
-            errmsg = tr("upload aborted by the user");
-            goto clean;
-        }
-
-    }
-    if(status.status != HIMD_STATUS_AUDIO_EOF)
-        errmsg = tr("Error reading audio data: ") + status.statusmsg;
-
-clean:
-    f.close();
-    himd_mp3stream_close(&str);
-    if(!errmsg.isNull())
-        f.remove();
-    return errmsg;
-}
-
-static inline TagLib::String QStringToTagString(const QString & s)
-{
-    return TagLib::String(s.toUtf8().data(), TagLib::String::UTF8);
-}
-
-static void addid3tag(QString title, QString artist, QString album, QString file)
-{
-#ifdef Q_OS_WIN
-    TagLib::FileRef f(file.toStdWString().c_str());
-#else
-    TagLib::FileRef f(file.toUtf8().data());
-#endif
-    TagLib::Tag *t = f.tag();
-    t->setTitle(QStringToTagString(title));
-    t->setArtist(QStringToTagString(artist));
-    t->setAlbum(QStringToTagString(album));
-    t->setComment("*** imported from HiMD via QHiMDTransfer ***");
-    f.file()->save();
-}
-
-QString QHiMDMainWindow::dumpoma(const QHiMDTrack & track, QString file)
-{
-    QString errmsg;
-    struct himd_nonmp3stream str;
-    struct himderrinfo status;
-    unsigned int len;
-    const unsigned char * data;
-    QFile f(file);
-
-    if(!f.open(QIODevice::ReadWrite))
-        return tr("Error opening file for ATRAC output");
-
-    if(!(errmsg = track.openNonMpegStream(&str)).isNull())
-    {
-        f.remove();
-        return tr("Error opening track: ") + status.statusmsg;
-    }
-
-    if(f.write(track.makeEA3Header()) == -1)
-    {
-        errmsg = tr("Error writing header");
-        goto clean;
-    }
-    while(himd_nonmp3stream_read_block(&str, &data, &len, NULL, &status) >= 0)
-    {
-        if(f.write((const char*)data,len) == -1)
-        {
-            errmsg = tr("Error writing audio data");
-            goto clean;
-        }
-        uploadDialog->blockTransferred();
-        QApplication::processEvents();
-        if(uploadDialog->upload_canceled())
-        {
-            errmsg = QString("upload aborted by the user");
-            goto clean;
-        }
-    }
-    if(status.status != HIMD_STATUS_AUDIO_EOF)
-        errmsg = QString("Error reading audio data: ") + status.statusmsg;
-
-clean:
-    f.close();
-    himd_nonmp3stream_close(&str);
-
-    if(!errmsg.isNull())
-        f.remove();
-    return errmsg;
-}
-
-QString QHiMDMainWindow::dumppcm(const QHiMDTrack & track, QString file)
-{
-    struct himd_nonmp3stream str;
-    struct himderrinfo status;
-    unsigned int len, i;
-    int left, right;
-    int clipcount;
-    QString errmsg;
-    QFile f(file);
-    const unsigned char * data;
-    sox_format_t * out;
-    sox_sample_t soxbuf [HIMD_MAX_PCMFRAME_SAMPLES * 2];
-    sox_signalinfo_t signal_out;
-
-    signal_out.channels = 2;
-    signal_out.length = 0;
-    signal_out.precision = 16;
-    signal_out.rate = 44100;
-
-    if(!(out = sox_open_write(file.toUtf8(), &signal_out, NULL, NULL, NULL, NULL)))
-        return tr("Error opening file for WAV output");
-
-    if(!(errmsg = track.openNonMpegStream(&str)).isNull())
-    {
-        f.remove();
-        return tr("Error opening track: ") + status.statusmsg;
-    }
-
-    while(himd_nonmp3stream_read_block(&str, &data, &len, NULL, &status) >= 0)
-    {
-
-      for(i = 0; i < len/4; i++) {
-
-        left = data[i*4]*256+data[i*4+1];
-        right = data[i*4+2]*256+data[i*4+3];
-        if (left > 0x8000) left -= 0x10000;
-        if (right > 0x8000) right -= 0x10000;
-
-        soxbuf[i*2] = SOX_SIGNED_16BIT_TO_SAMPLE(left, clipcount);
-        soxbuf[i*2+1] = SOX_SIGNED_16BIT_TO_SAMPLE(right, clipcount);
-        (void)clipcount; /* suppess "is unused" warning */
-      }
-
-      if (sox_write(out, soxbuf, len/2) != len/2)
-      {
-            errmsg = tr("Error writing audio data");
-            goto clean;
-      }
-      uploadDialog->blockTransferred();
-      QApplication::processEvents();
-      if(uploadDialog->upload_canceled())
-      {
-            errmsg = QString("upload aborted by the user");
-            goto clean;
-      }
-    }
-    if(status.status != HIMD_STATUS_AUDIO_EOF)
-        errmsg = QString("Error reading audio data: ") + status.statusmsg;
-
-clean:
-    sox_close(out);
-    himd_nonmp3stream_close(&str);
-
-    if(!errmsg.isNull())
-        f.remove();
-    return errmsg;
-}
-
-void QHiMDMainWindow::checkfile(QString UploadDirectory, QString &filename, QString extension)
+/* Tracks are uploaded in parallel, so names already taken by earlier
+   tracks of the same upload are passed in reserved. An incomplete export
+   of the same track is continued instead of picking a new name. */
+void QHiMDMainWindow::checkfile(QString UploadDirectory, QString &filename, QString extension, const QByteArray &contentid, QStringList &reserved)
 {
     QFile f;
     QString newname;
     int i = 2;
 
     f.setFileName(UploadDirectory + "/" + filename + extension);
-    while(f.exists())
+    while((f.exists() && !QHiMDUploader::can_resume(f.fileName(), contentid)) ||
+          reserved.contains(f.fileName()))
     {
         newname = filename + " (" + QString::number(i) + ")";
         f.setFileName(UploadDirectory + "/" + newname + extension);
@@ -206,6 +28,7 @@ void QHiMDMainWindow::checkfile(QString UploadDirectory, QString &filename, QStr
     }
     if(!newname.isEmpty())
         filename = newname;
+    reserved.append(f.fileName());
 }
 
 void QHiMDMainWindow::set_buttons_enable(bool connect, bool download, bool upload, bool rename, bool del, bool format, bool quit)
@@ -226,6 +49,9 @@ void QHiMDMainWindow::init_himd_browser()
     int i = 0;
 
     ui->TrackList->setModel(&trackmodel);
+    ui->TrackList->setUniformRowHeights(true);
+    ui->TrackList->setSortingEnabled(true);
+    ui->TrackList->sortByColumn(0, Qt::AscendingOrder);
     for(;i < trackmodel.columnCount(); i++)
         ui->TrackList->resizeColumnToContents(i);
     QObject::connect(ui->TrackList->selectionModel(), SIGNAL(selectionChanged (const QItemSelection &, const QItemSelection &)),
@@ -236,7 +62,7 @@ void QHiMDMainWindow::init_local_browser()
 {
     QStringList DownloadFileList;
     localmodel.setFilter(QDir::AllDirs | QDir::Files | QDir::NoDotAndDotDot);
-    localmodel.setNameFilters(QStringList() << "*.mp3" << "*.wav" << "*.oma");
+    localmodel.setNameFilters(QStringList() << "*.mp3" << "*.wav" << "*.flac" << "*.oma");
     localmodel.setNameFilterDisables(false);
     localmodel.setReadOnly(false);
     localmodel.setRootPath("/");
@@ -292,13 +118,25 @@ bool QHiMDMainWindow::autodetect_init()
     return true;
 }
 
+/* The himd is opened in the background, the model reports back with
+   himd_opened() */
 void QHiMDMainWindow::open_himd_at(const QString & path)
 {
-    QMessageBox himdStatus;
-    QString error;
+    /* the uploads read from the himd the model is about to close */
+    uploader.wait();
+    openingpath = path;
+    set_buttons_enable(0,0,0,0,0,0,1);
+    ui->statusBar->showMessage(tr("Opening %1...").arg(path));
+    trackmodel.open(path);
+}
 
-    error = trackmodel.open(path.toAscii());
+void QHiMDMainWindow::himd_opened(const QString & error)
+{
+    QMessageBox himdStatus;
+    QString path = openingpath;
 
+    openingpath.clear();
+    ui->statusBar->clearMessage();
     if (!error.isNull()) {
         himdStatus.setText(tr("Error opening HiMD data. Make sure you chose the proper root directory of your HiMD-Walkman.\n") + error);
         himdStatus.exec();
@@ -318,63 +156,89 @@ void QHiMDMainWindow::open_himd_at(const QString & path)
     set_buttons_enable(1,0,0,1,1,1,1);
 }
 
+/* the strings of the tracks are loaded after the himd is open */
+void QHiMDMainWindow::loading_progress(int done, int total)
+{
+    if(done >= total)
+    {
+        loadprogress->hide();
+        return;
+    }
+    loadprogress->setMaximum(total);
+    loadprogress->setValue(done);
+    loadprogress->show();
+}
+
 void QHiMDMainWindow::upload_to(const QString & UploadDirectory)
 {
+    if(uploader.is_running())
+        return;
+
     emit himd_busy(ui->himdpath->text());
 
     QHiMDTrackList tracks = trackmodel.tracks(ui->TrackList->selectionModel()->selectedRows(0));
-
+    QList<QHiMDUploadJob *> jobs;
+    QStringList reserved;
     int allblocks = 0;
-    for(int i = 0;i < tracks.length(); i++)
-        allblocks += tracks[i].blockcount();
-
-    uploadDialog->init(tracks.length(), allblocks);
 
     for(int i = 0;i < tracks.length(); i++)
     {
-        QString filename, errmsg;
+        QHiMDUploadJob * job = new QHiMDUploadJob;
+        QString filename;
         QString title = tracks[i].title();
         if(title.isNull())
             filename = tr("Track %1").arg(tracks[i].tracknum()+1);
         else
             filename = tracks[i].artist() + " - " + title;
 
-        uploadDialog->starttrack(tracks[i], filename);
-        if (!tracks[i].copyprotected())
+        job->tracknum = tracks[i].tracknum();
+        job->title = filename;
+        job->blocks = tracks[i].blockcount();
+        allblocks += job->blocks;
+        job->analyze = ui->action_LPCM_Loudness->isChecked();
+        jobs.append(job);
+
+        QString codec = tracks[i].codecname();
+        QString extension;
+        if (tracks[i].copyprotected())
+            job->format = UploadNone;	/* fails in the worker */
+        else if (codec == "MPEG")
         {
-            QString codec = tracks[i].codecname();
-            if (codec == "MPEG")
-            {
-                checkfile(UploadDirectory, filename, ".mp3");
-                errmsg = dumpmp3 (tracks[i], UploadDirectory + "/" + filename + ".mp3");
-                if(errmsg.isNull())
-                    addid3tag (tracks[i].title(),tracks[i].artist(),tracks[i].album(), UploadDirectory+ "/" +filename + ".mp3");
-            }
-            else if (codec == "LPCM")
-            {
-                checkfile(UploadDirectory, filename, ".wav");
-                errmsg = dumppcm (tracks[i], UploadDirectory + "/" + filename + ".wav");
-            }
-            else if (codec == "AT3+" || codec == "AT3 ")
-            {
-                checkfile(UploadDirectory, filename, ".oma");
-                errmsg = dumpoma (tracks[i], UploadDirectory + "/" + filename + ".oma");
-            }
+            job->format = UploadMP3;
+            extension = ".mp3";
+        }
+        else if (codec == "LPCM" && ui->action_LPCM_FLAC->isChecked())
+        {
+            job->format = UploadFLAC;
+            extension = ".flac";
+        }
+        else if (codec == "LPCM")
+        {
+            job->format = UploadWAV;
+            extension = ".wav";
+        }
+        else if (codec == "AT3+" || codec == "AT3 ")
+        {
+            job->format = UploadOMA;
+            extension = ".oma";
         }
         else
-            errmsg = tr("upload disabled because of DRM encryption");
-
-        if(errmsg.isNull())
-            uploadDialog->trackSucceeded();
-        else
-            uploadDialog->trackFailed(errmsg);
+            job->format = UploadNone;
 
-        QApplication::processEvents();
-        if(uploadDialog->upload_canceled())
-            break;
+        if(job->format != UploadNone)
+        {
+            checkfile(UploadDirectory, filename, extension, tracks[i].contentid(), reserved);
+            job->file = UploadDirectory + "/" + filename + extension;
+        }
     }
-    uploadDialog->finished();
 
+    uploadDialog->init(tracks.length(), allblocks);
+    uploader.start(trackmodel.handle(), jobs);
+}
+
+void QHiMDMainWindow::upload_finished()
+{
+    uploadDialog->finished();
     emit himd_idle(ui->himdpath->text());
 }
 
@@ -385,13 +249,29 @@ QHiMDMainWindow::QHiMDMainWindow(QWidget *parent)
     formatDialog = new QHiMDFormatDialog;
     uploadDialog = new QHiMDUploadDialog;
     detect = createDetection(this);
+    connect(&uploader, SIGNAL(track_started(int, int, const QString &)),
+            uploadDialog, SLOT(starttrack(int, int, const QString &)));
+    connect(&uploader, SIGNAL(progress(int, int)), uploadDialog, SLOT(progress(int, int)));
+    connect(&uploader, SIGNAL(track_failed(int, const QString &)),
+            uploadDialog, SLOT(trackFailed(int, const QString &)));
+    connect(&uploader, SIGNAL(track_succeeded(int)), uploadDialog, SLOT(trackSucceeded()));
+    connect(&uploader, SIGNAL(finished()), this, SLOT(upload_finished()));
+    connect(uploadDialog, SIGNAL(cancel_requested()), &uploader, SLOT(cancel()));
+    connect(&trackmodel, SIGNAL(opened(const QString &)), this, SLOT(himd_opened(const QString &)));
+    connect(&trackmodel, SIGNAL(loading_progress(int, int)), this, SLOT(loading_progress(int, int)));
     ui->setupUi(this);
+    loadprogress = new QProgressBar;
+    loadprogress->setMaximumWidth(150);
+    loadprogress->hide();
+    ui->statusBar->addPermanentWidget(loadprogress);
     ui->updir->setText(settings.value("lastUploadDirectory",
                                          QDir::homePath()).toString());
     set_buttons_enable(1,0,0,0,0,0,1);
     init_himd_browser();
     init_local_browser();
     read_window_settings();
+    ui->action_LPCM_FLAC->setChecked(settings.value("uploadLPCMasFLAC", false).toBool());
+    ui->action_LPCM_Loudness->setChecked(settings.value("analyzeLPCMLoudness", false).toBool());
     ui->himd_devices->hide();
     if(!autodetect_init())
         ui->statusBar->showMessage(" autodetection disabled", 10000);
@@ -399,6 +279,7 @@ QHiMDMainWindow::QHiMDMainWindow(QWidget *parent)
 
 QHiMDMainWindow::~QHiMDMainWindow()
 {
+    uploader.wait();
     save_window_settings();
     delete ui;
 }
@@ -418,6 +299,16 @@ void QHiMDMainWindow::on_action_Download_triggered()
 
 }
 
+void QHiMDMainWindow::on_action_LPCM_FLAC_toggled(bool checked)
+{
+    settings.setValue("uploadLPCMasFLAC", checked);
+}
+
+void QHiMDMainWindow::on_action_LPCM_Loudness_toggled(bool checked)
+{
+    settings.setValue("analyzeLPCMLoudness", checked);
+}
+
 void QHiMDMainWindow::on_action_Upload_triggered()
 {
     QString UploadDirectory = settings.value("lastManualUploadDirectory", QDir::homePath()).toString();
@@ -516,7 +407,7 @@ void QHiMDMainWindow::himd_found(QString HiMDPath)
         ui->himdpath->hide();
     }
 
-    if(!trackmodel.is_open())
+    if(!trackmodel.is_open() && !trackmodel.is_opening())
     {
         index = ui->himd_devices->findText(HiMDPath);
         ui->himd_devices->setCurrentIndex(index);
@@ -533,9 +424,39 @@ void QHiMDMainWindow::himd_removed(QString HiMDPath)
         return;
     if (ui->himdpath->text() == HiMDPath)
     {
+        /* closing stops an open of another himd as well */
+        QString pending = trackmodel.is_opening() && openingpath != HiMDPath ? openingpath : QString();
+
         ui->himdpath->setText(tr("(disconnected)"));
         ui->statusBar->clearMessage();
+        uploader.wait();
         trackmodel.close();
+        loadprogress->hide();
+        if (!pending.isEmpty())
+            open_himd_at(pending);
+        else if (!openingpath.isEmpty())
+        {
+            openingpath.clear();
+            set_buttons_enable(1,0,0,0,0,0,1);
+        }
+    }
+    else if (trackmodel.is_opening() && openingpath == HiMDPath)
+    {
+        /* only the pending open goes, the himd shown stays */
+        openingpath.clear();
+        trackmodel.cancel_open();
+        himd_device * dev = detect->find_by_path(ui->himdpath->text());
+        if (trackmodel.is_open() && dev)
+            ui->statusBar->showMessage(dev->recorder_name);
+        else
+            ui->statusBar->clearMessage();
+        if (trackmodel.is_open())
+        {
+            set_buttons_enable(1,0,0,1,1,1,1);
+            handle_selection_change(QItemSelection(), QItemSelection());
+        }
+        else
+            set_buttons_enable(1,0,0,0,0,0,1);
     }
 
     index = ui->himd_devices->findText(HiMDPath);
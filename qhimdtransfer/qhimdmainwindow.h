@@ -5,20 +5,14 @@
 #include <QtGui/QFileDialog>
 #include <QtCore/QSettings>
 #include <QtGui/QFileSystemModel>
+#include <QtGui/QProgressBar>
 #include "qhimdaboutdialog.h"
 #include "qhimdformatdialog.h"
 #include "qhimduploaddialog.h"
 #include "qhimddetection.h"
 #include "qhimdmodel.h"
+#include "qhimduploader.h"
 #include "../libhimd/himd.h"
-#include <tlist.h>
-#include <fileref.h>
-#include <tfile.h>
-#include <tag.h>
-
-extern "C" {
-#include <sox.h>
-}
 
 namespace Ui
 {
@@ -42,10 +36,10 @@ private:
     QHiMDTracksModel trackmodel;
     QFileSystemModel localmodel;
     QSettings settings;
-    QString dumpmp3(const QHiMDTrack & trk, QString file);
-    QString dumpoma(const QHiMDTrack & trk, QString file);
-    QString dumppcm(const QHiMDTrack & trk, QString file);
-    void checkfile(QString UploadDirectory, QString &filename, QString extension);
+    QHiMDUploader uploader;
+    QProgressBar * loadprogress;
+    QString openingpath;	/* the himd the model is opening */
+    void checkfile(QString UploadDirectory, QString &filename, QString extension, const QByteArray &contentid, QStringList &reserved);
     void set_buttons_enable(bool connect, bool download, bool upload, bool rename, bool del, bool format, bool quit);
     void init_himd_browser();
     void init_local_browser();
@@ -60,6 +54,8 @@ private slots:
     void on_action_Format_triggered();
     void on_action_Upload_triggered();
     void on_action_Download_triggered();
+    void on_action_LPCM_FLAC_toggled(bool checked);
+    void on_action_LPCM_Loudness_toggled(bool checked);
     void on_action_Quit_triggered();
     void on_action_About_triggered();
     void on_localScan_clicked(QModelIndex index);
@@ -68,6 +64,9 @@ private slots:
     void himd_found(QString path);
     void himd_removed(QString path);
     void on_himd_devices_activated(QString device);
+    void upload_finished();
+    void himd_opened(const QString & error);
+    void loading_progress(int done, int total);
 
 signals:
     void himd_busy(QString path);
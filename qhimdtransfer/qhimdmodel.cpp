@@ -1,7 +1,10 @@
+#include <QtCore/QRunnable>
 #include <QtGui/QFont>
 #include <QtGui/QFontMetrics>
 #include "qhimdmodel.h"
 
+#define LOAD_BATCH 64	/* rows per update from the loader */
+
 static QString get_himd_str(struct himd * himd, int idx)
 {
     QString outstr;
@@ -17,7 +20,7 @@ static QString get_himd_str(struct himd * himd, int idx)
     return outstr;
 }
 
-QHiMDTrack::QHiMDTrack(struct himd * himd, unsigned int trackindex) : himd(himd), trknum(trackindex)
+QHiMDTrack::QHiMDTrack(struct himd * himd, unsigned int trackindex) : himd(himd), trknum(trackindex), blocks(-1)
 {
     trackslot = himd_get_trackslot(himd, trackindex, NULL);
     if(trackslot != 0)
@@ -54,6 +57,14 @@ QString QHiMDTrack::album() const
         return QString();
 }
 
+int QHiMDTrack::trackinalbum() const
+{
+    if(trackslot != 0)
+        return ti.trackinalbum;
+    else
+        return 0;
+}
+
 QString QHiMDTrack::codecname() const
 {
     if(trackslot != 0)
@@ -80,10 +91,18 @@ bool QHiMDTrack::copyprotected() const
 
 int QHiMDTrack::blockcount() const
 {
-    if(trackslot != 0)
-        return himd_track_blocks(himd, &ti, NULL);
-    else
+    if(trackslot == 0)
         return 0;
+    if(blocks < 0)
+        blocks = himd_track_blocks(himd, &ti, NULL);
+    return blocks;
+}
+
+QByteArray QHiMDTrack::contentid() const
+{
+    if(trackslot == 0)
+        return QByteArray();
+    return QByteArray((const char *)ti.contentid, sizeof ti.contentid);
 }
 
 QString QHiMDTrack::openMpegStream(struct himd_mp3stream * str) const
@@ -164,6 +183,176 @@ QVariant QHiMDTracksModel::headerData(int section, Qt::Orientation orientation,
     return QVariant();
 }
 
+/* the columns that need nothing but the track descriptor */
+static QHiMDTrackRow load_skeleton(const QHiMDTrack & track)
+{
+    QHiMDTrackRow r;
+    QTime t = track.duration();
+
+    r.seconds = QTime(0,0).secsTo(t);
+    if(t < QTime(1,0,0))
+        r.length = t.toString("m:ss");
+    else
+        r.length = t.toString("h:mm:ss");
+    r.codec = track.codecname();
+    r.copyprotected = track.copyprotected();
+    return r;
+}
+
+static QHiMDTrackRow load_row(struct himd * himd, int tracknum)
+{
+    QHiMDTrack track(himd, tracknum);
+    QHiMDTrackRow r = load_skeleton(track);
+
+    r.title = track.title();
+    r.artist = track.artist();
+    r.album = track.album();
+    r.blocks = track.blockcount();
+    r.titlekey = r.title.toCaseFolded();
+    r.artistkey = r.artist.toCaseFolded();
+    r.albumkey = r.album.toCaseFolded();
+    r.loaded = true;
+    return r;
+}
+
+/* Opens the HiMD, passes it to the model with the skeleton rows, then
+   decodes all rows from a snapshot and hands them over in batches. The
+   model owns the himd once it is passed, but closes it only after
+   stopping the loader. */
+class QHiMDTrackLoader : public QRunnable {
+    QHiMDTracksModel * model;
+    QByteArray path;
+    int generation;
+    QAtomicInt * stop;
+public:
+    QHiMDTrackLoader(QHiMDTracksModel * model, const QByteArray & path, int generation, QAtomicInt * stop)
+        : model(model), path(path), generation(generation), stop(stop) {}
+    virtual void run()
+    {
+        struct himd * himd = new struct himd;
+        struct himd snapshot;
+        struct himderrinfo status;
+        QHiMDTrackRows skeleton;
+        int first, i, count;
+
+        if(himd_open(himd, path, &status) < 0)
+        {
+            delete himd;
+            QMetaObject::invokeMethod(model, "himd_opened", Qt::QueuedConnection,
+                                      Q_ARG(int, generation), Q_ARG(QHiMDHandle, (QHiMDHandle)NULL),
+                                      Q_ARG(QString, QString::fromUtf8(status.statusmsg)),
+                                      Q_ARG(QHiMDTrackRows, skeleton));
+            return;
+        }
+
+        himd_open_snapshot(&snapshot, himd);
+        count = himd_track_count(&snapshot);
+        for(i = 0; i < count; i++)
+            skeleton.append(load_skeleton(QHiMDTrack(&snapshot, i)));
+        QMetaObject::invokeMethod(model, "himd_opened", Qt::QueuedConnection,
+                                  Q_ARG(int, generation), Q_ARG(QHiMDHandle, himd),
+                                  Q_ARG(QString, QString()),
+                                  Q_ARG(QHiMDTrackRows, skeleton));
+
+        for(first = 0; first < count && !*stop; first += LOAD_BATCH)
+        {
+            QHiMDTrackRows batch;
+            for(i = first; i < count && i < first + LOAD_BATCH; i++)
+                batch.append(load_row(&snapshot, i));
+            QMetaObject::invokeMethod(model, "rows_loaded", Qt::QueuedConnection,
+                                      Q_ARG(int, generation), Q_ARG(int, first),
+                                      Q_ARG(QHiMDTrackRows, batch));
+        }
+        himd_close(&snapshot);
+    }
+};
+
+QHiMDTracksModel::QHiMDTracksModel()
+    : himd(NULL), sortcolumn(ColId), sortorder(Qt::AscendingOrder), generation(0), opening(false)
+{
+    qRegisterMetaType<QHiMDTrackRows>("QHiMDTrackRows");
+    qRegisterMetaType<QHiMDHandle>("QHiMDHandle");
+    loaderpool.setMaxThreadCount(1);
+}
+
+QHiMDTracksModel::~QHiMDTracksModel()
+{
+    close();
+}
+
+const QHiMDTrackRow & QHiMDTracksModel::row(int tracknum) const
+{
+    if(!rows[tracknum].loaded)
+        rows[tracknum] = load_row(himd, tracknum);
+    return rows[tracknum];
+}
+
+void QHiMDTracksModel::stop_loading()
+{
+    stoploading = 1;
+    loaderpool.waitForDone();
+    generation++;	/* batches still queued are dropped */
+    opening = false;
+}
+
+void QHiMDTracksModel::himd_opened(int batchgeneration, QHiMDHandle newhimd, const QString & error, const QHiMDTrackRows & skeleton)
+{
+    if(batchgeneration != generation)
+    {
+        /* superseded by another open() or close() */
+        if(newhimd)
+        {
+            himd_close(newhimd);
+            delete newhimd;
+        }
+        return;
+    }
+    opening = false;
+    if(!newhimd)
+    {
+        emit opened(error);
+        return;
+    }
+
+    /* like close(), but without stopping the loader of the new himd */
+    if(himd)
+    {
+        himd_close(himd);
+        delete himd;
+    }
+    himd = newhimd;
+    rows = skeleton;
+    order.resize(rows.size());
+    for(int i = 0; i < order.size(); i++)
+        order[i] = i;
+    reset();	/* inform views that the model contents changed */
+    if(sortcolumn != ColId || sortorder != Qt::AscendingOrder)
+        apply_sort();
+    emit opened(QString());
+    emit loading_progress(0, rows.size());
+}
+
+void QHiMDTracksModel::rows_loaded(int batchgeneration, int first, const QHiMDTrackRows & batch)
+{
+    int i;
+
+    if(batchgeneration != generation)
+        return;
+    for(i = 0; i < batch.size(); i++)
+        if(!rows[first + i].loaded)
+            rows[first + i] = batch[i];
+
+    if(sortcolumn == ColId && sortorder == Qt::AscendingOrder)
+        emit dataChanged(index(first, 0), index(first + batch.size() - 1, LAST_columnnum));
+    else
+        emit dataChanged(index(0, 0), index(rowCount() - 1, LAST_columnnum));
+
+    emit loading_progress(first + batch.size(), rows.size());
+    /* the order so far was based on the rows loaded at that time */
+    if(first + batch.size() == rows.size() && sortcolumn != ColId)
+        apply_sort();
+}
+
 QVariant QHiMDTracksModel::data(const QModelIndex & index, int role) const
 {
     if(role == Qt::TextAlignmentRole && 
@@ -173,33 +362,27 @@ QVariant QHiMDTracksModel::data(const QModelIndex & index, int role) const
     if(index.row() >= rowCount())
         return QVariant();
 
-    QHiMDTrack track(himd, index.row());
+    int tracknum = order[index.row()];
 
     if(role == Qt::CheckStateRole && index.column() == ColUploadable)
-        return track.copyprotected() ? Qt::Unchecked : Qt::Checked;
+        return row(tracknum).copyprotected ? Qt::Unchecked : Qt::Checked;
 
     if(role == Qt::DisplayRole)
     {
         switch((columnum)index.column())
         {
             case ColId:
-                return index.row() + 1;
+                return tracknum + 1;
             case ColTitle:
-                return track.title();
+                return row(tracknum).title;
             case ColArtist:
-                return track.artist();
+                return row(tracknum).artist;
             case ColAlbum:
-                return track.album();
+                return row(tracknum).album;
             case ColLength:
-            {
-                QTime t = track.duration();
-                if(t < QTime(1,0,0))
-                    return t.toString("m:ss");
-                else
-                    return t.toString("h:mm:ss");
-            }
+                return row(tracknum).length;
             case ColCodec:
-                return track.codecname();
+                return row(tracknum).codec;
             case ColUploadable:
                 return QVariant(); /* Displayed by checkbox */
         }
@@ -209,10 +392,7 @@ QVariant QHiMDTracksModel::data(const QModelIndex & index, int role) const
 
 int QHiMDTracksModel::rowCount(const QModelIndex &) const
 {
-    if(himd)
-        return himd_track_count(himd);
-    else
-        return 0;
+    return rows.size();
 }
 
 int QHiMDTracksModel::columnCount(const QModelIndex &) const
@@ -220,21 +400,20 @@ int QHiMDTracksModel::columnCount(const QModelIndex &) const
     return LAST_columnnum+1;
 }
 
-QString QHiMDTracksModel::open(const QString & path)
+/* The HiMD open so far stays until the new one is loaded, unless
+   opening it fails */
+void QHiMDTracksModel::open(const QString & path)
 {
-    struct himd * newhimd;
-    struct himderrinfo status;
+    stop_loading();
+    opening = true;
+    stoploading = 0;
+    loaderpool.start(new QHiMDTrackLoader(this, path.toUtf8(), generation, &stoploading));
+}
 
-    newhimd = new struct himd;
-    if(himd_open(newhimd,path.toUtf8(), &status) < 0)
-    {
-        delete newhimd;
-        return QString::fromUtf8(status.statusmsg);
-    }
-    close();
-    himd = newhimd;
-    reset();	/* inform views that the model contents changed */
-    return QString();
+void QHiMDTracksModel::cancel_open()
+{
+    if(opening)
+        stop_loading();
 }
 
 bool QHiMDTracksModel::is_open()
@@ -245,10 +424,13 @@ bool QHiMDTracksModel::is_open()
 void QHiMDTracksModel::close()
 {
     struct himd * oldhimd;
+    stop_loading();
     if(!himd)
         return;
     oldhimd = himd;
     himd = NULL;
+    rows.clear();
+    order.clear();
     reset();	/* inform views that the model contents changed */
     himd_close(oldhimd);
     delete oldhimd;
@@ -264,6 +446,76 @@ QHiMDTrackList QHiMDTracksModel::tracks(const QModelIndexList & modelindices) co
     QHiMDTrackList tracks;
     QModelIndex index;
     foreach(index, modelindices)
-        tracks.append(track(index.row()));
+        tracks.append(track(order[index.row()]));
     return tracks;
 }
+
+/* Orders track numbers by the precomputed keys of a column */
+class QHiMDRowLess {
+    const QHiMDTrackRows & rows;
+    int column;
+public:
+    QHiMDRowLess(const QHiMDTrackRows & rows, int column) : rows(rows), column(column) {}
+    bool operator()(int a, int b) const
+    {
+        const QHiMDTrackRow & ra = rows[a];
+        const QHiMDTrackRow & rb = rows[b];
+        switch((columnum)column)
+        {
+            case ColTitle:
+                return ra.titlekey < rb.titlekey;
+            case ColArtist:
+                return ra.artistkey < rb.artistkey;
+            case ColAlbum:
+                return ra.albumkey < rb.albumkey;
+            case ColLength:
+                return ra.seconds < rb.seconds;
+            case ColCodec:
+                return ra.codec < rb.codec;
+            case ColUploadable:
+                return ra.copyprotected > rb.copyprotected;
+            case ColId:
+                break;
+        }
+        return a < b;
+    }
+};
+
+class QHiMDRowGreater {
+    QHiMDRowLess less;
+public:
+    QHiMDRowGreater(const QHiMDTrackRows & rows, int column) : less(rows, column) {}
+    bool operator()(int a, int b) const { return less(b, a); }
+};
+
+void QHiMDTracksModel::apply_sort()
+{
+    QModelIndexList oldindices = persistentIndexList();
+    QModelIndexList newindices;
+    QVector<int> oldorder = order;
+    QVector<int> position(order.size());
+    QModelIndex i;
+
+    emit layoutAboutToBeChanged();
+    /* unloaded rows sort as empty, the loader sorts again when done */
+    for(int j = 0; j < order.size(); j++)
+        order[j] = j;
+    if(sortorder == Qt::AscendingOrder)
+        qStableSort(order.begin(), order.end(), QHiMDRowLess(rows, sortcolumn));
+    else
+        qStableSort(order.begin(), order.end(), QHiMDRowGreater(rows, sortcolumn));
+
+    for(int j = 0; j < order.size(); j++)
+        position[order[j]] = j;
+    foreach(i, oldindices)
+        newindices.append(index(position[oldorder[i.row()]], i.column()));
+    changePersistentIndexList(oldindices, newindices);
+    emit layoutChanged();
+}
+
+void QHiMDTracksModel::sort(int column, Qt::SortOrder neworder)
+{
+    sortcolumn = column;
+    sortorder = neworder;
+    apply_sort();
+}
@@ -4,6 +4,10 @@
 #include <QtCore/QAbstractListModel>
 #include <QtCore/QTime>
 #include <QtCore/QList>
+#include <QtCore/QVector>
+#include <QtCore/QThreadPool>
+#include <QtCore/QAtomicInt>
+#include <QtCore/QMetaType>
 #include "himd.h"
 
 #include "sony_oma.h"
@@ -15,16 +19,19 @@ class QHiMDTrack {
     unsigned int trknum;
     unsigned int trackslot;
     struct trackinfo ti;
+    mutable int blocks;	/* -1 until counted */
 public:
     QHiMDTrack(struct himd * himd, unsigned int trackindex);
     unsigned int tracknum() const;
     QString title() const;
     QString artist() const;
     QString album() const;
+    int trackinalbum() const;
     QString codecname() const;
     QTime duration() const;
     bool copyprotected() const;
     int blockcount() const;
+    QByteArray contentid() const;
 
     QString openMpegStream(struct himd_mp3stream * str) const;
     QString openNonMpegStream(struct himd_nonmp3stream * str) const;
@@ -33,23 +40,72 @@ public:
 
 typedef QList<QHiMDTrack> QHiMDTrackList;
 
+/* What the track list shows of a track, decoded once */
+struct QHiMDTrackRow {
+    bool loaded;
+    QString title, artist, album;
+    QString length;
+    QString codec;
+    int seconds;
+    int blocks;
+    bool copyprotected;
+    /* case folded for sorting */
+    QString titlekey, artistkey, albumkey;
+
+    QHiMDTrackRow() : loaded(false), seconds(0), blocks(0), copyprotected(true) {}
+};
+
+typedef QVector<QHiMDTrackRow> QHiMDTrackRows;
+Q_DECLARE_METATYPE(QHiMDTrackRows)
+typedef struct himd * QHiMDHandle;
+Q_DECLARE_METATYPE(QHiMDHandle)
+
+/* open() loads the HiMD in the background. The model first shows the
+   rows with what the track index says directly, then the loader fills in
+   the strings. A row the view asks for before the loader got to it is
+   decoded on the spot. */
 class QHiMDTracksModel : public QAbstractListModel {
     Q_OBJECT
 
     struct himd *himd;
+    mutable QHiMDTrackRows rows;	/* by track number */
+    QVector<int> order;		/* track number of each model row */
+    int sortcolumn;
+    Qt::SortOrder sortorder;
+    int generation;		/* tells batches of an old loader apart */
+    QAtomicInt stoploading;
+    QThreadPool loaderpool;
+    bool opening;
+
+    const QHiMDTrackRow & row(int tracknum) const;
+    void stop_loading();
+    void apply_sort();
 public:
-    QHiMDTracksModel() : himd(NULL) {}
+    QHiMDTracksModel();
+    virtual ~QHiMDTracksModel();
     /* QAbstractListModel stuff */
     virtual QVariant headerData(int section, Qt::Orientation orientation, int role = Qt::DisplayRole) const;
     virtual QVariant data(const QModelIndex & index, int role = Qt::DisplayRole) const;
     virtual int rowCount(const QModelIndex & parent = QModelIndex() ) const;
     virtual int columnCount(const QModelIndex & parent = QModelIndex() ) const;
+    virtual void sort(int column, Qt::SortOrder order = Qt::AscendingOrder);
     /* HiMD containter stuff */
-    QString open(const QString & path);	/* returns null if OK, error message otherwise */
+    void open(const QString & path);	/* reports the result with opened() */
+    void cancel_open();	/* keeps the himd open before, opened() isn't emitted */
     bool is_open();
+    bool is_opening() const { return opening; }
     void close();
+    struct himd * handle() const { return himd; }
     QHiMDTrack track(int trackidx) const;
     QHiMDTrackList tracks(const QModelIndexList & indices) const;
+
+private slots:
+    void himd_opened(int generation, QHiMDHandle newhimd, const QString & error, const QHiMDTrackRows & skeleton);
+    void rows_loaded(int generation, int first, const QHiMDTrackRows & batch);
+
+signals:
+    void opened(const QString & error);	/* error is null if the HiMD is open */
+    void loading_progress(int done, int total);
 };
 
 #endif
@@ -50,6 +50,7 @@ HEADERS += qhimdaboutdialog.h \
     qhimduploaddialog.h \
     qhimdmainwindow.h \
     qhimdmodel.h \
+    qhimduploader.h \
     qhimddetection.h
 FORMS += qhimdaboutdialog.ui \
     qhimdformatdialog.ui \
@@ -61,12 +62,12 @@ SOURCES += main.cpp \
     qhimduploaddialog.cpp \
     qhimdmainwindow.cpp \
     qhimdmodel.cpp \
+    qhimduploader.cpp \
     qhimddetection.cpp
 win32:SOURCES += qhimdwindetection.cpp
+else:linux-*:SOURCES += qhimdlinuxdetection.cpp
 else:SOURCES += qhimddummydetection.cpp
 RESOURCES += icons.qrc
-PKGCONFIG += sox \
-    taglib
 win32:LIBS += -lsetupapi \
     -lcfgmgr32
 win32:RC_FILE = qhimdtransfer.rc
@@ -1,18 +1,14 @@
 #include "qhimduploaddialog.h"
 #include "ui_qhimduploaddialog.h"
 
-void QHiMDUploadDialog::trackFailed(const QString & errmsg)
+void QHiMDUploadDialog::trackFailed(int tracknum, const QString & errmsg)
 {
-    allfinished -= thisfilefinished;
-    allfinished += thisfileblocks;
-    m_ui->AllPBar->setValue(allfinished);
-
     m_ui->failed_text->setText(tr("%1 track(s) could not be uploaded").arg(++fcount));
 
     QTreeWidgetItem * ErrorMsg;
     ErrorMsg = new QTreeWidgetItem(0);
 
-    ErrorMsg->setText(0, tr("Track %1").arg(tracknum));
+    ErrorMsg->setText(0, tr("Track %1").arg(tracknum + 1));
     ErrorMsg->setText(1, errmsg);
     m_ui->ErrorList->insertTopLevelItem(0, ErrorMsg);
     m_ui->details_button->setEnabled(true);
@@ -20,11 +16,6 @@ void QHiMDUploadDialog::trackFailed(const QString & errmsg)
 
 void QHiMDUploadDialog::trackSucceeded()
 {
-    /* should do nothing, just to be sure */
-    allfinished -= thisfilefinished;
-    allfinished += thisfileblocks;
-    m_ui->AllPBar->setValue(allfinished);
-
     m_ui->success_text->setText(tr("%1 track(s) successfully uploaded").arg(++scount));
 }
 
@@ -42,27 +33,23 @@ void QHiMDUploadDialog::finished()
     return;
 }
 
-void QHiMDUploadDialog::starttrack(const QHiMDTrack & trk, const QString & title)
+/* With several tracks in flight, the track bar follows the latest one */
+void QHiMDUploadDialog::starttrack(int tracknum, int blocks, const QString & title)
 {
-    tracknum = trk.tracknum() + 1;
-    m_ui->curtrack_label->setText(tr("current track: %1 - %2").arg(tracknum).arg(title));
-    thisfileblocks = trk.blockcount();
-    thisfilefinished = 0;
-    m_ui->TrkPBar->setRange(0, thisfileblocks);
+    m_ui->curtrack_label->setText(tr("current track: %1 - %2").arg(tracknum + 1).arg(title));
+    m_ui->TrkPBar->setRange(0, blocks);
     m_ui->TrkPBar->reset();
 }
 
-void QHiMDUploadDialog::blockTransferred()
+void QHiMDUploadDialog::progress(int trackblocks, int allblocks)
 {
-    m_ui->TrkPBar->setValue(++thisfilefinished);
-    m_ui->AllPBar->setValue(++allfinished);
+    m_ui->TrkPBar->setValue(trackblocks);
+    m_ui->AllPBar->setValue(allblocks);
 }
 
 void QHiMDUploadDialog::init(int trackcount, int totalblocks)
 {
-    allblocks = totalblocks;
-    allfinished = 0;
-    m_ui->AllPBar->setRange(0, allblocks);
+    m_ui->AllPBar->setRange(0, totalblocks);
     m_ui->AllPBar->reset();
 
     scount = fcount = 0;
@@ -96,8 +83,7 @@ void QHiMDUploadDialog::init(int trackcount, int totalblocks)
 
 QHiMDUploadDialog::QHiMDUploadDialog(QWidget *parent) :
     QDialog(parent),
-    m_ui(new Ui::QHiMDUploadDialog),
-    canceled(false)
+    m_ui(new Ui::QHiMDUploadDialog)
 {
     m_ui->setupUi(this);
 }
@@ -133,5 +119,5 @@ void QHiMDUploadDialog::on_close_button_clicked()
 void QHiMDUploadDialog::on_cancel_button_clicked()
 {
     m_ui->alltrack_label->setText(tr("upload aborted by the user"));
-    canceled = true;
+    emit cancel_requested();
 }
@@ -14,22 +14,22 @@ class QHiMDUploadDialog : public QDialog {
 public:
     explicit QHiMDUploadDialog(QWidget *parent = 0);
     virtual ~QHiMDUploadDialog();
-    bool upload_canceled() { return canceled; }
 
     void init(int trackcount, int totalblocks);
-    void starttrack(const QHiMDTrack & trk, const QString & title);
-    void blockTransferred();
-    void trackFailed(const QString & errmsg);
+
+public slots:
+    void starttrack(int tracknum, int blocks, const QString & title);
+    void progress(int trackblocks, int allblocks);
+    void trackFailed(int tracknum, const QString & errmsg);
     void trackSucceeded();
     void finished();
 
+signals:
+    void cancel_requested();
+
 private:
     Ui::QHiMDUploadDialog *m_ui;
-    int allblocks, allfinished;
-    int tracknum;
-    int thisfileblocks, thisfilefinished;
     int scount, fcount;
-    bool canceled;
 
 private slots:
     /* UI slots */
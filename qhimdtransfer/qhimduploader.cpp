@@ -0,0 +1,578 @@
+#include <QtCore/QCoreApplication>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QRunnable>
+#include "qhimduploader.h"
+#include "../libhimd/wavsink.h"
+#include "../libhimd/flacsink.h"
+#include "../libhimd/mp3sink.h"
+#include "../libhimd/trace.h"
+
+#define UPLOAD_THREADS 2
+#define PROGRESS_INTERVAL 100
+#define JOURNAL_INTERVAL 64	/* blocks between two checkpoints */
+
+/* libhimd opens its output files with g_fopen, which expects UTF-8 on
+   Windows and the on-disk encoding everywhere else. */
+static QByteArray himd_filename(const QString & file)
+{
+#ifdef Q_OS_WIN
+    return file.toUtf8();
+#else
+    return QFile::encodeName(file);
+#endif
+}
+
+static const char * const upload_comment = "*** imported from HiMD via QHiMDTransfer ***";
+
+class QHiMDUploadTask : public QRunnable {
+    QHiMDUploader * uploader;
+    int index;
+public:
+    QHiMDUploadTask(QHiMDUploader * uploader, int index) : uploader(uploader), index(index) {}
+    virtual void run()
+    {
+        QMetaObject::invokeMethod(uploader, "job_started", Qt::QueuedConnection, Q_ARG(int, index));
+        uploader->run_job(uploader->jobs.at(index));
+        QMetaObject::invokeMethod(uploader, "job_finished", Qt::QueuedConnection, Q_ARG(int, index));
+    }
+};
+
+/* The last checkpoint of an export, kept next to the output file while
+   the export is incomplete: after block blocks of the track with the
+   content ID, the stream was in fragment fragment and the output file was
+   offset bytes long. An interrupted WAV, MP3 or ATRAC export continues
+   from there. */
+class QHiMDExportJournal {
+    QString name;
+    QByteArray contentid;
+    bool saved;
+public:
+    unsigned int fragment;
+    unsigned int block;
+    qint64 offset;
+
+    /* an empty content ID disables the journal */
+    QHiMDExportJournal(const QString & file, const QByteArray & id)
+        : name(QHiMDUploader::journal_name(file)), contentid(id.toHex()), saved(false),
+          fragment(0), block(0), offset(0) {}
+    bool load(const QString & file);
+    void save(unsigned int newfragment, unsigned int newblock, qint64 newoffset);
+    void remove();
+    bool has_checkpoint() const { return saved; }
+};
+
+/* true if there is a checkpoint for this track that file can be continued from */
+bool QHiMDExportJournal::load(const QString & file)
+{
+    QFile f(name);
+    QList<QByteArray> fields;
+
+    if(contentid.isEmpty() || !f.open(QIODevice::ReadOnly))
+        return false;
+    fields = f.readLine(256).trimmed().split(' ');
+    if(fields.size() != 4 || fields[0] != contentid)
+        return false;
+    fragment = fields[1].toUInt();
+    block = fields[2].toUInt();
+    offset = fields[3].toLongLong();
+    saved = block > 0 && offset > 0 && QFileInfo(file).size() >= offset;
+    return saved;
+}
+
+/* A checkpoint that can't be written is skipped, the export goes on */
+void QHiMDExportJournal::save(unsigned int newfragment, unsigned int newblock, qint64 newoffset)
+{
+    QFile f(name + ".new");
+    QByteArray line = contentid + ' ' + QByteArray::number(newfragment) + ' ' +
+                      QByteArray::number(newblock) + ' ' + QByteArray::number(newoffset) + '\n';
+
+    if(contentid.isEmpty())
+        return;
+    if(!f.open(QIODevice::WriteOnly | QIODevice::Truncate) || f.write(line) != line.size())
+        return;
+    f.close();
+    /* no atomic replace in Qt, a crash right here just loses the checkpoint */
+    QFile::remove(name);
+    if(!f.rename(name))
+        return;
+    fragment = newfragment;
+    block = newblock;
+    offset = newoffset;
+    saved = true;
+}
+
+void QHiMDExportJournal::remove()
+{
+    QFile::remove(name);
+    saved = false;
+}
+
+QString QHiMDUploader::journal_name(const QString & file)
+{
+    return file + ".himdresume";
+}
+
+bool QHiMDUploader::can_resume(const QString & file, const QByteArray & contentid)
+{
+    return QHiMDExportJournal(file, contentid).load(file);
+}
+
+/* counts a block, returns false if the upload should stop */
+bool QHiMDUploader::block_done(QHiMDUploadJob * job)
+{
+    job->done.ref();
+    return !canceled;
+}
+
+QString QHiMDUploader::dumpmp3(const QHiMDTrack & trk, QHiMDUploadJob * job)
+{
+    QString errmsg;
+    struct himd_mp3stream str;
+    struct himd_mp3sink sink;
+    struct himd_tags tags;
+    struct himderrinfo status;
+    unsigned int len, blocks = 0;
+    const unsigned char * data;
+    QByteArray title = trk.title().toUtf8();
+    QByteArray artist = trk.artist().toUtf8();
+    QByteArray album = trk.album().toUtf8();
+    QHiMDExportJournal journal(job->file, trk.contentid());
+
+    tags.title = title.data();
+    tags.artist = artist.data();
+    tags.album = album.data();
+    tags.trackinalbum = trk.trackinalbum();
+    tags.comment = upload_comment;
+    tags.loudness = NULL;
+
+    if(!(errmsg = trk.openMpegStream(&str)).isNull())
+        return tr("Error opening track: ") + errmsg;
+
+    if(journal.load(job->file))
+    {
+        /* continue if the last block written is still the same */
+        if(QFile::resize(job->file, journal.offset) &&
+           himd_mp3stream_seek(&str, journal.block - 1, &status) >= 0 &&
+           himd_mp3stream_read_block(&str, &data, &len, NULL, &status) >= 0 &&
+           str.stream.curfragno == journal.fragment &&
+           himd_mp3sink_resume(&sink, himd_filename(job->file), journal.offset, data, len, &status) >= 0)
+            blocks = journal.block;
+        else
+        {
+            journal.remove();
+            if(himd_mp3stream_seek(&str, 0, &status) < 0)
+            {
+                himd_mp3stream_close(&str);
+                return tr("Error reading audio data: ") + status.statusmsg;
+            }
+        }
+    }
+    if(blocks == 0 && himd_mp3sink_open(&sink, himd_filename(job->file), &tags, &status) < 0)
+    {
+        himd_mp3stream_close(&str);
+        return tr("Error opening file for MP3 output");
+    }
+    job->done = blocks;
+    while(himd_mp3stream_read_block(&str, &data, &len, NULL, &status) >= 0)
+    {
+        if(himd_mp3sink_write(&sink, data, len, &status) < 0)
+        {
+            errmsg = tr("Error writing audio data");
+            goto clean;
+        }
+        if(++blocks % JOURNAL_INTERVAL == 0 && fflush(sink.out) == 0)
+            journal.save(str.stream.curfragno, blocks, ftell(sink.out));
+        if(!block_done(job))
+        {
+            errmsg = tr("upload aborted by the user");
+            goto clean;
+        }
+
+    }
+    if(status.status != HIMD_STATUS_AUDIO_EOF)
+        errmsg = tr("Error reading audio data: ") + status.statusmsg;
+
+clean:
+    if(himd_mp3sink_close(&sink, &status) < 0 && errmsg.isNull())
+        errmsg = tr("Error writing audio data");
+    himd_mp3stream_close(&str);
+    if(errmsg.isNull())
+        journal.remove();
+    else if(!journal.has_checkpoint())
+        QFile::remove(job->file);
+    return errmsg;
+}
+
+QString QHiMDUploader::dumpoma(const QHiMDTrack & track, QHiMDUploadJob * job)
+{
+    QString errmsg;
+    struct himd_nonmp3stream str;
+    struct himderrinfo status;
+    unsigned int len, blocks = 0;
+    const unsigned char * data;
+    QFile f(job->file);
+    QHiMDExportJournal journal(job->file, track.contentid());
+
+    if(!(errmsg = track.openNonMpegStream(&str)).isNull())
+        return tr("Error opening track: ") + errmsg;
+
+    if(!f.open(QIODevice::ReadWrite))
+    {
+        himd_nonmp3stream_close(&str);
+        return tr("Error opening file for ATRAC output");
+    }
+
+    if(journal.load(job->file))
+    {
+        /* continue if the last block written is still the same */
+        if(f.resize(journal.offset) &&
+           himd_nonmp3stream_seek(&str, journal.block - 1, &status) >= 0 &&
+           himd_nonmp3stream_read_block(&str, &data, &len, NULL, &status) >= 0 &&
+           str.stream.curfragno == journal.fragment &&
+           f.seek(journal.offset - len) && f.read(len) == QByteArray::fromRawData((const char *)data, len))
+            blocks = journal.block;
+        else
+        {
+            journal.remove();
+            if(himd_nonmp3stream_seek(&str, 0, &status) < 0)
+            {
+                errmsg = tr("Error reading audio data: ") + status.statusmsg;
+                goto clean;
+            }
+        }
+    }
+
+    if(blocks == 0 && (!f.resize(0) || f.write(track.makeEA3Header()) == -1))
+    {
+        errmsg = tr("Error writing header");
+        goto clean;
+    }
+    job->done = blocks;
+    while(himd_nonmp3stream_read_block(&str, &data, &len, NULL, &status) >= 0)
+    {
+        if(f.write((const char*)data,len) == -1)
+        {
+            errmsg = tr("Error writing audio data");
+            goto clean;
+        }
+        if(++blocks % JOURNAL_INTERVAL == 0 && f.flush())
+            journal.save(str.stream.curfragno, blocks, f.pos());
+        if(!block_done(job))
+        {
+            errmsg = QString("upload aborted by the user");
+            goto clean;
+        }
+    }
+    if(status.status != HIMD_STATUS_AUDIO_EOF)
+        errmsg = QString("Error reading audio data: ") + status.statusmsg;
+
+clean:
+    f.close();
+    himd_nonmp3stream_close(&str);
+
+    if(errmsg.isNull())
+        journal.remove();
+    else if(!journal.has_checkpoint())
+        f.remove();
+    return errmsg;
+}
+
+/* The loudness report of an uploaded file goes next to it */
+QString QHiMDUploader::write_loudness_report(const struct himd_loudness * loudness, const struct himd_tags * tags, QString file)
+{
+    struct himderrinfo status;
+    QString report = file.left(file.lastIndexOf('.')) + ".json";
+
+    if(himd_analysis_write_report(loudness, tags, himd_filename(report), &status) < 0)
+        return tr("Error writing loudness report: ") + status.statusmsg;
+    return QString();
+}
+
+QString QHiMDUploader::dumppcm(const QHiMDTrack & track, QHiMDUploadJob * job)
+{
+    struct himd_nonmp3stream str;
+    struct himd_wavsink sink;
+    struct himd_analysis an;
+    struct himderrinfo status;
+    unsigned int len, blocks = 0;
+    QString errmsg;
+    const unsigned char * data;
+    /* the analysis has to see every block, so it can't be resumed */
+    QHiMDExportJournal journal(job->file, job->analyze ? QByteArray() : track.contentid());
+
+    if(!(errmsg = track.openNonMpegStream(&str)).isNull())
+        return tr("Error opening track: ") + errmsg;
+
+    if(job->analyze && himd_nonmp3stream_set_analysis(&str, &an, &status) < 0)
+    {
+        himd_nonmp3stream_close(&str);
+        return tr("Error starting analysis: ") + status.statusmsg;
+    }
+
+    if(journal.load(job->file))
+    {
+        /* continue if the last block written is still the same */
+        if(QFile::resize(job->file, journal.offset) &&
+           himd_nonmp3stream_seek(&str, journal.block - 1, &status) >= 0 &&
+           himd_nonmp3stream_read_block(&str, &data, &len, NULL, &status) >= 0 &&
+           str.stream.curfragno == journal.fragment &&
+           himd_wavsink_resume(&sink, himd_filename(job->file), journal.offset, data, len, &status) >= 0)
+            blocks = journal.block;
+        else
+        {
+            journal.remove();
+            if(himd_nonmp3stream_seek(&str, 0, &status) < 0)
+            {
+                himd_nonmp3stream_close(&str);
+                return tr("Error reading audio data: ") + status.statusmsg;
+            }
+        }
+    }
+
+    if(blocks == 0 && himd_wavsink_open(&sink, himd_filename(job->file), &status) < 0)
+    {
+        himd_nonmp3stream_close(&str);
+        return tr("Error opening file for WAV output");
+    }
+
+    job->done = blocks;
+    while(himd_nonmp3stream_read_block(&str, &data, &len, NULL, &status) >= 0)
+    {
+      if(himd_wavsink_write(&sink, data, len, &status) < 0)
+      {
+            errmsg = tr("Error writing audio data");
+            goto clean;
+      }
+      if(++blocks % JOURNAL_INTERVAL == 0 && fflush(sink.out) == 0)
+            journal.save(str.stream.curfragno, blocks, ftell(sink.out));
+      if(!block_done(job))
+      {
+            errmsg = QString("upload aborted by the user");
+            goto clean;
+      }
+    }
+    if(status.status != HIMD_STATUS_AUDIO_EOF)
+        errmsg = QString("Error reading audio data: ") + status.statusmsg;
+
+clean:
+    if(himd_wavsink_close(&sink, &status) < 0 && errmsg.isNull())
+        errmsg = tr("Error writing audio data");
+    himd_nonmp3stream_close(&str);
+    if(job->analyze && errmsg.isNull())
+        errmsg = write_loudness_report(&an.result, NULL, job->file);
+
+    if(errmsg.isNull())
+        journal.remove();
+    else if(!journal.has_checkpoint())
+        QFile::remove(job->file);
+    return errmsg;
+}
+
+QString QHiMDUploader::dumpflac(const QHiMDTrack & track, QHiMDUploadJob * job)
+{
+    struct himd_nonmp3stream str;
+    struct himd_flacsink sink;
+    struct himd_analysis an;
+    struct himd_tags tags;
+    struct himderrinfo status;
+    unsigned int len;
+    QString errmsg;
+    const unsigned char * data;
+    QByteArray title = track.title().toUtf8();
+    QByteArray artist = track.artist().toUtf8();
+    QByteArray album = track.album().toUtf8();
+
+    tags.title = title.data();
+    tags.artist = artist.data();
+    tags.album = album.data();
+    tags.trackinalbum = track.trackinalbum();
+    tags.comment = upload_comment;
+    tags.loudness = NULL;
+
+    if(!(errmsg = track.openNonMpegStream(&str)).isNull())
+        return tr("Error opening track: ") + errmsg;
+
+    if(job->analyze && himd_nonmp3stream_set_analysis(&str, &an, &status) < 0)
+    {
+        himd_nonmp3stream_close(&str);
+        return tr("Error starting analysis: ") + status.statusmsg;
+    }
+
+    if(himd_flacsink_open(&sink, himd_filename(job->file), &tags, 0, &status) < 0)
+    {
+        himd_nonmp3stream_close(&str);
+        return tr("Error opening file for FLAC output");
+    }
+
+    while(himd_nonmp3stream_read_block(&str, &data, &len, NULL, &status) >= 0)
+    {
+      if(himd_flacsink_write(&sink, data, len, &status) < 0)
+      {
+            errmsg = tr("Error writing audio data");
+            goto clean;
+      }
+      if(!block_done(job))
+      {
+            errmsg = QString("upload aborted by the user");
+            goto clean;
+      }
+    }
+    if(status.status != HIMD_STATUS_AUDIO_EOF)
+        errmsg = QString("Error reading audio data: ") + status.statusmsg;
+
+clean:
+    /* closing the stream finishes the analysis, its results go into
+       the tags before the FLAC file is closed */
+    himd_nonmp3stream_close(&str);
+    if(job->analyze && errmsg.isNull())
+    {
+        tags.loudness = &an.result;
+        if(himd_flacsink_retag(&sink, &tags, &status) < 0)
+            errmsg = tr("Error writing tags: ") + status.statusmsg;
+    }
+    if(himd_flacsink_close(&sink, &status) < 0 && errmsg.isNull())
+        errmsg = tr("Error writing audio data");
+    if(job->analyze && errmsg.isNull())
+        errmsg = write_loudness_report(&an.result, &tags, job->file);
+
+    if(!errmsg.isNull())
+        QFile::remove(job->file);
+    return errmsg;
+}
+
+/* runs on a pool thread */
+void QHiMDUploader::run_job(QHiMDUploadJob * job)
+{
+    struct himd snapshot;
+
+    HIMD_TRACE_SCOPE(track_scope, "export_track");
+    if(canceled)
+    {
+        job->errmsg = tr("upload aborted by the user");
+        return;
+    }
+
+    himd_open_snapshot(&snapshot, himd);
+    {
+        QHiMDTrack track(&snapshot, job->tracknum);
+        if(track.copyprotected())
+            job->errmsg = tr("upload disabled because of DRM encryption");
+        else switch(job->format)
+        {
+            case UploadNone:
+                break;
+            case UploadMP3:
+                job->errmsg = dumpmp3(track, job);
+                break;
+            case UploadOMA:
+                job->errmsg = dumpoma(track, job);
+                break;
+            case UploadWAV:
+                job->errmsg = dumppcm(track, job);
+                break;
+            case UploadFLAC:
+                job->errmsg = dumpflac(track, job);
+                break;
+        }
+    }
+    himd_close(&snapshot);
+}
+
+QHiMDUploader::QHiMDUploader(QObject * parent)
+    : QObject(parent), himd(NULL), nfinished(0), shownjob(-1)
+{
+    pool.setMaxThreadCount(UPLOAD_THREADS);
+    progresstimer.setInterval(PROGRESS_INTERVAL);
+    connect(&progresstimer, SIGNAL(timeout()), this, SLOT(report_progress()));
+}
+
+QHiMDUploader::~QHiMDUploader()
+{
+    wait();
+    clear();
+}
+
+void QHiMDUploader::clear()
+{
+    qDeleteAll(jobs);
+    jobs.clear();
+}
+
+void QHiMDUploader::start(struct himd * newhimd, const QList<QHiMDUploadJob *> & newjobs)
+{
+    wait();
+    clear();
+
+    himd = newhimd;
+    jobs = newjobs;
+    canceled = 0;
+    nfinished = 0;
+    shownjob = -1;
+
+    if(jobs.isEmpty())
+    {
+        emit finished();
+        return;
+    }
+    for(int i = 0; i < jobs.size(); i++)
+        pool.start(new QHiMDUploadTask(this, i));
+    progresstimer.start();
+}
+
+bool QHiMDUploader::is_running() const
+{
+    return nfinished < jobs.size();
+}
+
+/* Stop all uploads and wait for the workers, e.g. before the himd goes away */
+void QHiMDUploader::wait()
+{
+    if(!is_running())
+        return;
+    cancel();
+    pool.waitForDone();
+    /* deliver the notifications the workers left in the event queue */
+    QCoreApplication::sendPostedEvents(this, QEvent::MetaCall);
+}
+
+void QHiMDUploader::cancel()
+{
+    canceled = 1;
+}
+
+void QHiMDUploader::job_started(int index)
+{
+    QHiMDUploadJob * job = jobs.at(index);
+
+    shownjob = index;
+    emit track_started(job->tracknum, job->blocks, job->title);
+}
+
+void QHiMDUploader::job_finished(int index)
+{
+    QHiMDUploadJob * job = jobs.at(index);
+
+    /* failed tracks count as done for the overall progress */
+    job->done = job->blocks;
+    if(job->errmsg.isNull())
+        emit track_succeeded(job->tracknum);
+    else
+        emit track_failed(job->tracknum, job->errmsg);
+
+    if(++nfinished == jobs.size())
+    {
+        progresstimer.stop();
+        report_progress();
+        emit finished();
+    }
+}
+
+void QHiMDUploader::report_progress()
+{
+    int all = 0;
+
+    for(int i = 0; i < jobs.size(); i++)
+        all += jobs.at(i)->done;
+    emit progress(shownjob >= 0 ? int(jobs.at(shownjob)->done) : 0, all);
+}
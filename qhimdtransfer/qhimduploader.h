@@ -0,0 +1,80 @@
+#ifndef QHIMDUPLOADER_H
+#define QHIMDUPLOADER_H
+
+#include <QtCore/QObject>
+#include <QtCore/QThreadPool>
+#include <QtCore/QTimer>
+#include <QtCore/QAtomicInt>
+#include <QtCore/QList>
+#include "qhimdmodel.h"
+#include "../libhimd/analysis.h"
+
+enum QHiMDUploadFormat { UploadNone, UploadMP3, UploadOMA, UploadWAV, UploadFLAC };
+
+struct QHiMDUploadJob {
+    unsigned int tracknum;	/* position in the play order */
+    QString title;		/* shown in the upload dialog */
+    QString file;
+    QHiMDUploadFormat format;
+    bool analyze;		/* write a loudness report, LPCM only */
+    int blocks;
+
+    /* written by the worker */
+    QAtomicInt done;		/* blocks transferred */
+    QString errmsg;		/* null if the upload succeeded */
+};
+
+/* Uploads tracks on a thread pool. Every track is read from its own
+   snapshot of the himd, progress is reported from the GUI thread every
+   PROGRESS_INTERVAL ms. */
+class QHiMDUploader : public QObject {
+    Q_OBJECT
+
+    friend class QHiMDUploadTask;
+
+    struct himd * himd;
+    QList<QHiMDUploadJob *> jobs;
+    QThreadPool pool;
+    QTimer progresstimer;
+    QAtomicInt canceled;
+    int nfinished;
+    int shownjob;	/* the job whose progress the track bar shows */
+
+    void clear();
+    void run_job(QHiMDUploadJob * job);
+    bool block_done(QHiMDUploadJob * job);
+    QString dumpmp3(const QHiMDTrack & trk, QHiMDUploadJob * job);
+    QString dumpoma(const QHiMDTrack & trk, QHiMDUploadJob * job);
+    QString dumppcm(const QHiMDTrack & trk, QHiMDUploadJob * job);
+    QString dumpflac(const QHiMDTrack & trk, QHiMDUploadJob * job);
+    QString write_loudness_report(const struct himd_loudness * loudness, const struct himd_tags * tags, QString file);
+
+public:
+    QHiMDUploader(QObject * parent = 0);
+    virtual ~QHiMDUploader();
+    /* takes ownership of the jobs */
+    void start(struct himd * himd, const QList<QHiMDUploadJob *> & newjobs);
+    bool is_running() const;
+    void wait();
+    /* the checkpoint file of an incomplete export to file */
+    static QString journal_name(const QString & file);
+    /* true if file is an incomplete export of the track with the content ID */
+    static bool can_resume(const QString & file, const QByteArray & contentid);
+
+public slots:
+    void cancel();
+
+private slots:
+    void job_started(int index);
+    void job_finished(int index);
+    void report_progress();
+
+signals:
+    void track_started(int tracknum, int blocks, const QString & title);
+    void progress(int trackblocks, int allblocks);
+    void track_failed(int tracknum, const QString & errmsg);
+    void track_succeeded(int tracknum);
+    void finished();
+};
+
+#endif // QHIMDUPLOADER_H
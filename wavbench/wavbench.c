@@ -0,0 +1,150 @@
+/*
+ *   wavbench.c - compare LPCM to WAV conversion through sox with himd_wavsink
+ *
+ *   The sox path is the per-sample loop QHiMDTransfer used before
+ *   himd_wavsink existed. Both paths get the same synthetic big-endian
+ *   LPCM blocks, so no HiMD medium is needed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <sox.h>
+
+#include "himd.h"
+#include "wavsink.h"
+
+#define DEFAULT_SECONDS 600
+#define RUNS 5
+
+static void make_lpcm(unsigned char * buf, unsigned int len)
+{
+    unsigned int i;
+    /* some triangle-ish noise, content does not matter for speed */
+    for(i = 0; i < len; i++)
+        buf[i] = (i * 7 + (i >> 9)) & 0xFF;
+}
+
+static double bench_sox(const char * filename, const unsigned char * block, unsigned int blocks)
+{
+    sox_format_t * out;
+    sox_signalinfo_t signal_out;
+    sox_sample_t soxbuf[HIMD_MAX_PCMFRAME_SAMPLES * 2];
+    unsigned int b, i;
+    int left, right, clipcount;
+    gint64 start;
+
+    memset(&signal_out, 0, sizeof signal_out);
+    signal_out.channels = 2;
+    signal_out.length = 0;
+    signal_out.precision = 16;
+    signal_out.rate = 44100;
+
+    start = g_get_monotonic_time();
+    if(!(out = sox_open_write(filename, &signal_out, NULL, NULL, NULL, NULL)))
+    {
+        fprintf(stderr, "sox can't open %s\n", filename);
+        exit(1);
+    }
+    for(b = 0; b < blocks; b++)
+    {
+        for(i = 0; i < HIMD_AUDIO_SIZE/4; i++)
+        {
+            left = block[i*4]*256+block[i*4+1];
+            right = block[i*4+2]*256+block[i*4+3];
+            if (left > 0x8000) left -= 0x10000;
+            if (right > 0x8000) right -= 0x10000;
+
+            soxbuf[i*2] = SOX_SIGNED_16BIT_TO_SAMPLE(left, clipcount);
+            soxbuf[i*2+1] = SOX_SIGNED_16BIT_TO_SAMPLE(right, clipcount);
+            (void)clipcount;
+        }
+        if(sox_write(out, soxbuf, HIMD_AUDIO_SIZE/2) != HIMD_AUDIO_SIZE/2)
+        {
+            fprintf(stderr, "sox write failed\n");
+            exit(1);
+        }
+    }
+    sox_close(out);
+    return (g_get_monotonic_time() - start) / 1e6;
+}
+
+static double bench_wavsink(const char * filename, const unsigned char * block, unsigned int blocks)
+{
+    struct himd_wavsink sink;
+    struct himderrinfo status;
+    unsigned int b;
+    gint64 start;
+
+    start = g_get_monotonic_time();
+    if(himd_wavsink_open(&sink, filename, &status) < 0)
+    {
+        fprintf(stderr, "%s\n", status.statusmsg);
+        exit(1);
+    }
+    for(b = 0; b < blocks; b++)
+        if(himd_wavsink_write(&sink, block, HIMD_AUDIO_SIZE, &status) < 0)
+        {
+            fprintf(stderr, "%s\n", status.statusmsg);
+            exit(1);
+        }
+    if(himd_wavsink_close(&sink, &status) < 0)
+    {
+        fprintf(stderr, "%s\n", status.statusmsg);
+        exit(1);
+    }
+    return (g_get_monotonic_time() - start) / 1e6;
+}
+
+static int cmp_double(const void * a, const void * b)
+{
+    double da = *(const double*)a, db = *(const double*)b;
+    return da < db ? -1 : da > db;
+}
+
+int main(int argc, char ** argv)
+{
+    unsigned char block[HIMD_AUDIO_SIZE];
+    const char * dir = argc > 1 ? argv[1] : ".";
+    int seconds = argc > 2 ? atoi(argv[2]) : DEFAULT_SECONDS;
+    unsigned int blocks;
+    double mbytes, soxtimes[RUNS], sinktimes[RUNS];
+    gchar * soxfile, * sinkfile;
+    int i;
+
+    if(seconds <= 0)
+    {
+        fprintf(stderr, "Usage: %s [<output dir> [<seconds of audio>]]\n", argv[0]);
+        return 1;
+    }
+
+    blocks = (unsigned long)seconds * 44100 * 4 / HIMD_AUDIO_SIZE + 1;
+    mbytes = blocks * (double)HIMD_AUDIO_SIZE / (1024*1024);
+    make_lpcm(block, sizeof block);
+
+    soxfile = g_build_filename(dir, "wavbench-sox.wav", NULL);
+    sinkfile = g_build_filename(dir, "wavbench-sink.wav", NULL);
+
+    sox_format_init();
+    for(i = 0; i < RUNS; i++)
+    {
+        soxtimes[i] = bench_sox(soxfile, block, blocks);
+        sinktimes[i] = bench_wavsink(sinkfile, block, blocks);
+    }
+    sox_format_quit();
+
+    qsort(soxtimes, RUNS, sizeof soxtimes[0], cmp_double);
+    qsort(sinktimes, RUNS, sizeof sinktimes[0], cmp_double);
+
+    printf("%u blocks, %.1f MB of LPCM, median of %d runs\n", blocks, mbytes, RUNS);
+    printf("sox:          %7.3f s  %8.1f MB/s\n", soxtimes[RUNS/2], mbytes / soxtimes[RUNS/2]);
+    printf("himd_wavsink: %7.3f s  %8.1f MB/s\n", sinktimes[RUNS/2], mbytes / sinktimes[RUNS/2]);
+
+    g_unlink(soxfile);
+    g_unlink(sinkfile);
+    g_free(soxfile);
+    g_free(sinkfile);
+    return 0;
+}
@@ -0,0 +1,7 @@
+TEMPLATE=app
+CONFIG  -= qt
+CONFIG  += console link_pkgconfig link_prl
+PKGCONFIG += glib-2.0 sox
+SOURCES += wavbench.c
+
+include(../libhimd/use_libhimd.pri)